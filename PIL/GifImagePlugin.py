@@ -228,6 +228,10 @@ RAWMODE = {
 
 def _save(im, fp, filename):
 
+    if "append_images" in im.encoderinfo:
+        _save_all(im, fp, filename)
+        return
+
     if _imaging_gif:
         # call external driver
         try:
@@ -236,18 +240,9 @@ def _save(im, fp, filename):
         except IOError:
             pass # write uncompressed file
 
-    try:
-        rawmode = RAWMODE[im.mode]
-        imOut = im
-    except KeyError:
-        # convert on the fly (EXPERIMENTAL -- I'm not sure PIL
-        # should automatically convert images on save...)
-        if Image.getmodebase(im.mode) == "RGB":
-            imOut = im.convert("P")
-            rawmode = "P"
-        else:
-            imOut = im.convert("L")
-            rawmode = "L"
+    # convert on the fly (EXPERIMENTAL -- I'm not sure PIL
+    # should automatically convert images on save...)
+    imOut, rawmode = _convert(im)
 
     # header
     for s in getheader(imOut, im.encoderinfo):
@@ -301,6 +296,86 @@ def _save(im, fp, filename):
         fp.flush()
     except: pass
 
+def _convert(im):
+    # get image in a mode suitable for GIF, and the corresponding rawmode
+    try:
+        return im, RAWMODE[im.mode]
+    except KeyError:
+        if Image.getmodebase(im.mode) == "RGB":
+            return im.convert("P"), "P"
+        return im.convert("L"), "L"
+
+def _save_all(im, fp, filename):
+    # write an animation.  the frames are compressed by a single encoder
+    # in one call, and frames that use the global palette are stored as
+    # changes to the previous frame.
+
+    info = im.encoderinfo
+
+    imOut, rawmode = _convert(im)
+    frames = [imOut]
+    for frame in info["append_images"]:
+        if frame.size != im.size:
+            raise ValueError("all frames must have the same size")
+        frame, mode = _convert(frame)
+        if frame.mode != imOut.mode:
+            frame = frame.convert(imOut.mode)
+        frames.append(frame)
+
+    duration = info.get("duration", 0)
+    if not isinstance(duration, type([])) and \
+       not isinstance(duration, type(())):
+        duration = [duration] * len(frames)
+    elif len(duration) != len(frames):
+        raise ValueError("need one duration for each frame")
+
+    if imOut.mode == "P":
+        palette = imOut.im.getpalette("RGB")
+    else:
+        palette = None
+
+    sequence = []
+    for frame, d in map(None, frames, duration):
+        frame.load()
+        if palette is not None:
+            p = frame.im.getpalette("RGB")
+            if p == palette:
+                p = None
+        else:
+            p = None
+        sequence.append((frame.im, int(d), p))
+
+    transparency = info.get("transparency", -1)
+    if transparency is None:
+        transparency = -1
+
+    data = Image.core.gif_encode_frames(
+        sequence, imOut.mode, rawmode,
+        info.get("interlace", 1), info.get("optimize", 1),
+        int(transparency)
+        )
+
+    # header (the global palette must cover all frames)
+    header = {"duration": duration}
+    for s in getheader(imOut, header):
+        fp.write(s)
+
+    loop = info.get("loop")
+    if loop is not None:
+        # application extension block
+        fp.write("!" +
+                 chr(255) +             # extension intro
+                 chr(11) +              # length
+                 "NETSCAPE2.0" +
+                 chr(3) + chr(1) +      # sub-block: loop count
+                 o16(loop) +            # number of loops (0 = forever)
+                 chr(0))
+
+    for s in data:
+        fp.write(s)
+
+    fp.write(";") # end of file
+
 def _save_netpbm(im, fp, filename):
 
     #
@@ -326,8 +401,14 @@ def getheader(im, info=None):
 
     optimize = info and info.get("optimize", 0)
 
+    # extension blocks need a GIF89a header
+    version = "GIF87a"
+    for key in ("transparency", "duration"):
+        if info and key in info:
+            version = "GIF89a"
+
     s = [
-        "GIF87a" +              # magic
+        version +               # magic
         o16(im.size[0]) +       # size
         o16(im.size[1]) +
         chr(7 + 128) +          # flags: bits + palette
@@ -392,6 +473,31 @@ def getdata(im, offset = (0, 0), **params):
 
     return fp.data
 
+def getdelta(im, previous=None, duration=0, transparency=None):
+    """Return a list of strings representing this image as a frame in
+       an animation, including a graphic control extension block.  If
+       the previous frame is given, only the area that has changed is
+       included, and unchanged pixels in that area are made transparent.
+       The transparency option gives the palette index to use for this;
+       by default, an index that the frame doesn't use is picked, if
+       there is one.  The duration is given in milliseconds."""
+
+    # this uses the same encoder as the animation writer (_save_all)
+    im, rawmode = _convert(im)
+    im.load()
+    if previous is not None:
+        previous, mode = _convert(previous)
+        if previous.mode != im.mode or previous.size != im.size:
+            raise ValueError("frames must have the same mode and size")
+        previous.load()
+        previous = previous.im
+    if transparency is None:
+        transparency = -1
+    return Image.core.gif_encode_frames(
+        [(im.im, int(duration), None)], im.mode, rawmode,
+        0, 1, int(transparency), previous
+        )
+
 
 # --------------------------------------------------------------------
 # Registry
@@ -734,12 +734,44 @@ class Image(object):
 
         return self._new(im)
 
-    def quantize(self, colors=256, method=0, kmeans=0, palette=None):
+    ##
+    # Converts the image to "P" mode, using an adaptive palette or
+    # the palette of a given image.
+    #
+    # @param colors Number of colours in the adaptive palette.
+    # @param method Quantization method: 0 (median cut), 1 (maximum
+    #    coverage) or 2 (fast octree).
+    # @param kmeans If non-zero, refine the palette with k-means,
+    #    until fewer than this number of pixels change between two
+    #    passes.
+    # @param palette An optional "P" image.  If given, the image is
+    #    mapped to the palette of this image instead.  Use
+    #    {@link #makepalette} to create a palette for a number of
+    #    images.
+    # @param dither Dithering method used with a palette image.  This
+    #    is either FLOYDSTEINBERG (default), or NONE, which maps each
+    #    pixel to the exact nearest palette colour.  The tables used
+    #    to find nearest colours are kept with the palette image, so
+    #    mapping many images to the same palette is fast.
+    # @param kmeans_sample If given, k-means only uses this number of
+    #    evenly spaced pixels, and the full image is then mapped to
+    #    the resulting palette.  The kmeans threshold applies to the
+    #    sampled pixels.
+    # @param kmeans_iterations If given, stop k-means after this many
+    #    passes, even if it hasn't converged.
+    # @param kmeans_time If given, stop k-means after this many
+    #    seconds of processor time.
+    # @param octree_bits Bits per colour channel used by the fast
+    #    octree method (4, 5 or 6).  More bits keep similar colours
+    #    apart, which helps images with few distinct colours, at the
+    #    cost of memory and speed.  For photographs, the default (4
+    #    bits, fewer for red, blue and alpha in RGBA images) usually
+    #    gives better results.
+    # @return An Image object.
 
-        # methods:
-        #    0 = median cut
-        #    1 = maximum coverage
-        #    2 = fast octree
+    def quantize(self, colors=256, method=0, kmeans=0, palette=None,
+                 dither=None, kmeans_sample=0, kmeans_iterations=0,
+                 kmeans_time=0.0, octree_bits=0):
 
         # NOTE: this functionality will be moved to the extended
         # quantizer interface in a later version of PIL.
@@ -751,6 +783,14 @@ class Image(object):
             palette.load()
             if palette.mode != "P":
                 raise ValueError("bad mode for palette image")
+            if dither == NONE:
+                if self.mode not in ("L", "P", "RGB", "RGBA"):
+                    raise ValueError(
+                        "only L, P, RGB or RGBA mode images can be "
+                        "mapped to a palette"
+                        )
+                im = self.im.quantize_palette(palette.im)
+                return self._new(im)
             if self.mode != "RGB" and self.mode != "L":
                 raise ValueError(
                     "only RGB or L mode images can be quantized to a palette"
@@ -758,7 +798,8 @@ class Image(object):
             im = self.im.convert("P", 1, palette.im)
             return self._makeself(im)
 
-        im = self.im.quantize(colors, method, kmeans)
+        im = self.im.quantize(colors, method, kmeans, kmeans_sample,
+                              kmeans_iterations, kmeans_time, octree_bits)
         return self._new(im)
 
     ##
@@ -841,9 +882,10 @@ class Image(object):
         if not hasattr(filter, "filter"):
             raise TypeError("filter argument should be ImageFilter.Filter instance or class")
 
-        if self.im.bands == 1:
+        if self.im.bands == 1 or getattr(filter, "multiband", 0):
             return self._new(filter.filter(self.im))
-        # fix to handle multiband images since _imaging doesn't
+        # fix to handle multiband images for filters that cannot
+        # handle them directly
         ims = []
         for c in range(self.im.bands):
             ims.append(self._new(filter.filter(self.im.getband(c))))
@@ -1551,15 +1593,15 @@ class Image(object):
     # @param resample Optional resampling filter.  This can be one
     #    of <b>NEAREST</b>, <b>BILINEAR</b>, <b>BICUBIC</b>, or
     #    <b>ANTIALIAS</b> (best quality).  If omitted, it defaults
-    #    to <b>NEAREST</b> (this will be changed to ANTIALIAS in a
-    #    future version).
+    #    to <b>ANTIALIAS</b>.
     # @return None
 
-    def thumbnail(self, size, resample=NEAREST):
+    def thumbnail(self, size, resample=ANTIALIAS):
         "Create thumbnail representation (modifies image in place)"
 
-        # FIXME: the default resampling filter will be changed
-        # to ANTIALIAS in future versions
+        # for formats that support it (e.g. JPEG), the draft method
+        # lets the decoder do most of the work, and the resize gives
+        # the final size
 
         # preserve aspect ratio
         x, y = self.size
@@ -2093,6 +2135,48 @@ def merge(mode, bands):
         im.putband(bands[i].im, i)
     return bands[0]._new(im)
 
+
+##
+# Creates a palette for a number of images, such as the frames of an
+# animation.  The palette is computed from the combined colours of
+# all images.  To convert the images, pass the result to
+# {@link Image#Image.quantize} as the palette argument.
+#
+# @param images A sequence of images, with mode "L", "P" or "RGB".
+# @param colors Number of colours in the palette.
+# @param method Quantization method, as for quantize.
+# @param kmeans K-means refinement, as for quantize.
+# @return A small "P" image holding the palette.
+
+def makepalette(images, colors=256, method=0, kmeans=0):
+    "Create a palette for a number of images"
+
+    images = list(images)
+    if not images:
+        raise ValueError("no images")
+    mode = "RGB"
+    if min([im.mode == "L" for im in images]):
+        mode = "L"
+    images = [im.convert(mode) for im in images]
+
+    # stack the images (or, if they have different widths, their
+    # pixels) into a single image, and quantize that
+    if len(set([im.size[0] for im in images])) == 1:
+        size = images[0].size[0], sum([im.size[1] for im in images])
+        combined = new(mode, size)
+        y = 0
+        for im in images:
+            combined.paste(im, (0, y))
+            y = y + im.size[1]
+    else:
+        data = "".join([im.tostring() for im in images])
+        size = sum([im.size[0] * im.size[1] for im in images]), 1
+        combined = fromstring(mode, size, data)
+
+    palette = combined.quantize(colors, method, kmeans).crop((0, 0, 1, 1))
+    palette.load()
+    return palette
+
 # --------------------------------------------------------------------
 # Plugin registry
 
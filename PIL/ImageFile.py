@@ -40,6 +40,13 @@ MAXBLOCK = 65536
 
 SAFEBLOCK = 1024*1024
 
+# if set, images with several independent tiles are decoded by a
+# number of worker threads (see Image.core.setthreads)
+LOAD_PARALLEL = 0
+
+# decoders that can be used for parallel tile decoding
+PARALLEL_DECODERS = ("raw", "packbits", "zip")
+
 ERRORS = {
     -1: "image buffer overrun error",
     -2: "decoding error",
@@ -183,8 +190,11 @@ class ImageFile(Image.Image):
         # look for read/seek overrides
         try:
             read = self.load_read
+            readinto = None
         except AttributeError:
             read = self.fp.read
+            # if possible, let the decoder read directly into its buffer
+            readinto = getattr(self.fp, "readinto", None)
 
         try:
             seek = self.load_seek
@@ -201,28 +211,34 @@ class ImageFile(Image.Image):
             except AttributeError:
                 prefix = ""
 
-            for d, e, o, a in self.tile:
+            tiles = self.tile
+            if LOAD_PARALLEL and not prefix and not hasattr(self, "load_read"):
+                tiles = self.load_parallel(read, seek)
+
+            if readinto is None:
+                def read_string(bytes, read=read):
+                    s = read(bytes)
+                    if isinstance(s, ImageSupport.ByteArray):
+                        s = s.tostring()
+                    return s
+            else:
+                read_string = None
+
+            for d, e, o, a in tiles:
                 d = Image._getdecoder(self.mode, d, a, self.decoderconfig)
                 seek(o)
                 try:
                     d.setimage(self.im, e)
                 except ValueError:
                     continue
-                b = prefix
-                t = len(b)
-                while True:
-                    s = read(self.decodermaxblock)
-                    if isinstance(s, ImageSupport.ByteArray):
-                        s = s.tostring()
-                    if not s:
-                        self.tile = []
-                        raise IOError("image file is truncated (%d bytes not processed)" % len(b))
-                    b = b + s
-                    n, e = d.decode(b)
-                    if n < 0:
-                        break
-                    b = b[n:]
-                    t = t + n
+                # the decoder keeps unprocessed data in its own buffer,
+                # and reads decodermaxblock bytes at a time
+                n, e = d.decodefile(
+                    read_string, readinto, prefix, self.decodermaxblock
+                    )
+                if n >= 0:
+                    self.tile = []
+                    raise IOError("image file is truncated (%d bytes not processed)" % n)
 
         self.tile = []
         self.readonly = readonly
@@ -242,6 +258,138 @@ class ImageFile(Image.Image):
 
         return Image.Image.load(self)
 
+    def load_parallel(self, read, seek):
+        # decode all tiles but the last one in parallel, and return
+        # the tiles that still need to be decoded.  the tile sizes
+        # aren't known, so each tile gets the data up to the start of
+        # the next one.  the last tile is left to the usual loader.
+
+        tiles = self.tile
+        if len(tiles) < 3 or Image.core.getthreads() < 2:
+            return tiles
+        for i in range(len(tiles)):
+            if tiles[i][0] not in PARALLEL_DECODERS:
+                return tiles
+            if i > 0 and tiles[i][2] <= tiles[i-1][2]:
+                return tiles # shared or overlapping data
+
+        jobs = []
+        for i in range(len(tiles) - 1):
+            d, e, o, a = tiles[i]
+            d = Image._getdecoder(self.mode, d, a, self.decoderconfig)
+            try:
+                d.setimage(self.im, e)
+            except ValueError:
+                continue
+            seek(o)
+            s = read(tiles[i+1][2] - o)
+            if isinstance(s, ImageSupport.ByteArray):
+                s = s.tostring()
+            jobs.append((d, s))
+
+        for n, e in Image.core.decode_tiles(jobs):
+            if n >= 0:
+                self.tile = []
+                raise IOError("image file is truncated")
+            if e < 0:
+                self.tile = []
+                raise_ioerror(e)
+
+        return tiles[-1:]
+
+    ##
+    # Decodes the image in bands of lines, without allocating memory
+    # for the full image.  This only works for formats that store the
+    # image as full-width tiles (strips), using a decoder that can
+    # stop at a given line (currently raw, packbits, and non-interlaced
+    # zip).
+    # <p>
+    # The callback is called as <b>callback(image, y)</b> for each band,
+    # in order.  The band image is reused for the next band, so the
+    # callback should copy it if it needs to keep the data.  The last
+    # band may have fewer lines.
+    #
+    # @param callback Function called for each band.
+    # @param lines Number of lines in each band.  Default is 64.
+    # @exception IOError If the image cannot be streamed, or the
+    #     file is broken.
+
+    def stream(self, callback, lines=64):
+        "Decode the image band by band"
+
+        if not self.tile:
+            raise IOError("cannot stream this image")
+
+        xsize, ysize = self.size
+        lines = max(1, min(lines, ysize))
+
+        sort_tiles(self.tile)
+
+        for d, e, o, a in self.tile:
+            if e[0] != 0 or e[2] != xsize:
+                raise IOError("cannot stream this image")
+
+        if hasattr(self, "tile_prefix") or hasattr(self, "tile_post_rotate"):
+            raise IOError("cannot stream this image")
+
+        try:
+            read = self.load_read
+            readinto = None
+        except AttributeError:
+            read = self.fp.read
+            readinto = getattr(self.fp, "readinto", None)
+
+        try:
+            seek = self.load_seek
+        except AttributeError:
+            seek = self.fp.seek
+
+        if readinto is None:
+            def read_string(bytes, read=read):
+                s = read(bytes)
+                if isinstance(s, ImageSupport.ByteArray):
+                    s = s.tostring()
+                return s
+        else:
+            read_string = None
+
+        band = Image.core.new(self.mode, (xsize, lines))
+        if self.mode == "P" and self.palette:
+            band.putpalette(*self.palette.getdata())
+        image = self._new(band)
+
+        def flush(y, n, image=image, callback=callback):
+            if n < image.size[1]:
+                callback(image.crop((0, 0, image.size[0], n)), y)
+            else:
+                callback(image, y)
+
+        tiles = self.tile
+        self.tile = []
+
+        for d, e, o, a in tiles:
+            d = Image._getdecoder(self.mode, d, a, self.decoderconfig)
+            try:
+                d.setband(band, e, ysize)
+            except ValueError:
+                raise IOError("cannot stream this image")
+            seek(o)
+            n, e = d.decodefile(
+                read_string, readinto, "", self.decodermaxblock, flush
+                )
+            if n >= 0:
+                raise IOError("image file is truncated (%d bytes not processed)" % n)
+            if e < 0:
+                raise_ioerror(e)
+
+        # the decoder only flushes full bands
+        if ysize % lines:
+            flush(ysize - ysize % lines, ysize % lines)
+
+        self.fp = None # might be shared
+
+        self.load_end()
+
     def load_prepare(self):
         # create image memory if necessary
         if not self.im or self.im.mode != self.mode or self.im.size != self.size:
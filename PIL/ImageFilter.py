@@ -16,7 +16,9 @@
 #
 
 class Filter(object):
-    pass
+    # if true, Image.filter passes multiband images to the filter
+    # as is, instead of filtering one band at a time
+    multiband = 0
 
 ##
 # Convolution filter kernel.
@@ -24,16 +26,19 @@ class Filter(object):
 class Kernel(Filter):
 
     ##
-    # Create a convolution kernel.  The current version only
-    # supports 3x3 and 5x5 integer and floating point kernels.
+    # Create a convolution kernel.  Kernels can have any odd width
+    # and height, and use integer or floating point weights.
+    # Separable kernels (where each row is a multiple of the same
+    # row vector) are applied in two passes, which is a lot faster
+    # for larger kernels.
     # <p>
-    # In the current version, kernels can only be applied to
-    # "L" and "RGB" images.
+    # Kernels can be applied to all 8-bit images except palette
+    # images, and to "F" images.  All bands are filtered in one go.
     #
     # @def __init__(size, kernel, **options)
-    # @param size Kernel size, given as (width, height).  In
-    #    the current version, this must be (3,3) or (5,5).
-    # @param kernel A sequence containing kernel weights.
+    # @param size Kernel size, given as (width, height).  Both
+    #    values must be odd.
+    # @param kernel A sequence containing kernel weights, row by row.
     # @param **options Optional keyword arguments.
     # @keyparam scale Scale factor.  If given, the result for each
     #    pixel is divided by this value.  The default is the sum
@@ -41,12 +46,17 @@ class Kernel(Filter):
     # @keyparam offset Offset.  If given, this value is added to the
     #    result, after it has been divided by the scale factor.
 
+    # the core filter handles all bands in one go
+    multiband = 1
+
     def __init__(self, size, kernel, scale=None, offset=0):
         if scale is None:
             # default scale is sum of kernel
             scale = reduce(lambda a,b: a+b, kernel)
         if size[0] * size[1] != len(kernel):
             raise ValueError("not enough coefficients in kernel")
+        if not (size[0] & 1 and size[1] & 1):
+            raise ValueError("kernel size must be odd")
         self.filterargs = size, scale, offset, kernel
 
     def filter(self, image):
@@ -64,6 +74,9 @@ class BuiltinFilter(Kernel):
 class RankFilter(Filter):
     name = "Rank"
 
+    # the core filter handles all bands in one go
+    multiband = 1
+
     ##
     # Create a rank filter.  The rank filter sorts all pixels in
     # a window of the given size, and returns the rank'th value.
@@ -156,10 +169,21 @@ class ModeFilter(Filter):
 class GaussianBlur(Filter):
     name = "GaussianBlur"
 
-    def __init__(self, radius=2):
+    ##
+    # Create a gaussian blur filter.
+    #
+    # @param radius Blur radius.
+    # @param passes If non-zero, the blur is approximated by this
+    #    many box blurs.  This takes the same time for any radius,
+    #    and is a lot faster for large radii.  Three passes is
+    #    usually good enough.  If zero (default), the exact blur
+    #    is used.
+
+    def __init__(self, radius=2, passes=0):
         self.radius = radius
+        self.passes = passes
     def filter(self, image):
-        return image.gaussian_blur(self.radius)
+        return image.gaussian_blur(self.radius, self.passes)
 
 ##
 # Unsharp mask filter.
@@ -167,12 +191,25 @@ class GaussianBlur(Filter):
 class UnsharpMask(Filter):
     name = "UnsharpMask"
 
-    def __init__(self, radius=2, percent=150, threshold=3):
+    ##
+    # Create an unsharp mask filter.
+    #
+    # @param radius Blur radius.
+    # @param percent Unsharp strength, in percent.
+    # @param threshold Minimum brightness change that will be
+    #    sharpened.
+    # @param passes If non-zero, use a box blur approximation with
+    #    this many passes (see {@link #GaussianBlur}).
+
+    def __init__(self, radius=2, percent=150, threshold=3, passes=0):
         self.radius = radius
         self.percent = percent
         self.threshold = threshold
+        self.passes = passes
     def filter(self, image):
-        return image.unsharp_mask(self.radius, self.percent, self.threshold)
+        return image.unsharp_mask(
+            self.radius, self.percent, self.threshold, self.passes
+            )
 
 ##
 # Simple blur filter.
@@ -95,6 +95,7 @@ class BinaryFileWrapper(object):
         copy('seek')
         copy('tell')
         copy('fileno')
+        copy('readinto')
         self.fp = fp
         self.name = filename
         self.safesize = safesize
@@ -128,6 +129,7 @@ class TextFileWrapper(object):
         copy('seek')
         copy('tell')
         copy('fileno')
+        copy('readinto')
         self.fp = fp
         self.name = filename
         self.safesize = safesize
@@ -91,6 +91,7 @@ class BinaryFileWrapper(object):
         copy('seek')
         copy('tell')
         copy('fileno')
+        copy('readinto')
         self.fp = fp
         self.name = filename
         self.safesize = safesize
@@ -122,6 +123,7 @@ class TextFileWrapper(object):
         copy('seek')
         copy('tell')
         copy('fileno')
+        copy('readinto')
         self.fp = fp
         self.name = filename
         self.safesize = safesize
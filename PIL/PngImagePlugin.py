@@ -358,6 +358,9 @@ class PngImageFile(ImageFile.ImageFile):
         self.text = self.png.im_text # experimental
         self.tile = self.png.im_tile
 
+        if self.info.get("interlace"):
+            self.decoderconfig = self.decoderconfig + (1,)
+
         if self.png.im_palette:
             rawmode, data = self.png.im_palette
             self.palette = ImagePalette.raw(rawmode, data)
@@ -382,14 +385,6 @@ class PngImageFile(ImageFile.ImageFile):
 
         self.fp = None
 
-    def load_prepare(self):
-        "internal: prepare to read PNG file"
-
-        if self.info.get("interlace"):
-            self.decoderconfig = self.decoderconfig + (1,)
-
-        ImageFile.ImageFile.load_prepare(self)
-
     def load_read(self, bytes):
         "internal: read more image data"
 
@@ -450,6 +445,19 @@ _OUTMODES = {
     "RGBA":("RGBA", chr(8)+chr(6)),
 }
 
+# filter types and zlib strategies, for the filter and compress_type
+# options (the default is to pick a filter for each line, and to use
+# the "filtered" strategy for filtered data)
+
+_FILTERS = {
+    "none": 0, "sub": 1, "up": 2, "average": 3, "paeth": 4,
+    "adaptive": -1,
+}
+
+_STRATEGIES = {
+    "default": 0, "filtered": 1, "huffman": 2, "rle": 3, "fixed": 4,
+}
+
 def putchunk(fp, cid, *data):
     "Write a PNG chunk (including CRC field)"
 
@@ -507,11 +515,20 @@ def _save(im, fp, filename, chunk=putchunk, check=0):
     else:
         dictionary = ""
 
-    im.encoderconfig = ("optimize" in im.encoderinfo, dictionary)
+    filter_type = im.encoderinfo.get("filter", -1)
+    filter_type = _FILTERS.get(filter_type, filter_type)
+    if filter_type not in _FILTERS.values():
+        raise ValueError("unknown filter type")
+
+    compress_type = im.encoderinfo.get("compress_type", -1)
+    compress_type = _STRATEGIES.get(compress_type, compress_type)
+
     im.encoderconfig = ("optimize" in im.encoderinfo,
         im.encoderinfo.get("compress_level", -1),
-        im.encoderinfo.get("compress_type", -1),
-        dictionary)
+        compress_type,
+        dictionary,
+        im.encoderinfo.get("parallel", 0),
+        filter_type)
 
     # get the corresponding PNG mode
     try:
@@ -121,8 +121,10 @@ COMPRESSION_INFO = {
     5: "tiff_lzw",
     6: "tiff_jpeg", # obsolete
     7: "jpeg",
+    8: "tiff_adobe_deflate",
     32771: "tiff_raw_16", # 16-bit padding
-    32773: "packbits"
+    32773: "packbits",
+    32946: "tiff_deflate"
 }
 
 OPEN_INFO = {
@@ -583,6 +585,12 @@ class TiffImageFile(ImageFile.ImageFile):
             if 317 in self.tag:
                 # Section 14: Differencing Predictor
                 self.decoderconfig = (self.tag[PREDICTOR][0],)
+        elif compression in ("tiff_adobe_deflate", "tiff_deflate"):
+            # use the zip decoder, in TIFF mode (see Zip.h)
+            zipmode = 3
+            if self.tag.getscalar(PREDICTOR, 1) == 2:
+                zipmode = 2
+            args = rawmode, 0, zipmode
 
         if ICCPROFILE in self.tag:
             self.info['icc_profile'] = self.tag[ICCPROFILE]
@@ -662,6 +670,9 @@ class TiffImageFile(ImageFile.ImageFile):
         # build tile descriptors
         x = y = l = 0
         self.tile = []
+        decoder = self._compression
+        if decoder in ("tiff_adobe_deflate", "tiff_deflate"):
+            decoder = "zip"
         if STRIPOFFSETS in self.tag:
             # striped image
             h = getscalar(ROWSPERSTRIP, ysize)
@@ -671,7 +682,7 @@ class TiffImageFile(ImageFile.ImageFile):
                 if not a:
                     a = self._decoder(rawmode, l)
                 self.tile.append(
-                    (self._compression,
+                    (decoder,
                     (0, min(y, ysize), w, min(y+h, ysize)),
                     o, a))
                 y = y + h
@@ -690,7 +701,7 @@ class TiffImageFile(ImageFile.ImageFile):
                 # FIXME: this doesn't work if the image size
                 # is not a multiple of the tile size...
                 self.tile.append(
-                    (self._compression,
+                    (decoder,
                     (x, y, x+w, y+h),
                     o, a))
                 x = x + w
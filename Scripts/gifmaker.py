@@ -39,9 +39,9 @@
 # write data directly to a socket.  Or something...
 #
 
-from PIL import Image, ImageChops
+from PIL import Image
 
-from PIL.GifImagePlugin import getheader, getdata
+from PIL.GifImagePlugin import getheader, getdelta
 
 # --------------------------------------------------------------------
 # sequence iterator
@@ -62,7 +62,7 @@ class ImageSequence(object):
 # --------------------------------------------------------------------
 # straightforward delta encoding
 
-def makedelta(fp, sequence):
+def makedelta(fp, sequence, duration=0):
     """Convert list of image frames to a GIF animation file"""
 
     frames = 0
@@ -71,31 +71,16 @@ def makedelta(fp, sequence):
 
     for im in sequence:
 
-        #
-        # FIXME: write graphics control block before each frame
-
-        if not previous:
+        if previous is None:
 
             # global header
-            for s in getheader(im) + getdata(im):
+            for s in getheader(im, {"duration": duration}):
                 fp.write(s)
 
-        else:
-
-            # delta frame
-            delta = ImageChops.subtract_modulo(im, previous)
-
-            bbox = delta.getbbox()
-
-            if bbox:
-
-                # compress difference
-                for s in getdata(im.crop(bbox), offset = bbox[:2]):
-                    fp.write(s)
-
-            else:
-                # FIXME: what should we do in this case?
-                pass
+        # changed area, with unchanged pixels made transparent (the
+        # first frame is written in full)
+        for s in getdelta(im, previous, duration):
+            fp.write(s)
 
         previous = im.copy()
 
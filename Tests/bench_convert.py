@@ -0,0 +1,23 @@
+import sys
+sys.path.insert(0, ".")
+
+import tester
+import timeit
+
+from PIL import Image
+
+# time the mode conversions that have vectorized kernels
+
+SIZE = 4096, 1024
+
+def bench(mode, target):
+    im = tester.lena(mode).resize(SIZE)
+    t = min(timeit.repeat(lambda: im.convert(target), number=1, repeat=10))
+    print mode, "->", target, "%.2f ms" % (t * 1000)
+
+bench("RGB", "L")
+bench("RGBA", "L")
+bench("RGB", "CMYK")
+bench("L", "RGB")
+bench("RGB", "YCbCr")
+bench("YCbCr", "RGB")
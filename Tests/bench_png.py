@@ -0,0 +1,35 @@
+import sys
+sys.path.insert(0, ".")
+
+import glob
+import timeit
+
+from PIL import Image
+from StringIO import StringIO
+
+# time PNG filtering and compression (save), and decompression and
+# reconstruction (load), for the images in the Images directory
+
+SIZE = 2048, 2048
+
+def bench(file, mode):
+    im = Image.open(file).convert(mode).resize(SIZE)
+    def save():
+        out = StringIO()
+        im.save(out, "PNG")
+        return out.getvalue()
+    data = save()
+    def load():
+        Image.open(StringIO(data)).load()
+    t1 = min(timeit.repeat(save, number=1, repeat=5))
+    t2 = min(timeit.repeat(load, number=1, repeat=5))
+    print "%-20s %-4s save %7.2f ms, load %7.2f ms" % (
+        file, mode, t1 * 1000, t2 * 1000)
+
+for file in sorted(glob.glob("Images/*")):
+    try:
+        Image.open(file).load()
+    except (IOError, SyntaxError):
+        continue
+    for mode in "RGB", "RGBA":
+        bench(file, mode)
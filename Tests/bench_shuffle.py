@@ -0,0 +1,43 @@
+import sys
+sys.path.insert(0, ".")
+
+import timeit
+
+from PIL import Image
+
+# time the raw unpackers and packers, one shuffler at a time
+
+SIZE = 4096, 1024
+
+def bench(name, func):
+    t = min(timeit.repeat(func, number=1, repeat=10))
+    print name, "%.2f ms" % (t * 1000)
+
+def unpack(mode, rawmode, bits):
+    data = "\x5a" * (SIZE[0] * SIZE[1] * bits / 8)
+    bench("unpack %s %s" % (mode, rawmode),
+          lambda: Image.fromstring(mode, SIZE, data, "raw", rawmode))
+
+def pack(mode, rawmode):
+    im = Image.new(mode, SIZE)
+    bench("pack %s %s" % (mode, rawmode),
+          lambda: im.tostring("raw", rawmode))
+
+unpack("1", "1", 1)
+unpack("1", "1;I", 1)
+unpack("RGB", "RGB", 24)
+unpack("RGB", "BGR", 24)
+unpack("RGB", "BGRX", 32)
+unpack("RGBA", "BGRA", 32)
+unpack("RGBA", "ABGR", 32)
+unpack("I", "I;16", 16)
+unpack("I", "I;16B", 16)
+
+pack("1", "1")
+pack("1", "1;I")
+pack("RGB", "RGB")
+pack("RGB", "BGR")
+pack("RGB", "BGRX")
+pack("RGBA", "BGRA")
+pack("RGBA", "ABGR")
+pack("I", "I;16B")
@@ -0,0 +1,30 @@
+import sys
+sys.path.insert(0, ".")
+
+import tester
+import timeit
+
+from PIL import Image
+
+# time JPEG thumbnails, split into decoding (with draft) and resizing
+
+SIZE = 2048, 1536
+
+data = tester.tostring(tester.lena().resize(SIZE), "JPEG")
+
+def bench(size, resample):
+    def decode():
+        im = tester.fromstring(data)
+        im.draft(None, size)
+        im.load()
+        return im
+    im = decode()
+    t0 = min(timeit.repeat(decode, number=1, repeat=10))
+    t1 = min(timeit.repeat(lambda: im.copy().thumbnail(size, resample),
+                           number=1, repeat=10))
+    print size, resample, "decode %.2f ms, resize %.2f ms" % (
+        t0 * 1000, t1 * 1000)
+
+bench((128, 128), Image.ANTIALIAS)
+bench((128, 128), Image.NEAREST)
+bench((640, 480), Image.ANTIALIAS)
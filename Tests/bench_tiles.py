@@ -0,0 +1,25 @@
+import sys
+sys.path.insert(0, ".")
+
+import tester
+import timeit
+
+from PIL import Image, ImageFile
+
+# decode a large tiled TIFF, with and without parallel tile decoding
+
+def bench(mode, compression, threads):
+    im = tester.lena(mode).resize((4096, 4096))
+    data = tester.tiled_tiff(im, (256, 256), compression)
+    ImageFile.LOAD_PARALLEL = threads > 1
+    Image.core.setthreads(threads)
+    t0 = timeit.default_timer()
+    for i in range(5):
+        tester.fromstring(data).load()
+    t = (timeit.default_timer() - t0) / 5
+    print mode, compression, threads, "%.1f ms" % (t * 1000)
+
+for mode in "L", "RGB":
+    for compression in "raw", "deflate":
+        for threads in 1, 2, 4:
+            bench(mode, compression, threads)
@@ -24,5 +24,108 @@ def test_optimize():
         file = StringIO()
         im.save(file, "GIF", optimize=optimize)
         return len(file.getvalue())
-    assert_equal(test(0), 800)
-    assert_equal(test(1), 32)
+    assert_equal(test(0), 799)
+    assert_equal(test(1), 31)
+
+def test_roundtrip():
+    # noisy images fill up the LZW string table several times
+    import random
+    random.seed(42)
+    def roundtrip(im, **options):
+        file = StringIO()
+        im.save(file, "GIF", **options)
+        file.seek(0)
+        return Image.open(file)
+    for size in (1, 1), (7, 3), (300, 200):
+        data = "".join([chr(random.randrange(256))
+                        for i in range(size[0] * size[1])])
+        im = Image.fromstring("L", size, data)
+        assert_image_equal(roundtrip(im, interlace=0), im)
+        assert_image_equal(roundtrip(im, interlace=1), im)
+    im = lena("P").resize((256, 256))
+    out = roundtrip(im)
+    assert_image_equal(out, im)
+    # flat areas compress well
+    file = StringIO()
+    Image.new("L", (256, 256), 7).save(file, "GIF")
+    assert_true(len(file.getvalue()) < 2000)
+
+def delta_frames():
+    # a rectangle moving over lena, followed by a repeated frame
+    from PIL import ImageDraw
+    frames = []
+    for i in range(3):
+        im = lena("P").copy()
+        draw = ImageDraw.Draw(im)
+        draw.rectangle((10 + i * 10, 20, 30 + i * 10, 40), fill=7)
+        frames.append(im)
+    frames.append(frames[-1].copy())
+    return frames
+
+def assert_delta_frames(file, frames, durations):
+    # only the changed areas are stored
+    assert_true(len(file.getvalue()) < 2 * len(data))
+    # the reader doesn't handle transparency, so put the frames
+    # together here
+    file.seek(0)
+    im = Image.open(file)
+    current = None
+    for i in range(len(frames)):
+        im.seek(i)
+        im.load()
+        assert_equal(im.info["duration"], durations[i])
+        pixels = im.tostring()
+        if current:
+            transparency = chr(im.info["transparency"])
+            pixels = "".join([(p, c)[p == transparency]
+                              for p, c in zip(pixels, current)])
+        assert_equal(pixels, frames[i].tostring())
+        current = pixels
+    assert_exception(EOFError, lambda: im.seek(len(frames)))
+    return im
+
+def test_delta():
+    from PIL import GifImagePlugin
+    frames = delta_frames()
+    file = StringIO()
+    for s in GifImagePlugin.getheader(frames[0], {"duration": 100}):
+        file.write(s)
+    previous = None
+    for im in frames:
+        for s in GifImagePlugin.getdelta(im, previous, duration=100):
+            file.write(s)
+        previous = im
+    file.write(";")
+    assert_delta_frames(file, frames, [100] * len(frames))
+    assert_exception(ValueError, lambda: GifImagePlugin.getdelta(
+        frames[0], lena("L")))
+
+def test_save_all():
+    frames = delta_frames()
+    durations = [100, 200, 100, 100]
+    file = StringIO()
+    frames[0].save(file, "GIF", append_images=frames[1:],
+                   duration=durations, loop=0)
+    im = assert_delta_frames(file, frames, durations)
+    assert_equal(im.info["loop"], 0)
+
+def test_save_all_modes():
+    # frames are converted to the mode of the first frame
+    from PIL import ImageChops
+    im = lena("L")
+    frames = [lena("RGB"), lena("P"), lena("1")]
+    file = StringIO()
+    im.save(file, "GIF", append_images=frames, optimize=0)
+    file.seek(0)
+    reloaded = Image.open(file)
+    for i in range(len(frames)):
+        reloaded.seek(i + 1)
+        reloaded.load()
+        # RGB frames go through the web palette, so allow some error
+        expected = frames[i].convert("L")
+        diff = ImageChops.difference(reloaded.convert("L"), expected)
+        histogram = diff.histogram()
+        error = sum([v * n for v, n in enumerate(histogram)])
+        assert_true(error < 16 * sum(histogram))
+    assert_exception(ValueError, lambda: im.save(
+        StringIO(), "GIF", append_images=[lena("L").resize((64, 64))]))
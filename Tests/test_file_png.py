@@ -181,3 +181,44 @@ def test_trns_rgb():
 
     im = roundtrip(im, transparency=(0, 1, 2))
     assert_equal(im.info["transparency"], (0, 1, 2))
+
+def test_parallel():
+    # bands of rows are compressed separately, and joined to a single
+    # zlib stream; the result must not depend on the number of threads
+    def save(im, **options):
+        out = StringIO()
+        im.save(out, "PNG", **options)
+        return out.getvalue()
+    for mode in "1", "L", "P", "RGB", "RGBA", "I":
+        im = lena(mode).resize((700, 500))
+        expected, data = assert_threads_equal(lambda: save(im, parallel=1))
+        out = load(data)
+        assert_image_equal(out, load(save(im)))
+
+def test_roundtrip_filters():
+    # the filters may be applied and undone by vectorized code; use
+    # noisy images of odd sizes so that all filter types and the ends
+    # of the lines are covered
+    import random
+    random.seed(42)
+    for width in 1, 5, 33, 67:
+        size = width, 24
+        noise = Image.fromstring("RGB", size, "".join(
+            [chr(random.randrange(256)) for i in range(width * 24 * 3)]))
+        im = Image.blend(lena().resize(size), noise, 0.3)
+        for mode in "L", "RGB", "RGBA":
+            for options in {}, {"optimize": 1}:
+                out = roundtrip(im.convert(mode), **options)
+                assert_image_equal(out, im.convert(mode))
+
+def test_save_options():
+    im = lena("RGB")
+    for filter in "none", "sub", "up", "average", "paeth", "adaptive", 0, 4:
+        assert_image_equal(roundtrip(im, filter=filter), im)
+    for compress_type in "default", "filtered", "huffman", "rle", "fixed":
+        out = roundtrip(im, compress_type=compress_type, compress_level=1)
+        assert_image_equal(out, im)
+    out = roundtrip(im, filter="none", compress_level=0)
+    assert_image_equal(out, im)
+    assert_exception(ValueError, lambda: roundtrip(im, filter=5))
+    assert_exception(ValueError, lambda: roundtrip(im, filter="bogus"))
@@ -55,3 +55,35 @@ def test_gimp_tiff():
             ('jpeg', (0, 192, 256, 256), 3890, ('RGB', '')),
             ])
     assert_no_exception(lambda: im.load())
+
+def test_tiled():
+
+    for mode in "L", "RGB":
+        for compression in "raw", "deflate":
+            data = tiled_tiff(lena(mode), (32, 32), compression)
+            im = fromstring(data)
+            assert_equal(len(im.tile), 16)
+            assert_image_equal(im, lena(mode))
+
+def test_load_parallel():
+
+    from PIL import ImageFile
+
+    def load(data):
+        im = fromstring(data)
+        im.load()
+        return im
+
+    def truncated():
+        assert_exception(IOError, lambda: load(data[:len(data)//2]))
+
+    try:
+        ImageFile.LOAD_PARALLEL = 1
+        for mode in "L", "RGB":
+            for compression in "raw", "deflate":
+                data = tiled_tiff(lena(mode), (16, 32), compression)
+                expected, out = assert_threads_equal(lambda: load(data))
+                assert_image_equal(out, lena(mode))
+        assert_threads_equal(truncated)
+    finally:
+        ImageFile.LOAD_PARALLEL = 0
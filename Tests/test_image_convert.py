@@ -24,3 +24,60 @@ def test_default():
     assert_image(im, "RGB", im.size)
     im = im.convert()
     assert_image(im, "RGB", im.size)
+
+def test_web_palette():
+
+    # every colour in the web palette maps to itself
+    im = Image.new("RGB", (216, 1))
+    im.putdata([(r, g, b)
+                for b in range(0, 256, 51)
+                for g in range(0, 256, 51)
+                for r in range(0, 256, 51)])
+    for i in range(2):
+        out = im.convert("P", dither=Image.NONE)
+        assert_equal(out.convert("RGB").tostring(), im.tostring())
+
+    # the palette cache is shared between conversions
+    im = lena()
+    for dither in Image.NONE, Image.FLOYDSTEINBERG:
+        expected = im.convert("P", dither=dither)
+        assert_image_equal(im.convert("P", dither=dither), expected)
+        assert_image_equal(im.convert("RGBA").convert("P", dither=dither),
+                           expected)
+
+def test_lines():
+
+    # long lines may be converted by vectorized code, which must give
+    # the same result as converting one pixel at a time
+    im = Image.new("RGB", (45, 1))
+    im.putdata([(i * 37 & 255, i * 101 & 255, i * 59 & 255) for i in range(45)])
+    im = Image.blend(lena().crop((0, 0, 45, 64)), im.resize((45, 64)), 0.5)
+    for mode, target in [("RGB", "L"), ("RGBA", "L"), ("RGB", "CMYK"),
+                         ("L", "RGB"), ("RGB", "YCbCr"), ("YCbCr", "RGB")]:
+        source = im.convert(mode)
+        expected = Image.new(target, im.size)
+        for x in range(im.size[0]):
+            column = source.crop((x, 0, x + 1, im.size[1])).convert(target)
+            expected.paste(column, (x, 0))
+        assert_image_equal(source.convert(target), expected)
+
+def test_threads():
+
+    check = assert_threads_equal
+    im = lena().resize((1024, 1024))
+    for mode in "L", "RGBA", "CMYK", "YCbCr", "I", "F":
+        yield_test(check, lambda mode=mode: im.convert(mode))
+    pim = im.convert("P", dither=Image.NONE)
+    for mode in "L", "RGB", "RGBA":
+        yield_test(check, lambda mode=mode: pim.convert(mode))
+    yield_test(check, lambda: im.split()[1])
+    def putalpha():
+        out = im.convert("RGBA")
+        out.putalpha(im.split()[0])
+        return out
+    yield_test(check, putalpha)
+    def fillband():
+        out = im.convert("RGBA")
+        out.putalpha(128)
+        return out
+    yield_test(check, fillband)
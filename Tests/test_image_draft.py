@@ -23,3 +23,8 @@ def test_mode():
     assert_equal(draft("L", (512, 512)).mode, "L")
     assert_equal(draft("RGB", (512, 512)).mode, "RGB")
     assert_equal(draft("YCbCr", (512, 512)).mode, "YCbCr")
+
+def test_aspect():
+    # the decoded image should never be smaller than the request
+    assert_equal(draft("RGB", (64, 200)).size, (256, 256))
+    assert_equal(draft("RGB", (200, 64)).size, (256, 256))
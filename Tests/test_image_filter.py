@@ -80,3 +80,108 @@ def test_rankfilter():
     assert_equal(rankfilter("RGB"), ((0, 0, 0), (4, 0, 0), (8, 0, 0)))
     assert_equal(rankfilter("I"), (0, 4, 8))
     assert_equal(rankfilter("F"), (0.0, 4.0, 8.0))
+
+def test_kernel():
+
+    def reference(im, size, kernel, scale, offset, xy):
+        # filter a single pixel
+        x, y = xy
+        w, h = size
+        sum = 0.0
+        for j in range(h):
+            for i in range(w):
+                # the first kernel row applies to the line below
+                p = im.getpixel((x + i - w//2, y + h//2 - j))
+                sum = sum + p * kernel[j * w + i]
+        return sum / scale + offset
+
+    im = lena("L")
+
+    for size in (3, 3), (7, 7), (1, 5), (9, 3):
+        w, h = size
+        # separable and non-separable kernels
+        for kernel in (range(1, w*h+1),
+                       [(i % w + 1) * (i // w + 1) for i in range(w*h)]):
+            filter = ImageFilter.Kernel(size, kernel)
+            scale = filter.filterargs[1]
+            out = im.filter(filter)
+            outf = im.convert("F").filter(filter)
+            for xy in (w//2, h//2), (64, 64), (127 - w//2, 127 - h//2):
+                v = reference(im, size, kernel, scale, 0, xy)
+                assert_true(abs(outf.getpixel(xy) - v) < 0.01)
+                assert_true(abs(out.getpixel(xy) - int(v)) <= 1)
+            # border pixels are left as is
+            assert_equal(out.getpixel((0, 0)), im.getpixel((0, 0)))
+
+    assert_exception(ValueError, lambda: ImageFilter.Kernel((2, 2), range(4)))
+
+def test_kernel_multiband():
+
+    # multiband images are filtered in one go, with the same result
+    # as filtering each band
+    for mode in "RGB", "RGBA", "CMYK":
+        im = lena(mode)
+        for filter in (ImageFilter.SMOOTH_MORE, ImageFilter.EMBOSS,
+                       ImageFilter.Kernel((7, 7), [1] * 49)):
+            bands = [band.filter(filter) for band in im.split()]
+            assert_image_equal(im.filter(filter), Image.merge(mode, bands))
+
+def test_rankfilter_large():
+
+    # larger windows use sliding histograms
+    import random
+    random.seed(0)
+    im = Image.new("L", (23, 17))
+    im.putdata([random.randrange(256) for i in range(23*17)])
+    data = list(im.getdata())
+
+    def window(x, y, size):
+        # window centered on x, y, clipped to the image
+        values = []
+        for yy in range(y - size//2, y + size//2 + 1):
+            for xx in range(x - size//2, x + size//2 + 1):
+                if 0 <= xx < 23 and 0 <= yy < 17:
+                    values.append(data[yy * 23 + xx])
+        return values
+
+    for size in 5, 7, 11:
+        for rank in 0, size*size//2, size*size-1, 7:
+            out = im.filter(ImageFilter.RankFilter(size, rank))
+            for xy in (0, 0), (11, 8), (22, 16), (size//2, 3):
+                # the image is expanded by repeating the edge pixels
+                expanded = []
+                for yy in range(xy[1] - size//2, xy[1] + size//2 + 1):
+                    for xx in range(xy[0] - size//2, xy[0] + size//2 + 1):
+                        xx = min(max(xx, 0), 22)
+                        yy2 = min(max(yy, 0), 16)
+                        expanded.append(data[yy2 * 23 + xx])
+                expanded.sort()
+                assert_equal(out.getpixel(xy), expanded[rank])
+
+    # posterize, so the mode filter has something to do
+    im = im.point(lambda v: v & 0xC0)
+    data = list(im.getdata())
+    for size in 3, 5, 8:
+        out = im.filter(ImageFilter.ModeFilter(size))
+        for xy in (0, 0), (11, 8), (22, 16), (3, 15):
+            values = window(xy[0], xy[1], size)
+            counts = [(-values.count(v), v) for v in values]
+            counts.sort()
+            if -counts[0][0] > 2:
+                expected = counts[0][1]
+            else:
+                expected = im.getpixel(xy)
+            assert_equal(out.getpixel(xy), expected)
+
+def test_rankfilter_multiband():
+
+    # multiband images are filtered in one go, with the same result
+    # as filtering each band
+    for mode in "RGB", "RGBA", "LA", "CMYK":
+        im = lena(mode)
+        for size in 3, 5:
+            for filter in (ImageFilter.MinFilter(size),
+                           ImageFilter.MedianFilter(size),
+                           ImageFilter.RankFilter(size, size)):
+                bands = [band.filter(filter) for band in im.split()]
+                assert_image_equal(im.filter(filter), Image.merge(mode, bands))
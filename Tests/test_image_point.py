@@ -17,3 +17,13 @@ def test_sanity():
     assert_no_exception(lambda: im.point(lambda x: x*1+1))
     assert_exception(TypeError, lambda: im.point(lambda x: x-1))
     assert_exception(TypeError, lambda: im.point(lambda x: x/1))
+
+def test_threads():
+
+    def check(im, lut):
+        assert_threads_equal(lambda: im.point(lut))
+    im = lena().resize((1024, 1024))
+    yield_test(check, im, range(255, -1, -1) * 3)
+    yield_test(check, im.convert("L"), lambda x: x // 2)
+    yield_test(check, im.convert("I"), lambda x: x * 2 + 1)
+    yield_test(check, im.convert("F"), lambda x: x * 0.5 + 3)
@@ -19,4 +19,64 @@ def test_octree_quantize():
     im = im.quantize(100, Image.FASTOCTREE)
     assert_image(im, "P", im.size)
 
-    assert len(im.getcolors()) == 100
\ No newline at end of file
+    assert len(im.getcolors()) == 100
+
+def test_median_cut_threads():
+    # more than 65536 colours, so the histogram has to be rescaled
+    im = lena().resize((512, 512), Image.BILINEAR)
+    im = Image.blend(im, im.rotate(90), 0.5)
+    expected, out = assert_threads_equal(lambda: im.quantize(64))
+    assert_equal(out.im.getpalette("RGB"), expected.im.getpalette("RGB"))
+    assert_equal(len(out.getcolors()), 64)
+
+def test_quantize_palette():
+    frames = [lena().rotate(angle) for angle in (0, 10, 20)]
+    palette = Image.makepalette(frames, 32)
+    assert_image(palette, "P", (1, 1))
+    colors = palette.im.getpalette("RGB")
+    colors = [tuple(map(ord, colors[i:i+3])) for i in range(0, 96, 3)]
+    for im in frames:
+        out = im.quantize(palette=palette, dither=Image.NONE)
+        assert_image(out, "P", im.size)
+        assert_equal(out.im.getpalette("RGB"), palette.im.getpalette("RGB"))
+        assert_true(len(out.getcolors()) <= 32)
+        # each pixel is mapped to the nearest colour
+        for xy in (0, 0), (40, 60), (90, 20), (127, 127):
+            r, g, b = im.getpixel(xy)
+            dist = [(r-c[0])**2 + (g-c[1])**2 + (b-c[2])**2 for c in colors]
+            assert_equal(dist[out.getpixel(xy)], min(dist))
+    out = lena("L").quantize(palette=palette, dither=Image.NONE)
+    assert_image(out, "P", (128, 128))
+    # empty images get the same palette
+    out = Image.new("RGB", (0, 0)).quantize(palette=palette, dither=Image.NONE)
+    assert_image(out, "P", (0, 0))
+    assert_equal(out.im.getpalette("RGB"), palette.im.getpalette("RGB"))
+
+def test_kmeans_options():
+    im = lena()
+    for method in 0, 1:
+        full = im.quantize(16, method, kmeans=1)
+        # a sample covering the whole image gives the same result
+        out = im.quantize(16, method, kmeans=1, kmeans_sample=128*128)
+        assert_image_equal(out, full)
+        out = im.quantize(16, method, kmeans=1, kmeans_sample=1000)
+        assert_image(out, "P", im.size)
+        assert_true(len(out.getcolors()) <= 16)
+        out = im.quantize(16, method, kmeans=1, kmeans_iterations=1)
+        assert_image(out, "P", im.size)
+        out = im.quantize(16, method, kmeans=1, kmeans_time=0.001)
+        assert_image(out, "P", im.size)
+
+def test_octree_bits():
+    im = lena().convert("RGBA")
+    im.putalpha(lena("L"))
+    for mode in "RGB", "RGBA":
+        for bits in 4, 5, 6:
+            expected, out = assert_threads_equal(
+                lambda: im.convert(mode).quantize(64, 2, octree_bits=bits))
+            assert_image(out, "P", im.size)
+            assert_true(len(out.getcolors()) <= 64)
+    # the default depth is 4 bits
+    assert_image_equal(lena().quantize(64, 2, octree_bits=4),
+                       lena().quantize(64, 2))
+    assert_exception(ValueError, lambda: lena().quantize(64, 2, octree_bits=7))
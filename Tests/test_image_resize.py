@@ -10,3 +10,46 @@ def test_resize():
     for mode in "1", "P", "L", "RGB", "I", "F":
         yield_test(resize, mode, (100, 100))
         yield_test(resize, mode, (200, 200))
+
+def test_antialias_threads():
+    def resize(mode, size):
+        im = lena(mode)
+        assert_threads_equal(lambda: im.resize(size, Image.ANTIALIAS))
+    for mode in "L", "RGB", "RGBA", "I", "F":
+        yield_test(resize, mode, (37, 211))
+        yield_test(resize, mode, (300, 64))
+
+def test_antialias_fixed():
+    # 8-bit images use fixed-point arithmetic; compare with the
+    # floating point version (allow one unit of error per pass)
+    def stretch(im, size, filter):
+        return Image.Image()._new(im.im.stretch(size, filter))
+    def resize(size, filter):
+        im = lena("L")
+        out = stretch(im, size, filter).convert("F")
+        expected = stretch(im.convert("F"), size, filter)
+        diff = [abs(a - b) for a, b in zip(out.getdata(), expected.getdata())]
+        assert_true(max(diff) <= 2.5, "max diff %s" % max(diff))
+    for filter in Image.BILINEAR, Image.BICUBIC, Image.ANTIALIAS:
+        yield_test(resize, (37, 211), filter)
+        yield_test(resize, (300, 64), filter)
+        yield_test(resize, (17, 17), filter)
+
+def test_antialias_fused():
+    # the fused resampler should give the same result as two
+    # separate passes, in either order (8-bit images only; the
+    # extra identity pass isn't exact for "I" and "F")
+    def stretch(im, size):
+        return Image.Image()._new(im.im.stretch(size, Image.ANTIALIAS))
+    def resize(mode, size):
+        im = lena(mode)
+        out = stretch(im, size)
+        if im.size[0] * size[1] < size[0] * im.size[1]:
+            temp = stretch(im, (im.size[0], size[1]))
+        else:
+            temp = stretch(im, (size[0], im.size[1]))
+        assert_image_equal(out, stretch(temp, size))
+    for mode in "L", "RGB", "RGBA":
+        yield_test(resize, mode, (37, 211))
+        yield_test(resize, mode, (300, 64))
+        yield_test(resize, mode, (50, 40))
@@ -34,3 +34,14 @@ def test_aspect():
     im = lena().resize((128, 128))
     im.thumbnail((100, 100))
     assert_image(im, im.mode, (100, 100))
+
+def test_draft():
+    # JPEG thumbnails are decoded at a reduced size, and then
+    # resampled to the final size
+    im = fromstring(tostring(lena().resize((512, 512)), "JPEG"))
+    im.thumbnail((100, 100))
+    assert_image(im, "RGB", (100, 100))
+
+    im = fromstring(tostring(lena().resize((512, 256)), "JPEG"))
+    im.thumbnail((200, 200))
+    assert_image(im, "RGB", (200, 100))
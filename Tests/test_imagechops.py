@@ -54,3 +54,20 @@ def test_logical():
     assert_equal(table(ImageChops.logical_and, 0, 255), (0, 0, 0, 255))
     assert_equal(table(ImageChops.logical_or, 0, 255), (0, 255, 255, 255))
     assert_equal(table(ImageChops.logical_xor, 0, 255), (0, 255, 255, 0))
+
+def test_threads():
+
+    # large images are processed by several threads; the result must
+    # not depend on the number of threads
+    im1 = lena("L").resize((1024, 1024))
+    im2 = im1.transpose(Image.ROTATE_90)
+    check = assert_threads_equal
+    for op in [lambda: ImageChops.invert(im1),
+               lambda: ImageChops.lighter(im1, im2),
+               lambda: ImageChops.difference(im1, im2),
+               lambda: ImageChops.multiply(im1, im2),
+               lambda: ImageChops.add(im1, im2, 2.0, 10),
+               lambda: ImageChops.subtract_modulo(im1, im2),
+               lambda: ImageChops.blend(im1, im2, 0.5),
+               lambda: ImageChops.blend(im1, im2, 1.5)]:
+        yield_test(check, op)
@@ -59,3 +59,82 @@ def test_safeblock():
         ImageFile.SAFEBLOCK = SAFEBLOCK
     
     assert_image_equal(im1, im2)
+
+def test_decodermaxblock():
+
+    # data is read in small blocks, and kept in the decoder's buffer
+    # until it's been consumed
+    def load(format, maxblock):
+        im = lena()
+        data = tostring(im, format)
+        for fp in (StringIO(), open(tempfile("temp." + format), "w+b")):
+            fp.write(data)
+            fp.seek(0)
+            imOut = Image.open(fp)
+            imOut.decodermaxblock = maxblock
+            imOut.load()
+            fp.close()
+            if format != "JPEG":
+                assert_image_equal(im, imOut)
+
+    for format in "BMP", "PNG", "JPEG", "TIFF":
+        load(format, 1)
+        load(format, 1000)
+
+def test_truncated():
+
+    data = tostring(lena(), "BMP")
+    im = fromstring(data[:-100])
+    assert_exception(IOError, lambda: im.load())
+
+def test_stream():
+
+    def stream(data, lines):
+        im = fromstring(data)
+        out = Image.new(im.mode, im.size)
+        bands = []
+        def callback(band, y):
+            bands.append((y, band.size[1]))
+            out.paste(band, (0, y))
+        im.stream(callback, lines)
+        assert_equal(bands[0], (0, min(lines, im.size[1])))
+        assert_equal(sum([n for y, n in bands]), im.size[1])
+        return out
+
+    for mode in "L", "RGB", "RGBA", "P":
+        im = lena(mode)
+        for format in "PPM", "PNG", "TIFF", "BMP":
+            try:
+                data = tostring(im, format)
+            except IOError:
+                continue
+            if format == "BMP":
+                # stored bottom-up
+                assert_exception(IOError, lambda: stream(data, 10))
+                continue
+            for lines in 1, 10, 64, 128, 1000:
+                assert_image_equal(stream(data, lines), fromstring(data))
+
+    # multiple strips, with bands crossing strip boundaries
+    im = lena("RGB")
+    for compression in "raw", "deflate":
+        data = tiled_tiff(im, (128, 16), compression)
+        assert_image_equal(stream(data, 24), im)
+        assert_image_equal(stream(data, 16), im)
+
+    # compressed with jpeg
+    data = tostring(lena(), "JPEG")
+    assert_exception(IOError, lambda: stream(data, 10))
+
+    # truncated
+    data = tostring(lena(), "PPM")
+    assert_exception(IOError, lambda: stream(data[:-1000], 10))
+
+def test_bad_read():
+
+    # read must not return more data than asked for
+    im = Image.new("L", (16, 16))
+    d = Image._getdecoder("L", "raw", ("L", 0, 1))
+    d.setimage(im.im, (0, 0) + im.size)
+    assert_exception(IOError, lambda: d.decodefile(
+        lambda bytes: "x" * (bytes + 1), None, "", 64))
@@ -3,6 +3,7 @@ from tester import *
 from PIL import Image
 from PIL import ImageOps
 from PIL import ImageFilter
+from PIL import ImageChops
 
 im = Image.open("Images/lena.ppm")
 
@@ -53,3 +54,34 @@ def test_blur():
     assert_no_exception(lambda: blur(im.convert("RGBA")))
     assert_no_exception(lambda: blur(im.convert("CMYK")))
     assert_exception(ValueError, lambda: blur(im.convert("YCbCr")))
+
+def test_box_blur():
+
+    # compare the extended box approximation with the exact blur
+    def compare(im, radius, passes):
+        a = im.filter(ImageFilter.GaussianBlur(radius))
+        b = im.filter(ImageFilter.GaussianBlur(radius, passes))
+        assert_equal(b.mode, im.mode)
+        assert_equal(b.size, im.size)
+        h = ImageChops.difference(a, b).histogram()
+        mean = sum([(i % 256) * h[i] for i in range(len(h))]) / float(sum(h))
+        worst = max([i % 256 for i in range(len(h)) if h[i]])
+        assert_true(mean < 1.5, "radius %s: mean error %.2f" % (radius, mean))
+        assert_true(worst < 32, "radius %s: max error %d" % (radius, worst))
+
+    for radius in 0.5, 1, 2.5, 5, 20, 40:
+        compare(im, radius, 3)
+    compare(im.convert("L"), 5, 4)
+    compare(im.convert("CMYK"), 5, 3)
+
+    # radius 0 leaves the image as is
+    assert_image_equal(im.filter(ImageFilter.GaussianBlur(0, 3)), im)
+
+    # alpha is left as is
+    rgba = im.convert("RGBA")
+    rgba.putalpha(im.convert("L"))
+    out = Image.Image()._new(rgba.im.gaussian_blur(5, 3))
+    assert_image_equal(out.split()[3], rgba.split()[3])
+
+    filter = ImageFilter.UnsharpMask(5, 125, 8, 3)
+    assert_image(im.filter(filter), "RGB", (128, 128))
@@ -107,4 +107,60 @@ def test_unpack():
     assert_exception(ValueError, lambda: unpack("RGB", "RGB", 2))
     assert_exception(ValueError, lambda: unpack("CMYK", "CMYK", 2))
 
+def test_unpack_lines():
+
+    # longer lines go through the vectorized unpackers, if any; the
+    # result must match unpacking one pixel at a time
+
+    data = "".join([chr((i * 73 + 41) & 255) for i in range(1024)])
+
+    def check(mode, rawmode, bytes, pixels=1):
+        for xsize in 1, 7, 15, 16, 17, 31, 32, 33, 47, 100, 129:
+            xsize = xsize * pixels
+            size = xsize * bytes / pixels
+            im = Image.fromstring(mode, (xsize, 1), data[:size],
+                                  "raw", rawmode, 0, 1)
+            expected = []
+            for i in range(0, size, bytes):
+                pixel = Image.fromstring(mode, (pixels, 1),
+                                         data[i:i+bytes],
+                                         "raw", rawmode, 0, 1)
+                expected.extend(pixel.getdata())
+            assert_equal(list(im.getdata()), expected)
+
+    for rawmode in "1", "1;I", "1;R", "1;IR":
+        check("1", rawmode, 1, 8)
+    for rawmode in "RGB", "BGR", "BGRX", "XBGR":
+        check("RGB", rawmode, len(rawmode))
+    for rawmode in "BGRA", "ARGB", "ABGR":
+        check("RGBA", rawmode, 4)
+    for rawmode in "I;16", "I;16S", "I;16B", "I;16BS":
+        check("I", rawmode, 2)
+
+def test_pack_lines():
+
+    # same as above, for the packers
+
+    data = "".join([chr((i * 73 + 41) & 255) for i in range(8192)])
+
+    def check(mode, rawmode, pixels=1):
+        for xsize in 1, 7, 15, 16, 17, 31, 32, 33, 47, 100, 129:
+            xsize = xsize * pixels
+            im = Image.fromstring(mode, (xsize, 1), data)
+            if mode == "1":
+                im = im.point(lambda v: v & 1 and 255)
+            expected = []
+            for x in range(0, xsize, pixels):
+                pixel = im.crop((x, 0, x + pixels, 1))
+                expected.append(pixel.tostring("raw", rawmode))
+            assert_equal(im.tostring("raw", rawmode), "".join(expected))
+
+    for rawmode in "1", "1;I", "1;R", "1;IR":
+        check("1", rawmode, 8)
+    for rawmode in "RGB", "BGR", "BGRX", "XRGB", "XBGR":
+        check("RGB", rawmode)
+    for rawmode in "BGRA", "ABGR":
+        check("RGBA", rawmode)
+    check("I", "I;16B")
+
 run()
@@ -0,0 +1,76 @@
+from tester import *
+
+from PIL import Image
+
+core = Image.core
+
+def test_pool():
+
+    core.setpool(1, 16, 1024*1024)
+
+    stats = core.getpoolstats()
+    assert_equal(stats["enabled"], 1)
+    assert_equal(stats["maxblocks"], 16)
+    assert_equal(stats["maxbytes"], 1024*1024)
+
+    # first allocation misses, second one reuses the released block
+    misses = stats["misses"]
+    im = Image.new("RGB", (100, 100), (1, 2, 3))
+    assert_equal(core.getpoolstats()["misses"], misses + 1)
+    del im
+    assert_equal(core.getpoolstats()["blocks"], 1)
+    hits = core.getpoolstats()["hits"]
+    im = Image.new("RGB", (100, 100), (4, 5, 6))
+    assert_equal(core.getpoolstats()["hits"], hits + 1)
+    assert_equal(core.getpoolstats()["blocks"], 0)
+    assert_equal(im.getpixel((99, 99)), (4, 5, 6))
+
+    # same size class
+    del im
+    im = Image.new("L", (400, 100))
+    assert_equal(core.getpoolstats()["hits"], hits + 2)
+
+    core.clearpool()
+    assert_equal(core.getpoolstats()["blocks"], 0)
+    assert_equal(core.getpoolstats()["bytes"], 0)
+
+    core.setpool(0)
+    assert_equal(core.getpoolstats()["enabled"], 0)
+
+def test_limits():
+
+    core.setpool(1, 2, 1024*1024)
+
+    ims = [Image.new("L", (64, 64)) for i in range(4)]
+    del ims
+    stats = core.getpoolstats()
+    assert_equal(stats["blocks"], 2)
+
+    # larger than the pool; allocated in the usual way
+    misses = stats["misses"]
+    im = Image.new("RGB", (1024, 1024))
+    assert_equal(core.getpoolstats()["misses"], misses)
+    assert_false(core.getpoolstats()["blocks"] > 2)
+
+    core.setpool(1, 0)
+    assert_equal(core.getpoolstats()["blocks"], 0)
+
+    core.setpool(0)
+
+def test_operations():
+
+    core.setpool(0)
+    expected = {}
+    for mode in "1", "L", "P", "RGB", "RGBA", "I", "F":
+        expected[mode] = lena(mode).resize((64, 64))
+
+    core.setpool(1)
+    for mode in "1", "L", "P", "RGB", "RGBA", "I", "F":
+        im = lena(mode)
+        assert_image_equal(im.copy(), im)
+        # the second resize gets recycled blocks
+        assert_image_equal(im.resize((64, 64)), expected[mode])
+        assert_image_equal(im.resize((64, 64)), expected[mode])
+    im = lena().im.new_pooled("RGB", (0, 0))
+    assert_equal(im.size, (0, 0))
+    core.setpool(0)
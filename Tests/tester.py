@@ -128,6 +128,46 @@ def lena(mode="RGB", cache={}):
     cache[mode] = im
     return im
 
+def tiled_tiff(im, tile, compression="raw"):
+    # write an "L" or "RGB" image as a tiled TIFF file (the TIFF
+    # writer only supports single-strip files).  compression is
+    # "raw" or "deflate".
+    import zlib
+    from PIL import TiffImagePlugin
+    w, h = tile
+    data = []
+    offsets = []
+    counts = []
+    offset = 8
+    for y in range(0, im.size[1], h):
+        for x in range(0, im.size[0], w):
+            s = im.crop((x, y, x+w, y+h)).tostring()
+            if compression == "deflate":
+                s = zlib.compress(s)
+            offsets.append(offset)
+            counts.append(len(s))
+            data.append(s)
+            offset = offset + len(s)
+    if offset & 1:
+        data.append("\0")
+        offset = offset + 1
+    ifd = TiffImagePlugin.ImageFileDirectory("II")
+    ifd[TiffImagePlugin.IMAGEWIDTH] = im.size[0]
+    ifd[TiffImagePlugin.IMAGELENGTH] = im.size[1]
+    ifd[TiffImagePlugin.BITSPERSAMPLE] = (8,) * len(im.getbands())
+    ifd[TiffImagePlugin.COMPRESSION] = {"raw": 1, "deflate": 8}[compression]
+    ifd[TiffImagePlugin.PHOTOMETRIC_INTERPRETATION] = {"L": 1, "RGB": 2}[im.mode]
+    ifd[TiffImagePlugin.SAMPLESPERPIXEL] = len(im.getbands())
+    ifd[322] = w # tile width
+    ifd[323] = h # tile length
+    ifd[TiffImagePlugin.TILEOFFSETS] = tuple(offsets)
+    ifd[325] = tuple(counts) # tile byte counts
+    out = StringIO()
+    out.write(ifd.prefix + ifd.o16(42) + ifd.o32(offset))
+    out.write("".join(data))
+    ifd.save(out)
+    return out.getvalue()
+
 def assert_image(im, mode, size, msg=None):
     if mode is not None and im.mode != mode:
         failure(msg or "got mode %r, expected %r" % (im.mode, mode))
@@ -147,6 +187,24 @@ def assert_image_equal(a, b, msg=None):
     else:
         success()
 
+def assert_threads_equal(op, threads=4):
+    # call op with one thread and with several, and check that the
+    # results are the same.  returns both results.
+    from PIL import Image
+    Image.core.setthreads(1)
+    try:
+        expected = op()
+        Image.core.setthreads(threads)
+        assert_equal(Image.core.getthreads(), threads)
+        out = op()
+    finally:
+        Image.core.setthreads(1)
+    if isinstance(out, Image.Image):
+        assert_image_equal(out, expected)
+    else:
+        assert_equal(out, expected)
+    return expected, out
+
 def tempfile(template, *extra):
     import os, sys
     files = []
@@ -639,6 +639,18 @@ _new_block(PyObject* self, PyObject* args)
     return PyImagingNew(ImagingNewBlock(mode, xsize, ysize));
 }
 
+static PyObject* 
+_new_pooled(PyObject* self, PyObject* args)
+{
+    char* mode;
+    int xsize, ysize;
+
+    if (!PyArg_ParseTuple(args, "s(ii)", &mode, &xsize, &ysize))
+	return NULL;
+
+    return PyImagingNew(ImagingNewPooled(mode, xsize, ysize));
+}
+
 static PyObject* 
 _getcount(PyObject* self, PyObject* args)
 {
@@ -648,6 +660,71 @@ _getcount(PyObject* self, PyObject* args)
     return PyInt_FromLong(ImagingNewCount);
 }
 
+static PyObject* 
+_setpool(PyObject* self, PyObject* args)
+{
+    int enabled;
+    int maxblocks = -1;
+    long maxbytes = -1;
+    if (!PyArg_ParseTuple(args, "i|il:setpool", &enabled, &maxblocks, &maxbytes))
+	return NULL;
+
+    ImagingMemoryPoolSetup(enabled, maxblocks, maxbytes);
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* 
+_clearpool(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":clearpool"))
+	return NULL;
+
+    ImagingMemoryPoolClear();
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
+static PyObject* 
+_getpoolstats(PyObject* self, PyObject* args)
+{
+    ImagingMemoryPoolStats stats;
+
+    if (!PyArg_ParseTuple(args, ":getpoolstats"))
+	return NULL;
+
+    ImagingMemoryPoolGetStats(&stats);
+
+    return Py_BuildValue(
+        "{s:i,s:i,s:l,s:i,s:l,s:l,s:l,s:l,s:l}",
+        "enabled", stats.enabled, "maxblocks", stats.maxblocks,
+        "maxbytes", stats.maxbytes, "blocks", stats.blocks,
+        "bytes", stats.bytes, "hits", stats.hits, "misses", stats.misses,
+        "returned", stats.returned, "released", stats.released
+        );
+}
+
+static PyObject* 
+_setthreads(PyObject* self, PyObject* args)
+{
+    int threads;
+    if (!PyArg_ParseTuple(args, "i:setthreads", &threads))
+	return NULL;
+
+    return PyInt_FromLong(ImagingParallelSetThreads(threads));
+}
+
+static PyObject* 
+_getthreads(PyObject* self, PyObject* args)
+{
+    if (!PyArg_ParseTuple(args, ":getthreads"))
+	return NULL;
+
+    return PyInt_FromLong(ImagingParallelGetThreads());
+}
+
 static PyObject* 
 _linear_gradient(PyObject* self, PyObject* args)
 {
@@ -848,7 +925,8 @@ _gaussian_blur(ImagingObject* self, PyObject* args)
     Imaging imOut;
 
     float radius = 0;
-    if (!PyArg_ParseTuple(args, "f", &radius))
+    int passes = 0;
+    if (!PyArg_ParseTuple(args, "f|i", &radius, &passes))
         return NULL;
 
     imIn = self->image;
@@ -856,7 +934,7 @@ _gaussian_blur(ImagingObject* self, PyObject* args)
     if (!imOut)
         return NULL;
 
-    if (!ImagingGaussianBlur(imIn, imOut, radius))
+    if (!ImagingGaussianBlur(imIn, imOut, radius, passes))
         return NULL;
 
     return PyImagingNew(imOut);
@@ -1340,7 +1418,12 @@ _quantize(ImagingObject* self, PyObject* args)
     int colours = 256;
     int method = 0;
     int kmeans = 0;
-    if (!PyArg_ParseTuple(args, "|iii", &colours, &method, &kmeans))
+    int sample = 0;
+    int iterations = 0;
+    double seconds = 0.0;
+    int bits = 0;
+    if (!PyArg_ParseTuple(args, "|iiiiidi", &colours, &method, &kmeans,
+                          &sample, &iterations, &seconds, &bits))
 	return NULL;
 
     if (!self->image->xsize || !self->image->ysize) {
@@ -1350,7 +1433,39 @@ _quantize(ImagingObject* self, PyObject* args)
             );
     }
 
-    return PyImagingNew(ImagingQuantize(self->image, colours, method, kmeans));
+    return PyImagingNew(ImagingQuantize(self->image, colours, method, kmeans,
+                                        sample, iterations, seconds, bits));
+}
+
+static PyObject* 
+_quantize_palette(ImagingObject* self, PyObject* args)
+{
+    ImagingObject* paletteimage;
+    if (!PyArg_ParseTuple(args, "O!", &Imaging_Type, &paletteimage))
+	return NULL;
+
+    if (paletteimage->image->palette == NULL) {
+	PyErr_SetString(PyExc_ValueError, no_palette);
+	return NULL;
+    }
+
+    if (!self->image->xsize || !self->image->ysize) {
+        /* no content; return an empty image with the given palette */
+        Imaging imOut;
+        imOut = ImagingNew("P", self->image->xsize, self->image->ysize);
+        if (!imOut)
+            return NULL;
+        ImagingPaletteDelete(imOut->palette);
+        imOut->palette = ImagingPaletteDuplicate(paletteimage->image->palette);
+        if (!imOut->palette) {
+            ImagingDelete(imOut);
+            return PyErr_NoMemory();
+        }
+        return PyImagingNew(imOut);
+    }
+
+    return PyImagingNew(ImagingQuantizePalette(self->image,
+                                               paletteimage->image->palette));
 }
 #endif
 
@@ -1595,7 +1710,6 @@ static PyObject*
 _stretch(ImagingObject* self, PyObject* args)
 {
     Imaging imIn;
-    Imaging imTemp;
     Imaging imOut;
 
     int xsize, ysize;
@@ -1605,35 +1719,16 @@ _stretch(ImagingObject* self, PyObject* args)
 
     imIn = self->image;
 
-    /* two-pass resize: minimize size of intermediate image */
-    if (imIn->xsize * ysize < xsize * imIn->ysize)
-        imTemp = ImagingNew(imIn->mode, imIn->xsize, ysize);
-    else 
-        imTemp = ImagingNew(imIn->mode, xsize, imIn->ysize);
-    if (!imTemp)
-        return NULL;
-
-    /* first pass */
-    if (!ImagingStretch(imTemp, imIn, filter)) {
-        ImagingDelete(imTemp);
-        return NULL;
-    }
-
     imOut = ImagingNew(imIn->mode, xsize, ysize);
-    if (!imOut) {
-        ImagingDelete(imTemp);
+    if (!imOut)
         return NULL;
-    }
 
-    /* second pass */
-    if (!ImagingStretch(imOut, imTemp, filter)) {
+    /* two-pass resize, without a full intermediate image */
+    if (!ImagingResample(imOut, imIn, filter)) {
         ImagingDelete(imOut);
-        ImagingDelete(imTemp);
         return NULL;
     }
 
-    ImagingDelete(imTemp);
-    
     return PyImagingNew(imOut);
 }
 
@@ -1770,7 +1865,9 @@ _unsharp_mask(ImagingObject* self, PyObject* args)
 
     float radius;
     int percent, threshold;
-    if (!PyArg_ParseTuple(args, "fii", &radius, &percent, &threshold))
+    int passes = 0;
+    if (!PyArg_ParseTuple(args, "fii|i", &radius, &percent, &threshold,
+                          &passes))
         return NULL;
 
 
@@ -1779,7 +1876,7 @@ _unsharp_mask(ImagingObject* self, PyObject* args)
     if (!imOut)
         return NULL;
 
-    if (!ImagingUnsharpMask(imIn, imOut, radius, percent, threshold))
+    if (!ImagingUnsharpMask(imIn, imOut, radius, percent, threshold, passes))
         return NULL;
 
     return PyImagingNew(imOut);
@@ -2972,6 +3069,7 @@ static struct PyMethodDef methods[] = {
     {"putdata", (PyCFunction)_putdata, METH_VARARGS},
 #ifdef WITH_QUANTIZE
     {"quantize", (PyCFunction)_quantize, METH_VARARGS},
+    {"quantize_palette", (PyCFunction)_quantize_palette, METH_VARARGS},
 #endif
 #ifdef WITH_RANKFILTER
     {"rankfilter", (PyCFunction)_rankfilter, METH_VARARGS},
@@ -3032,6 +3130,7 @@ static struct PyMethodDef methods[] = {
     /* Misc. */
     {"new_array", (PyCFunction)_new_array, METH_VARARGS},
     {"new_block", (PyCFunction)_new_block, METH_VARARGS},
+    {"new_pooled", (PyCFunction)_new_pooled, METH_VARARGS},
 
 #ifdef WITH_DEBUG
     {"save_ppm", (PyCFunction)_save_ppm, METH_VARARGS},
@@ -3324,6 +3423,7 @@ static PyTypeObject PixelAccess_Type = {
    pluggable codecs, but not before PIL 1.2 */
 
 /* Decoders (in decode.c) */
+extern PyObject* PyImaging_DecodeTiles(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_BitDecoderNew(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_FliDecoderNew(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_GifDecoderNew(PyObject* self, PyObject* args);
@@ -3344,6 +3444,7 @@ extern PyObject* PyImaging_ZipDecoderNew(PyObject* self, PyObject* args);
 /* Encoders (in encode.c) */
 extern PyObject* PyImaging_EpsEncoderNew(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_GifEncoderNew(PyObject* self, PyObject* args);
+extern PyObject* PyImaging_GifEncodeFrames(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_JpegEncoderNew(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_PcxEncoderNew(PyObject* self, PyObject* args);
 extern PyObject* PyImaging_RawEncoderNew(PyObject* self, PyObject* args);
@@ -3381,16 +3482,27 @@ static PyMethodDef functions[] = {
 
     {"getcount", (PyCFunction)_getcount, METH_VARARGS},
 
+    /* Memory pool */
+    {"setpool", (PyCFunction)_setpool, METH_VARARGS},
+    {"clearpool", (PyCFunction)_clearpool, METH_VARARGS},
+    {"getpoolstats", (PyCFunction)_getpoolstats, METH_VARARGS},
+
+    /* Worker threads */
+    {"setthreads", (PyCFunction)_setthreads, METH_VARARGS},
+    {"getthreads", (PyCFunction)_getthreads, METH_VARARGS},
+
     /* Functions */
     {"convert", (PyCFunction)_convert2, METH_VARARGS},
     {"copy", (PyCFunction)_copy2, METH_VARARGS},
 
     /* Codecs */
+    {"decode_tiles", (PyCFunction)PyImaging_DecodeTiles, METH_VARARGS},
     {"bit_decoder", (PyCFunction)PyImaging_BitDecoderNew, METH_VARARGS},
     {"eps_encoder", (PyCFunction)PyImaging_EpsEncoderNew, METH_VARARGS},
     {"fli_decoder", (PyCFunction)PyImaging_FliDecoderNew, METH_VARARGS},
     {"gif_decoder", (PyCFunction)PyImaging_GifDecoderNew, METH_VARARGS},
     {"gif_encoder", (PyCFunction)PyImaging_GifEncoderNew, METH_VARARGS},
+    {"gif_encode_frames", (PyCFunction)PyImaging_GifEncodeFrames, METH_VARARGS},
     {"hex_decoder", (PyCFunction)PyImaging_HexDecoderNew, METH_VARARGS},
     {"hex_encoder", (PyCFunction)PyImaging_EpsEncoderNew, METH_VARARGS}, /* EPS=HEX! */
 #ifdef HAVE_LIBJPEG
@@ -3525,6 +3637,9 @@ PyInit__imaging(void)
 
     ImagingAccessInit();
 
+    /* release shared conversion tables when the interpreter exits */
+    Py_AtExit(ImagingConvertCleanup);
+
     PyImaging_DecoderInit();
     PyImaging_EncoderInit();
     PyImaging_MappingInit();
@@ -39,6 +39,9 @@
 #include "Raw.h"
 #include "Bit.h"
 #include "WebP.h"
+#ifdef HAVE_LIBZ
+#include "Zip.h"
+#endif
 
 
 /* -------------------------------------------------------------------- */
@@ -52,6 +55,8 @@ typedef struct {
     struct ImagingCodecStateInstance state;
     Imaging im;
     PyObject* lock;
+    Imaging band; /* row table for streaming (see setband) */
+    int bandsize;
 } ImagingDecoderObject;
 
 static PyTypeObject ImagingDecoderType;
@@ -98,6 +103,8 @@ PyImaging_DecoderNew(int contextsize)
     /* Target image */
     decoder->lock = NULL;
     decoder->im = NULL;
+    decoder->band = NULL;
+    decoder->bandsize = 0;
 
     return decoder;
 }
@@ -107,6 +114,7 @@ _dealloc(ImagingDecoderObject* decoder)
 {
     free(decoder->state.buffer);
     free(decoder->state.context);
+    ImagingDelete(decoder->band);
     Py_XDECREF(decoder->lock);
     PyObject_Del(decoder);
 }
@@ -125,25 +133,203 @@ _decode(ImagingDecoderObject* decoder, PyObject* args)
     return Py_BuildValue("ii", status, decoder->state.errcode);
 }
 
-extern Imaging PyImaging_AsImaging(PyObject *op);
+/* Decode data from a file, without going through Python strings for
+   the data the decoder hasn't consumed yet.  The input buffer holds
+   any unconsumed data, plus room for another block.  If a readinto
+   method is given, the file reads directly into that buffer.
+   Otherwise, read is called to get the next block.  Returns (status,
+   errcode) when the decoder is done (status < 0), or (remaining, 0)
+   if the file ended first.  remaining is the number of bytes left
+   unprocessed.
 
-static PyObject*
-_setimage(ImagingDecoderObject* decoder, PyObject* args)
+   If the decoder is set up for streaming (see setband), callback(y,
+   lines) is called each time the band has been filled. */
+
+#define	MAXBLOCK 65536
+
+static int
+_readblock(PyObject* read, PyObject* readinto, UINT8* buffer, int size)
 {
-    PyObject* op;
-    Imaging im;
-    ImagingCodecState state;
-    int x0, y0, x1, y1;
+    PyObject* result;
+    int bytes;
+
+    if (readinto != Py_None) {
+        /* read directly into the input buffer */
+        Py_buffer view;
+        PyObject* memory;
+        if (PyBuffer_FillInfo(&view, NULL, buffer, size, 0, PyBUF_CONTIG))
+            return -1;
+        memory = PyMemoryView_FromBuffer(&view);
+        if (!memory)
+            return -1;
+        result = PyObject_CallFunctionObjArgs(readinto, memory, NULL);
+        Py_DECREF(memory);
+        if (!result)
+            return -1;
+        if (result == Py_None)
+            bytes = 0; /* no data available */
+        else
+            bytes = (int) PyInt_AsLong(result);
+        Py_DECREF(result);
+        if (bytes < 0 || bytes > size) {
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_IOError, "bad readinto result");
+            return -1;
+        }
+    } else {
+        const void* data;
+        Py_ssize_t length;
+        result = PyObject_CallFunction(read, "i", size);
+        if (!result)
+            return -1;
+        if (PyObject_AsReadBuffer(result, &data, &length) < 0) {
+            Py_DECREF(result);
+            return -1;
+        }
+        if (length > size) {
+            Py_DECREF(result);
+            PyErr_SetString(PyExc_IOError, "bad read result");
+            return -1;
+        }
+        memcpy(buffer, data, length);
+        bytes = (int) length;
+        Py_DECREF(result);
+    }
 
-    x0 = y0 = x1 = y1 = 0;
+    return bytes;
+}
 
-    /* FIXME: should publish the ImagingType descriptor */
-    if (!PyArg_ParseTuple(args, "O|(iiii)", &op, &x0, &y0, &x1, &y1))
-	return NULL;
-    im = PyImaging_AsImaging(op);
-    if (!im)
+static int
+_flushband(PyObject* callback, int y, int lines)
+{
+    PyObject* result;
+
+    result = PyObject_CallFunction(callback, "ii", y, lines);
+    if (!result)
+        return 0;
+    Py_DECREF(result);
+
+    return 1;
+}
+
+static PyObject* 
+_decodefile(ImagingDecoderObject* decoder, PyObject* args)
+{
+    PyObject* read;
+    PyObject* readinto = Py_None;
+    char* prefix = NULL;
+    int prefixsize = 0;
+    int maxblock = MAXBLOCK;
+    PyObject* callback = Py_None;
+    ImagingCodecState state = &decoder->state;
+    UINT8* buffer;
+    int bytes, status, size, n, y, readmore;
+
+    if (!PyArg_ParseTuple(args, "O|Os#iO:decodefile", &read, &readinto,
+                          &prefix, &prefixsize, &maxblock, &callback))
 	return NULL;
 
+    if (decoder->band && callback == Py_None) {
+        PyErr_SetString(PyExc_ValueError, "streaming requires a callback");
+        return NULL;
+    }
+
+    if (maxblock < 1)
+        maxblock = MAXBLOCK;
+
+    size = prefixsize + maxblock;
+    buffer = malloc(size);
+    if (!buffer)
+        return PyErr_NoMemory();
+
+    bytes = prefixsize;
+    if (prefixsize > 0)
+        memcpy(buffer, prefix, prefixsize);
+
+    readmore = 1;
+
+    for (;;) {
+
+        if (readmore) {
+
+            /* make room for another block */
+            if (bytes + maxblock > size) {
+                UINT8* p = realloc(buffer, bytes + maxblock);
+                if (!p) {
+                    free(buffer);
+                    return PyErr_NoMemory();
+                }
+                buffer = p;
+                size = bytes + maxblock;
+            }
+
+            n = _readblock(read, readinto, buffer + bytes, maxblock);
+            if (n < 0) {
+                free(buffer);
+                return NULL;
+            }
+            if (n == 0) {
+                /* premature end of file */
+                free(buffer);
+                return Py_BuildValue("ii", bytes, 0);
+            }
+            bytes += n;
+
+        }
+
+        if (decoder->band) {
+            /* stop at the end of the current band */
+            y = state->y + state->yoff;
+            state->ystop = (y / decoder->bandsize + 1) * decoder->bandsize;
+            state->ystop -= state->yoff;
+        }
+
+        status = decoder->decode(decoder->im, state, buffer, bytes);
+        if (status < 0)
+            break;
+
+        /* keep the unconsumed data */
+        if (status > 0) {
+            bytes -= status;
+            memmove(buffer, buffer + status, bytes);
+        }
+
+        readmore = 1;
+
+        if (decoder->band && state->y >= state->ystop) {
+            /* hand the band over before the decoder overwrites it.
+               there may be more lines in the data we already have */
+            y = state->ystop + state->yoff - decoder->bandsize;
+            if (!_flushband(callback, y, decoder->bandsize)) {
+                free(buffer);
+                return NULL;
+            }
+            readmore = 0;
+        }
+    }
+
+    free(buffer);
+
+    /* flush the last band, if the decoder filled it */
+    if (decoder->band && status == -1 && state->errcode == 0) {
+        y = state->y + state->yoff;
+        if (y > 0 && y % decoder->bandsize == 0)
+            if (!_flushband(callback, y - decoder->bandsize,
+                            decoder->bandsize))
+                return NULL;
+    }
+
+    return Py_BuildValue("ii", status, state->errcode);
+}
+
+extern Imaging PyImaging_AsImaging(PyObject *op);
+
+static int
+setimage(ImagingDecoderObject* decoder, Imaging im,
+         int x0, int y0, int x1, int y1)
+{
+    ImagingCodecState state;
+
     decoder->im = im;
 
     state = &decoder->state;
@@ -164,7 +350,7 @@ _setimage(ImagingDecoderObject* decoder, PyObject* args)
 	state->ysize <= 0 ||
 	state->ysize + state->yoff > (int) im->ysize) {
 	PyErr_SetString(PyExc_ValueError, "tile cannot extend outside image");
-	return NULL;
+	return -1;
     }
 
     /* Allocate memory buffer (if bits field is set) */
@@ -172,10 +358,34 @@ _setimage(ImagingDecoderObject* decoder, PyObject* args)
         if (!state->bytes)
             state->bytes = (state->bits * state->xsize+7)/8;
 	state->buffer = (UINT8*) malloc(state->bytes);
-	if (!state->buffer)
-	    return PyErr_NoMemory();
+	if (!state->buffer) {
+	    PyErr_NoMemory();
+	    return -1;
+	}
     }
 
+    return 0;
+}
+
+static PyObject*
+_setimage(ImagingDecoderObject* decoder, PyObject* args)
+{
+    PyObject* op;
+    Imaging im;
+    int x0, y0, x1, y1;
+
+    x0 = y0 = x1 = y1 = 0;
+
+    /* FIXME: should publish the ImagingType descriptor */
+    if (!PyArg_ParseTuple(args, "O|(iiii)", &op, &x0, &y0, &x1, &y1))
+	return NULL;
+    im = PyImaging_AsImaging(op);
+    if (!im)
+	return NULL;
+
+    if (setimage(decoder, im, x0, y0, x1, y1) < 0)
+        return NULL;
+
     /* Keep a reference to the image object, to make sure it doesn't
        go away before we do */
     Py_INCREF(op);
@@ -186,8 +396,74 @@ _setimage(ImagingDecoderObject* decoder, PyObject* args)
     return Py_None;
 }
 
+static PyObject*
+_setband(ImagingDecoderObject* decoder, PyObject* args)
+{
+    /* decode into a band of lines, which is reused for every
+       band.  the decoder sees an image with ysize lines, where
+       line y is stored in line y % (band height) of the band */
+
+    PyObject* op;
+    Imaging band, im;
+    int x0, y0, x1, y1, ysize, y;
+
+    if (!PyArg_ParseTuple(args, "O(iiii)i", &op, &x0, &y0, &x1, &y1, &ysize))
+	return NULL;
+    band = PyImaging_AsImaging(op);
+    if (!band)
+	return NULL;
+
+    /* only decoders that stop at ystop, and write lines in order */
+    if ((decoder->decode != ImagingRawDecode &&
+         decoder->decode != ImagingPackbitsDecode
+#ifdef HAVE_LIBZ
+         && decoder->decode != ImagingZipDecode
+#endif
+            ) || decoder->state.ystep < 0) {
+        PyErr_SetString(PyExc_ValueError, "decoder cannot stream");
+        return NULL;
+    }
+#ifdef HAVE_LIBZ
+    if (decoder->decode == ImagingZipDecode &&
+        ((ZIPSTATE*) decoder->state.context)->interlaced) {
+        PyErr_SetString(PyExc_ValueError, "decoder cannot stream");
+        return NULL;
+    }
+#endif
+
+    if (ysize < 1) {
+        PyErr_SetString(PyExc_ValueError, "bad image size");
+        return NULL;
+    }
+
+    im = ImagingNewPrologue(band->mode, band->xsize, ysize);
+    if (!im)
+        return NULL;
+    for (y = 0; y < ysize; y++)
+        im->image[y] = band->image[y % band->ysize];
+
+    if (setimage(decoder, im, x0, y0, x1, y1) < 0) {
+        ImagingDelete(im);
+        return NULL;
+    }
+
+    ImagingDelete(decoder->band);
+    decoder->band = im;
+    decoder->bandsize = band->ysize;
+
+    /* keep the band alive */
+    Py_INCREF(op);
+    Py_XDECREF(decoder->lock);
+    decoder->lock = op;
+
+    Py_INCREF(Py_None);
+    return Py_None;
+}
+
 static struct PyMethodDef methods[] = {
     {"decode", (PyCFunction)_decode, METH_VARARGS},
+    {"decodefile", (PyCFunction)_decodefile, METH_VARARGS},
+    {"setband", (PyCFunction)_setband, METH_VARARGS},
     {"setimage", (PyCFunction)_setimage, METH_VARARGS},
     {NULL, NULL} /* sentinel */
 };
@@ -246,6 +522,104 @@ static PyTypeObject ImagingDecoderType = {
 #endif
 };
 
+/* -------------------------------------------------------------------- */
+/* Decode a number of independent tiles in parallel.  Each tile is
+   given as a (decoder, data) tuple, where the decoder has already been
+   attached to its part of the image via setimage.  The data must hold
+   all data for that tile.  Returns a list of (status, errcode)
+   tuples.  Only use this with decoders that don't share state between
+   tiles (raw, packbits, zip, etc). */
+
+struct decode_tiles_context {
+    ImagingDecoderObject** decoders;
+    UINT8** data;
+    int* bytes;
+    int* status;
+};
+
+static void
+decode_tiles(void* context, int start, int end)
+{
+    struct decode_tiles_context* ctx = context;
+    ImagingDecoderObject* decoder;
+    int i;
+
+    for (i = start; i < end; i++) {
+        decoder = ctx->decoders[i];
+        ctx->status[i] = decoder->decode(decoder->im, &decoder->state,
+                                         ctx->data[i], ctx->bytes[i]);
+    }
+}
+
+PyObject*
+PyImaging_DecodeTiles(PyObject* self, PyObject* args)
+{
+    ImagingSectionCookie cookie;
+    struct decode_tiles_context context;
+    PyObject* tiles;
+    PyObject* result;
+    int i, n;
+
+    if (!PyArg_ParseTuple(args, "O:decode_tiles", &tiles))
+	return NULL;
+
+    /* make sure the tiles stay alive while we're working on them */
+    tiles = PySequence_Tuple(tiles);
+    if (!tiles)
+        return NULL;
+
+    n = (int) PyTuple_GET_SIZE(tiles);
+
+    context.decoders = malloc((n + 1) * sizeof(ImagingDecoderObject*));
+    context.data = malloc((n + 1) * sizeof(UINT8*));
+    context.bytes = malloc((n + 1) * sizeof(int));
+    context.status = malloc((n + 1) * sizeof(int));
+    if (!context.decoders || !context.data || !context.bytes ||
+        !context.status) {
+        PyErr_NoMemory();
+        goto error;
+    }
+
+    for (i = 0; i < n; i++) {
+        if (!PyArg_ParseTuple(PyTuple_GET_ITEM(tiles, i), "O!s#",
+                              &ImagingDecoderType, &context.decoders[i],
+                              &context.data[i], &context.bytes[i]))
+            goto error;
+        if (!context.decoders[i]->im) {
+            PyErr_SetString(PyExc_ValueError, "decoder has no image");
+            goto error;
+        }
+    }
+
+    ImagingSectionEnter(&cookie);
+    ImagingParallelFor(n, 1, decode_tiles, &context);
+    ImagingSectionLeave(&cookie);
+
+    result = PyList_New(n);
+    if (!result)
+        goto error;
+    for (i = 0; i < n; i++)
+        PyList_SET_ITEM(result, i, Py_BuildValue(
+            "ii", context.status[i], context.decoders[i]->state.errcode
+            ));
+
+    free(context.decoders);
+    free(context.data);
+    free(context.bytes);
+    free(context.status);
+    Py_DECREF(tiles);
+
+    return result;
+
+  error:
+    free(context.decoders);
+    free(context.data);
+    free(context.bytes);
+    free(context.status);
+    Py_DECREF(tiles);
+    return NULL;
+}
+
 /* -------------------------------------------------------------------- */
 
 int
@@ -641,8 +1015,6 @@ PyImaging_XbmDecoderNew(PyObject* self, PyObject* args)
 
 #ifdef HAVE_LIBZ
 
-#include "Zip.h"
-
 PyObject*
 PyImaging_ZipDecoderNew(PyObject* self, PyObject* args)
 {
@@ -651,7 +1023,9 @@ PyImaging_ZipDecoderNew(PyObject* self, PyObject* args)
     char* mode;
     char* rawmode;
     int interlaced = 0;
-    if (!PyArg_ParseTuple(args, "ss|i", &mode, &rawmode, &interlaced))
+    int zipmode = ZIP_PNG;
+    if (!PyArg_ParseTuple(args, "ss|ii", &mode, &rawmode, &interlaced,
+                          &zipmode))
 	return NULL;
 
     decoder = PyImaging_DecoderNew(sizeof(ZIPSTATE));
@@ -664,6 +1038,7 @@ PyImaging_ZipDecoderNew(PyObject* self, PyObject* args)
     decoder->decode = ImagingZipDecode;
 
     ((ZIPSTATE*)decoder->state.context)->interlaced = interlaced;
+    ((ZIPSTATE*)decoder->state.context)->mode = zipmode;
 
     return (PyObject*) decoder;
 }
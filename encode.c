@@ -40,6 +40,7 @@ typedef struct {
     PyObject_HEAD
     int (*encode)(Imaging im, ImagingCodecState state,
 		  UINT8* buffer, int bytes);
+    void (*cleanup)(ImagingCodecState state);
     struct ImagingCodecStateInstance state;
     Imaging im;
     PyObject* lock;
@@ -86,6 +87,10 @@ PyImaging_EncoderNew(int contextsize)
     /* Initialize encoder context */
     encoder->state.context = context;
 
+    /* Optional; releases codec resources if the encoder is destroyed
+       before it has finished */
+    encoder->cleanup = NULL;
+
     /* Target image */
     encoder->lock = NULL;
     encoder->im = NULL;
@@ -96,6 +101,8 @@ PyImaging_EncoderNew(int contextsize)
 static void
 _dealloc(ImagingEncoderObject* encoder)
 {
+    if (encoder->cleanup)
+	encoder->cleanup(&encoder->state);
     free(encoder->state.buffer);
     free(encoder->state.context);
     Py_XDECREF(encoder->lock);
@@ -374,6 +381,315 @@ PyImaging_GifEncoderNew(PyObject* self, PyObject* args)
     return (PyObject*) encoder;
 }
 
+/* Find the area that differs between two 8-bit images of the same
+   size.  Returns 0 if the images are identical. */
+
+static int
+changed_area(Imaging im, Imaging previous, int bbox[4])
+{
+    int x, y;
+
+    bbox[0] = im->xsize;
+    bbox[1] = -1;
+    bbox[2] = bbox[3] = 0;
+
+    for (y = 0; y < im->ysize; y++) {
+	UINT8* in = im->image8[y];
+	UINT8* prev = previous->image8[y];
+	if (!memcmp(in, prev, im->xsize))
+	    continue;
+	for (x = 0; x < bbox[0]; x++)
+	    if (in[x] != prev[x]) {
+		bbox[0] = x;
+		break;
+	    }
+	for (x = im->xsize; x > bbox[2]; x--)
+	    if (in[x-1] != prev[x-1]) {
+		bbox[2] = x;
+		break;
+	    }
+	if (bbox[1] < 0)
+	    bbox[1] = y;
+	bbox[3] = y+1;
+    }
+
+    return bbox[1] >= 0;
+}
+
+/* Find a palette index that isn't used in the given area */
+
+static int
+unused_index(Imaging im, int bbox[4])
+{
+    int count[256];
+    int x, y, i;
+
+    memset(count, 0, sizeof(count));
+    for (y = bbox[1]; y < bbox[3]; y++)
+	for (x = bbox[0]; x < bbox[2]; x++)
+	    count[im->image8[y][x]]++;
+
+    for (i = 255; i >= 0; i--)
+	if (!count[i])
+	    return i;
+
+    return -1;
+}
+
+/* Write one frame, from the graphic control extension to the block
+   terminator */
+
+static PyObject*
+gif_frame(ImagingEncoderObject* encoder, Imaging im, int bbox[4],
+	  int duration, Imaging previous, int transparency,
+	  const char* palette, int palette_size, int interlace)
+{
+    ImagingCodecState state = &encoder->state;
+    GIFENCODERSTATE* context = (GIFENCODERSTATE*) state->context;
+    ImagingSectionCookie cookie;
+    PyObject* result;
+    UINT8* buf;
+    UINT8* p;
+    int bufsize, size, status, bits;
+    int xsize = bbox[2] - bbox[0];
+    int ysize = bbox[3] - bbox[1];
+
+    /* Set up the encoder for this frame */
+    free(state->buffer);
+    state->buffer = NULL;
+    state->xoff = bbox[0];
+    state->yoff = bbox[1];
+    state->xsize = xsize;
+    state->ysize = ysize;
+    state->bytes = (state->bits * xsize + 7) / 8;
+    state->state = state->errcode = 0;
+    state->x = state->y = 0;
+
+    /* workaround for @PIL153 */
+    context->interlace = interlace && xsize >= 16 && ysize >= 16;
+    context->previous = previous;
+    context->transparency = transparency;
+
+    bufsize = 1024 + palette_size + xsize * ysize;
+    state->buffer = (UINT8*) malloc(state->bytes);
+    buf = (UINT8*) malloc(bufsize);
+    if (!state->buffer || !buf) {
+	free(buf);
+	return PyErr_NoMemory();
+    }
+
+    /* local palette size, as number of bits minus one */
+    for (bits = 0; palette_size > (6 << bits); bits++)
+	;
+
+    p = buf;
+
+    /* graphic control extension */
+    *p++ = '!';
+    *p++ = 249;
+    *p++ = 4;
+    *p++ = (1 << 2) | (transparency >= 0); /* leave frame in place */
+    *p++ = (UINT8) (duration / 10);
+    *p++ = (UINT8) ((duration / 10) >> 8);
+    *p++ = (UINT8) ((transparency >= 0) ? transparency : 0);
+    *p++ = 0;
+
+    /* image descriptor */
+    *p++ = ',';
+    *p++ = (UINT8) bbox[0];
+    *p++ = (UINT8) (bbox[0] >> 8);
+    *p++ = (UINT8) bbox[1];
+    *p++ = (UINT8) (bbox[1] >> 8);
+    *p++ = (UINT8) xsize;
+    *p++ = (UINT8) (xsize >> 8);
+    *p++ = (UINT8) ysize;
+    *p++ = (UINT8) (ysize >> 8);
+    *p++ = (context->interlace ? 64 : 0) | (palette ? 128 | bits : 0);
+    if (palette) {
+	memset(p, 0, 6 << bits);
+	memcpy(p, palette, palette_size);
+	p += 6 << bits;
+    }
+    *p++ = (UINT8) context->bits;
+
+    /* image data */
+    size = p - buf;
+    ImagingSectionEnter(&cookie);
+    do {
+	if (bufsize - size < 1024) {
+	    UINT8* newbuf = (UINT8*) realloc(buf, bufsize * 2);
+	    if (!newbuf) {
+		state->errcode = IMAGING_CODEC_MEMORY;
+		break;
+	    }
+	    buf = newbuf;
+	    bufsize *= 2;
+	}
+	status = ImagingGifEncode(im, state, buf + size, bufsize - size - 1);
+	if (status > 0)
+	    size += status;
+    } while (state->errcode == 0);
+    ImagingSectionLeave(&cookie);
+
+    if (state->errcode < 0) {
+	free(buf);
+	if (state->errcode == IMAGING_CODEC_MEMORY)
+	    return PyErr_NoMemory();
+	PyErr_SetString(PyExc_IOError, "encoder error");
+	return NULL;
+    }
+
+    buf[size++] = 0; /* end of image data */
+
+    result = PyString_FromStringAndSize((char*) buf, size);
+    free(buf);
+
+    return result;
+}
+
+/* Encode a sequence of frames as a GIF animation.  FRAMES is a sequence
+   of (image, duration, palette) tuples, where the palette is None for
+   frames that use the global palette, or a string holding a local
+   palette.  All frames are compressed by the same encoder.  If OPTIMIZE
+   is set, frames that use the same palette as the previous frame are
+   cropped to the area that changed, and unchanged pixels are written
+   as the TRANSPARENCY index (by default, an index that the frame
+   doesn't use).  If PREVIOUS is given, the first frame is compared
+   to that image.  Returns a list of strings, one for each frame. */
+
+PyObject*
+PyImaging_GifEncodeFrames(PyObject* self, PyObject* args)
+{
+    ImagingEncoderObject* encoder;
+    PyObject* frames;
+    PyObject* result;
+    PyObject* item;
+    PyObject* data;
+    PyObject* op;
+    PyObject* palette;
+    Imaging im, previous;
+    int bbox[4];
+    int i, n, duration, t;
+    const char* prev_palette;
+
+    char *mode;
+    char *rawmode;
+    int interlace = 0;
+    int optimize = 1;
+    int transparency = -1;
+    PyObject* previous_op = Py_None;
+    if (!PyArg_ParseTuple(args, "Oss|iiiO", &frames, &mode, &rawmode,
+			  &interlace, &optimize, &transparency,
+			  &previous_op))
+	return NULL;
+
+    n = PySequence_Length(frames);
+    if (n < 0)
+	return NULL;
+
+    previous = NULL;
+    if (previous_op != Py_None) {
+	previous = PyImaging_AsImaging(previous_op);
+	if (!previous)
+	    return NULL;
+	if (!previous->image8 || strcmp(previous->mode, mode)) {
+	    PyErr_SetString(PyExc_ValueError,
+			    "frames must have the same mode and size");
+	    return NULL;
+	}
+    }
+
+    encoder = PyImaging_EncoderNew(sizeof(GIFENCODERSTATE));
+    if (encoder == NULL)
+	return NULL;
+
+    if (get_packer(encoder, mode, rawmode) < 0)
+	return NULL;
+
+    encoder->encode = ImagingGifEncode;
+
+    ((GIFENCODERSTATE*)encoder->state.context)->bits = 8;
+
+    result = PyList_New(0);
+    if (!result) {
+	Py_DECREF(encoder);
+	return NULL;
+    }
+
+    prev_palette = NULL;
+
+    for (i = 0; i < n; i++) {
+
+	item = PySequence_GetItem(frames, i);
+	if (!item)
+	    goto error;
+	if (!PyArg_ParseTuple(item, "OiO", &op, &duration, &palette)) {
+	    Py_DECREF(item);
+	    goto error;
+	}
+	/* the sequence keeps the frame alive */
+	Py_DECREF(item);
+
+	im = PyImaging_AsImaging(op);
+	if (!im)
+	    goto error;
+	if (!im->image8 || strcmp(im->mode, mode) ||
+	    (previous && (im->xsize != previous->xsize ||
+			  im->ysize != previous->ysize))) {
+	    PyErr_SetString(PyExc_ValueError,
+			    "frames must have the same mode and size");
+	    goto error;
+	}
+	if (palette != Py_None && (!PyString_Check(palette) ||
+				   PyString_Size(palette) > 768)) {
+	    PyErr_SetString(PyExc_ValueError, "bad palette");
+	    goto error;
+	}
+
+	bbox[0] = bbox[1] = 0;
+	bbox[2] = im->xsize;
+	bbox[3] = im->ysize;
+	t = transparency;
+
+	if (optimize && previous && palette == Py_None && !prev_palette) {
+	    /* only store the changes */
+	    if (!changed_area(im, previous, bbox)) {
+		/* nothing changed; store a single (transparent) pixel,
+		   to keep the timing */
+		bbox[0] = bbox[1] = 0;
+		bbox[2] = bbox[3] = 1;
+	    }
+	    if (t < 0)
+		t = unused_index(im, bbox);
+	} else
+	    previous = NULL;
+
+	data = gif_frame(encoder, im, bbox, duration,
+			 (t >= 0) ? previous : NULL, t,
+			 (palette != Py_None) ? PyString_AsString(palette) : NULL,
+			 (palette != Py_None) ? PyString_Size(palette) : 0,
+			 interlace);
+	if (!data)
+	    goto error;
+	if (PyList_Append(result, data) < 0) {
+	    Py_DECREF(data);
+	    goto error;
+	}
+	Py_DECREF(data);
+
+	previous = im;
+	prev_palette = (palette != Py_None) ? "" : NULL;
+    }
+
+    Py_DECREF(encoder);
+    return result;
+
+  error:
+    Py_DECREF(encoder);
+    Py_DECREF(result);
+    return NULL;
+}
+
 
 /* -------------------------------------------------------------------- */
 /* PCX									*/
@@ -514,10 +830,12 @@ PyImaging_ZipEncoderNew(PyObject* self, PyObject* args)
     int compress_type = -1;
     char* dictionary = NULL;
     int dictionary_size = 0;
-    if (!PyArg_ParseTuple(args, ARG("ss|iiis#", "ss|iiiy#"),
+    int parallel = 0;
+    int filter = -1;
+    if (!PyArg_ParseTuple(args, ARG("ss|iiis#ii", "ss|iiiy#ii"),
 			  &mode, &rawmode, &optimize,
 			  &compress_level, &compress_type,
-			  &dictionary, &dictionary_size))
+			  &dictionary, &dictionary_size, &parallel, &filter))
 	return NULL;
 
     encoder = PyImaging_EncoderNew(sizeof(ZIPSTATE));
@@ -528,6 +846,7 @@ PyImaging_ZipEncoderNew(PyObject* self, PyObject* args)
 	return NULL;
 
     encoder->encode = ImagingZipEncode;
+    encoder->cleanup = ImagingZipEncodeCleanup;
 
     if (rawmode[0] == 'P')
 	/* disable filtering */
@@ -538,6 +857,8 @@ PyImaging_ZipEncoderNew(PyObject* self, PyObject* args)
     ((ZIPSTATE*)encoder->state.context)->compress_type = compress_type;
     ((ZIPSTATE*)encoder->state.context)->dictionary = dictionary;
     ((ZIPSTATE*)encoder->state.context)->dictionary_size = dictionary_size;
+    ((ZIPSTATE*)encoder->state.context)->parallel = parallel;
+    ((ZIPSTATE*)encoder->state.context)->filter = filter;
 
     return (PyObject*) encoder;
 }
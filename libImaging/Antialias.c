@@ -80,51 +80,27 @@ static inline float bicubic_filter(float x)
 
 static struct filter BICUBIC = { bicubic_filter, 2.0 };
 
-Imaging
-ImagingStretch(Imaging imOut, Imaging imIn, int filter)
-{
-    /* FIXME: this is a quick and straightforward translation from a
-       python prototype.  might need some further C-ification... */
+/* precomputed resampling coefficients for one axis */
 
-    ImagingSectionCookie cookie;
-    struct filter *filterp;
+struct coeffs {
+    int ksize;		/* max number of coefficients per output pixel */
+    int *bounds;	/* first input pixel and count, for each output pixel */
+    float *kk;		/* coefficients (ksize per output pixel) */
+    float *ww;		/* normalization factors */
+    INT16 *ik;		/* fixed-point coefficients (8-bit images only) */
+    int bits;		/* fixed-point precision */
+};
+
+static int
+precompute_coeffs(struct coeffs* c, int inSize, int outSize,
+                  struct filter *filterp)
+{
     float support, scale, filterscale;
-    float center, ww, ss, ymin, ymax, xmin, xmax;
-    int xx, yy, x, y, b;
+    float center, ww, ss, min, max;
+    int xx, x, xmin, xmax;
     float *k;
 
-    /* check modes */
-    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
-	return (Imaging) ImagingError_ModeError();
-
-    /* check filter */
-    switch (filter) {
-    case IMAGING_TRANSFORM_NEAREST:
-        filterp = &NEAREST;
-        break;
-    case IMAGING_TRANSFORM_ANTIALIAS:
-        filterp = &ANTIALIAS;
-        break;
-    case IMAGING_TRANSFORM_BILINEAR:
-        filterp = &BILINEAR;
-        break;
-    case IMAGING_TRANSFORM_BICUBIC:
-        filterp = &BICUBIC;
-        break;
-    default:
-        return (Imaging) ImagingError_ValueError(
-            "unsupported resampling filter"
-            );
-    }
-
-    if (imIn->ysize == imOut->ysize) {
-        /* prepare for horizontal stretch */
-        filterscale = scale = (float) imIn->xsize / imOut->xsize;
-    } else if (imIn->xsize == imOut->xsize) {
-        /* prepare for vertical stretch */
-        filterscale = scale = (float) imIn->ysize / imOut->ysize;
-    } else
-	return (Imaging) ImagingError_Mismatch();
+    filterscale = scale = (float) inSize / outSize;
 
     /* determine support size (length of resampling filter) */
     support = filterp->support;
@@ -133,175 +109,852 @@ ImagingStretch(Imaging imOut, Imaging imIn, int filter)
         filterscale = 1.0;
         support = 0.5;
     }
-    
+
     support = support * filterscale;
 
     /* coefficient buffer (with rounding safety margin) */
-    k = malloc(((int) support * 2 + 10) * sizeof(float));
-    if (!k)
-        return (Imaging) ImagingError_MemoryError();
+    c->ksize = (int) support * 2 + 10;
 
-    ImagingSectionEnter(&cookie);
-    if (imIn->xsize == imOut->xsize) {
-        /* vertical stretch */
-        for (yy = 0; yy < imOut->ysize; yy++) {
-            center = (yy + 0.5) * scale;
-            ww = 0.0;
-            ss = 1.0 / filterscale;
-            /* calculate filter weights */
-            ymin = floor(center - support);
-            if (ymin < 0.0)
-                ymin = 0.0;
-            ymax = ceil(center + support);
-            if (ymax > (float) imIn->ysize)
-		ymax = (float) imIn->ysize;
-            for (y = (int) ymin; y < (int) ymax; y++) {
-                float w = filterp->filter((y - center + 0.5) * ss) * ss;
-                k[y - (int) ymin] = w;
-                ww = ww + w;
+    c->ik = NULL;
+
+    c->bounds = malloc(outSize * 2 * sizeof(int));
+    c->kk = malloc(outSize * c->ksize * sizeof(float));
+    c->ww = malloc(outSize * sizeof(float));
+    if (!c->bounds || !c->kk || !c->ww) {
+        free(c->bounds);
+        free(c->kk);
+        free(c->ww);
+        return 0;
+    }
+
+    for (xx = 0; xx < outSize; xx++) {
+        k = &c->kk[xx * c->ksize];
+        center = (xx + 0.5) * scale;
+        ww = 0.0;
+        ss = 1.0 / filterscale;
+        min = floor(center - support);
+        if (min < 0.0)
+            min = 0.0;
+        max = ceil(center + support);
+        if (max > (float) inSize)
+            max = (float) inSize;
+        xmin = (int) min;
+        xmax = (int) max;
+        for (x = xmin; x < xmax; x++) {
+            float w = filterp->filter((x - center + 0.5) * ss) * ss;
+            k[x - xmin] = w;
+            ww = ww + w;
+        }
+        if (ww == 0.0)
+            ww = 1.0;
+        else
+            ww = 1.0 / ww;
+        c->bounds[xx * 2 + 0] = xmin;
+        c->bounds[xx * 2 + 1] = xmax - xmin;
+        c->ww[xx] = ww;
+    }
+
+    return 1;
+}
+
+static int
+precompute_fixed(struct coeffs* c, int outSize)
+{
+    /* convert normalized coefficients to 16-bit fixed point.  use as
+       much precision as we can without overflowing the largest
+       coefficient */
+    float w, wmax;
+    int i, x;
+
+    c->ik = calloc(outSize * c->ksize, sizeof(INT16));
+    if (!c->ik)
+        return 0;
+
+    wmax = 0.0;
+    for (i = 0; i < outSize; i++)
+        for (x = 0; x < c->bounds[i * 2 + 1]; x++) {
+            w = c->kk[i * c->ksize + x] * c->ww[i];
+            if (w < 0)
+                w = -w;
+            if (w > wmax)
+                wmax = w;
+        }
+
+    for (c->bits = 14; c->bits > 1; c->bits--)
+        if (wmax * (1 << c->bits) < 32767.0)
+            break;
+
+    for (i = 0; i < outSize; i++) {
+        for (x = 0; x < c->bounds[i * 2 + 1]; x++) {
+            w = c->kk[i * c->ksize + x] * c->ww[i] * (1 << c->bits);
+            c->ik[i * c->ksize + x] = (INT16) floor(w + 0.5);
+        }
+    }
+
+    return 1;
+}
+
+static void
+free_coeffs(struct coeffs* c)
+{
+    free(c->bounds);
+    free(c->kk);
+    free(c->ww);
+    free(c->ik);
+}
+
+/* stretch workers.  each call processes a range of output rows */
+
+struct stretch_context {
+    Imaging imOut;
+    Imaging imIn;
+    struct coeffs* c;
+};
+
+static inline UINT8
+clip8(float ss)
+{
+    ss = ss + 0.5;
+    if (ss < 0.5)
+        return 0;
+    if (ss >= 255.0)
+        return 255;
+    return (UINT8) ss;
+}
+
+static void
+stretch_horizontal(void* context, int yy0, int yy1)
+{
+    struct stretch_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    struct coeffs* c = ctx->c;
+    int xx, yy, x, b, xmin, xcnt;
+    float ss, *k;
+
+    for (yy = yy0; yy < yy1; yy++) {
+        if (imIn->image8) {
+            /* 8-bit grayscale */
+            for (xx = 0; xx < imOut->xsize; xx++) {
+                xmin = c->bounds[xx * 2 + 0];
+                xcnt = c->bounds[xx * 2 + 1];
+                k = &c->kk[xx * c->ksize];
+                ss = 0.0;
+                for (x = 0; x < xcnt; x++)
+                    ss = ss + imIn->image8[yy][x + xmin] * k[x];
+                imOut->image8[yy][xx] = clip8(ss * c->ww[xx]);
             }
-            if (ww == 0.0)
-                ww = 1.0;
-            else
-                ww = 1.0 / ww;
-            if (imIn->image8) {
-                /* 8-bit grayscale */
+        } else
+            switch(imIn->type) {
+            case IMAGING_TYPE_UINT8:
+                /* n-bit grayscale */
                 for (xx = 0; xx < imOut->xsize; xx++) {
-                    ss = 0.0;
-                    for (y = (int) ymin; y < (int) ymax; y++)
-                        ss = ss + imIn->image8[y][xx] * k[y - (int) ymin];
-                    ss = ss * ww + 0.5;
-                    if (ss < 0.5)
-                        imOut->image8[yy][xx] = 0;
-                    else if (ss >= 255.0)
-                        imOut->image8[yy][xx] = 255;
-                    else
-                        imOut->image8[yy][xx] = (UINT8) ss;
-                }
-            } else
-                switch(imIn->type) {
-                case IMAGING_TYPE_UINT8:
-                    /* n-bit grayscale */
-                    for (xx = 0; xx < imOut->xsize*4; xx++) {
-                        /* FIXME: skip over unused pixels */
-                        ss = 0.0;
-                        for (y = (int) ymin; y < (int) ymax; y++)
-                            ss = ss + (UINT8) imIn->image[y][xx] * k[y-(int) ymin];
-                        ss = ss * ww + 0.5;
-                        if (ss < 0.5)
-                            imOut->image[yy][xx] = (UINT8) 0;
-                        else if (ss >= 255.0)
-                            imOut->image[yy][xx] = (UINT8) 255;
-                        else
-                            imOut->image[yy][xx] = (UINT8) ss;
-                    }
-                    break;
-                case IMAGING_TYPE_INT32:
-                    /* 32-bit integer */
-                    for (xx = 0; xx < imOut->xsize; xx++) {
-                        ss = 0.0;
-                        for (y = (int) ymin; y < (int) ymax; y++)
-                            ss = ss + IMAGING_PIXEL_I(imIn, xx, y) * k[y - (int) ymin];
-                        IMAGING_PIXEL_I(imOut, xx, yy) = (int) ss * ww;
-                    }
-                    break;
-                case IMAGING_TYPE_FLOAT32:
-                    /* 32-bit float */
-                    for (xx = 0; xx < imOut->xsize; xx++) {
+                    xmin = c->bounds[xx * 2 + 0];
+                    xcnt = c->bounds[xx * 2 + 1];
+                    k = &c->kk[xx * c->ksize];
+                    for (b = 0; b < imIn->bands; b++) {
+                        if (imIn->bands == 2 && b)
+                            b = 3; /* hack to deal with LA images */
                         ss = 0.0;
-                        for (y = (int) ymin; y < (int) ymax; y++)
-                            ss = ss + IMAGING_PIXEL_F(imIn, xx, y) * k[y - (int) ymin];
-                        IMAGING_PIXEL_F(imOut, xx, yy) = ss * ww;
+                        for (x = 0; x < xcnt; x++)
+                            ss = ss + (UINT8) imIn->image[yy][(x + xmin)*4+b] * k[x];
+                        imOut->image[yy][xx*4+b] = (char) clip8(ss * c->ww[xx]);
                     }
-                    break;
-                default:
-                    ImagingSectionLeave(&cookie);
-                    return (Imaging) ImagingError_ModeError();
                 }
-        }
-    } else {
-        /* horizontal stretch */
-        for (xx = 0; xx < imOut->xsize; xx++) {
-            center = (xx + 0.5) * scale;
-            ww = 0.0;
-            ss = 1.0 / filterscale;
-            xmin = floor(center - support);
-            if (xmin < 0.0)
-                xmin = 0.0;
-            xmax = ceil(center + support);
-            if (xmax > (float) imIn->xsize)
-		xmax = (float) imIn->xsize;
-            for (x = (int) xmin; x < (int) xmax; x++) {
-                float w = filterp->filter((x - center + 0.5) * ss) * ss;
-                k[x - (int) xmin] = w;
-                ww = ww + w;
+                break;
+            case IMAGING_TYPE_INT32:
+                /* 32-bit integer */
+                for (xx = 0; xx < imOut->xsize; xx++) {
+                    xmin = c->bounds[xx * 2 + 0];
+                    xcnt = c->bounds[xx * 2 + 1];
+                    k = &c->kk[xx * c->ksize];
+                    ss = 0.0;
+                    for (x = 0; x < xcnt; x++)
+                        ss = ss + IMAGING_PIXEL_I(imIn, x + xmin, yy) * k[x];
+                    IMAGING_PIXEL_I(imOut, xx, yy) = (int) ss * c->ww[xx];
+                }
+                break;
+            case IMAGING_TYPE_FLOAT32:
+                /* 32-bit float */
+                for (xx = 0; xx < imOut->xsize; xx++) {
+                    xmin = c->bounds[xx * 2 + 0];
+                    xcnt = c->bounds[xx * 2 + 1];
+                    k = &c->kk[xx * c->ksize];
+                    ss = 0.0;
+                    for (x = 0; x < xcnt; x++)
+                        ss = ss + IMAGING_PIXEL_F(imIn, x + xmin, yy) * k[x];
+                    IMAGING_PIXEL_F(imOut, xx, yy) = ss * c->ww[xx];
+                }
+                break;
             }
-            if (ww == 0.0)
-                ww = 1.0;
-            else
-                ww = 1.0 / ww;
-            if (imIn->image8) {
-                /* 8-bit grayscale */
-                for (yy = 0; yy < imOut->ysize; yy++) {
+    }
+}
+
+static void
+stretch_vertical(void* context, int yy0, int yy1)
+{
+    struct stretch_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    struct coeffs* c = ctx->c;
+    int xx, yy, y, ymin, ycnt;
+    float ss, ww, *k;
+
+    for (yy = yy0; yy < yy1; yy++) {
+        ymin = c->bounds[yy * 2 + 0];
+        ycnt = c->bounds[yy * 2 + 1];
+        k = &c->kk[yy * c->ksize];
+        ww = c->ww[yy];
+        if (imIn->image8) {
+            /* 8-bit grayscale */
+            for (xx = 0; xx < imOut->xsize; xx++) {
+                ss = 0.0;
+                for (y = 0; y < ycnt; y++)
+                    ss = ss + imIn->image8[y + ymin][xx] * k[y];
+                imOut->image8[yy][xx] = clip8(ss * ww);
+            }
+        } else
+            switch(imIn->type) {
+            case IMAGING_TYPE_UINT8:
+                /* n-bit grayscale */
+                for (xx = 0; xx < imOut->xsize*4; xx++) {
+                    /* FIXME: skip over unused pixels */
                     ss = 0.0;
-                    for (x = (int) xmin; x < (int) xmax; x++)
-                        ss = ss + imIn->image8[yy][x] * k[x - (int) xmin];
-                    ss = ss * ww + 0.5;
-                    if (ss < 0.5)
-                        imOut->image8[yy][xx] = (UINT8) 0;
-                    else if (ss >= 255.0)
-                        imOut->image8[yy][xx] = (UINT8) 255;
-                    else
-                        imOut->image8[yy][xx] = (UINT8) ss;
+                    for (y = 0; y < ycnt; y++)
+                        ss = ss + (UINT8) imIn->image[y + ymin][xx] * k[y];
+                    imOut->image[yy][xx] = (char) clip8(ss * ww);
                 }
-            } else
-                switch(imIn->type) {
-                case IMAGING_TYPE_UINT8:
-                    /* n-bit grayscale */
-                    for (yy = 0; yy < imOut->ysize; yy++) {
-                        for (b = 0; b < imIn->bands; b++) {
-                            if (imIn->bands == 2 && b)
-                                b = 3; /* hack to deal with LA images */
-                            ss = 0.0;
-                            for (x = (int) xmin; x < (int) xmax; x++)
-                                ss = ss + (UINT8) imIn->image[yy][x*4+b] * k[x - (int) xmin];
-                            ss = ss * ww + 0.5;
-                            if (ss < 0.5)
-                                imOut->image[yy][xx*4+b] = (UINT8) 0;
-                            else if (ss >= 255.0)
-                                imOut->image[yy][xx*4+b] = (UINT8) 255;
-                            else
-                                imOut->image[yy][xx*4+b] = (UINT8) ss;
-                        }
-                    }
-                    break;
-                case IMAGING_TYPE_INT32:
-                    /* 32-bit integer */
-                    for (yy = 0; yy < imOut->ysize; yy++) {
-                        ss = 0.0;
-                        for (x = (int) xmin; x < (int) xmax; x++)
-                            ss = ss + IMAGING_PIXEL_I(imIn, x, yy) * k[x - (int) xmin];
-                        IMAGING_PIXEL_I(imOut, xx, yy) = (int) ss * ww;
-                    }
-                    break;
-                case IMAGING_TYPE_FLOAT32:
-                    /* 32-bit float */
-                    for (yy = 0; yy < imOut->ysize; yy++) {
-                        ss = 0.0;
-                        for (x = (int) xmin; x < (int) xmax; x++)
-                            ss = ss + IMAGING_PIXEL_F(imIn, x, yy) * k[x - (int) xmin];
-                        IMAGING_PIXEL_F(imOut, xx, yy) = ss * ww;
-                    }
-                    break;
-                default:
-                    ImagingSectionLeave(&cookie);
-                    return (Imaging) ImagingError_ModeError();
+                break;
+            case IMAGING_TYPE_INT32:
+                /* 32-bit integer */
+                for (xx = 0; xx < imOut->xsize; xx++) {
+                    ss = 0.0;
+                    for (y = 0; y < ycnt; y++)
+                        ss = ss + IMAGING_PIXEL_I(imIn, xx, y + ymin) * k[y];
+                    IMAGING_PIXEL_I(imOut, xx, yy) = (int) ss * ww;
                 }
+                break;
+            case IMAGING_TYPE_FLOAT32:
+                /* 32-bit float */
+                for (xx = 0; xx < imOut->xsize; xx++) {
+                    ss = 0.0;
+                    for (y = 0; y < ycnt; y++)
+                        ss = ss + IMAGING_PIXEL_F(imIn, xx, y + ymin) * k[y];
+                    IMAGING_PIXEL_F(imOut, xx, yy) = ss * ww;
+                }
+                break;
+            }
+    }
+}
+
+/* -------------------------------------------------------------------- */
+/* Fixed-point resampling of 8-bit images.  The same integer arithmetic
+   is used by the plain C and the SSE2/AVX2 kernels, so results don't
+   depend on what instruction set the CPU supports. */
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#if (defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__)
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+#endif
+
+static inline UINT8
+clip8_fixed(int ss, int bits)
+{
+    ss = ss >> bits;
+    if (ss < 0)
+        return 0;
+    if (ss > 255)
+        return 255;
+    return (UINT8) ss;
+}
+
+/* horizontal kernels; process one output line */
+
+static void
+horizontal8_1(UINT8* out, UINT8* in, struct coeffs* c, int xsize)
+{
+    int xx, x, ss, xcnt;
+    INT16* k;
+    UINT8* p;
+
+    for (xx = 0; xx < xsize; xx++) {
+        p = &in[c->bounds[xx * 2 + 0]];
+        xcnt = c->bounds[xx * 2 + 1];
+        k = &c->ik[xx * c->ksize];
+        ss = 1 << (c->bits - 1);
+        for (x = 0; x < xcnt; x++)
+            ss += p[x] * k[x];
+        out[xx] = clip8_fixed(ss, c->bits);
+    }
+}
+
+static void
+horizontal8_4(UINT8* out, UINT8* in, struct coeffs* c, int xsize)
+{
+    int xx, x, ss0, ss1, ss2, ss3, xcnt;
+    INT16* k;
+    UINT8* p;
+
+    for (xx = 0; xx < xsize; xx++) {
+        p = &in[c->bounds[xx * 2 + 0] * 4];
+        xcnt = c->bounds[xx * 2 + 1];
+        k = &c->ik[xx * c->ksize];
+        ss0 = ss1 = ss2 = ss3 = 1 << (c->bits - 1);
+        for (x = 0; x < xcnt; x++) {
+            ss0 += p[x*4+0] * k[x];
+            ss1 += p[x*4+1] * k[x];
+            ss2 += p[x*4+2] * k[x];
+            ss3 += p[x*4+3] * k[x];
+        }
+        out[xx*4+0] = clip8_fixed(ss0, c->bits);
+        out[xx*4+1] = clip8_fixed(ss1, c->bits);
+        out[xx*4+2] = clip8_fixed(ss2, c->bits);
+        out[xx*4+3] = clip8_fixed(ss3, c->bits);
+    }
+}
+
+/* vertical kernels; process bytes x0 to x1 of one output line */
+
+static void
+vertical8(UINT8* out, UINT8** in, INT16* k, int ycnt, int bits,
+          int x0, int x1)
+{
+    int xx, y, ss;
+
+    for (xx = x0; xx < x1; xx++) {
+        ss = 1 << (bits - 1);
+        for (y = 0; y < ycnt; y++)
+            ss += in[y][xx] * k[y];
+        out[xx] = clip8_fixed(ss, bits);
+    }
+}
+
+#ifdef USE_SSE2
+
+static inline __m128i
+pair_sse2(INT16* k, int x)
+{
+    /* coefficient pair k[x], k[x+1], repeated */
+    return _mm_set1_epi32((int) (((UINT32) (UINT16) k[x+1] << 16) |
+                                 (UINT16) k[x]));
+}
+
+static void
+horizontal8_1_sse2(UINT8* out, UINT8* in, struct coeffs* c, int xsize)
+{
+    int xx, x, ss, xcnt;
+    INT16* k;
+    UINT8* p;
+    __m128i zero = _mm_setzero_si128();
+
+    for (xx = 0; xx < xsize; xx++) {
+        __m128i sss = zero;
+        p = &in[c->bounds[xx * 2 + 0]];
+        xcnt = c->bounds[xx * 2 + 1];
+        k = &c->ik[xx * c->ksize];
+        for (x = 0; x + 8 <= xcnt; x += 8) {
+            __m128i pix = _mm_loadl_epi64((__m128i*) &p[x]);
+            __m128i kk = _mm_loadu_si128((__m128i*) &k[x]);
+            pix = _mm_unpacklo_epi8(pix, zero);
+            sss = _mm_add_epi32(sss, _mm_madd_epi16(pix, kk));
+        }
+        sss = _mm_add_epi32(sss, _mm_srli_si128(sss, 8));
+        sss = _mm_add_epi32(sss, _mm_srli_si128(sss, 4));
+        ss = _mm_cvtsi128_si32(sss) + (1 << (c->bits - 1));
+        for (; x < xcnt; x++)
+            ss += p[x] * k[x];
+        out[xx] = clip8_fixed(ss, c->bits);
+    }
+}
+
+static void
+horizontal8_4_sse2(UINT8* out, UINT8* in, struct coeffs* c, int xsize)
+{
+    int xx, x, xcnt;
+    INT16* k;
+    UINT8* p;
+    __m128i zero = _mm_setzero_si128();
+
+    for (xx = 0; xx < xsize; xx++) {
+        __m128i sss = _mm_set1_epi32(1 << (c->bits - 1));
+        __m128i pix;
+        p = &in[c->bounds[xx * 2 + 0] * 4];
+        xcnt = c->bounds[xx * 2 + 1];
+        k = &c->ik[xx * c->ksize];
+        for (x = 0; x + 2 <= xcnt; x += 2) {
+            /* interleave two pixels: r0 r1 g0 g1 b0 b1 a0 a1 */
+            pix = _mm_loadl_epi64((__m128i*) &p[x*4]);
+            pix = _mm_unpacklo_epi8(pix, _mm_srli_si128(pix, 4));
+            pix = _mm_unpacklo_epi8(pix, zero);
+            sss = _mm_add_epi32(sss, _mm_madd_epi16(pix, pair_sse2(k, x)));
+        }
+        if (x < xcnt) {
+            int v;
+            memcpy(&v, &p[x*4], 4);
+            pix = _mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero);
+            pix = _mm_unpacklo_epi16(pix, zero);
+            sss = _mm_add_epi32(sss, _mm_madd_epi16(
+                pix, _mm_set1_epi32((UINT16) k[x])
+                ));
+        }
+        sss = _mm_srai_epi32(sss, c->bits);
+        sss = _mm_packs_epi32(sss, sss);
+        sss = _mm_packus_epi16(sss, sss);
+        x = _mm_cvtsi128_si32(sss);
+        memcpy(&out[xx*4], &x, 4);
+    }
+}
+
+static void
+vertical8_sse2(UINT8* out, UINT8** in, INT16* k, int ycnt, int bits,
+               int x0, int x1)
+{
+    int xx, y;
+    __m128i zero = _mm_setzero_si128();
+    __m128i round = _mm_set1_epi32(1 << (bits - 1));
+
+    for (xx = x0; xx + 16 <= x1; xx += 16) {
+        __m128i sss0 = round, sss1 = round, sss2 = round, sss3 = round;
+        __m128i r0, r1, lo, hi, kk;
+        for (y = 0; y < ycnt; y += 2) {
+            r0 = _mm_loadu_si128((__m128i*) &in[y][xx]);
+            if (y + 1 < ycnt) {
+                r1 = _mm_loadu_si128((__m128i*) &in[y+1][xx]);
+                kk = pair_sse2(k, y);
+            } else {
+                r1 = zero;
+                kk = _mm_set1_epi32((UINT16) k[y]);
+            }
+            lo = _mm_unpacklo_epi8(r0, r1);
+            hi = _mm_unpackhi_epi8(r0, r1);
+            sss0 = _mm_add_epi32(sss0, _mm_madd_epi16(
+                _mm_unpacklo_epi8(lo, zero), kk));
+            sss1 = _mm_add_epi32(sss1, _mm_madd_epi16(
+                _mm_unpackhi_epi8(lo, zero), kk));
+            sss2 = _mm_add_epi32(sss2, _mm_madd_epi16(
+                _mm_unpacklo_epi8(hi, zero), kk));
+            sss3 = _mm_add_epi32(sss3, _mm_madd_epi16(
+                _mm_unpackhi_epi8(hi, zero), kk));
         }
+        sss0 = _mm_packs_epi32(_mm_srai_epi32(sss0, bits),
+                               _mm_srai_epi32(sss1, bits));
+        sss2 = _mm_packs_epi32(_mm_srai_epi32(sss2, bits),
+                               _mm_srai_epi32(sss3, bits));
+        _mm_storeu_si128((__m128i*) &out[xx], _mm_packus_epi16(sss0, sss2));
     }
+
+    vertical8(out, in, k, ycnt, bits, xx, x1);
+}
+
+#endif
+
+#ifdef USE_AVX2
+
+#if defined(__GNUC__)
+__attribute__((target("avx2")))
+#endif
+static void
+vertical8_avx2(UINT8* out, UINT8** in, INT16* k, int ycnt, int bits,
+               int x0, int x1)
+{
+    /* same as the SSE2 version, but 32 bytes at a time.  unpack and
+       pack both work within 128-bit lanes, so the order comes out
+       right in the end */
+    int xx, y;
+    __m256i zero = _mm256_setzero_si256();
+    __m256i round = _mm256_set1_epi32(1 << (bits - 1));
+
+    for (xx = x0; xx + 32 <= x1; xx += 32) {
+        __m256i sss0 = round, sss1 = round, sss2 = round, sss3 = round;
+        __m256i r0, r1, lo, hi, kk;
+        for (y = 0; y < ycnt; y += 2) {
+            r0 = _mm256_loadu_si256((__m256i*) &in[y][xx]);
+            if (y + 1 < ycnt) {
+                r1 = _mm256_loadu_si256((__m256i*) &in[y+1][xx]);
+                kk = _mm256_set1_epi32((int) (((UINT32) (UINT16) k[y+1] << 16) |
+                                              (UINT16) k[y]));
+            } else {
+                r1 = zero;
+                kk = _mm256_set1_epi32((UINT16) k[y]);
+            }
+            lo = _mm256_unpacklo_epi8(r0, r1);
+            hi = _mm256_unpackhi_epi8(r0, r1);
+            sss0 = _mm256_add_epi32(sss0, _mm256_madd_epi16(
+                _mm256_unpacklo_epi8(lo, zero), kk));
+            sss1 = _mm256_add_epi32(sss1, _mm256_madd_epi16(
+                _mm256_unpackhi_epi8(lo, zero), kk));
+            sss2 = _mm256_add_epi32(sss2, _mm256_madd_epi16(
+                _mm256_unpacklo_epi8(hi, zero), kk));
+            sss3 = _mm256_add_epi32(sss3, _mm256_madd_epi16(
+                _mm256_unpackhi_epi8(hi, zero), kk));
+        }
+        sss0 = _mm256_packs_epi32(_mm256_srai_epi32(sss0, bits),
+                                  _mm256_srai_epi32(sss1, bits));
+        sss2 = _mm256_packs_epi32(_mm256_srai_epi32(sss2, bits),
+                                  _mm256_srai_epi32(sss3, bits));
+        _mm256_storeu_si256((__m256i*) &out[xx],
+                            _mm256_packus_epi16(sss0, sss2));
+    }
+
+    vertical8_sse2(out, in, k, ycnt, bits, xx, x1);
+}
+
+#endif
+
+typedef void (*horizontal8_kernel)(UINT8* out, UINT8* in,
+                                   struct coeffs* c, int xsize);
+typedef void (*vertical8_kernel)(UINT8* out, UINT8** in, INT16* k,
+                                 int ycnt, int bits, int x0, int x1);
+
+static struct {
+    int ready;
+    horizontal8_kernel horizontal_1;
+    horizontal8_kernel horizontal_4;
+    vertical8_kernel vertical;
+} kernels;
+
+static void
+select_kernels(void)
+{
+    /* pick the best kernels for this CPU (only done once) */
+
+    if (kernels.ready)
+        return;
+
+    kernels.horizontal_1 = horizontal8_1;
+    kernels.horizontal_4 = horizontal8_4;
+    kernels.vertical = vertical8;
+
+#ifdef USE_SSE2
+    kernels.horizontal_1 = horizontal8_1_sse2;
+    kernels.horizontal_4 = horizontal8_4_sse2;
+    kernels.vertical = vertical8_sse2;
+#endif
+
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+        kernels.vertical = vertical8_avx2;
+#endif
+
+    kernels.ready = 1;
+}
+
+static void
+stretch_horizontal8(void* context, int yy0, int yy1)
+{
+    struct stretch_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    int yy;
+
+    for (yy = yy0; yy < yy1; yy++)
+        if (imIn->pixelsize == 1)
+            kernels.horizontal_1((UINT8*) imOut->image[yy],
+                                 (UINT8*) imIn->image[yy],
+                                 ctx->c, imOut->xsize);
+        else
+            kernels.horizontal_4((UINT8*) imOut->image[yy],
+                                 (UINT8*) imIn->image[yy],
+                                 ctx->c, imOut->xsize);
+}
+
+static void
+stretch_vertical8(void* context, int yy0, int yy1)
+{
+    struct stretch_context* ctx = context;
+    Imaging imOut = ctx->imOut;
+    Imaging imIn = ctx->imIn;
+    struct coeffs* c = ctx->c;
+    int yy;
+
+    for (yy = yy0; yy < yy1; yy++)
+        kernels.vertical((UINT8*) imOut->image[yy],
+                         (UINT8**) &imIn->image[c->bounds[yy * 2 + 0]],
+                         &c->ik[yy * c->ksize], c->bounds[yy * 2 + 1],
+                         c->bits, 0, imOut->linesize);
+}
+
+/* fused two-pass resampling.  the first pass writes to a small ring
+   buffer of rows instead of a full intermediate image.  if the
+   vertical pass is done first, a single row is enough.  otherwise, the
+   ring holds the horizontally resampled input rows needed for one
+   output row */
+
+struct resample_context {
+    Imaging imOut;
+    Imaging imIn;
+    struct coeffs* cx;
+    struct coeffs* cy;
+    int vertical_first;
+    int ringsize;
+    ImagingParallelCallback horizontal;
+    ImagingParallelCallback vertical;
+    int failed;
+};
+
+static void
+resample_rows(void* context, int yy0, int yy1)
+{
+    struct resample_context* ctx = context;
+    struct stretch_context hctx, vctx;
+    struct ImagingMemoryInstance ring;
+    char *block, **rows;
+    int y, yy, ymin, ycnt, next;
+
+    /* the ring buffer looks like the intermediate image, but only
+       the last ringsize rows exist */
+    if (ctx->vertical_first) {
+        ring = *ctx->imIn;
+        ring.ysize = ctx->imOut->ysize;
+    } else {
+        ring = *ctx->imOut;
+        ring.ysize = ctx->imIn->ysize;
+    }
+
+    rows = calloc(ring.ysize, sizeof(char*));
+    block = malloc(ctx->ringsize * ring.linesize);
+    if (!rows || !block) {
+        free(rows);
+        free(block);
+        ctx->failed = 1;
+        return;
+    }
+
+    ring.palette = NULL;
+    ring.image = rows;
+    ring.image8 = (ring.image8) ? (UINT8**) rows : NULL;
+    ring.image32 = (ring.image32) ? (INT32**) rows : NULL;
+    ring.block = block;
+    ring.destroy = NULL;
+
+    hctx.c = ctx->cx;
+    vctx.c = ctx->cy;
+
+    if (ctx->vertical_first) {
+        vctx.imOut = hctx.imIn = &ring;
+        vctx.imIn = ctx->imIn;
+        hctx.imOut = ctx->imOut;
+        for (yy = yy0; yy < yy1; yy++) {
+            rows[yy] = block;
+            ctx->vertical(&vctx, yy, yy + 1);
+            ctx->horizontal(&hctx, yy, yy + 1);
+        }
+    } else {
+        hctx.imOut = vctx.imIn = &ring;
+        hctx.imIn = ctx->imIn;
+        vctx.imOut = ctx->imOut;
+        next = 0;
+        for (yy = yy0; yy < yy1; yy++) {
+            ymin = ctx->cy->bounds[yy * 2 + 0];
+            ycnt = ctx->cy->bounds[yy * 2 + 1];
+            if (next < ymin)
+                next = ymin;
+            /* input windows never move backwards, so the rows we
+               overwrite here are no longer needed */
+            for (y = next; y < ymin + ycnt; y++) {
+                rows[y] = block + (y % ctx->ringsize) * ring.linesize;
+                ctx->horizontal(&hctx, y, y + 1);
+            }
+            next = y;
+            ctx->vertical(&vctx, yy, yy + 1);
+        }
+    }
+
+    free(block);
+    free(rows);
+}
+
+static struct filter *
+getfilter(int filter)
+{
+    switch (filter) {
+    case IMAGING_TRANSFORM_NEAREST:
+        return &NEAREST;
+    case IMAGING_TRANSFORM_ANTIALIAS:
+        return &ANTIALIAS;
+    case IMAGING_TRANSFORM_BILINEAR:
+        return &BILINEAR;
+    case IMAGING_TRANSFORM_BICUBIC:
+        return &BICUBIC;
+    }
+    return NULL;
+}
+
+Imaging
+ImagingStretch(Imaging imOut, Imaging imIn, int filter)
+{
+    ImagingSectionCookie cookie;
+    struct filter *filterp;
+    struct stretch_context context;
+    struct coeffs c;
+    int vertical;
+
+    /* check modes */
+    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+	return (Imaging) ImagingError_ModeError();
+
+    if (!imIn->image8 && imIn->type != IMAGING_TYPE_UINT8 &&
+        imIn->type != IMAGING_TYPE_INT32 && imIn->type != IMAGING_TYPE_FLOAT32)
+        return (Imaging) ImagingError_ModeError();
+
+    /* check filter */
+    filterp = getfilter(filter);
+    if (!filterp)
+        return (Imaging) ImagingError_ValueError(
+            "unsupported resampling filter"
+            );
+
+    /* precompute coefficients for the stretched axis */
+    if (imIn->xsize == imOut->xsize) {
+        /* prepare for vertical stretch */
+        vertical = 1;
+        if (!precompute_coeffs(&c, imIn->ysize, imOut->ysize, filterp))
+            return (Imaging) ImagingError_MemoryError();
+    } else if (imIn->ysize == imOut->ysize) {
+        /* prepare for horizontal stretch */
+        vertical = 0;
+        if (!precompute_coeffs(&c, imIn->xsize, imOut->xsize, filterp))
+            return (Imaging) ImagingError_MemoryError();
+    } else
+	return (Imaging) ImagingError_Mismatch();
+
+    context.imOut = imOut;
+    context.imIn = imIn;
+    context.c = &c;
+
+    /* use fixed-point arithmetic for 8-bit images (the float path
+       is still used for "I" and "F" images) */
+    if (imIn->type == IMAGING_TYPE_UINT8 &&
+        (imIn->pixelsize == 1 || imIn->pixelsize == 4)) {
+        if (!precompute_fixed(&c, vertical ? imOut->ysize : imOut->xsize)) {
+            free_coeffs(&c);
+            return (Imaging) ImagingError_MemoryError();
+        }
+        select_kernels();
+    }
+
+    /* split output rows over the worker threads */
+    ImagingSectionEnter(&cookie);
+    if (c.ik) {
+        if (vertical)
+            ImagingParallelFor(imOut->ysize, 16, stretch_vertical8, &context);
+        else
+            ImagingParallelFor(imOut->ysize, 16, stretch_horizontal8, &context);
+    } else {
+        if (vertical)
+            ImagingParallelFor(imOut->ysize, 16, stretch_vertical, &context);
+        else
+            ImagingParallelFor(imOut->ysize, 16, stretch_horizontal, &context);
+    }
+    ImagingSectionLeave(&cookie);
+
+    free_coeffs(&c);
+
+    return imOut;
+}
+
+Imaging
+ImagingResample(Imaging imOut, Imaging imIn, int filter)
+{
+    /* same as two ImagingStretch calls, but without allocating a full
+       intermediate image */
+
+    ImagingSectionCookie cookie;
+    struct filter *filterp;
+    struct resample_context context;
+    struct coeffs cx, cy;
+    int i;
+
+    /* check modes */
+    if (!imOut || !imIn || strcmp(imIn->mode, imOut->mode) != 0)
+	return (Imaging) ImagingError_ModeError();
+
+    if (imIn->xsize == imOut->xsize || imIn->ysize == imOut->ysize) {
+        /* the intermediate image is no larger than the input or the
+           output image in this case, so just call ImagingStretch twice
+           (the unchanged axis is filtered too, like in earlier
+           versions) */
+        Imaging imTemp;
+        if (imIn->xsize * imOut->ysize < imOut->xsize * imIn->ysize)
+            imTemp = ImagingNew(imIn->mode, imIn->xsize, imOut->ysize);
+        else
+            imTemp = ImagingNew(imIn->mode, imOut->xsize, imIn->ysize);
+        if (!imTemp)
+            return NULL;
+        if (!ImagingStretch(imTemp, imIn, filter) ||
+            !ImagingStretch(imOut, imTemp, filter)) {
+            ImagingDelete(imTemp);
+            return NULL;
+        }
+        ImagingDelete(imTemp);
+        return imOut;
+    }
+
+    if (!imIn->image8 && imIn->type != IMAGING_TYPE_UINT8 &&
+        imIn->type != IMAGING_TYPE_INT32 && imIn->type != IMAGING_TYPE_FLOAT32)
+        return (Imaging) ImagingError_ModeError();
+
+    /* check filter */
+    filterp = getfilter(filter);
+    if (!filterp)
+        return (Imaging) ImagingError_ValueError(
+            "unsupported resampling filter"
+            );
+
+    if (!precompute_coeffs(&cx, imIn->xsize, imOut->xsize, filterp))
+        return (Imaging) ImagingError_MemoryError();
+    if (!precompute_coeffs(&cy, imIn->ysize, imOut->ysize, filterp)) {
+        free_coeffs(&cx);
+        return (Imaging) ImagingError_MemoryError();
+    }
+
+    context.imOut = imOut;
+    context.imIn = imIn;
+    context.cx = &cx;
+    context.cy = &cy;
+    context.horizontal = stretch_horizontal;
+    context.vertical = stretch_vertical;
+    context.failed = 0;
+
+    /* same order as the two-pass version: do the pass that gives the
+       smallest intermediate image first */
+    context.vertical_first = (imIn->xsize * imOut->ysize <
+                              imOut->xsize * imIn->ysize);
+
+    /* largest number of input rows used by an output row */
+    context.ringsize = 1;
+    if (!context.vertical_first)
+        for (i = 0; i < imOut->ysize; i++)
+            if (cy.bounds[i * 2 + 1] > context.ringsize)
+                context.ringsize = cy.bounds[i * 2 + 1];
+
+    if (imIn->type == IMAGING_TYPE_UINT8 &&
+        (imIn->pixelsize == 1 || imIn->pixelsize == 4)) {
+        if (!precompute_fixed(&cx, imOut->xsize) ||
+            !precompute_fixed(&cy, imOut->ysize)) {
+            free_coeffs(&cx);
+            free_coeffs(&cy);
+            return (Imaging) ImagingError_MemoryError();
+        }
+        select_kernels();
+        context.horizontal = stretch_horizontal8;
+        context.vertical = stretch_vertical8;
+    }
+
+    ImagingSectionEnter(&cookie);
+    ImagingParallelFor(imOut->ysize, 16, resample_rows, &context);
     ImagingSectionLeave(&cookie);
 
-    free(k);
+    free_coeffs(&cx);
+    free_coeffs(&cy);
+
+    if (context.failed)
+        return (Imaging) ImagingError_MemoryError();
 
     return imOut;
 }
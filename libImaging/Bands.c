@@ -22,11 +22,84 @@
 #define CLIP(x) ((x) <= 0 ? 0 : (x) < 256 ? (x) : 255)
 
 
+struct band_context {
+    Imaging imOut;
+    Imaging imIn;
+    int band;
+    int color;
+};
+
+static void
+get_band(void* context, int y0, int y1)
+{
+    struct band_context* ctx = context;
+    int x, y;
+
+    /* Extract band from image */
+    for (y = y0; y < y1; y++) {
+	UINT8* in = (UINT8*) ctx->imIn->image[y] + ctx->band;
+	UINT8* out = ctx->imOut->image8[y];
+	for (x = 0; x < ctx->imIn->xsize; x++) {
+	    out[x] = *in;
+	    in += 4;
+	}
+    }
+}
+
+static void
+put_band(void* context, int y0, int y1)
+{
+    struct band_context* ctx = context;
+    int x, y;
+
+    /* Insert band into image */
+    for (y = y0; y < y1; y++) {
+	UINT8* in = ctx->imIn->image8[y];
+	UINT8* out = (UINT8*) ctx->imOut->image[y] + ctx->band;
+	for (x = 0; x < ctx->imIn->xsize; x++) {
+	    *out = in[x];
+	    out += 4;
+	}
+    }
+}
+
+static void
+fill_band(void* context, int y0, int y1)
+{
+    struct band_context* ctx = context;
+    int x, y;
+
+    /* Insert color into image */
+    for (y = y0; y < y1; y++) {
+	UINT8* out = (UINT8*) ctx->imOut->image[y] + ctx->band;
+	for (x = 0; x < ctx->imOut->xsize; x++) {
+	    *out = (UINT8) ctx->color;
+	    out += 4;
+	}
+    }
+}
+
+static void
+run(Imaging imOut, Imaging imIn, int band, int color,
+    ImagingParallelCallback func)
+{
+    ImagingSectionCookie cookie;
+    struct band_context ctx;
+
+    ctx.imOut = imOut;
+    ctx.imIn = imIn;
+    ctx.band = band;
+    ctx.color = color;
+
+    ImagingSectionEnter(&cookie);
+    ImagingParallelRows(imOut, func, &ctx);
+    ImagingSectionLeave(&cookie);
+}
+
 Imaging
 ImagingGetBand(Imaging imIn, int band)
 {
     Imaging imOut;
-    int x, y;
 
     /* Check arguments */
     if (!imIn || imIn->type != IMAGING_TYPE_UINT8)
@@ -47,15 +120,7 @@ ImagingGetBand(Imaging imIn, int band)
     if (!imOut)
 	return NULL;
 
-    /* Extract band from image */
-    for (y = 0; y < imIn->ysize; y++) {
-	UINT8* in = (UINT8*) imIn->image[y] + band;
-	UINT8* out = imOut->image8[y];
-	for (x = 0; x < imIn->xsize; x++) {
-	    out[x] = *in;
-	    in += 4;
-	}
-    }
+    run(imOut, imIn, band, 0, get_band);
 
     return imOut;
 }
@@ -63,8 +128,6 @@ ImagingGetBand(Imaging imIn, int band)
 Imaging
 ImagingPutBand(Imaging imOut, Imaging imIn, int band)
 {
-    int x, y;
-
     /* Check arguments */
     if (!imIn || imIn->bands != 1 || !imOut)
 	return (Imaging) ImagingError_ModeError();
@@ -85,15 +148,7 @@ ImagingPutBand(Imaging imOut, Imaging imIn, int band)
     if (imOut->bands == 2 && band == 1)
         band = 3;
 
-    /* Insert band into image */
-    for (y = 0; y < imIn->ysize; y++) {
-	UINT8* in = imIn->image8[y];
-	UINT8* out = (UINT8*) imOut->image[y] + band;
-	for (x = 0; x < imIn->xsize; x++) {
-	    *out = in[x];
-	    out += 4;
-	}
-    }
+    run(imOut, imIn, band, 0, put_band);
 
     return imOut;
 }
@@ -101,8 +156,6 @@ ImagingPutBand(Imaging imOut, Imaging imIn, int band)
 Imaging
 ImagingFillBand(Imaging imOut, int band, int color)
 {
-    int x, y;
-
     /* Check arguments */
     if (!imOut || imOut->type != IMAGING_TYPE_UINT8)
 	return (Imaging) ImagingError_ModeError();
@@ -116,14 +169,7 @@ ImagingFillBand(Imaging imOut, int band, int color)
 
     color = CLIP(color);
 
-    /* Insert color into image */
-    for (y = 0; y < imOut->ysize; y++) {
-	UINT8* out = (UINT8*) imOut->image[y] + band;
-	for (x = 0; x < imOut->xsize; x++) {
-	    *out = (UINT8) color;
-	    out += 4;
-	}
-    }
+    run(imOut, NULL, band, color, fill_band);
 
     return imOut;
 }
@@ -19,11 +19,61 @@
 #include "Imaging.h"
 
 
+struct blend_context {
+    Imaging imOut;
+    Imaging imIn1;
+    Imaging imIn2;
+    float alpha;
+};
+
+static void
+interpolate(void* context, int y0, int y1)
+{
+    struct blend_context* ctx = context;
+    float alpha = ctx->alpha;
+    int x, y;
+
+    /* Interpolate between bands */
+    for (y = y0; y < y1; y++) {
+	UINT8* in1 = (UINT8*) ctx->imIn1->image[y];
+	UINT8* in2 = (UINT8*) ctx->imIn2->image[y];
+	UINT8* out = (UINT8*) ctx->imOut->image[y];
+	for (x = 0; x < ctx->imIn1->linesize; x++)
+	    out[x] = (UINT8)
+		((int) in1[x] + alpha * ((int) in2[x] - (int) in1[x]));
+    }
+}
+
+static void
+extrapolate(void* context, int y0, int y1)
+{
+    struct blend_context* ctx = context;
+    float alpha = ctx->alpha;
+    int x, y;
+
+    /* Extrapolation; must make sure to clip resulting values */
+    for (y = y0; y < y1; y++) {
+	UINT8* in1 = (UINT8*) ctx->imIn1->image[y];
+	UINT8* in2 = (UINT8*) ctx->imIn2->image[y];
+	UINT8* out = (UINT8*) ctx->imOut->image[y];
+	for (x = 0; x < ctx->imIn1->linesize; x++) {
+	    float temp = (float)
+		((int) in1[x] + alpha * ((int) in2[x] - (int) in1[x]));
+	    if (temp <= 0.0)
+		out[x] = 0;
+	    else if (temp >= 255.0)
+		out[x] = 255;
+	    else
+		out[x] = (UINT8) temp;
+	}
+    }
+}
+
 Imaging
 ImagingBlend(Imaging imIn1, Imaging imIn2, float alpha)
 {
-    Imaging imOut;
-    int x, y;
+    ImagingSectionCookie cookie;
+    struct blend_context ctx;
 
     /* Check arguments */
     if (!imIn1 || !imIn2 || imIn1->type != IMAGING_TYPE_UINT8)
@@ -40,40 +90,22 @@ ImagingBlend(Imaging imIn1, Imaging imIn2, float alpha)
     else if (alpha == 1.0)
 	return ImagingCopy(imIn2);
 
-    imOut = ImagingNew(imIn1->mode, imIn1->xsize, imIn1->ysize);
-    if (!imOut)
+    ctx.imOut = ImagingNew(imIn1->mode, imIn1->xsize, imIn1->ysize);
+    if (!ctx.imOut)
 	return NULL;
 
-    ImagingCopyInfo(imOut, imIn1);
-
-    if (alpha >= 0 && alpha <= 1.0) {
-	/* Interpolate between bands */
-	for (y = 0; y < imIn1->ysize; y++) {
-	    UINT8* in1 = (UINT8*) imIn1->image[y];
-	    UINT8* in2 = (UINT8*) imIn2->image[y];
-	    UINT8* out = (UINT8*) imOut->image[y];
-	    for (x = 0; x < imIn1->linesize; x++)
-		out[x] = (UINT8)
-		    ((int) in1[x] + alpha * ((int) in2[x] - (int) in1[x]));
-	}
-    } else {
-	/* Extrapolation; must make sure to clip resulting values */
-	for (y = 0; y < imIn1->ysize; y++) {
-	    UINT8* in1 = (UINT8*) imIn1->image[y];
-	    UINT8* in2 = (UINT8*) imIn2->image[y];
-	    UINT8* out = (UINT8*) imOut->image[y];
-	    for (x = 0; x < imIn1->linesize; x++) {
-		float temp = (float)
-		    ((int) in1[x] + alpha * ((int) in2[x] - (int) in1[x]));
-		if (temp <= 0.0)
-		    out[x] = 0;
-		else if (temp >= 255.0)
-		    out[x] = 255;
-		else
-		    out[x] = (UINT8) temp;
-	    }
-	}
-    }
+    ImagingCopyInfo(ctx.imOut, imIn1);
+
+    ctx.imIn1 = imIn1;
+    ctx.imIn2 = imIn2;
+    ctx.alpha = alpha;
+
+    ImagingSectionEnter(&cookie);
+    if (alpha >= 0 && alpha <= 1.0)
+	ImagingParallelRows(ctx.imOut, interpolate, &ctx);
+    else
+	ImagingParallelRows(ctx.imOut, extrapolate, &ctx);
+    ImagingSectionLeave(&cookie);
 
-    return imOut;
+    return ctx.imOut;
 }
@@ -19,17 +19,26 @@
 
 #include "Imaging.h"
 
-#define	CHOP(operation, mode)\
+/* the operations run on row ranges, possibly in several threads */
+
+struct chop_context {
+    Imaging imOut;
+    Imaging imIn1;
+    Imaging imIn2;
+    float scale;
+    int offset;
+};
+
+#define	CHOP(name, operation)\
+static void name(void* context, int y0, int y1)\
+{\
+    struct chop_context* ctx = context;\
     int x, y;\
-    Imaging imOut;\
-    imOut = create(imIn1, imIn2, mode);\
-    if (!imOut)\
-	return NULL;\
-    for (y = 0; y < imOut->ysize; y++) {\
-	UINT8* out = (UINT8*) imOut->image[y];\
-	UINT8* in1 = (UINT8*) imIn1->image[y];\
-	UINT8* in2 = (UINT8*) imIn2->image[y];\
-	for (x = 0; x < imOut->linesize; x++) {\
+    for (y = y0; y < y1; y++) {\
+	UINT8* out = (UINT8*) ctx->imOut->image[y];\
+	UINT8* in1 = (UINT8*) ctx->imIn1->image[y];\
+	UINT8* in2 = (UINT8*) ctx->imIn2->image[y];\
+	for (x = 0; x < ctx->imOut->linesize; x++) {\
 	    int temp = operation;\
 	    if (temp <= 0)\
 		out[x] = 0;\
@@ -39,23 +48,38 @@
 		out[x] = temp;\
 	}\
     }\
-    return imOut;
+}
 
-#define	CHOP2(operation, mode)\
+#define	CHOP2(name, operation)\
+static void name(void* context, int y0, int y1)\
+{\
+    struct chop_context* ctx = context;\
     int x, y;\
-    Imaging imOut;\
-    imOut = create(imIn1, imIn2, mode);\
-    if (!imOut)\
-	return NULL;\
-    for (y = 0; y < imOut->ysize; y++) {\
-	UINT8* out = (UINT8*) imOut->image[y];\
-	UINT8* in1 = (UINT8*) imIn1->image[y];\
-	UINT8* in2 = (UINT8*) imIn2->image[y];\
-	for (x = 0; x < imOut->linesize; x++) {\
+    for (y = y0; y < y1; y++) {\
+	UINT8* out = (UINT8*) ctx->imOut->image[y];\
+	UINT8* in1 = (UINT8*) ctx->imIn1->image[y];\
+	UINT8* in2 = (UINT8*) ctx->imIn2->image[y];\
+	for (x = 0; x < ctx->imOut->linesize; x++) {\
 	    out[x] = operation;\
 	}\
     }\
-    return imOut;
+}
+
+CHOP(chop_lighter, (in1[x] > in2[x]) ? in1[x] : in2[x])
+CHOP(chop_darker, (in1[x] < in2[x]) ? in1[x] : in2[x])
+CHOP(chop_difference, abs((int) in1[x] - (int) in2[x]))
+CHOP(chop_multiply, (int) in1[x] * (int) in2[x] / 255)
+CHOP(chop_screen, 255 - ((int) (255 - in1[x]) * (int) (255 - in2[x])) / 255)
+CHOP(chop_add,
+     ((int) in1[x] + (int) in2[x]) / ctx->scale + ctx->offset)
+CHOP(chop_subtract,
+     ((int) in1[x] - (int) in2[x]) / ctx->scale + ctx->offset)
+
+CHOP2(chop_and, (in1[x] && in2[x]) ? 255 : 0)
+CHOP2(chop_or, (in1[x] || in2[x]) ? 255 : 0)
+CHOP2(chop_xor, ((in1[x] != 0) ^ (in2[x] != 0)) ? 255 : 0)
+CHOP2(chop_add_modulo, in1[x] + in2[x])
+CHOP2(chop_subtract_modulo, in1[x] - in2[x])
 
 static Imaging
 create(Imaging im1, Imaging im2, char* mode)
@@ -75,74 +99,97 @@ create(Imaging im1, Imaging im2, char* mode)
     return ImagingNew(im1->mode, xsize, ysize);
 }
 
+static Imaging
+chop(Imaging imIn1, Imaging imIn2, char* mode, ImagingParallelCallback func,
+     float scale, int offset)
+{
+    ImagingSectionCookie cookie;
+    struct chop_context ctx;
+
+    ctx.imOut = create(imIn1, imIn2, mode);
+    if (!ctx.imOut)
+	return NULL;
+
+    ctx.imIn1 = imIn1;
+    ctx.imIn2 = imIn2;
+    ctx.scale = scale;
+    ctx.offset = offset;
+
+    ImagingSectionEnter(&cookie);
+    ImagingParallelRows(ctx.imOut, func, &ctx);
+    ImagingSectionLeave(&cookie);
+
+    return ctx.imOut;
+}
+
 Imaging
 ImagingChopLighter(Imaging imIn1, Imaging imIn2)
 {
-    CHOP((in1[x] > in2[x]) ? in1[x] : in2[x], NULL);
+    return chop(imIn1, imIn2, NULL, chop_lighter, 1, 0);
 }
 
 Imaging
 ImagingChopDarker(Imaging imIn1, Imaging imIn2)
 {
-    CHOP((in1[x] < in2[x]) ? in1[x] : in2[x], NULL);
+    return chop(imIn1, imIn2, NULL, chop_darker, 1, 0);
 }
 
 Imaging
 ImagingChopDifference(Imaging imIn1, Imaging imIn2)
 {
-    CHOP(abs((int) in1[x] - (int) in2[x]), NULL);
+    return chop(imIn1, imIn2, NULL, chop_difference, 1, 0);
 }
 
 Imaging
 ImagingChopMultiply(Imaging imIn1, Imaging imIn2)
 {
-    CHOP((int) in1[x] * (int) in2[x] / 255, NULL);
+    return chop(imIn1, imIn2, NULL, chop_multiply, 1, 0);
 }
 
 Imaging
 ImagingChopScreen(Imaging imIn1, Imaging imIn2)
 {
-    CHOP(255 - ((int) (255 - in1[x]) * (int) (255 - in2[x])) / 255, NULL);
+    return chop(imIn1, imIn2, NULL, chop_screen, 1, 0);
 }
 
 Imaging
 ImagingChopAdd(Imaging imIn1, Imaging imIn2, float scale, int offset)
 {
-    CHOP(((int) in1[x] + (int) in2[x]) / scale + offset, NULL);
+    return chop(imIn1, imIn2, NULL, chop_add, scale, offset);
 }
 
 Imaging
 ImagingChopSubtract(Imaging imIn1, Imaging imIn2, float scale, int offset)
 {
-    CHOP(((int) in1[x] - (int) in2[x]) / scale + offset, NULL);
+    return chop(imIn1, imIn2, NULL, chop_subtract, scale, offset);
 }
 
 Imaging
 ImagingChopAnd(Imaging imIn1, Imaging imIn2)
 {
-    CHOP2((in1[x] && in2[x]) ? 255 : 0, "1");
+    return chop(imIn1, imIn2, "1", chop_and, 1, 0);
 }
 
 Imaging
 ImagingChopOr(Imaging imIn1, Imaging imIn2)
 {
-    CHOP2((in1[x] || in2[x]) ? 255 : 0, "1");
+    return chop(imIn1, imIn2, "1", chop_or, 1, 0);
 }
 
 Imaging
 ImagingChopXor(Imaging imIn1, Imaging imIn2)
 {
-    CHOP2(((in1[x] != 0) ^ (in2[x] != 0)) ? 255 : 0, "1");
+    return chop(imIn1, imIn2, "1", chop_xor, 1, 0);
 }
 
 Imaging
 ImagingChopAddModulo(Imaging imIn1, Imaging imIn2)
 {
-    CHOP2(in1[x] + in2[x], NULL);
+    return chop(imIn1, imIn2, NULL, chop_add_modulo, 1, 0);
 }
 
 Imaging
 ImagingChopSubtractModulo(Imaging imIn1, Imaging imIn2)
 {
-    CHOP2(in1[x] - in2[x], NULL);
+    return chop(imIn1, imIn2, NULL, chop_subtract_modulo, 1, 0);
 }
@@ -35,6 +35,12 @@
 
 #include "Imaging.h"
 
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+
 #define CLIP(v) ((v) <= 0 ? 0 : (v) >= 255 ? 255 : (v))
 #define CLIP16(v) ((v) <= -32768 ? -32768 : (v) >= 32767 ? 32767 : (v))
 
@@ -46,6 +52,83 @@
 #define L(rgb)\
     ((INT32) (rgb)[0]*299 + (INT32) (rgb)[1]*587 + (INT32) (rgb)[2]*114)
 
+/* -------------------------------------------------------------------- */
+/* AVX2 kernels.  These give exactly the same results as the plain C
+   loops below, which call them for as many pixels as they can handle
+   and do the rest themselves. */
+
+#ifdef USE_AVX2
+
+__attribute__((target("avx2"))) static int
+rgb2l_avx2(UINT8* out, const UINT8* in, int xsize)
+{
+    /* L(in) / 1000 is computed as ((L(in) >> 3) * 33555) >> 22, which
+       is exact for all 8-bit inputs.  the weighted sum is done in two
+       multiply-adds, on the red/blue and green/alpha halves of each
+       pixel */
+    __m256i mask = _mm256_set1_epi32(0x00ff00ff);
+    __m256i rb = _mm256_set1_epi32((114 << 16) | 299);
+    __m256i ga = _mm256_set1_epi32(587);
+    __m256i scale = _mm256_set1_epi16((short) 33555);
+    __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    __m256i v, l[4];
+    int x, i;
+    for (x = 0; x + 32 <= xsize; x += 32) {
+        for (i = 0; i < 4; i++) {
+            v = _mm256_loadu_si256((__m256i*) (in + 32*i));
+            l[i] = _mm256_srli_epi32(_mm256_add_epi32(
+                _mm256_madd_epi16(_mm256_and_si256(v, mask), rb),
+                _mm256_madd_epi16(_mm256_srli_epi16(v, 8), ga)), 3);
+        }
+        l[0] = _mm256_srli_epi16(_mm256_mulhi_epu16(
+            _mm256_packus_epi32(l[0], l[1]), scale), 6);
+        l[2] = _mm256_srli_epi16(_mm256_mulhi_epu16(
+            _mm256_packus_epi32(l[2], l[3]), scale), 6);
+        v = _mm256_permutevar8x32_epi32(
+            _mm256_packus_epi16(l[0], l[2]), order);
+        _mm256_storeu_si256((__m256i*) out, v);
+        out += 32; in += 128;
+    }
+    return x;
+}
+
+__attribute__((target("avx2"))) static int
+l2rgb_avx2(UINT8* out, const UINT8* in, int xsize)
+{
+    __m256i alpha = _mm256_set1_epi32(0xff000000);
+    __m256i lo = _mm256_setr_epi8(0, 0, 0, -1, 1, 1, 1, -1,
+                                  2, 2, 2, -1, 3, 3, 3, -1,
+                                  4, 4, 4, -1, 5, 5, 5, -1,
+                                  6, 6, 6, -1, 7, 7, 7, -1);
+    __m256i hi = _mm256_add_epi8(lo, _mm256_set1_epi32(0x00080808));
+    __m256i v;
+    int x;
+    for (x = 0; x + 16 <= xsize; x += 16) {
+        v = _mm256_broadcastsi128_si256(_mm_loadu_si128((__m128i*) in));
+        _mm256_storeu_si256((__m256i*) out,
+                            _mm256_or_si256(_mm256_shuffle_epi8(v, lo), alpha));
+        _mm256_storeu_si256((__m256i*) (out + 32),
+                            _mm256_or_si256(_mm256_shuffle_epi8(v, hi), alpha));
+        out += 64; in += 16;
+    }
+    return x;
+}
+
+__attribute__((target("avx2"))) static int
+rgb2cmyk_avx2(UINT8* out, const UINT8* in, int xsize)
+{
+    __m256i mask = _mm256_set1_epi32(0x00ffffff);
+    int x;
+    for (x = 0; x + 8 <= xsize; x += 8) {
+        _mm256_storeu_si256((__m256i*) out, _mm256_andnot_si256(
+            _mm256_loadu_si256((__m256i*) in), mask));
+        out += 32; in += 32;
+    }
+    return x;
+}
+
+#endif
+
 /* ------------------- */
 /* 1 (bit) conversions */
 /* ------------------- */
@@ -123,8 +206,12 @@ l2la(UINT8* out, const UINT8* in, int xsize)
 static void
 l2rgb(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+	x = l2rgb_avx2(out, in, xsize);
+#endif
+    for (out += 4*x, in += x; x < xsize; x++) {
         UINT8 v = *in++;
 	*out++ = v;
 	*out++ = v;
@@ -166,8 +253,12 @@ rgb2bit(UINT8* out, const UINT8* in, int xsize)
 static void
 rgb2l(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++, in += 4)
+    int x = 0;
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+	x = rgb2l_avx2(out, in, xsize);
+#endif
+    for (out += x, in += 4*x; x < xsize; x++, in += 4)
 	/* ITU-R Recommendation 601-2 (assuming nonlinear RGB) */
 	*out++ = L(in) / 1000;
 }
@@ -308,8 +399,12 @@ l2cmyk(UINT8* out, const UINT8* in, int xsize)
 static void
 rgb2cmyk(UINT8* out, const UINT8* in, int xsize)
 {
-    int x;
-    for (x = 0; x < xsize; x++) {
+    int x = 0;
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+	x = rgb2cmyk_avx2(out, in, xsize);
+#endif
+    for (out += 4*x, in += 4*x; x < xsize; x++) {
 	/* Note: no undercolour removal */
         *out++ = ~(*in++);
         *out++ = ~(*in++);
@@ -739,12 +834,45 @@ p2ycbcr(UINT8* out, const UINT8* in, int xsize, const UINT8* palette)
     ImagingConvertRGB2YCbCr(out, out, xsize);
 }
 
+/* Row workers for the simple converters.  Rows are independent, so
+   they can be converted by several threads at once */
+
+struct convert_context {
+    Imaging imOut;
+    Imaging imIn;
+    ImagingShuffler convert;
+    void (*pconvert)(UINT8*, const UINT8*, int, const UINT8*);
+};
+
+static void
+convert_rows(void* context, int y0, int y1)
+{
+    struct convert_context* ctx = context;
+    int y;
+
+    for (y = y0; y < y1; y++)
+	(*ctx->convert)((UINT8*) ctx->imOut->image[y],
+			(UINT8*) ctx->imIn->image[y], ctx->imIn->xsize);
+}
+
+static void
+frompalette_rows(void* context, int y0, int y1)
+{
+    struct convert_context* ctx = context;
+    int y;
+
+    for (y = y0; y < y1; y++)
+	(*ctx->pconvert)((UINT8*) ctx->imOut->image[y],
+			 (UINT8*) ctx->imIn->image[y], ctx->imIn->xsize,
+			 ctx->imIn->palette->palette);
+}
+
 static Imaging
 frompalette(Imaging imOut, Imaging imIn, const char *mode)
 {
     ImagingSectionCookie cookie;
+    struct convert_context ctx;
     int alpha;
-    int y;
     void (*convert)(UINT8*, const UINT8*, int, const UINT8*);
 
     /* Map palette image to L, RGB, RGBA, or CMYK */
@@ -781,21 +909,60 @@ frompalette(Imaging imOut, Imaging imIn, const char *mode)
     if (!imOut)
         return NULL;
 
+    ctx.imOut = imOut;
+    ctx.imIn = imIn;
+    ctx.pconvert = convert;
+
     ImagingSectionEnter(&cookie);
-    for (y = 0; y < imIn->ysize; y++)
-	(*convert)((UINT8*) imOut->image[y], (UINT8*) imIn->image[y],
-		   imIn->xsize, imIn->palette->palette);
+    ImagingParallelRows(imOut, frompalette_rows, &ctx);
     ImagingSectionLeave(&cookie);
 
     return imOut;
 }
 
+struct topalette_context {
+    Imaging imOut;
+    Imaging imIn;
+    ImagingPalette palette;
+};
+
+static void
+topalette_rows(void* context, int start, int end)
+{
+    struct topalette_context* ctx = (struct topalette_context*) context;
+    ImagingPalette palette = ctx->palette;
+    int x, y;
+
+    /* closest colour; the cache has been filled in advance, so this
+       only reads from it */
+    for (y = start; y < end; y++) {
+        UINT8* in  = (UINT8*) ctx->imIn->image[y];
+        UINT8* out = ctx->imOut->image8[y];
+        for (x = 0; x < ctx->imIn->xsize; x++, in += 4)
+            out[x] = (UINT8) ImagingPaletteCache(palette, in[0], in[1], in[2]);
+    }
+}
+
+/* the standard colour cube is shared by all conversions, so its
+   colour cache (512k) only needs to be built once.  It is created on
+   first use, and released by ImagingConvertCleanup */
+static ImagingPalette browser_palette = NULL;
+
+void
+ImagingConvertCleanup(void)
+{
+    if (browser_palette) {
+	ImagingPaletteDelete(browser_palette);
+	browser_palette = NULL;
+    }
+}
+
 static Imaging
 topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
 {
     ImagingSectionCookie cookie;
     int x, y;
-    ImagingPalette palette = inpalette;;
+    ImagingPalette palette = inpalette;
 
     /* Map L or RGB/RGBX/RGBA to palette image */
     if (strcmp(imIn->mode, "L") != 0 && strncmp(imIn->mode, "RGB", 3) != 0)
@@ -805,8 +972,11 @@ topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
       /* FIXME: make user configurable */
       if (imIn->bands == 1)
 	palette = ImagingPaletteNew("RGB"); /* Initialised to grey ramp */
-      else
-	palette = ImagingPaletteNewBrowser(); /* Standard colour cube */
+      else {
+	if (!browser_palette)
+	  browser_palette = ImagingPaletteNewBrowser(); /* Standard colour cube */
+	palette = inpalette = browser_palette;
+      }
     }
 
     if (!palette)
@@ -834,11 +1004,10 @@ topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
     } else {
 	/* colour image */
 
-	/* Create mapping cache */
-	if (ImagingPaletteCachePrepare(palette) < 0) {
+	/* Create mapping cache.  This is done while holding the
+	   interpreter lock, since the palette may be shared */
+	if (ImagingPaletteCacheBuild(palette) < 0) {
 	    ImagingDelete(imOut);
-	    if (palette != inpalette)
-	      ImagingPaletteDelete(palette);
 	    return NULL;
 	}
 
@@ -868,21 +1037,19 @@ topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
 
                 for (x = 0; x < imIn->xsize; x++, in += 4) {
                     int d2;
-                    INT16* cache;
+                    UINT8* p;
 
                     r = CLIP(in[0] + (r + e[3+0])/16);
                     g = CLIP(in[1] + (g + e[3+1])/16);
                     b = CLIP(in[2] + (b + e[3+2])/16);
 
                     /* get closest colour */
-                    cache = &ImagingPaletteCache(palette, r, g, b);
-                    if (cache[0] == 0x100)
-                        ImagingPaletteCacheUpdate(palette, r, g, b);
-                    out[x] = (UINT8) cache[0];
+                    out[x] = (UINT8) ImagingPaletteCache(palette, r, g, b);
+                    p = &palette->palette[out[x]*4];
 
-                    r -= (int) palette->palette[cache[0]*4];
-                    g -= (int) palette->palette[cache[0]*4+1];
-                    b -= (int) palette->palette[cache[0]*4+2];
+                    r -= (int) p[0];
+                    g -= (int) p[1];
+                    b -= (int) p[2];
 
                     /* propagate errors (don't ask ;-) */
                     r2 = r; d2 = r + r; r += d2; e[0] = r + r0;
@@ -907,30 +1074,15 @@ topalette(Imaging imOut, Imaging imIn, ImagingPalette inpalette, int dither)
         } else {
 
             /* closest colour */
+            struct topalette_context ctx;
+            ctx.imOut = imOut;
+            ctx.imIn = imIn;
+            ctx.palette = palette;
             ImagingSectionEnter(&cookie);
-            for (y = 0; y < imIn->ysize; y++) {
-                int r, g, b;
-                UINT8* in  = (UINT8*) imIn->image[y];
-                UINT8* out = imOut->image8[y];
-
-                for (x = 0; x < imIn->xsize; x++, in += 4) {
-                    INT16* cache;
-
-                    r = in[0]; g = in[1]; b = in[2];
-
-                    /* get closest colour */
-                    cache = &ImagingPaletteCache(palette, r, g, b);
-                    if (cache[0] == 0x100)
-                        ImagingPaletteCacheUpdate(palette, r, g, b);
-                    out[x] = (UINT8) cache[0];
-
-                }
-            }
+            ImagingParallelFor(imIn->ysize, 64, topalette_rows, &ctx);
             ImagingSectionLeave(&cookie);
 
         }
-	if (inpalette != palette)
-	  ImagingPaletteCacheDelete(palette);
     }
 
     if (inpalette != palette)
@@ -1029,6 +1181,7 @@ convert(Imaging imOut, Imaging imIn, const char *mode,
         ImagingPalette palette, int dither)
 {
     ImagingSectionCookie cookie;
+    struct convert_context ctx;
     ImagingShuffler convert;
     int y;
 
@@ -1085,10 +1238,12 @@ convert(Imaging imOut, Imaging imIn, const char *mode,
     if (!imOut)
         return NULL;
 
+    ctx.imOut = imOut;
+    ctx.imIn = imIn;
+    ctx.convert = convert;
+
     ImagingSectionEnter(&cookie);
-    for (y = 0; y < imIn->ysize; y++)
-	(*convert)((UINT8*) imOut->image[y], (UINT8*) imIn->image[y],
-		   imIn->xsize);
+    ImagingParallelRows(imOut, convert_rows, &ctx);
     ImagingSectionLeave(&cookie);
 
     return imOut;
@@ -1111,8 +1266,8 @@ Imaging
 ImagingConvertInPlace(Imaging imIn, const char* mode)
 {
     ImagingSectionCookie cookie;
+    struct convert_context ctx;
     ImagingShuffler convert;
-    int y;
 
     /* limited support for inplace conversion */
     if (strcmp(imIn->mode, "L") == 0 && strcmp(mode, "1") == 0)
@@ -1122,10 +1277,12 @@ ImagingConvertInPlace(Imaging imIn, const char* mode)
     else
         return ImagingError_ModeError();
     
+    ctx.imOut = imIn;
+    ctx.imIn = imIn;
+    ctx.convert = convert;
+
     ImagingSectionEnter(&cookie);
-    for (y = 0; y < imIn->ysize; y++)
-	(*convert)((UINT8*) imIn->image[y], (UINT8*) imIn->image[y],
-                   imIn->xsize);
+    ImagingParallelRows(imIn, convert_rows, &ctx);
     ImagingSectionLeave(&cookie);
 
     return imIn;
@@ -14,6 +14,12 @@
 
 #include "Imaging.h"
 
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+
 /*  JPEG/JFIF YCbCr conversions
 
     Y  = R *  0.29900 + G *  0.58700 + B *  0.11400
@@ -334,15 +340,133 @@ static INT16 B_Cb[] = { -14515, -14402, -14288, -14175, -14062,
 13496, 13609, 13722, 13836, 13949, 14063, 14176, 14289, 14403 };
 
 
+/* AVX2 versions.  Instead of looking up the tables, these compute
+   (n * M + H) / 8192, rounded towards zero, where n is the component
+   value (minus 128 for Cb and Cr).  The constants below reproduce
+   every table entry exactly. */
+
+#ifdef USE_AVX2
+
+#define FIX_Y_R 156762, 4096
+#define FIX_Y_G 307757, 4096
+#define FIX_Y_B 59769, 4055
+#define FIX_Cb_R -88468, 4037
+#define FIX_Cb_G -173676, 4129
+#define FIX_Cb_B 262144, 4096
+#define FIX_Cr_R FIX_Cb_B
+#define FIX_Cr_G -219514, 4063
+#define FIX_Cr_B -42630, 4109
+#define FIX_R_Cr 735052, 4096
+#define FIX_G_Cb -180428, 4096
+#define FIX_G_Cr -374415, 4096
+#define FIX_B_Cb 929038, 4096
+
+__attribute__((target("avx2"))) static inline __m256i
+fixed(__m256i n, int m, int h)
+{
+    __m256i v = _mm256_add_epi32(_mm256_mullo_epi32(n, _mm256_set1_epi32(m)),
+                                 _mm256_set1_epi32(h));
+    return _mm256_sign_epi32(_mm256_srli_epi32(_mm256_abs_epi32(v), 13), v);
+}
+
+__attribute__((target("avx2"))) static int
+rgb2ycbcr_avx2(UINT8* out, const UINT8* in, int pixels)
+{
+    __m256i mask = _mm256_set1_epi32(255);
+    __m256i alpha = _mm256_set1_epi32(0xff000000);
+    __m256i offset = _mm256_set1_epi32(128);
+    __m256i v, r, g, b, y, cb, cr;
+    int x;
+
+    for (x = 0; x + 8 <= pixels; x += 8, in += 32, out += 32) {
+
+        v = _mm256_loadu_si256((__m256i*) in);
+        r = _mm256_and_si256(v, mask);
+        g = _mm256_and_si256(_mm256_srli_epi32(v, 8), mask);
+        b = _mm256_and_si256(_mm256_srli_epi32(v, 16), mask);
+
+        y = _mm256_add_epi32(_mm256_add_epi32(fixed(r, FIX_Y_R),
+                                              fixed(g, FIX_Y_G)),
+                             fixed(b, FIX_Y_B));
+        cb = _mm256_add_epi32(_mm256_add_epi32(fixed(r, FIX_Cb_R),
+                                               fixed(g, FIX_Cb_G)),
+                              fixed(b, FIX_Cb_B));
+        cr = _mm256_add_epi32(_mm256_add_epi32(fixed(r, FIX_Cr_R),
+                                               fixed(g, FIX_Cr_G)),
+                              fixed(b, FIX_Cr_B));
+
+        /* same as the casts to UINT8 in the plain version */
+        y = _mm256_and_si256(_mm256_srai_epi32(y, SCALE), mask);
+        cb = _mm256_and_si256(_mm256_add_epi32(
+            _mm256_srai_epi32(cb, SCALE), offset), mask);
+        cr = _mm256_and_si256(_mm256_add_epi32(
+            _mm256_srai_epi32(cr, SCALE), offset), mask);
+
+        v = _mm256_or_si256(_mm256_and_si256(v, alpha), y);
+        v = _mm256_or_si256(v, _mm256_slli_epi32(cb, 8));
+        v = _mm256_or_si256(v, _mm256_slli_epi32(cr, 16));
+        _mm256_storeu_si256((__m256i*) out, v);
+    }
+
+    return x;
+}
+
+__attribute__((target("avx2"))) static int
+ycbcr2rgb_avx2(UINT8* out, const UINT8* in, int pixels)
+{
+    __m256i mask = _mm256_set1_epi32(255);
+    __m256i alpha = _mm256_set1_epi32(0xff000000);
+    __m256i offset = _mm256_set1_epi32(128);
+    __m256i zero = _mm256_setzero_si256();
+    __m256i v, r, g, b, y, cb, cr;
+    int x;
+
+    for (x = 0; x + 8 <= pixels; x += 8, in += 32, out += 32) {
+
+        v = _mm256_loadu_si256((__m256i*) in);
+        y = _mm256_and_si256(v, mask);
+        cb = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v, 8),
+                                               mask), offset);
+        cr = _mm256_sub_epi32(_mm256_and_si256(_mm256_srli_epi32(v, 16),
+                                               mask), offset);
+
+        r = _mm256_srai_epi32(fixed(cr, FIX_R_Cr), SCALE);
+        g = _mm256_srai_epi32(_mm256_add_epi32(fixed(cb, FIX_G_Cb),
+                                               fixed(cr, FIX_G_Cr)), SCALE);
+        b = _mm256_srai_epi32(fixed(cb, FIX_B_Cb), SCALE);
+
+        r = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y, r),
+                                              zero), mask);
+        g = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y, g),
+                                              zero), mask);
+        b = _mm256_min_epi32(_mm256_max_epi32(_mm256_add_epi32(y, b),
+                                              zero), mask);
+
+        v = _mm256_or_si256(_mm256_and_si256(v, alpha), r);
+        v = _mm256_or_si256(v, _mm256_slli_epi32(g, 8));
+        v = _mm256_or_si256(v, _mm256_slli_epi32(b, 16));
+        _mm256_storeu_si256((__m256i*) out, v);
+    }
+
+    return x;
+}
+
+#endif
+
 void
 ImagingConvertRGB2YCbCr(UINT8* out, const UINT8* in, int pixels)
 {
-    int x;
+    int x = 0;
     UINT8 a;
     int r, g, b;
     int y, cr, cb;
 
-    for (x = 0; x < pixels; x++, in +=4, out += 4) {
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+        x = rgb2ycbcr_avx2(out, in, pixels);
+#endif
+
+    for (in += 4*x, out += 4*x; x < pixels; x++, in +=4, out += 4) {
 
         r = in[0];
         g = in[1];
@@ -363,12 +487,17 @@ ImagingConvertRGB2YCbCr(UINT8* out, const UINT8* in, int pixels)
 void
 ImagingConvertYCbCr2RGB(UINT8* out, const UINT8* in, int pixels)
 {
-    int x;
+    int x = 0;
     UINT8 a;
     int r, g, b;
     int y, cr, cb;
 
-    for (x = 0; x < pixels; x++, in += 4, out += 4) {
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+        x = ycbcr2rgb_avx2(out, in, pixels);
+#endif
+
+    for (in += 4*x, out += 4*x; x < pixels; x++, in += 4, out += 4) {
 
         y = in[0];
         cb = in[1];
@@ -16,6 +16,19 @@
 
 #include "Imaging.h"
 
+#ifdef	HAVE_LIBZ
+
+#include "zlib.h"
+
+UINT32
+ImagingCRC32(UINT32 crc, UINT8* buffer, int bytes)
+{
+    /* the zlib version is several times faster (it's used for every
+       PNG chunk, including the compressed image data) */
+    return (UINT32) crc32((uLong) crc, buffer, (uInt) bytes);
+}
+
+#else
 
 /* Precalculated CRC values (created by makecrctable.py) */
 
@@ -85,3 +98,5 @@ ImagingCRC32(UINT32 crc, UINT8* buffer, int bytes)
 
     return crc ^ 0xFFFFFFFFL;
 }
+
+#endif
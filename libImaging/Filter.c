@@ -19,13 +19,14 @@
  */
 
 /*
- * FIXME: Support RGB and RGBA/CMYK modes as well
  * FIXME: Expand image border (current version leaves border as is)
  * FIXME: Implement image processing gradient filters
  */
 
 #include "Imaging.h"
 
+#include <math.h>
+
 Imaging
 ImagingExpand(Imaging imIn, int xmargin, int ymargin, int mode)
 {
@@ -71,109 +72,294 @@ ImagingExpand(Imaging imIn, int xmargin, int ymargin, int mode)
     return imOut;
 }
 
+/* -------------------------------------------------------------------- */
+/* Convolution.  The kernel is given as ysize rows of xsize weights,
+   where the first row applies to the line below the current one (this
+   is how the original 3x3 and 5x5 implementations worked).  Pixels
+   closer to the border than half the kernel size are copied as is.
+
+   Sums are accumulated in single precision, one kernel weight at a
+   time, for a full row of samples.  Bands in multi-band images are
+   handled as separate samples.  Kernels that are the outer product of
+   a row and a column (e.g. box and gaussian kernels) are applied as
+   two one-dimensional passes. */
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* acc[i] += in[i] * k, for n samples.  the SSE2 versions do exactly
+   the same arithmetic, four samples at a time */
+
+static void
+accumulate8(FLOAT32* acc, const UINT8* in, int n, FLOAT32 k)
+{
+    int i = 0;
+#ifdef USE_SSE2
+    __m128 kk = _mm_set1_ps(k);
+    __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= n; i += 16) {
+        __m128i p = _mm_loadu_si128((__m128i*) &in[i]);
+        __m128i lo = _mm_unpacklo_epi8(p, zero);
+        __m128i hi = _mm_unpackhi_epi8(p, zero);
+#define ACCUMULATE(offset, v)\
+        _mm_storeu_ps(&acc[i+offset], _mm_add_ps(\
+            _mm_loadu_ps(&acc[i+offset]),\
+            _mm_mul_ps(_mm_cvtepi32_ps(v), kk)))
+        ACCUMULATE(0, _mm_unpacklo_epi16(lo, zero));
+        ACCUMULATE(4, _mm_unpackhi_epi16(lo, zero));
+        ACCUMULATE(8, _mm_unpacklo_epi16(hi, zero));
+        ACCUMULATE(12, _mm_unpackhi_epi16(hi, zero));
+#undef ACCUMULATE
+    }
+#endif
+    for (; i < n; i++)
+        acc[i] += (int) in[i] * k;
+}
+
+static void
+accumulatef(FLOAT32* acc, const FLOAT32* in, int n, FLOAT32 k)
+{
+    int i = 0;
+#ifdef USE_SSE2
+    __m128 kk = _mm_set1_ps(k);
+    for (; i + 4 <= n; i += 4)
+        _mm_storeu_ps(&acc[i], _mm_add_ps(
+            _mm_loadu_ps(&acc[i]), _mm_mul_ps(_mm_loadu_ps(&in[i]), kk)
+            ));
+#endif
+    for (; i < n; i++)
+        acc[i] += in[i] * k;
+}
+
+static void
+accumulate(Imaging im, FLOAT32* acc, int y, int x, int n, FLOAT32 k)
+{
+    /* add n samples from line y, starting at pixel x */
+    if (im->type == IMAGING_TYPE_FLOAT32)
+        accumulatef(acc, (FLOAT32*) im->image[y] + x, n, k);
+    else
+        accumulate8(acc, (UINT8*) im->image[y] + x * im->pixelsize, n, k);
+}
+
+struct filter_context {
+    Imaging imOut;
+    Imaging imIn;
+    const FLOAT32* kernel; /* full kernel */
+    FLOAT32* row; /* separable kernel, or NULL */
+    FLOAT32* column;
+    int xsize, ysize;
+    FLOAT32 offset, divisor;
+    int failed;
+};
+
+static void
+filter_store(struct filter_context* ctx, FLOAT32* acc, int y, int n)
+{
+    Imaging imOut = ctx->imOut;
+    int xmargin = ctx->xsize / 2;
+    FLOAT32 sum;
+    int i;
+
+    if (imOut->type == IMAGING_TYPE_FLOAT32) {
+        FLOAT32* out = (FLOAT32*) imOut->image[y] + xmargin;
+        for (i = 0; i < n; i++)
+            out[i] = acc[i] / ctx->divisor + ctx->offset;
+    } else {
+        UINT8* out = (UINT8*) imOut->image[y] + xmargin * imOut->pixelsize;
+        for (i = 0; i < n; i++) {
+            sum = acc[i] / ctx->divisor + ctx->offset;
+            if (sum <= 0)
+                out[i] = 0;
+            else if (sum >= 255)
+                out[i] = 255;
+            else
+                out[i] = (UINT8) sum;
+        }
+    }
+}
+
+static void
+filter_rows(void* context, int y0, int y1)
+{
+    /* process lines y0 to y1, counting from the first inner line */
+    struct filter_context* ctx = context;
+    Imaging imIn = ctx->imIn;
+    int xmargin = ctx->xsize / 2;
+    int ymargin = ctx->ysize / 2;
+    int bands = (imIn->type == IMAGING_TYPE_FLOAT32) ? 1 : imIn->pixelsize;
+    int n = (imIn->xsize - 2 * xmargin) * bands;
+    FLOAT32* acc;
+    FLOAT32* ring = NULL;
+    int x, y, yy, next;
+
+    acc = malloc(n * sizeof(FLOAT32));
+    if (!acc) {
+        ctx->failed = 1;
+        return;
+    }
+
+    if (!ctx->row) {
+
+        /* full kernel */
+        for (y = y0 + ymargin; y < y1 + ymargin; y++) {
+            memset(acc, 0, n * sizeof(FLOAT32));
+            for (yy = 0; yy < ctx->ysize; yy++)
+                for (x = 0; x < ctx->xsize; x++)
+                    accumulate(imIn, acc, y + ymargin - yy, x, n,
+                               ctx->kernel[yy * ctx->xsize + x]);
+            filter_store(ctx, acc, y, n);
+        }
+
+    } else {
+
+        /* separable kernel.  the ring holds the horizontally filtered
+           input lines needed for one output line; line y is stored
+           in slot y % ysize */
+        ring = malloc(ctx->ysize * n * sizeof(FLOAT32));
+        if (!ring) {
+            free(acc);
+            ctx->failed = 1;
+            return;
+        }
+
+        next = y0;
+        for (y = y0 + ymargin; y < y1 + ymargin; y++) {
+            for (; next <= y + ymargin; next++) {
+                FLOAT32* line = &ring[(next % ctx->ysize) * n];
+                memset(line, 0, n * sizeof(FLOAT32));
+                for (x = 0; x < ctx->xsize; x++)
+                    accumulate(imIn, line, next, x, n, ctx->row[x]);
+            }
+            memset(acc, 0, n * sizeof(FLOAT32));
+            for (yy = 0; yy < ctx->ysize; yy++)
+                accumulatef(acc, &ring[((y + ymargin - yy) % ctx->ysize) * n],
+                            n, ctx->column[yy]);
+            filter_store(ctx, acc, y, n);
+        }
+
+    }
+
+    free(ring);
+    free(acc);
+}
+
+static int
+filter_separable(const FLOAT32* kernel, int xsize, int ysize,
+                 FLOAT32* row, FLOAT32* column)
+{
+    /* check if the kernel is the outer product of a row and a
+       column vector.  if so, store the vectors and return true */
+
+    int x, y, x0, y0;
+    double v, vmax, error;
+
+    if (xsize < 2 || ysize < 2)
+        return 0; /* nothing to gain */
+
+    /* use the largest weight as pivot */
+    x0 = y0 = 0;
+    vmax = 0.0;
+    for (y = 0; y < ysize; y++)
+        for (x = 0; x < xsize; x++) {
+            v = fabs(kernel[y * xsize + x]);
+            if (v > vmax) {
+                vmax = v;
+                x0 = x; y0 = y;
+            }
+        }
+    if (vmax == 0.0)
+        return 0;
+
+    for (x = 0; x < xsize; x++)
+        row[x] = kernel[y0 * xsize + x];
+    for (y = 0; y < ysize; y++)
+        column[y] = kernel[y * xsize + x0] / kernel[y0 * xsize + x0];
+
+    for (y = 0; y < ysize; y++)
+        for (x = 0; x < xsize; x++) {
+            error = (double) row[x] * column[y] - kernel[y * xsize + x];
+            if (fabs(error) > vmax * 1e-6)
+                return 0;
+        }
+
+    return 1;
+}
+
 Imaging
 ImagingFilter(Imaging im, int xsize, int ysize, const FLOAT32* kernel,
               FLOAT32 offset, FLOAT32 divisor)
 {
+    struct filter_context ctx;
+    ImagingSectionCookie cookie;
     Imaging imOut;
-    int x, y;
-    FLOAT32 sum;
+    int x, y, xmargin, ymargin, bytes;
 
-    if (!im || strcmp(im->mode, "L") != 0)
+    if (!im || im->type == IMAGING_TYPE_INT32 ||
+        im->type == IMAGING_TYPE_SPECIAL || strcmp(im->mode, "1") == 0 ||
+        strcmp(im->mode, "P") == 0 || strcmp(im->mode, "PA") == 0)
 	return (Imaging) ImagingError_ModeError();
 
+    if (xsize < 1 || ysize < 1 || !(xsize & 1) || !(ysize & 1))
+	return (Imaging) ImagingError_ValueError("bad kernel size");
+
     if (im->xsize < xsize || im->ysize < ysize)
         return ImagingCopy(im);
 
-    if ((xsize != 3 && xsize != 5) || xsize != ysize)
-	return (Imaging) ImagingError_ValueError("bad kernel size");
-
     imOut = ImagingNew(im->mode, im->xsize, im->ysize);
     if (!imOut)
 	return NULL;
 
-    /* brute force kernel implementations */
-#define	KERNEL3x3(image, kernel, d) ( \
-    (int) image[y+1][x-d] * kernel[0] + \
-    (int) image[y+1][x]   * kernel[1] + \
-    (int) image[y+1][x+d] * kernel[2] + \
-    (int) image[y][x-d]   * kernel[3] + \
-    (int) image[y][x]     * kernel[4] + \
-    (int) image[y][x+d]   * kernel[5] + \
-    (int) image[y-1][x-d] * kernel[6] + \
-    (int) image[y-1][x]   * kernel[7] + \
-    (int) image[y-1][x+d] * kernel[8])
-
-#define	KERNEL5x5(image, kernel, d) ( \
-    (int) image[y+2][x-d-d] * kernel[0] + \
-    (int) image[y+2][x-d]   * kernel[1] + \
-    (int) image[y+2][x]     * kernel[2] + \
-    (int) image[y+2][x+d]   * kernel[3] + \
-    (int) image[y+2][x+d+d] * kernel[4] + \
-    (int) image[y+1][x-d-d] * kernel[5] + \
-    (int) image[y+1][x-d]   * kernel[6] + \
-    (int) image[y+1][x]     * kernel[7] + \
-    (int) image[y+1][x+d]   * kernel[8] + \
-    (int) image[y+1][x+d+d] * kernel[9] + \
-    (int) image[y][x-d-d]   * kernel[10] + \
-    (int) image[y][x-d]     * kernel[11] + \
-    (int) image[y][x]       * kernel[12] + \
-    (int) image[y][x+d]     * kernel[13] + \
-    (int) image[y][x+d+d]   * kernel[14] + \
-    (int) image[y-1][x-d-d] * kernel[15] + \
-    (int) image[y-1][x-d]   * kernel[16] + \
-    (int) image[y-1][x]     * kernel[17] + \
-    (int) image[y-1][x+d]   * kernel[18] + \
-    (int) image[y-1][x+d+d] * kernel[19] + \
-    (int) image[y-2][x-d-d] * kernel[20] + \
-    (int) image[y-2][x-d]   * kernel[21] + \
-    (int) image[y-2][x]     * kernel[22] + \
-    (int) image[y-2][x+d]   * kernel[23] + \
-    (int) image[y-2][x+d+d] * kernel[24])
-
-    if (xsize == 3) {
-	/* 3x3 kernel. */
-	for (x = 0; x < im->xsize; x++)
-	    imOut->image[0][x] = im->image8[0][x];
-	for (y = 1; y < im->ysize-1; y++) {
-	    imOut->image[y][0] = im->image8[y][0];
-	    for (x = 1; x < im->xsize-1; x++) {
-		sum = KERNEL3x3(im->image8, kernel, 1) / divisor + offset;
-		if (sum <= 0)
-		    imOut->image8[y][x] = 0;
-		else if (sum >= 255)
-		    imOut->image8[y][x] = 255;
-		else
-		    imOut->image8[y][x] = (UINT8) sum;
-	     }
-	    imOut->image8[y][x] = im->image8[y][x];
-	}
-	for (x = 0; x < im->xsize; x++)
-	    imOut->image8[y][x] = im->image8[y][x];
-    } else {
-	/* 5x5 kernel. */
-	for (y = 0; y < 2; y++)
-	    for (x = 0; x < im->xsize; x++)
-		imOut->image8[y][x] = im->image8[y][x];
-	for (; y < im->ysize-2; y++) {
-	    for (x = 0; x < 2; x++)
-		imOut->image8[y][x] = im->image8[y][x];
-	    for (; x < im->xsize-2; x++) {
-		sum = KERNEL5x5(im->image8, kernel, 1) / divisor + offset;
-		if (sum <= 0)
-		    imOut->image8[y][x] = 0;
-		else if (sum >= 255)
-		    imOut->image8[y][x] = 255;
-		else
-		    imOut->image8[y][x] = (UINT8) sum;
-	    }
-	    for (; x < im->xsize; x++)
-		imOut->image8[y][x] = im->image8[y][x];
-	}
-	for (; y < im->ysize; y++)
-	    for (x = 0; x < im->xsize; x++)
-		imOut->image8[y][x] = im->image8[y][x];
+    ctx.imOut = imOut;
+    ctx.imIn = im;
+    ctx.kernel = kernel;
+    ctx.xsize = xsize;
+    ctx.ysize = ysize;
+    ctx.offset = offset;
+    ctx.divisor = divisor;
+    ctx.failed = 0;
+
+    ctx.row = malloc((xsize + ysize) * sizeof(FLOAT32));
+    if (!ctx.row) {
+        ImagingDelete(imOut);
+        return (Imaging) ImagingError_MemoryError();
+    }
+    ctx.column = ctx.row + xsize;
+    if (!filter_separable(kernel, xsize, ysize, ctx.row, ctx.column)) {
+        free(ctx.row);
+        ctx.row = NULL;
+    }
+
+    xmargin = xsize / 2;
+    ymargin = ysize / 2;
+
+    ImagingSectionEnter(&cookie);
+
+    /* copy the border */
+    bytes = xmargin * im->pixelsize;
+    for (y = 0; y < im->ysize; y++)
+        if (y < ymargin || y >= im->ysize - ymargin)
+            memcpy(imOut->image[y], im->image[y], im->linesize);
+        else if (bytes > 0) {
+            x = (im->xsize - xmargin) * im->pixelsize;
+            memcpy(imOut->image[y], im->image[y], bytes);
+            memcpy(imOut->image[y] + x, im->image[y] + x, bytes);
+        }
+
+    ImagingParallelFor(im->ysize - 2 * ymargin, 16, filter_rows, &ctx);
+
+    ImagingSectionLeave(&cookie);
+
+    free(ctx.row);
+
+    if (ctx.failed) {
+        ImagingDelete(imOut);
+        return (Imaging) ImagingError_MemoryError();
     }
+
+    ImagingCopyInfo(imOut, im);
+
     return imOut;
 }
-
@@ -15,6 +15,10 @@
 #define	GIFTABLE    (1<<GIFBITS)
 #define	GIFBUFFER   (1<<GIFBITS)
 
+/* Size of the encoder's string table (a hash table) */
+
+#define	GIFHASH	    (1<<(GIFBITS+1))
+
 
 typedef struct {
 
@@ -81,11 +85,15 @@ typedef struct {
        the first time. */
     int bits;
 
-    /* NOTE: the expanding encoder ignores this field */
-
     /* If set, write an interlaced image (see above) */
     int interlace;
 
+    /* If set, pixels that have the same value in this image (usually
+       the previous frame of an animation) are written as the
+       transparency index instead */
+    Imaging previous;
+    int transparency;
+
     /* PRIVATE CONTEXT (set by encoder) */
 
     /* Interlace parameters */
@@ -100,10 +108,15 @@ typedef struct {
     GIFENCODERBLOCK* flush; /* output queue */
     GIFENCODERBLOCK* free; /* if not null, use this */
 
-    /* Fields used for run-length encoding */
-    int first; /* true if we haven't read the first pixel */
-    int last; /* last byte value seen */
-    int count; /* how many bytes with that value we've seen */
-    int lastcode;
+    /* Code buffer */
+    int codesize;
+
+    /* Constant symbol codes */
+    int clear, end;
+
+    /* String table */
+    int prefix; /* code for the current string (-1 if none) */
+    int next; /* next free code */
+    UINT32 table[GIFHASH]; /* prefix, pixel, and code; or all ones */
 
 } GIFENCODERSTATE;
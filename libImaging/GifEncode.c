@@ -2,7 +2,7 @@
  * The Python Imaging Library.
  * $Id$
  *
- * encoder for uncompressed GIF data
+ * encoder for GIF (LZW compressed) data
  *
  * history:
  * 97-01-05 fl	created (writes uncompressed data)
@@ -21,14 +21,15 @@
 
 #include "Gif.h"
 
-/* codes from 0 to 255 are literals */
-#define CLEAR_CODE 256
-#define EOF_CODE 257
-#define FIRST_CODE 258
-#define LAST_CODE 511
-
 enum { INIT, ENCODE, ENCODE_EOF, FLUSH, EXIT };
 
+/* the string table is an open hash table, indexed by a hash of the
+   prefix code and the next pixel.  each entry holds the prefix, the
+   pixel, and the code for the string, or UNUSED */
+
+#define	UNUSED 0xFFFFFFFFU
+#define	HASH(key) ((((key) * 2654435761U) >> 19) & (GIFHASH-1))
+
 /* to make things a little less complicated, we use a simple output
    queue to hold completed blocks.  the following inlined function
    adds a byte to the current block.  it allocates a new block if
@@ -80,11 +81,14 @@ emit(GIFENCODERSTATE *context, int byte)
 }
 
 /* write a code word to the current block.  this is a macro to make
-   sure it's inlined on all platforms */
+   sure it's inlined on all platforms.  the code size grows when the
+   next code to be added to the table no longer fits (the decoder is
+   one code behind, so it makes the same change after reading this
+   code) */
 
 #define EMIT(code) {\
     context->bitbuffer |= ((INT32) (code)) << context->bitcount;\
-    context->bitcount += 9;\
+    context->bitcount += context->codesize;\
     while (context->bitcount >= 8) {\
         if (!emit(context, (UINT8) context->bitbuffer)) {\
             state->errcode = IMAGING_CODEC_MEMORY;\
@@ -93,62 +97,44 @@ emit(GIFENCODERSTATE *context, int byte)
         context->bitbuffer >>= 8;\
         context->bitcount -= 8;\
     }\
+    if (context->next >= (1 << context->codesize) &&\
+        context->codesize < GIFBITS)\
+        context->codesize++;\
 }
 
-/* write a run.  we use a combination of literals and combinations of
-   literals.  this can give quite decent compression for images with
-   long stretches of identical pixels.  but remember: if you want
-   really good compression, use another file format. */
-
-#define EMIT_RUN(label) {\
-label:\
-    while (context->count > 0) {\
-        int run = 2;\
-        EMIT(context->last);\
-        context->count--;\
-        if (state->count++ == LAST_CODE) {\
-            EMIT(CLEAR_CODE);\
-            state->count = FIRST_CODE;\
-            goto label;\
-        }\
-        while (context->count >= run) {\
-            EMIT(state->count - 1);\
-            context->count -= run;\
-            run++;\
-            if (state->count++ == LAST_CODE) {\
-                EMIT(CLEAR_CODE);\
-                state->count = FIRST_CODE;\
-                goto label;\
-            }\
-        }\
-        if (context->count > 1) {\
-            EMIT(state->count - 1 - (run - context->count));\
-            context->count = 0;\
-            if (state->count++ == LAST_CODE) {\
-                EMIT(CLEAR_CODE);\
-                state->count = FIRST_CODE;\
-            }\
-            break;\
-        }\
-    }\
+/* reset the string table */
+
+static void
+clear(GIFENCODERSTATE *context)
+{
+    context->codesize = context->bits + 1;
+    context->next = context->end + 1;
+    memset(context->table, 255, sizeof(context->table));
 }
 
 int
 ImagingGifEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 {
     UINT8* ptr;
-    int this;
+    UINT32 key, entry;
+    UINT32* table;
+    UINT8* buffer;
+    int prefix, x, h, xsize;
 
     GIFENCODERBLOCK* block;
     GIFENCODERSTATE *context = (GIFENCODERSTATE*) state->context;
 
+    table = context->table;
+
     if (!state->state) {
 
-	/* place a clear code in the output buffer */
-	context->bitbuffer = CLEAR_CODE;
-	context->bitcount = 9;
+        context->clear = 1 << context->bits;
+        context->end = context->clear + 1;
+        clear(context);
 
-	state->count = FIRST_CODE;
+	/* place a clear code in the output buffer */
+	context->bitbuffer = context->clear;
+	context->bitcount = context->codesize;
 
 	if (context->interlace) {
 	    context->interlace = 1;
@@ -156,7 +142,7 @@ ImagingGifEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 	} else
 	    context->step = 1;
 
-        context->last = -1;
+        context->prefix = -1;
 
         /* sanity check */
         if (state->xsize <= 0 || state->ysize <= 0)
@@ -173,80 +159,104 @@ ImagingGifEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
         case INIT:
         case ENCODE:
 
-            /* identify and store a run of pixels */
+            if (!context->interlace && state->y >= state->ysize) {
+                state->state = ENCODE_EOF;
+                break;
+            }
+
+            if (context->flush) {
+                state->state = FLUSH;
+                break;
+            }
 
-            if (state->x == 0 || state->x >= state->xsize) {
+            /* get another line of data */
+            state->shuffle(
+                state->buffer,
+                (UINT8*) im->image[state->y + state->yoff] +
+                state->xoff * im->pixelsize, state->xsize
+                );
+
+            buffer = state->buffer;
+            xsize = state->xsize;
+
+            if (context->previous) {
+                /* make unchanged pixels transparent */
+                UINT8* in = (UINT8*) im->image[state->y + state->yoff] +
+                    state->xoff;
+                UINT8* prev = (UINT8*)
+                    context->previous->image[state->y + state->yoff] +
+                    state->xoff;
+                for (x = 0; x < xsize; x++)
+                    if (in[x] == prev[x])
+                        buffer[x] = context->transparency;
+            }
 
-                if (!context->interlace && state->y >= state->ysize) {
-                    state->state = ENCODE_EOF;
-                    break;
-                }
+            x = 0;
+            if (state->state == INIT) {
+                context->prefix = state->buffer[0];
+                x = 1;
+                state->state = ENCODE;
+            }
 
-                if (context->flush) {
-                    state->state = FLUSH;
+            /* step forward, according to the interlace settings */
+            state->y += context->step;
+            while (context->interlace && state->y >= state->ysize)
+                switch (context->interlace) {
+                case 1:
+                    state->y = 4;
+                    context->interlace = 2;
+                    break;
+                case 2:
+                    context->step = 4;
+                    state->y = 2;
+                    context->interlace = 3;
+                    break;
+                case 3:
+                    context->step = 2;
+                    state->y = 1;
+                    context->interlace = 0;
                     break;
+                default:
+                    /* just make sure we don't loop forever */
+                    context->interlace = 0;
                 }
 
-                /* get another line of data */
-                state->shuffle(
-                    state->buffer,
-                    (UINT8*) im->image[state->y + state->yoff] +
-                    state->xoff * im->pixelsize, state->xsize
-                    );
-
-                state->x = 0;
-
-                if (state->state == INIT) {
-                    /* preload the run-length buffer and get going */
-                    context->last = state->buffer[0];
-                    context->count = state->x = 1;
-                    state->state = ENCODE;
+            /* compress the line.  the current string is extended as
+               long as it's in the table; when it isn't, write the
+               code for the string, and add the extended string to
+               the table */
+            prefix = context->prefix;
+            for (; x < xsize; x++) {
+                int this = buffer[x];
+                key = ((UINT32) prefix << 8) | this;
+                h = HASH(key);
+                while ((entry = table[h]) != UNUSED && (entry >> GIFBITS) != key)
+                    h = (h + 1) & (GIFHASH-1);
+                if (entry != UNUSED) {
+                    prefix = entry & (GIFTABLE-1);
+                    continue;
                 }
-
-                /* step forward, according to the interlace settings */
-                state->y += context->step;
-                while (context->interlace && state->y >= state->ysize)
-                    switch (context->interlace) {
-                    case 1:
-                        state->y = 4;
-                        context->interlace = 2;
-                        break;
-                    case 2:
-                        context->step = 4;
-                        state->y = 2;
-                        context->interlace = 3;
-                        break;
-                    case 3:
-                        context->step = 2;
-                        state->y = 1;
-                        context->interlace = 0;
-                        break;
-                    default:
-                        /* just make sure we don't loop forever */
-                        context->interlace = 0;
-                    }
-
-            }
-
-            this = state->buffer[state->x++];
-
-            if (this == context->last)
-                context->count++;
-            else {
-                EMIT_RUN(label1);
-                context->last = this;
-                context->count = 1;
+                EMIT(prefix);
+                if (context->next >= GIFTABLE-1) {
+                    /* table full; start over */
+                    EMIT(context->clear);
+                    clear(context);
+                } else
+                    table[h] = (key << GIFBITS) | context->next++;
+                prefix = this;
             }
+            context->prefix = prefix;
 	    break;
 
 
         case ENCODE_EOF:
 
-            /* write the final run */
-            EMIT_RUN(label2);
+            /* write the last string */
+            if (context->prefix >= 0)
+                EMIT(context->prefix);
 
             /* write an end of image marker */
-            EMIT(EOF_CODE);
+            EMIT(context->end);
 
             /* empty the bit buffer */
             while (context->bitcount > 0) {
@@ -309,6 +319,7 @@ ImagingGifEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
                 /* this was the last block! */
                 if (context->free)
                     free(context->free);
+                context->free = NULL;
                 state->errcode = IMAGING_CODEC_END;
                 return ptr - buf;
             }
@@ -147,6 +147,8 @@ struct ImagingPaletteInstance {
     INT16* cache;	/* Palette cache (used for predefined palettes) */
     int keep_cache;	/* This palette will be reused; keep cache */
 
+    struct ImagingPaletteNearest* nearest; /* Distance tables (Quant.c) */
+
 };
 
 
@@ -164,6 +166,24 @@ extern Imaging ImagingNewArray(const char* mode, int xsize, int ysize);
 extern Imaging ImagingNewMap(const char* filename, int readonly,
                              const char* mode, int xsize, int ysize);
 
+extern Imaging ImagingNewPooled(const char* mode, int xsize, int ysize);
+
+typedef struct ImagingMemoryPoolStats {
+    int enabled;	/* Set if ImagingNew should use the pool */
+    int maxblocks;	/* Max number of blocks to keep in the pool */
+    long maxbytes;	/* Max number of bytes to keep in the pool */
+    int blocks;		/* Number of blocks currently in the pool */
+    long bytes;		/* Number of bytes currently in the pool */
+    long hits;		/* Allocations served from the pool */
+    long misses;	/* Allocations that had to call malloc */
+    long returned;	/* Blocks returned to the pool */
+    long released;	/* Blocks given back to the system */
+} ImagingMemoryPoolStats;
+
+extern void ImagingMemoryPoolSetup(int enabled, int maxblocks, long maxbytes);
+extern void ImagingMemoryPoolClear(void);
+extern void ImagingMemoryPoolGetStats(ImagingMemoryPoolStats* stats);
+
 extern Imaging ImagingNewPrologue(const char *mode,
                                   unsigned xsize, unsigned ysize);
 extern Imaging ImagingNewPrologueSubtype(const char *mode,
@@ -188,6 +208,7 @@ extern ImagingPalette ImagingPaletteDuplicate(ImagingPalette palette);
 extern void           ImagingPaletteDelete(ImagingPalette palette);
 
 extern int  ImagingPaletteCachePrepare(ImagingPalette palette);
+extern int  ImagingPaletteCacheBuild(ImagingPalette palette);
 extern void ImagingPaletteCacheUpdate(ImagingPalette palette,
 				      int r, int g, int b);
 extern void ImagingPaletteCacheDelete(ImagingPalette palette);
@@ -195,7 +216,10 @@ extern void ImagingPaletteCacheDelete(ImagingPalette palette);
 #define	ImagingPaletteCache(p, r, g, b)\
     p->cache[(r>>2) + (g>>2)*64 + (b>>2)*64*64]
 
-extern Imaging ImagingQuantize(Imaging im, int colours, int mode, int kmeans);
+extern Imaging ImagingQuantize(Imaging im, int colours, int mode, int kmeans,
+                               int kmeansSample, int kmeansIterations,
+                               double kmeansTime, int octreeBits);
+extern Imaging ImagingQuantizePalette(Imaging im, ImagingPalette palette);
 
 /* Threading */
 /* --------- */
@@ -205,6 +229,21 @@ typedef void* ImagingSectionCookie;
 extern void ImagingSectionEnter(ImagingSectionCookie* cookie);
 extern void ImagingSectionLeave(ImagingSectionCookie* cookie);
 
+typedef void (*ImagingParallelCallback)(void* context, int start, int end);
+
+extern int  ImagingParallelGetThreads(void);
+extern int  ImagingParallelSetThreads(int threads);
+extern void ImagingParallelFor(int count, int granularity,
+                               ImagingParallelCallback func, void* context);
+extern void ImagingParallelRows(Imaging im, ImagingParallelCallback func,
+                                void* context);
+
+/* Processor features (for vectorized kernels) */
+#define IMAGING_CPU_SSSE3 1
+#define IMAGING_CPU_AVX2 2
+
+extern int  ImagingCPUFeatures(void);
+
 /* Exceptions */
 /* ---------- */
 
@@ -243,6 +282,7 @@ extern Imaging ImagingBlend(Imaging imIn1, Imaging imIn2, float alpha);
 extern Imaging ImagingCopy(Imaging im);
 extern Imaging ImagingConvert(Imaging im, const char* mode, ImagingPalette palette, int dither);
 extern Imaging ImagingConvertInPlace(Imaging im, const char* mode);
+extern void ImagingConvertCleanup(void);
 extern Imaging ImagingConvertMatrix(Imaging im, const char *mode, float m[]);
 extern Imaging ImagingCrop(Imaging im, int x0, int y0, int x1, int y1);
 extern Imaging ImagingExpand(Imaging im, int x, int y, int mode);
@@ -258,7 +298,8 @@ extern Imaging ImagingFilter(
     FLOAT32 offset, FLOAT32 divisor);
 extern Imaging ImagingFlipLeftRight(Imaging imOut, Imaging imIn);
 extern Imaging ImagingFlipTopBottom(Imaging imOut, Imaging imIn);
-extern Imaging ImagingGaussianBlur(Imaging im, Imaging imOut, float radius);
+extern Imaging ImagingGaussianBlur(Imaging im, Imaging imOut, float radius,
+    int passes);
 extern Imaging ImagingGetBand(Imaging im, int band);
 extern int ImagingGetBBox(Imaging im, int bbox[4]);
 typedef struct { int x, y; INT32 count; INT32 pixel; } ImagingColorItem;
@@ -280,6 +321,7 @@ extern Imaging ImagingPointTransform(
     Imaging imIn, double scale, double offset);
 extern Imaging ImagingPutBand(Imaging im, Imaging imIn, int band);
 extern Imaging ImagingRankFilter(Imaging im, int size, int rank);
+extern Imaging ImagingResample(Imaging imOut, Imaging imIn, int filter);
 extern Imaging ImagingResize(Imaging imOut, Imaging imIn, int filter);
 extern Imaging ImagingRotate(
     Imaging imOut, Imaging imIn, double theta, int filter);
@@ -302,7 +344,8 @@ extern Imaging ImagingTransform(
     ImagingTransformFilter filter, void* filter_data,
     int fill);
 extern Imaging ImagingUnsharpMask(
-    Imaging im, Imaging imOut, float radius, int percent, int threshold);
+    Imaging im, Imaging imOut, float radius, int percent, int threshold,
+    int passes);
 
 extern Imaging ImagingCopy2(Imaging imOut, Imaging imIn);
 extern Imaging ImagingConvert2(Imaging imOut, Imaging imIn);
@@ -456,6 +499,7 @@ extern int ImagingZipDecode(Imaging im, ImagingCodecState state,
 			    UINT8* buffer, int bytes);
 extern int ImagingZipEncode(Imaging im, ImagingCodecState state,
 			    UINT8* buffer, int bytes);
+extern void ImagingZipEncodeCleanup(ImagingCodecState state);
 #endif
 
 typedef void (*ImagingShuffler)(UINT8* out, const UINT8* in, int pixels);
@@ -483,6 +527,7 @@ struct ImagingCodecStateInstance {
     int errcode;
     int x, y;
     int ystep;
+    int ystop;		/* if set, return when y reaches this line */
     int xsize, ysize, xoff, yoff;
     ImagingShuffler shuffle;
     int bits, bytes;
@@ -15,53 +15,122 @@
 
 #include "Imaging.h"
 
-Imaging
-ImagingModeFilter(Imaging im, int size)
+/* The window histogram is updated incrementally.  For each column,
+   we keep a histogram of the pixels in the current window rows, and
+   update it as we move from one line to the next.  The window
+   histogram is then updated by adding the column that enters the
+   window and subtracting the one that leaves it, so the cost per
+   pixel doesn't depend on the window size.  Each histogram also has
+   16 coarse bins, which are used to skip large parts of the fine
+   histogram when looking for the most frequent value. */
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define HISTSIZE (256 + 16) /* fine bins, coarse bins */
+
+static void
+histogram_add(UINT16* h, const UINT16* column, int sign)
 {
+    int i = 0;
+#ifdef USE_SSE2
+    if (sign > 0)
+        for (; i < HISTSIZE; i += 8)
+            _mm_storeu_si128((__m128i*) &h[i], _mm_add_epi16(
+                _mm_loadu_si128((__m128i*) &h[i]),
+                _mm_loadu_si128((__m128i*) &column[i])));
+    else
+        for (; i < HISTSIZE; i += 8)
+            _mm_storeu_si128((__m128i*) &h[i], _mm_sub_epi16(
+                _mm_loadu_si128((__m128i*) &h[i]),
+                _mm_loadu_si128((__m128i*) &column[i])));
+#else
+    if (sign > 0)
+        for (; i < HISTSIZE; i++)
+            h[i] += column[i];
+    else
+        for (; i < HISTSIZE; i++)
+            h[i] -= column[i];
+#endif
+}
+
+static void
+column_update(UINT16* columns, UINT8* in, int xsize, int sign)
+{
+    /* add (or remove) a line to the column histograms */
+    int x;
+    for (x = 0; x < xsize; x++) {
+        columns[x * HISTSIZE + in[x]] += sign;
+        columns[x * HISTSIZE + 256 + (in[x] >> 4)] += sign;
+    }
+}
+
+struct mode_context {
     Imaging imOut;
-    int x, y, i;
-    int xx, yy;
+    Imaging imIn;
+    int size; /* half size */
+    int failed;
+};
+
+static void
+mode_rows(void* context, int y0, int y1)
+{
+    struct mode_context* ctx = context;
+    Imaging im = ctx->imIn;
+    int size = ctx->size;
+    UINT16* columns;
+    UINT16 histogram[HISTSIZE];
+    int x, y, yy, i, c;
     int maxcount;
     UINT8 maxpixel;
-    int histogram[256];
 
-    if (!im || im->bands != 1 || im->type != IMAGING_TYPE_UINT8)
-	return (Imaging) ImagingError_ModeError();
+    columns = calloc(im->xsize * HISTSIZE, sizeof(UINT16));
+    if (!columns) {
+        ctx->failed = 1;
+        return;
+    }
 
-    imOut = ImagingNew(im->mode, im->xsize, im->ysize);
-    if (!imOut)
-	return NULL;
+    /* window rows for the first line */
+    for (yy = y0 - size; yy < y0 + size; yy++)
+        if (yy >= 0 && yy < im->ysize)
+            column_update(columns, im->image8[yy], im->xsize, 1);
 
-    size = size / 2;
+    for (y = y0; y < y1; y++) {
+        UINT8* out = &IMAGING_PIXEL_L(ctx->imOut, 0, y);
 
-    for (y = 0; y < imOut->ysize; y++) {
-        UINT8* out = &IMAGING_PIXEL_L(imOut, 0, y);
-        for (x = 0; x < imOut->xsize; x++) {
+        /* move the window rows down one line */
+        if (y + size < im->ysize)
+            column_update(columns, im->image8[y + size], im->xsize, 1);
+        if (y > y0 && y - size - 1 >= 0)
+            column_update(columns, im->image8[y - size - 1], im->xsize, -1);
 
-            /* calculate histogram over current area */
+        memset(histogram, 0, sizeof(histogram));
+        for (i = 0; i < size && i < im->xsize; i++)
+            histogram_add(histogram, &columns[i * HISTSIZE], 1);
 
-            /* FIXME: brute force! to improve, update the histogram
-               incrementally.  may also add a "frequent list", like in
-               the old implementation, but I'm not sure that's worth
-               the added complexity... */
+        for (x = 0; x < im->xsize; x++) {
 
-            memset(histogram, 0, sizeof(histogram));
-            for (yy = y - size; yy <= y + size; yy++)
-                if (yy >= 0 && yy < imOut->ysize) {
-                    UINT8* in = &IMAGING_PIXEL_L(im, 0, yy);
-                    for (xx = x - size; xx <= x + size; xx++)
-                        if (xx >= 0 && xx < imOut->xsize)
-                            histogram[in[xx]]++;
-                }
+            /* move the window right one pixel */
+            if (x + size < im->xsize)
+                histogram_add(histogram, &columns[(x + size) * HISTSIZE], 1);
+            if (x - size - 1 >= 0)
+                histogram_add(histogram, &columns[(x-size-1) * HISTSIZE], -1);
 
-            /* find most frequent pixel value in this region */
+            /* find most frequent pixel value in this region.  if
+               there's a tie, use the lowest value.  skip coarse bins
+               that cannot contain anything better */
             maxpixel = 0;
-            maxcount = histogram[maxpixel];
-            for (i = 1; i < 256; i++)
-                if (histogram[i] > maxcount) {
-                    maxcount = histogram[i];
-                    maxpixel = (UINT8) i;
-                }
+            maxcount = -1;
+            for (c = 0; c < 16; c++)
+                if (histogram[256 + c] > maxcount)
+                    for (i = c * 16; i < c * 16 + 16; i++)
+                        if (histogram[i] > maxcount) {
+                            maxcount = histogram[i];
+                            maxpixel = (UINT8) i;
+                        }
 
             if (maxcount > 2)
                 out[x] = maxpixel;
@@ -69,7 +138,43 @@ ImagingModeFilter(Imaging im, int size)
                 out[x] = IMAGING_PIXEL_L(im, x, y);
 
         }
-        
+    }
+
+    free(columns);
+}
+
+Imaging
+ImagingModeFilter(Imaging im, int size)
+{
+    ImagingSectionCookie cookie;
+    struct mode_context ctx;
+    Imaging imOut;
+
+    if (!im || im->bands != 1 || im->type != IMAGING_TYPE_UINT8)
+	return (Imaging) ImagingError_ModeError();
+
+    size = size / 2;
+
+    /* the histograms use 16-bit counters */
+    if (size < 0 || (2 * size + 1) * (2 * size + 1) > 65535)
+	return (Imaging) ImagingError_ValueError("bad filter size");
+
+    imOut = ImagingNew(im->mode, im->xsize, im->ysize);
+    if (!imOut)
+	return NULL;
+
+    ctx.imOut = imOut;
+    ctx.imIn = im;
+    ctx.size = size;
+    ctx.failed = 0;
+
+    ImagingSectionEnter(&cookie);
+    ImagingParallelFor(im->ysize, 32, mode_rows, &ctx);
+    ImagingSectionLeave(&cookie);
+
+    if (ctx.failed) {
+        ImagingDelete(imOut);
+        return (Imaging) ImagingError_MemoryError();
     }
 
     ImagingCopyInfo(imOut, im);
@@ -20,23 +20,41 @@
 #include "Imaging.h"
 
 
+struct negative_context {
+    Imaging imOut;
+    Imaging imIn;
+};
+
+static void
+negative_rows(void* context, int y0, int y1)
+{
+    struct negative_context* ctx = context;
+    int x, y;
+
+    for (y = y0; y < y1; y++)
+	for (x = 0; x < ctx->imIn->linesize; x++)
+	     ctx->imOut->image[y][x] = ~ctx->imIn->image[y][x];
+}
+
 Imaging
 ImagingNegative(Imaging im)
 {
-    Imaging imOut;
-    int x, y;
+    ImagingSectionCookie cookie;
+    struct negative_context ctx;
 
     if (!im)
 	return (Imaging) ImagingError_ModeError();
 
-    imOut = ImagingNew(im->mode, im->xsize, im->ysize);
-    if (!imOut)
+    ctx.imOut = ImagingNew(im->mode, im->xsize, im->ysize);
+    if (!ctx.imOut)
 	return NULL;
 
-    for (y = 0; y < im->ysize; y++)
-	for (x = 0; x < im->linesize; x++)
-	     imOut->image[y][x] = ~im->image[y][x];
+    ctx.imIn = im;
+
+    ImagingSectionEnter(&cookie);
+    ImagingParallelRows(ctx.imOut, negative_rows, &ctx);
+    ImagingSectionLeave(&cookie);
 
-    return imOut;
+    return ctx.imOut;
 }
 
@@ -28,6 +28,14 @@
 
 #include "Imaging.h"
 
+/* the SSSE3 and AVX2 versions of the most common packers are picked at
+   run time, when the CPU supports them */
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define USE_SIMD
+#include <immintrin.h>
+#endif
 #define	R 0
 #define	G 1
 #define	B 2
@@ -441,6 +449,201 @@ band3(UINT8* out, const UINT8* in, int pixels)
 	out[i] = in[3];
 }
 
+/* -------------------------------------------------------------------- */
+/* SIMD packers.  Each kernel handles as many whole vectors as it can,
+   and leaves the rest of the line to the plain C version. */
+
+#ifdef USE_SIMD
+
+#define SSSE3 __attribute__((target("ssse3")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* shuffle masks.  indexes with the top bit set clear the byte; ZERO
+   stays negative when the masks add their offsets */
+
+#define ZERO -128
+
+#define RGB_MASK(a, b, c)\
+    a, b, c, a+4, b+4, c+4, a+8, b+8, c+8, a+12, b+12, c+12,\
+    ZERO, ZERO, ZERO, ZERO
+#define QUAD_MASK(a, b, c, d)\
+    a, b, c, d, a+4, b+4, c+4, d+4, a+8, b+8, c+8, d+8,\
+    a+12, b+12, c+12, d+12
+
+SSSE3 static int
+pack24_ssse3(UINT8* out, const UINT8* in, int pixels, __m128i mask)
+{
+    /* 16 quadruples to packed triplets.  each shuffle leaves 12 bytes
+       at the bottom of the register, and the shifts stitch them up */
+    __m128i a, b, c, d;
+    int i;
+    for (i = 0; i + 16 <= pixels; i += 16) {
+        a = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) in), mask);
+        b = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) (in + 16)), mask);
+        c = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) (in + 32)), mask);
+        d = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) (in + 48)), mask);
+        _mm_storeu_si128((__m128i*) out,
+                         _mm_or_si128(a, _mm_slli_si128(b, 12)));
+        _mm_storeu_si128((__m128i*) (out + 16),
+                         _mm_or_si128(_mm_srli_si128(b, 4),
+                                      _mm_slli_si128(c, 8)));
+        _mm_storeu_si128((__m128i*) (out + 32),
+                         _mm_or_si128(_mm_srli_si128(c, 8),
+                                      _mm_slli_si128(d, 4)));
+        out += 48; in += 64;
+    }
+    return i;
+}
+
+SSSE3 static int
+pack32_ssse3(UINT8* out, const UINT8* in, int pixels, __m128i mask)
+{
+    /* quadruples to quadruples */
+    int i;
+    for (i = 0; i + 4 <= pixels; i += 4) {
+        _mm_storeu_si128((__m128i*) out, _mm_shuffle_epi8(
+            _mm_loadu_si128((__m128i*) in), mask));
+        out += 16; in += 16;
+    }
+    return i;
+}
+
+AVX2 static int
+pack32_avx2(UINT8* out, const UINT8* in, int pixels, __m128i mask)
+{
+    __m256i mask2 = _mm256_broadcastsi128_si256(mask);
+    int i;
+    for (i = 0; i + 8 <= pixels; i += 8) {
+        _mm256_storeu_si256((__m256i*) out, _mm256_shuffle_epi8(
+            _mm256_loadu_si256((__m256i*) in), mask2));
+        out += 32; in += 32;
+    }
+    return i;
+}
+
+SSSE3 static int
+collect1_ssse3(UINT8* out, const UINT8* in, int pixels, __m128i order,
+               int invert)
+{
+    /* 16 bytes to two bytes of bits.  movemask takes the bits in lsb
+       first order, so "order" reverses each group of eight when the
+       msb should come first */
+    int i, bits;
+    for (i = 0; i + 16 <= pixels; i += 16) {
+        bits = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_shuffle_epi8(
+            _mm_loadu_si128((__m128i*) in), order), _mm_setzero_si128()));
+        bits ^= invert;
+        out[0] = (UINT8) bits;
+        out[1] = (UINT8) (bits >> 8);
+        out += 2; in += 16;
+    }
+    return i;
+}
+
+AVX2 static int
+collect1_avx2(UINT8* out, const UINT8* in, int pixels, __m128i order,
+              int invert)
+{
+    __m256i order2 = _mm256_broadcastsi128_si256(order);
+    UINT32 bits;
+    int i;
+    for (i = 0; i + 32 <= pixels; i += 32) {
+        bits = (UINT32) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+            _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i*) in), order2),
+            _mm256_setzero_si256()));
+        bits ^= (UINT32) invert;
+        out[0] = (UINT8) bits;
+        out[1] = (UINT8) (bits >> 8);
+        out[2] = (UINT8) (bits >> 16);
+        out[3] = (UINT8) (bits >> 24);
+        out += 4; in += 32;
+    }
+    return i;
+}
+
+AVX2 static int
+packI16B_avx2(UINT8* out, const UINT8* in, int pixels)
+{
+    /* clip to 0..65535, and store the low halves big endian */
+    __m256i zero = _mm256_setzero_si256();
+    __m256i limit = _mm256_set1_epi32(65535);
+    __m256i v;
+    int i;
+    for (i = 0; i + 8 <= pixels; i += 8) {
+        v = _mm256_loadu_si256((__m256i*) in);
+        v = _mm256_min_epi32(_mm256_max_epi32(v, zero), limit);
+        v = _mm256_shuffle_epi8(v, _mm256_setr_epi8(
+            1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1,
+            1, 0, 5, 4, 9, 8, 13, 12, -1, -1, -1, -1, -1, -1, -1, -1));
+        v = _mm256_permute4x64_epi64(v, 0x08);
+        _mm_storeu_si128((__m128i*) out, _mm256_castsi256_si128(v));
+        out += 16; in += 32;
+    }
+    return i;
+}
+
+#define PACK24(NAME, GENERIC, MASK)\
+SSSE3 static void NAME##_ssse3(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = pack24_ssse3(out, in, pixels, _mm_setr_epi8(MASK));\
+    GENERIC(out + 3*n, in + 4*n, pixels - n);\
+}
+
+#define PACK32(NAME, GENERIC, MASK)\
+SSSE3 static void NAME##_ssse3(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = pack32_ssse3(out, in, pixels, _mm_setr_epi8(MASK));\
+    GENERIC(out + 4*n, in + 4*n, pixels - n);\
+}\
+AVX2 static void NAME##_avx2(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = pack32_avx2(out, in, pixels, _mm_setr_epi8(MASK));\
+    NAME##_ssse3(out + 4*n, in + 4*n, pixels - n);\
+}
+
+#define PACK1(NAME, GENERIC, ORDER, INVERT)\
+SSSE3 static void NAME##_ssse3(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = collect1_ssse3(out, in, pixels, ORDER, INVERT);\
+    GENERIC(out + n/8, in + n, pixels - n);\
+}\
+AVX2 static void NAME##_avx2(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = collect1_avx2(out, in, pixels, ORDER, INVERT);\
+    NAME##_ssse3(out + n/8, in + n, pixels - n);\
+}
+
+#define MSB_FIRST\
+    _mm_setr_epi8(7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8)
+#define LSB_FIRST\
+    _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+
+PACK24(packRGB, ImagingPackRGB, RGB_MASK(0, 1, 2))
+PACK24(packBGR, ImagingPackBGR, RGB_MASK(2, 1, 0))
+
+PACK32(packXRGB, ImagingPackXRGB, QUAD_MASK(ZERO, 0, 1, 2))
+PACK32(packBGRX, ImagingPackBGRX, QUAD_MASK(2, 1, 0, ZERO))
+PACK32(packXBGR, ImagingPackXBGR, QUAD_MASK(ZERO, 2, 1, 0))
+PACK32(packBGRA, ImagingPackBGRA, QUAD_MASK(2, 1, 0, 3))
+PACK32(packABGR, ImagingPackABGR, QUAD_MASK(3, 2, 1, 0))
+
+/* the zero test gives the bits for zero bytes, so the "black is 0"
+   packers flip them */
+
+PACK1(pack1, pack1, MSB_FIRST, -1)
+PACK1(pack1I, pack1I, MSB_FIRST, 0)
+PACK1(pack1R, pack1R, LSB_FIRST, -1)
+PACK1(pack1IR, pack1IR, LSB_FIRST, 0)
+
+AVX2 static void
+packI16B_fast(UINT8* out, const UINT8* in, int pixels)
+{
+    int n = packI16B_avx2(out, in, pixels);
+    packI16B(out + 2*n, in + 4*n, pixels - n);
+}
+
+#endif
+
 static struct {
     const char* mode;
     const char* rawmode;
@@ -549,11 +752,70 @@ static struct {
 };
 
 
+#ifdef USE_SIMD
+
+#define FAST(NAME, GENERIC) {GENERIC, NAME##_ssse3, NAME##_avx2}
+
+static struct {
+    ImagingShuffler generic;
+    ImagingShuffler ssse3;
+    ImagingShuffler avx2;
+} fast_packers[] = {
+    {ImagingPackRGB, packRGB_ssse3, NULL},
+    {ImagingPackBGR, packBGR_ssse3, NULL},
+    FAST(packXRGB, ImagingPackXRGB),
+    FAST(packBGRX, ImagingPackBGRX),
+    FAST(packXBGR, ImagingPackXBGR),
+    FAST(packBGRA, ImagingPackBGRA),
+    FAST(packABGR, ImagingPackABGR),
+    FAST(pack1, pack1),
+    FAST(pack1I, pack1I),
+    FAST(pack1R, pack1R),
+    FAST(pack1IR, pack1IR),
+    {packI16B, NULL, packI16B_fast},
+    {NULL}
+};
+
+#endif
+
+static void
+select_packers(void)
+{
+    /* replace the generic packers with the best versions for this CPU
+       (only done once) */
+
+    static int ready = 0;
+
+#ifdef USE_SIMD
+    int i, j, ssse3, avx2;
+
+    if (ready)
+        return;
+
+    ssse3 = ImagingCPUFeatures() & IMAGING_CPU_SSSE3;
+    avx2 = ImagingCPUFeatures() & IMAGING_CPU_AVX2;
+
+    for (i = 0; packers[i].rawmode; i++)
+        for (j = 0; fast_packers[j].generic; j++)
+            if (packers[i].pack == fast_packers[j].generic) {
+                if (avx2 && fast_packers[j].avx2)
+                    packers[i].pack = fast_packers[j].avx2;
+                else if (ssse3 && fast_packers[j].ssse3)
+                    packers[i].pack = fast_packers[j].ssse3;
+                break;
+            }
+#endif
+
+    ready = 1;
+}
+
 ImagingShuffler
 ImagingFindPacker(const char* mode, const char* rawmode, int* bits_out)
 {
     int i;
 
+    select_packers();
+
     /* find a suitable pixel packer */
     for (i = 0; packers[i].rawmode; i++)
 	if (strcmp(packers[i].mode, mode) == 0 &&
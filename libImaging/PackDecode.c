@@ -86,6 +86,9 @@ ImagingPackbitsDecode(Imaging im, ImagingCodecState state,
 		/* End of file (errcode = 0) */
 		return -1;
 	    }
+
+	    if (state->ystop && state->y >= state->ystop)
+		return ptr - buf; /* caller wants the lines */
 	}
 
     }
@@ -112,6 +112,7 @@ ImagingPaletteDuplicate(ImagingPalette palette)
 
     /* Don't share the cache */
     new_palette->cache = NULL;
+    new_palette->nearest = NULL;
 
     return new_palette;
 }
@@ -124,6 +125,8 @@ ImagingPaletteDelete(ImagingPalette palette)
     if (palette) {
 	if (palette->cache)
 	    free(palette->cache);
+	if (palette->nearest)
+	    free(palette->nearest);
 	free(palette);
     }
 }
@@ -304,6 +307,44 @@ ImagingPaletteCachePrepare(ImagingPalette palette)
 }
 
 
+static void
+cache_build(void* context, int start, int end)
+{
+    ImagingPalette palette = (ImagingPalette) context;
+    int i;
+
+    /* each box covers 8x8x8 cache slots, and the boxes don't overlap,
+       so they can be filled in parallel */
+    for (i = start; i < end; i++)
+	if (ImagingPaletteCache(palette, (i&7)<<5, ((i>>3)&7)<<5,
+				(i>>6)<<5) == 0x100)
+	    ImagingPaletteCacheUpdate(palette, (i&7)<<5, ((i>>3)&7)<<5,
+				      (i>>6)<<5);
+}
+
+int
+ImagingPaletteCacheBuild(ImagingPalette palette)
+{
+    /* Fill in the entire colour cache, so that it can be used
+       without checking for empty entries.  The cache stays with the
+       palette, so this is only done once for each palette. */
+
+    int i;
+
+    if (ImagingPaletteCachePrepare(palette) < 0)
+	return -1;
+
+    for (i = 0; i < 512; i++)
+	if (ImagingPaletteCache(palette, (i&7)<<5, ((i>>3)&7)<<5,
+				(i>>6)<<5) == 0x100) {
+	    ImagingParallelFor(512, 16, cache_build, palette);
+	    break;
+	}
+
+    return 0;
+}
+
+
 void
 ImagingPaletteCacheDelete(ImagingPalette palette)
 {
@@ -0,0 +1,194 @@
+/*
+ * The Python Imaging Library
+ * $Id$
+ *
+ * simple parallel-for support
+ *
+ * Operations that work on independent ranges of items (usually image
+ * rows) can use ImagingParallelFor to split the work over a number of
+ * worker threads.  The calling thread processes the last range itself,
+ * and waits for the others before returning.  The callback must not
+ * call into Python, since it's normally run inside a thread section.
+ * Simple per-pixel operations use ImagingParallelRows, which picks the
+ * number of rows per thread from the image size.
+ *
+ * The number of threads is a process-wide setting, which defaults to
+ * one (that is, everything runs in the calling thread).
+ *
+ * This file also tells the vectorized kernels which instruction set
+ * extensions the processor supports (ImagingCPUFeatures).
+ *
+ * See the README file for information on usage and redistribution.
+ */
+
+
+#include "Imaging.h"
+
+#ifdef WIN32
+#include <windows.h>
+#include <process.h>
+#else
+#include <pthread.h>
+#include <unistd.h>
+#endif
+
+
+#define	MAX_THREADS 64
+
+/* starting a thread costs about as much as processing this many bytes
+   of pixel data in a simple per-pixel loop */
+#define	MIN_BYTES 65536
+
+static int threads = 1;
+
+typedef struct {
+    ImagingParallelCallback func;
+    void* context;
+    int start, end;
+} ImagingParallelJob;
+
+#ifdef WIN32
+static unsigned __stdcall
+worker(void* arg)
+{
+    ImagingParallelJob* job = (ImagingParallelJob*) arg;
+    job->func(job->context, job->start, job->end);
+    return 0;
+}
+#else
+static void*
+worker(void* arg)
+{
+    ImagingParallelJob* job = (ImagingParallelJob*) arg;
+    job->func(job->context, job->start, job->end);
+    return NULL;
+}
+#endif
+
+int
+ImagingCPUFeatures(void)
+{
+    /* returns a combination of IMAGING_CPU flags.  this is only
+       checked on x86 platforms where the compiler can build the
+       kernels; elsewhere, it's always zero */
+    static int features = -1;
+    if (features < 0) {
+        features = 0;
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("ssse3"))
+            features |= IMAGING_CPU_SSSE3;
+        if (__builtin_cpu_supports("avx2"))
+            features |= IMAGING_CPU_AVX2;
+#endif
+    }
+    return features;
+}
+
+int
+ImagingParallelGetThreads(void)
+{
+    return threads;
+}
+
+int
+ImagingParallelSetThreads(int count)
+{
+    if (count <= 0) {
+        /* use one thread per processor */
+#ifdef WIN32
+        SYSTEM_INFO info;
+        GetSystemInfo(&info);
+        count = (int) info.dwNumberOfProcessors;
+#elif defined(_SC_NPROCESSORS_ONLN)
+        count = (int) sysconf(_SC_NPROCESSORS_ONLN);
+#else
+        count = 1;
+#endif
+    }
+
+    if (count < 1)
+        count = 1;
+    else if (count > MAX_THREADS)
+        count = MAX_THREADS;
+
+    threads = count;
+
+    return threads;
+}
+
+void
+ImagingParallelFor(int count, int granularity,
+                   ImagingParallelCallback func, void* context)
+{
+    ImagingParallelJob jobs[MAX_THREADS];
+#ifdef WIN32
+    HANDLE handles[MAX_THREADS];
+#else
+    pthread_t handles[MAX_THREADS];
+#endif
+    int started[MAX_THREADS];
+    int i, n, start;
+
+    if (count <= 0)
+        return;
+
+    /* don't hand out less than granularity items to each thread */
+    if (granularity < 1)
+        granularity = 1;
+    n = count / granularity;
+    if (n > threads)
+        n = threads;
+
+    if (n <= 1) {
+        func(context, 0, count);
+        return;
+    }
+
+    for (i = start = 0; i < n; i++) {
+        jobs[i].func = func;
+        jobs[i].context = context;
+        jobs[i].start = start;
+        start += count / n + (i < count % n);
+        jobs[i].end = start;
+    }
+
+    /* start workers for all but the last range.  if a thread cannot
+       be started, that range is processed by the calling thread */
+    for (i = 0; i < n - 1; i++) {
+#ifdef WIN32
+        handles[i] = (HANDLE) _beginthreadex(
+            NULL, 0, worker, &jobs[i], 0, NULL
+            );
+        started[i] = (handles[i] != 0);
+#else
+        started[i] = !pthread_create(&handles[i], NULL, worker, &jobs[i]);
+#endif
+        if (!started[i])
+            func(context, jobs[i].start, jobs[i].end);
+    }
+
+    func(context, jobs[n-1].start, jobs[n-1].end);
+
+    for (i = 0; i < n - 1; i++)
+        if (started[i]) {
+#ifdef WIN32
+            WaitForSingleObject(handles[i], INFINITE);
+            CloseHandle(handles[i]);
+#else
+            pthread_join(handles[i], NULL);
+#endif
+        }
+}
+
+void
+ImagingParallelRows(Imaging im, ImagingParallelCallback func, void* context)
+{
+    /* split the rows of an image over the worker threads.  each thread
+       gets at least MIN_BYTES of pixel data, so small images are still
+       processed by the calling thread alone */
+    int linesize = (im->linesize > 0) ? im->linesize : 1;
+    ImagingParallelFor(im->ysize, (MIN_BYTES + linesize - 1) / linesize,
+                       func, context);
+}
@@ -23,16 +23,22 @@
 #include "Imaging.h"
 
 typedef struct {
+    Imaging imOut;
+    Imaging imIn;
     const void* table;
+    double scale, offset;
 } im_point_context;
 
 static void
-im_point_8_8(Imaging imOut, Imaging imIn, im_point_context* context)
+im_point_8_8(void* context_, int y0, int y1)
 {
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
     int x, y;
     /* 8-bit source, 8-bit destination */
     UINT8* table = (UINT8*) context->table;
-    for (y = 0; y < imIn->ysize; y++) {
+    for (y = y0; y < y1; y++) {
         UINT8* in = imIn->image8[y];
         UINT8* out = imOut->image8[y];
         for (x = 0; x < imIn->xsize; x++)
@@ -41,12 +47,15 @@ im_point_8_8(Imaging imOut, Imaging imIn, im_point_context* context)
 }
 
 static void
-im_point_2x8_2x8(Imaging imOut, Imaging imIn, im_point_context* context)
+im_point_2x8_2x8(void* context_, int y0, int y1)
 {
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
     int x, y;
     /* 2x8-bit source, 2x8-bit destination */
     UINT8* table = (UINT8*) context->table;
-    for (y = 0; y < imIn->ysize; y++) {
+    for (y = y0; y < y1; y++) {
         UINT8* in = (UINT8*) imIn->image[y];
         UINT8* out = (UINT8*) imOut->image[y];
         for (x = 0; x < imIn->xsize; x++) {
@@ -58,12 +67,15 @@ im_point_2x8_2x8(Imaging imOut, Imaging imIn, im_point_context* context)
 }
 
 static void
-im_point_3x8_3x8(Imaging imOut, Imaging imIn, im_point_context* context)
+im_point_3x8_3x8(void* context_, int y0, int y1)
 {
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
     int x, y;
     /* 3x8-bit source, 3x8-bit destination */
     UINT8* table = (UINT8*) context->table;
-    for (y = 0; y < imIn->ysize; y++) {
+    for (y = y0; y < y1; y++) {
         UINT8* in = (UINT8*) imIn->image[y];
         UINT8* out = (UINT8*) imOut->image[y];
         for (x = 0; x < imIn->xsize; x++) {
@@ -76,12 +88,15 @@ im_point_3x8_3x8(Imaging imOut, Imaging imIn, im_point_context* context)
 }
 
 static void
-im_point_4x8_4x8(Imaging imOut, Imaging imIn, im_point_context* context)
+im_point_4x8_4x8(void* context_, int y0, int y1)
 {
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
     int x, y;
     /* 4x8-bit source, 4x8-bit destination */
     UINT8* table = (UINT8*) context->table;
-    for (y = 0; y < imIn->ysize; y++) {
+    for (y = y0; y < y1; y++) {
         UINT8* in = (UINT8*) imIn->image[y];
         UINT8* out = (UINT8*) imOut->image[y];
         for (x = 0; x < imIn->xsize; x++) {
@@ -95,12 +110,15 @@ im_point_4x8_4x8(Imaging imOut, Imaging imIn, im_point_context* context)
 }
 
 static void
-im_point_8_32(Imaging imOut, Imaging imIn, im_point_context* context)
+im_point_8_32(void* context_, int y0, int y1)
 {
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
     int x, y;
     /* 8-bit source, 32-bit destination */
     INT32* table = (INT32*) context->table;
-    for (y = 0; y < imIn->ysize; y++) {
+    for (y = y0; y < y1; y++) {
         UINT8* in = imIn->image8[y];
         INT32* out = imOut->image32[y];
         for (x = 0; x < imIn->xsize; x++)
@@ -109,12 +127,15 @@ im_point_8_32(Imaging imOut, Imaging imIn, im_point_context* context)
 }
 
 static void
-im_point_32_8(Imaging imOut, Imaging imIn, im_point_context* context)
+im_point_32_8(void* context_, int y0, int y1)
 {
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
     int x, y;
     /* 32-bit source, 8-bit destination */
     UINT8* table = (UINT8*) context->table;
-    for (y = 0; y < imIn->ysize; y++) {
+    for (y = y0; y < y1; y++) {
         INT32* in = imIn->image32[y];
         UINT8* out = imOut->image8[y];
         for (x = 0; x < imIn->xsize; x++) {
@@ -136,7 +157,7 @@ ImagingPoint(Imaging imIn, const char* mode, const void* table)
     ImagingSectionCookie cookie;
     Imaging imOut;
     im_point_context context;
-    void (*point)(Imaging imIn, Imaging imOut, im_point_context* context);
+    ImagingParallelCallback point;
 
     if (!imIn)
 	return (Imaging) ImagingError_ModeError();
@@ -184,8 +205,10 @@ ImagingPoint(Imaging imIn, const char* mode, const void* table)
 
     ImagingSectionEnter(&cookie);
 
+    context.imOut = imOut;
+    context.imIn = imIn;
     context.table = table;
-    point(imOut, imIn, &context);
+    ImagingParallelRows(imOut, point, &context);
 
     ImagingSectionLeave(&cookie);
 
@@ -198,6 +221,60 @@ ImagingPoint(Imaging imIn, const char* mode, const void* table)
 }
 
 
+
+static void
+im_point_transform_32(void* context_, int y0, int y1)
+{
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
+    double scale = context->scale;
+    double offset = context->offset;
+    int x, y;
+    for (y = y0; y < y1; y++) {
+        INT32* in  = imIn->image32[y];
+        INT32* out = imOut->image32[y];
+        /* FIXME: add clipping? */
+        for (x = 0; x < imIn->xsize; x++)
+            out[x] = in[x] * scale + offset;
+    }
+}
+
+static void
+im_point_transform_f(void* context_, int y0, int y1)
+{
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
+    double scale = context->scale;
+    double offset = context->offset;
+    int x, y;
+    for (y = y0; y < y1; y++) {
+        FLOAT32* in  = (FLOAT32*) imIn->image32[y];
+        FLOAT32* out = (FLOAT32*) imOut->image32[y];
+        for (x = 0; x < imIn->xsize; x++)
+            out[x] = in[x] * scale + offset;
+    }
+}
+
+static void
+im_point_transform_16(void* context_, int y0, int y1)
+{
+    im_point_context* context = context_;
+    Imaging imOut = context->imOut;
+    Imaging imIn = context->imIn;
+    double scale = context->scale;
+    double offset = context->offset;
+    int x, y;
+    for (y = y0; y < y1; y++) {
+        UINT16* in  = (UINT16 *)imIn->image[y];
+        UINT16* out = (UINT16 *)imOut->image[y];
+        /* FIXME: add clipping? */
+        for (x = 0; x < imIn->xsize; x++)
+            out[x] = in[x] * scale + offset;
+    }
+}
+
 Imaging
 ImagingPointTransform(Imaging imIn, double scale, double offset)
 {
@@ -205,7 +282,8 @@ ImagingPointTransform(Imaging imIn, double scale, double offset)
 
     ImagingSectionCookie cookie;
     Imaging imOut;
-    int x, y;
+    im_point_context context;
+    ImagingParallelCallback transform;
 
     if (!imIn || (strcmp(imIn->mode, "I") != 0 && 
                   strcmp(imIn->mode, "I;16") != 0 && 
@@ -220,37 +298,14 @@ ImagingPointTransform(Imaging imIn, double scale, double offset)
 
     switch (imIn->type) {
     case IMAGING_TYPE_INT32:
-        ImagingSectionEnter(&cookie);
-        for (y = 0; y < imIn->ysize; y++) {
-            INT32* in  = imIn->image32[y];
-            INT32* out = imOut->image32[y];
-            /* FIXME: add clipping? */
-            for (x = 0; x < imIn->xsize; x++)
-                out[x] = in[x] * scale + offset;
-        }
-        ImagingSectionLeave(&cookie);
+        transform = im_point_transform_32;
         break;
     case IMAGING_TYPE_FLOAT32:
-        ImagingSectionEnter(&cookie);
-        for (y = 0; y < imIn->ysize; y++) {
-            FLOAT32* in  = (FLOAT32*) imIn->image32[y];
-            FLOAT32* out = (FLOAT32*) imOut->image32[y];
-            for (x = 0; x < imIn->xsize; x++)
-                out[x] = in[x] * scale + offset;
-        }
-        ImagingSectionLeave(&cookie);
+        transform = im_point_transform_f;
         break;
     case IMAGING_TYPE_SPECIAL:
         if (strcmp(imIn->mode,"I;16") == 0) {
-            ImagingSectionEnter(&cookie);
-            for (y = 0; y < imIn->ysize; y++) {
-                UINT16* in  = (UINT16 *)imIn->image[y];
-                UINT16* out = (UINT16 *)imOut->image[y];
-                /* FIXME: add clipping? */
-                for (x = 0; x < imIn->xsize; x++)
-                    out[x] = in[x] * scale + offset;
-            }
-            ImagingSectionLeave(&cookie);
+            transform = im_point_transform_16;
             break;
 	}
         /* FALL THROUGH */
@@ -259,5 +314,14 @@ ImagingPointTransform(Imaging imIn, double scale, double offset)
         return (Imaging) ImagingError_ValueError("internal error");
     }
 
+    context.imOut = imOut;
+    context.imIn = imIn;
+    context.scale = scale;
+    context.offset = offset;
+
+    ImagingSectionEnter(&cookie);
+    ImagingParallelRows(imOut, transform, &context);
+    ImagingSectionLeave(&cookie);
+
     return imOut;
 }
@@ -34,25 +34,6 @@
 
 #define NO_OUTPUT
 
-typedef struct {
-    unsigned long scale;
-} PixelHashData;
-
-typedef struct _PixelList {
-    struct _PixelList *next[3],*prev[3];
-    Pixel p;
-    unsigned int flag:1;
-    int count;
-} PixelList;
-
-typedef struct _BoxNode {
-    struct _BoxNode *l,*r;
-    PixelList *head[3],*tail[3];
-    int axis;
-    int volume;
-    unsigned long pixelCount;
-} BoxNode;
-
 #define _SQR(x) ((x)*(x))
 #define _DISTSQR(p1,p2) \
     _SQR((int)((p1)->c.r)-(int)((p2)->c.r))+ \
@@ -66,16 +47,6 @@ typedef struct _BoxNode {
      ((unsigned int)(g)<< 8)*10069 ^ \
      ((unsigned int)(b)<<16)*64997)
 
-#define PIXEL_UNSCALE(p,q,s) \
-    ((q)->c.r=(p)->c.r<<(s)), \
-    ((q)->c.g=(p)->c.g<<(s)), \
-    ((q)->c.b=(p)->c.b<<(s))
-
-#define PIXEL_SCALE(p,q,s)\
-    ((q)->c.r=(p)->c.r>>(s)),              \
-    ((q)->c.g=(p)->c.g>>(s)),              \
-    ((q)->c.b=(p)->c.b>>(s))
-
 static unsigned long
 unshifted_pixel_hash(const HashTable h, const void *p)
 {
@@ -106,539 +77,425 @@ unshifted_pixel_cmp(const HashTable h, const void *a, const void *b)
     }
 }
 
-static unsigned long
-pixel_hash(const HashTable h,const void *p)
-{
-    PixelHashData *d=(PixelHashData *)hashtable_get_user_data(h);
-    Pixel *pixel=(Pixel *)&p;
-    unsigned long hash=PIXEL_HASH(pixel->c.r>>d->scale,
-                                  pixel->c.g>>d->scale,
-                                  pixel->c.b>>d->scale);
-    return hash;
-}
+/* %% */
 
-static int
-pixel_cmp(const HashTable h,const void *a,const void *b)
+/* The median cut works on a histogram of pixel classes; that is,
+   colours with the lowest scale bits dropped, where scale is the
+   smallest shift that leaves at most MAX_HASH_ENTRIES classes.  Each
+   class keeps its pixel count and the sum of the (unscaled) pixel
+   values, so the palette can be computed without another pass over
+   the image.  The histogram is an open addressing hash table, built
+   in parallel over ranges of the image and merged afterwards. */
+
+typedef struct {
+   UINT32 key;
+   unsigned long count;
+   unsigned long sum[3];
+   unsigned long box;
+} PixelClass;
+
+typedef struct {
+   int scale;
+   int bits;
+   int count,size;
+   int *slots;
+   PixelClass *classes;
+} PixelHistogram;
+
+#define CLASS_KEY(r,g,b,s) \
+   ((UINT32)((r)>>(s)) | \
+    ((UINT32)((g)>>(s))<<8) | \
+    ((UINT32)((b)>>(s))<<16))
+
+#define CLASS_VALUE(key,axis) \
+   (((key)>>((axis)*8))&255)
+
+#define CLASS_SLOT(key,bits) \
+   ((int)(((UINT32)(key)*2654435761U)>>(32-(bits))))
+
+#define HISTOGRAM_CHUNK 16384
+
+static UINT32
+rescale_key(UINT32 key,int shift)
 {
-    PixelHashData *d=(PixelHashData *)hashtable_get_user_data(h);
-    Pixel *pixel1=(Pixel *)&a;
-    Pixel *pixel2=(Pixel *)&b;
-    unsigned long A,B;
-    A=PIXEL_HASH(pixel1->c.r>>d->scale,
-                 pixel1->c.g>>d->scale,
-                 pixel1->c.b>>d->scale);
-    B=PIXEL_HASH(pixel2->c.r>>d->scale,
-                 pixel2->c.g>>d->scale,
-                 pixel2->c.b>>d->scale);
-    return (A==B)?0:((A<B)?-1:1);
+   return CLASS_KEY(CLASS_VALUE(key,0),
+                    CLASS_VALUE(key,1),
+                    CLASS_VALUE(key,2),
+                    shift);
 }
 
-static void
-exists_count_func(const HashTable h, const void *key, void **val)
+static int
+histogram_init(PixelHistogram *h)
 {
-    (*(int *)val)+=1;
+   h->scale=0;
+   h->bits=10;
+   h->count=0;
+   h->size=1<<(h->bits-1);
+   h->slots=calloc(1<<h->bits,sizeof(int));
+   h->classes=malloc(sizeof(PixelClass)*h->size);
+   return h->slots&&h->classes;
 }
 
 static void
-new_count_func(const HashTable h, const void *key, void **val)
+histogram_free(PixelHistogram *h)
 {
-    (*(int *)val)=1;
+   if (h->slots) free(h->slots);
+   if (h->classes) free(h->classes);
+   h->slots=NULL;
+   h->classes=NULL;
 }
 
-static void
-rehash_collide(HashTable h,
-               void **keyp,
-               void **valp,
-               void *newkey,
-               void *newval)
+static int
+histogram_find(PixelHistogram *h,UINT32 key)
 {
-   *valp=(void *)((*(int *)valp)+(*(int *)&newval));
+   /* returns the slot holding the given key, or the free slot
+      where it should go */
+   int mask=(1<<h->bits)-1;
+   int i=CLASS_SLOT(key,h->bits);
+   while (h->slots[i] && h->classes[h->slots[i]-1].key!=key) {
+      i=(i+1)&mask;
+   }
+   return i;
 }
 
-/* %% */
-
-static HashTable
-create_pixel_hash(Pixel *pixelData,unsigned long nPixels)
+static int
+histogram_resize(PixelHistogram *h,int bits)
 {
-   PixelHashData *d;
-   HashTable *hash;
-   unsigned long i;
-   unsigned long timer,timer2,timer3;
-
-   d=malloc(sizeof(PixelHashData));
-   if (!d) return NULL;
-   hash=hashtable_new(pixel_hash,pixel_cmp);
-   hashtable_set_user_data(hash,d);
-   d->scale=0;
-   timer=timer3=clock();
-   for (i=0;i<nPixels;i++) {
-      if (!hashtable_insert_or_update_computed(hash,
-                                              (void *)pixelData[i].v,
-                                              new_count_func,
-                                              exists_count_func)) {;
-      }
-      while (hashtable_get_count(hash)>MAX_HASH_ENTRIES) {
-         d->scale++;
-#ifndef NO_OUTPUT
-         printf ("rehashing - new scale: %d\n",(int)d->scale);
-#endif
-         timer2=clock();
-         hashtable_rehash_compute(hash,rehash_collide);
-         timer2=clock()-timer2;
-#ifndef NO_OUTPUT
-         printf ("rehash took %f sec\n",timer2/(double)CLOCKS_PER_SEC);
-#endif
-         timer+=timer2;
-      }
+   PixelClass *classes;
+   int i;
+   int *slots=calloc(1<<bits,sizeof(int));
+   if (!slots) return 0;
+   classes=realloc(h->classes,sizeof(PixelClass)*(1<<(bits-1)));
+   if (!classes) { free(slots); return 0; }
+   free(h->slots);
+   h->slots=slots;
+   h->classes=classes;
+   h->bits=bits;
+   h->size=1<<(bits-1);
+   for (i=0;i<h->count;i++) {
+      h->slots[histogram_find(h,classes[i].key)]=i+1;
    }
-#ifndef NO_OUTPUT
-   printf ("inserts took %f sec\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
-#endif
-#ifndef NO_OUTPUT
-   printf ("total        %f sec\n",(clock()-timer3)/(double)CLOCKS_PER_SEC);
-#endif
-   return hash;
+   return 1;
 }
 
-static void
-destroy_pixel_hash(HashTable hash)
+static PixelClass *
+histogram_insert(PixelHistogram *h,UINT32 key)
 {
-   PixelHashData *d=(PixelHashData *)hashtable_get_user_data(hash);
-   if (d) free(d);
-   hashtable_free(hash);
+   PixelClass *c;
+   int i=histogram_find(h,key);
+   if (h->slots[i]) {
+      return &h->classes[h->slots[i]-1];
+   }
+   if (h->count==h->size) {
+      if (!histogram_resize(h,h->bits+1)) return NULL;
+      i=histogram_find(h,key);
+   }
+   c=&h->classes[h->count++];
+   h->slots[i]=h->count;
+   c->key=key;
+   c->count=0;
+   c->sum[0]=c->sum[1]=c->sum[2]=0;
+   return c;
 }
 
-
-/* 1. hash quantized pixels.                                                  */
-/* 2. create R,G,B lists of sorted quantized pixels.                          */
-/* 3. median cut.                                                             */
-/* 4. build hash table from median cut boxes.                                 */
-/* 5. for each pixel, compute entry in hash table, and hence median cut box.  */
-/* 6. compute median cut box pixel averages.                                  */
-/* 7. map each pixel to nearest average.                                      */
-
-static int
-compute_box_volume(BoxNode *b)
+static PixelClass *
+histogram_lookup(PixelHistogram *h,UINT32 key)
 {
-   unsigned char rl,rh,gl,gh,bl,bh;
-   if (b->volume>=0) return b->volume;
-   if (!b->head[0]) {
-      b->volume=0;
-   } else {
-      rh=b->head[0]->p.c.r;
-      rl=b->tail[0]->p.c.r;
-      gh=b->head[1]->p.c.g;
-      gl=b->tail[1]->p.c.g;
-      bh=b->head[2]->p.c.b;
-      bl=b->tail[2]->p.c.b;
-      b->volume=(rh-rl+1)*(gh-gl+1)*(bh-bl+1);
-   }
-   return b->volume;
+   int i=histogram_find(h,key);
+   return h->slots[i]?&h->classes[h->slots[i]-1]:NULL;
 }
 
 static void
-hash_to_list(HashTable h, const void *key, const void *val, void *u)
+histogram_rescale(PixelHistogram *h,int scale)
 {
-   PixelHashData *d=(PixelHashData *)hashtable_get_user_data(h);
-   PixelList **pl=(PixelList **)u;
-   PixelList *p;
-   Pixel *pixel=(Pixel *)&key;
-   int i;
-   Pixel q;
-   int count=*(int *)&val;
-
-   PIXEL_SCALE(pixel,&q,d->scale);
-
-   p=malloc(sizeof(PixelList));
-   if (!p) return;
-   
-   p->flag=0;
-   p->p=q;
-   p->count=count;
-   for (i=0;i<3;i++) {
-      p->next[i]=pl[i];
-      p->prev[i]=NULL;
-      if (pl[i]) pl[i]->prev[i]=p;
-      pl[i]=p;
-   }
-}
-
-static PixelList *
-mergesort_pixels(PixelList *head, int i)
-{
-   PixelList *c,*t,*a,*b,*p;
-   if (!head||!head->next[i]) {
-      if (head) {
-         head->next[i]=NULL;
-         head->prev[i]=NULL;
-      }
-      return head;
-   }
-   for (c=t=head;c&&t;c=c->next[i],t=(t->next[i])?t->next[i]->next[i]:NULL);
-   if (c) {
-      if (c->prev[i]) c->prev[i]->next[i]=NULL;
-      c->prev[i]=NULL;
-   }
-   a=mergesort_pixels(head,i);
-   b=mergesort_pixels(c,i);
-   head=NULL;
-   p=NULL;
-   while (a&&b) {
-      if (a->p.a.v[i]>b->p.a.v[i]) {
-         c=a;
-         a=a->next[i];
+   /* merge classes in place; the number of classes can only
+      shrink, so the table never needs to grow here */
+   PixelClass *c,*d;
+   int i,j,n;
+   int shift=scale-h->scale;
+   memset(h->slots,0,sizeof(int)*(1<<h->bits));
+   n=h->count;
+   h->count=0;
+   h->scale=scale;
+   for (i=0;i<n;i++) {
+      c=&h->classes[i];
+      c->key=rescale_key(c->key,shift);
+      j=histogram_find(h,c->key);
+      if (h->slots[j]) {
+         d=&h->classes[h->slots[j]-1];
+         d->count+=c->count;
+         d->sum[0]+=c->sum[0];
+         d->sum[1]+=c->sum[1];
+         d->sum[2]+=c->sum[2];
       } else {
-         c=b;
-         b=b->next[i];
+         h->classes[h->count]=*c;
+         h->slots[j]=++h->count;
       }
-      c->prev[i]=p;
-      c->next[i]=NULL;
-      if (p) p->next[i]=c;
-      p=c;
-      if (!head) head=c;
-   }
-   if (a) {
-      c->next[i]=a;
-      a->prev[i]=c;
-   } else if (b) {
-      c->next[i]=b;
-      b->prev[i]=c;
-   }
-   return head;
+   }
 }
 
-#if defined(TEST_MERGESORT) || defined(TEST_SORTED)
 static int
-test_sorted(PixelList *pl[3])
+histogram_merge(PixelHistogram *h,PixelHistogram *other)
 {
-   int i,n,l;
-   PixelList *t;
-
-   for(i=0;i<3;i++) {
-      n=0;
-      l=256;
-      for (t=pl[i];t;t=t->next[i]) {
-         if (l<t->p.a.v[i]) return 0;
-         l=t->p.a.v[i];
+   PixelClass *c,*d;
+   int i;
+   if (other->scale>h->scale) {
+      histogram_rescale(h,other->scale);
+   }
+   for (i=0;i<other->count;i++) {
+      c=&other->classes[i];
+      d=histogram_insert(h,rescale_key(c->key,h->scale-other->scale));
+      if (!d) return 0;
+      d->count+=c->count;
+      d->sum[0]+=c->sum[0];
+      d->sum[1]+=c->sum[1];
+      d->sum[2]+=c->sum[2];
+      while (h->count>MAX_HASH_ENTRIES) {
+         histogram_rescale(h,h->scale+1);
       }
    }
    return 1;
 }
-#endif
 
-static int
-box_heap_cmp(const Heap h, const void *A, const void *B)
+struct histogram_context {
+   Pixel *pixelData;
+   unsigned long nPixels;
+   int chunks;
+   PixelHistogram *histograms;
+   int failed;
+};
+
+static void
+histogram_chunks(void *context,int start,int end)
 {
-   BoxNode *a=(BoxNode *)A;
-   BoxNode *b=(BoxNode *)B;
-   return (int)a->pixelCount-(int)b->pixelCount;
+   struct histogram_context *ctx=(struct histogram_context *)context;
+   PixelHistogram *h;
+   PixelClass *c;
+   Pixel *p,*last;
+   unsigned long i,first,stop;
+   int chunk;
+
+   for (chunk=start;chunk<end;chunk++) {
+      h=&ctx->histograms[chunk];
+      if (!histogram_init(h)) {
+         ctx->failed=1;
+         return;
+      }
+      first=(unsigned long)((double)ctx->nPixels*chunk/ctx->chunks);
+      stop=(unsigned long)((double)ctx->nPixels*(chunk+1)/ctx->chunks);
+      c=NULL;
+      last=NULL;
+      for (i=first;i<stop;i++) {
+         p=&ctx->pixelData[i];
+         /* runs of identical pixels are common */
+         if (!c||p->c.r!=last->c.r||p->c.g!=last->c.g||p->c.b!=last->c.b) {
+            c=histogram_insert(h,CLASS_KEY(p->c.r,p->c.g,p->c.b,h->scale));
+            if (!c) {
+               ctx->failed=1;
+               return;
+            }
+            last=p;
+         }
+         c->count++;
+         c->sum[0]+=p->c.r;
+         c->sum[1]+=p->c.g;
+         c->sum[2]+=p->c.b;
+         if (h->count>MAX_HASH_ENTRIES) {
+            while (h->count>MAX_HASH_ENTRIES) {
+               histogram_rescale(h,h->scale+1);
+            }
+            c=NULL;
+         }
+      }
+   }
 }
 
-#define LUMINANCE(p) (77*(p)->c.r+150*(p)->c.g+29*(p)->c.b)
-
 static int
-splitlists(PixelList *h[3],
-           PixelList *t[3],
-           PixelList *nh[2][3],
-           PixelList *nt[2][3],
-           unsigned long nCount[2],
-           int axis,
-           unsigned long pixelCount)
+create_pixel_histogram(Pixel *pixelData,
+                       unsigned long nPixels,
+                       PixelHistogram *h)
 {
-   unsigned long left;
+   /* the scale only grows when there are too many classes, and
+      merging histograms never adds classes to a given scale, so this
+      ends up with the same scale (and classes) as a sequential scan */
+   struct histogram_context ctx;
+   int i,ok;
 
-   PixelList *l,*r,*c,*n;
-   int i;
-   int nRight,nLeft;
-   int splitColourVal;
-
-#ifdef TEST_SPLIT
-   {
-      PixelList *_prevTest,*_nextTest;
-      int _i,_nextCount[3],_prevCount[3];
-      for (_i=0;_i<3;_i++) {
-         for (_nextCount[_i]=0,_nextTest=h[_i];_nextTest&&_nextTest->next[_i];_nextTest=_nextTest->next[_i],_nextCount[_i]++);
-         for (_prevCount[_i]=0,_prevTest=t[_i];_prevTest&&_prevTest->prev[_i];_prevTest=_prevTest->prev[_i],_prevCount[_i]++);
-         if (_nextTest!=t[_i]) {
-            printf ("next-list of axis %d does not end at tail\n",_i);
-            exit(1);
-         }
-         if (_prevTest!=h[_i]) {
-            printf ("prev-list of axis %d does not end at head\n",_i);
-            exit(1);
-         }
-         for (;_nextTest&&_nextTest->prev[_i];_nextTest=_nextTest->prev[_i]);
-         for (;_prevTest&&_prevTest->next[_i];_prevTest=_prevTest->next[_i]);
-         if (_nextTest!=h[_i]) {
-            printf ("next-list of axis %d does not loop back to head\n",_i);
-            exit(1);
-         }
-         if (_prevTest!=t[_i]) {
-            printf ("prev-list of axis %d does not loop back to tail\n",_i);
-            exit(1);
-         }
-      }
-      for (_i=1;_i<3;_i++) {
-         if (_prevCount[_i]!=_prevCount[_i-1] ||
-             _nextCount[_i]!=_nextCount[_i-1] ||
-             _prevCount[_i]!=_nextCount[_i]) {
-            printf ("{%d %d %d} {%d %d %d}\n",
-                    _prevCount[0],
-                    _prevCount[1],
-                    _prevCount[2],
-                    _nextCount[0],
-                    _nextCount[1],
-                    _nextCount[2]);
-            exit(1);
-         }
-      }
-    }
-#endif
-   nCount[0]=nCount[1]=0;
-   nLeft=nRight=0;
-   for (left=0,c=h[axis];c;) {
-      left=left+c->count;
-      nCount[0]+=c->count;
-      c->flag=0;
-      nLeft++;
-      c=c->next[axis];
-      if (left*2>pixelCount) {
-         break;
-      }
+   ctx.chunks=ImagingParallelGetThreads();
+   if ((unsigned long)ctx.chunks>nPixels/HISTOGRAM_CHUNK) {
+      ctx.chunks=(int)(nPixels/HISTOGRAM_CHUNK);
    }
-   if (c) {
-      splitColourVal=c->prev[axis]->p.a.v[axis];
-      for (;c;c=c->next[axis]) {
-         if (splitColourVal!=c->p.a.v[axis]) {
-            break;
-         }
-         c->flag=0;
-         nLeft++;
-         nCount[0]+=c->count;
-      }
+   if (ctx.chunks<1) {
+      ctx.chunks=1;
    }
-   for (;c;c=c->next[axis]) {
-      c->flag=1;
-      nRight++;
-      nCount[1]+=c->count;
+   ctx.histograms=calloc(ctx.chunks,sizeof(PixelHistogram));
+   if (!ctx.histograms) return 0;
+   ctx.pixelData=pixelData;
+   ctx.nPixels=nPixels;
+   ctx.failed=0;
+
+   ImagingParallelFor(ctx.chunks,1,histogram_chunks,&ctx);
+
+   ok=!ctx.failed;
+   for (i=1;ok&&i<ctx.chunks;i++) {
+      ok=histogram_merge(&ctx.histograms[0],&ctx.histograms[i]);
    }
-   if (!nRight) {
-      for (c=t[axis],splitColourVal=t[axis]->p.a.v[axis];c;c=c->prev[axis]) {
-         if (splitColourVal!=c->p.a.v[axis]) {
-            break;
-         }
-         c->flag=1;
-         nRight++;
-         nLeft--;
-         nCount[0]-=c->count;
-         nCount[1]+=c->count;
-      }
+   for (i=1;i<ctx.chunks;i++) {
+      histogram_free(&ctx.histograms[i]);
    }
-#ifndef NO_OUTPUT
-   if (!nLeft) {
-      for (c=h[axis];c;c=c->next[axis]) {
-         printf ("[%d %d %d]\n",c->p.c.r,c->p.c.g,c->p.c.b);
-      }
-      printf ("warning... trivial split\n");
+   if (ok) {
+      *h=ctx.histograms[0];
+   } else {
+      histogram_free(&ctx.histograms[0]);
    }
-#endif
+   free(ctx.histograms);
+   return ok;
+}
 
-   for (i=0;i<3;i++) {
-      l=r=NULL;
-      nh[0][i]=nt[0][i]=NULL;
-      nh[1][i]=nt[1][i]=NULL;
-      for (c=h[i];c;c=n) {
-         n=c->next[i];
-         if (c->flag) {    /* move pixel to right  list*/
-            if (r) r->next[i]=c; else nh[1][i]=c;
-            c->prev[i]=r;
-            r=c;
-         } else {          /* move pixel to left list */
-            if (l) l->next[i]=c; else nh[0][i]=c;
-            c->prev[i]=l;
-            l=c;
-         }
+
+/* 1. build histogram of quantized pixels.                                    */
+/* 2. median cut, partitioning an array of the histogram classes.             */
+/* 3. number the median cut boxes, and mark each class with its box.          */
+/* 4. compute median cut box pixel averages from the class sums.              */
+/* 5. map each pixel to nearest average, starting at its median cut box.      */
+
+typedef struct _BoxNode {
+   struct _BoxNode *l,*r;
+   unsigned long start,end;
+   unsigned char min[3],max[3];
+   int axis;
+   int volume;
+   unsigned long pixelCount;
+} BoxNode;
+
+static BoxNode *
+new_box(PixelClass *classes,
+        unsigned long *order,
+        unsigned long start,
+        unsigned long end,
+        unsigned long pixelCount)
+{
+   BoxNode *b;
+   unsigned long i;
+   int j,v;
+
+   b=malloc(sizeof(BoxNode));
+   if (!b) return NULL;
+   b->l=b->r=NULL;
+   b->start=start;
+   b->end=end;
+   b->axis=-1;
+   b->pixelCount=pixelCount;
+   for (j=0;j<3;j++) {
+      b->min[j]=255;
+      b->max[j]=0;
+   }
+   for (i=start;i<end;i++) {
+      for (j=0;j<3;j++) {
+         v=CLASS_VALUE(classes[order[i]].key,j);
+         if (v<b->min[j]) b->min[j]=v;
+         if (v>b->max[j]) b->max[j]=v;
       }
-      if (l) l->next[i]=NULL;
-      if (r) r->next[i]=NULL;
-      nt[0][i]=l;
-      nt[1][i]=r;
    }
-   return 1;
+   if (start==end) {
+      b->volume=0;
+   } else {
+      b->volume=(b->max[0]-b->min[0]+1)*
+                (b->max[1]-b->min[1]+1)*
+                (b->max[2]-b->min[2]+1);
+   }
+   return b;
+}
+
+static int
+box_heap_cmp(const Heap h, const void *A, const void *B)
+{
+   BoxNode *a=(BoxNode *)A;
+   BoxNode *b=(BoxNode *)B;
+   return (int)a->pixelCount-(int)b->pixelCount;
 }
 
 static int
-split(BoxNode *node)
+split(BoxNode *node,PixelClass *classes,unsigned long *order)
 {
-   unsigned char rl,rh,gl,gh,bl,bh;
    int f[3];
    int best,axis;
-   int i;
-   PixelList *heads[2][3];
-   PixelList *tails[2][3];
-   unsigned long newCounts[2];
-   BoxNode *left,*right;
-
-   rh=node->head[0]->p.c.r;
-   rl=node->tail[0]->p.c.r;
-   gh=node->head[1]->p.c.g;
-   gl=node->tail[1]->p.c.g;
-   bh=node->head[2]->p.c.b;
-   bl=node->tail[2]->p.c.b;
-#ifdef TEST_SPLIT
-   printf ("splitting node [%d %d %d] [%d %d %d] ",rl,gl,bl,rh,gh,bh);
-#endif
-   f[0]=(rh-rl)*77;
-   f[1]=(gh-gl)*150;
-   f[2]=(bh-bl)*29;
+   int i,v,split;
+   unsigned long count[256];
+   unsigned long left,j,k,t;
+
+   f[0]=(node->max[0]-node->min[0])*77;
+   f[1]=(node->max[1]-node->min[1])*150;
+   f[2]=(node->max[2]-node->min[2])*29;
 
    best=f[0];
    axis=0;
    for (i=1;i<3;i++) {
       if (best<f[i]) { best=f[i]; axis=i; }
    }
-#ifdef TEST_SPLIT
-   printf ("along axis %d\n",axis+1);
-#endif
-   
-#ifdef TEST_SPLIT
-   {
-      PixelList *_prevTest,*_nextTest;
-      int _i,_nextCount[3],_prevCount[3];
-      for (_i=0;_i<3;_i++) {
-         if (node->tail[_i]->next[_i]) {
-            printf ("tail is not tail\n");
-            printf ("node->tail[%d]->next[%d]=%p\n",_i,_i,node->tail[_i]->next[_i]);
-         }
-         if (node->head[_i]->prev[_i]) {
-            printf ("head is not head\n");
-            printf ("node->head[%d]->prev[%d]=%p\n",_i,_i,node->head[_i]->prev[_i]);
-         }
-      }
+   node->axis=axis;
 
-      for (_i=0;_i<3;_i++) {
-         for (_nextCount[_i]=0,_nextTest=node->head[_i];_nextTest&&_nextTest->next[_i];_nextTest=_nextTest->next[_i],_nextCount[_i]++);
-         for (_prevCount[_i]=0,_prevTest=node->tail[_i];_prevTest&&_prevTest->prev[_i];_prevTest=_prevTest->prev[_i],_prevCount[_i]++);
-         if (_nextTest!=node->tail[_i]) {
-            printf ("next-list of axis %d does not end at tail\n",_i);
-         }
-         if (_prevTest!=node->head[_i]) {
-            printf ("prev-list of axis %d does not end at head\n",_i);
-         }
-         for (;_nextTest&&_nextTest->prev[_i];_nextTest=_nextTest->prev[_i]);
-         for (;_prevTest&&_prevTest->next[_i];_prevTest=_prevTest->next[_i]);
-         if (_nextTest!=node->head[_i]) {
-            printf ("next-list of axis %d does not loop back to head\n",_i);
-         }
-         if (_prevTest!=node->tail[_i]) {
-            printf ("prev-list of axis %d does not loop back to tail\n",_i);
-         }
-      }
-      for (_i=1;_i<3;_i++) {
-         if (_prevCount[_i]!=_prevCount[_i-1] ||
-             _nextCount[_i]!=_nextCount[_i-1] ||
-             _prevCount[_i]!=_nextCount[_i]) {
-            printf ("{%d %d %d} {%d %d %d}\n",
-                    _prevCount[0],
-                    _prevCount[1],
-                    _prevCount[2],
-                    _nextCount[0],
-                    _nextCount[1],
-                    _nextCount[2]);
-         }
+   /* the left box gets the largest values along the axis, up to and
+      including the value where the running pixel count passes half
+      of the box.  if that leaves nothing for the right box, the
+      smallest value goes there instead */
+   memset(count,0,sizeof(count));
+   for (j=node->start;j<node->end;j++) {
+      count[CLASS_VALUE(classes[order[j]].key,axis)]+=
+         classes[order[j]].count;
+   }
+   left=0;
+   for (split=255;split>0;split--) {
+      left+=count[split];
+      if (left*2>node->pixelCount) break;
+   }
+   if (split<=node->min[axis]) {
+      split=node->min[axis]+1;
+      left=node->pixelCount-count[node->min[axis]];
+   }
+
+   /* partition the class array */
+   for (j=node->start,k=node->end;j<k;) {
+      v=CLASS_VALUE(classes[order[j]].key,axis);
+      if (v>=split) {
+         j++;
+      } else {
+         k--;
+         t=order[j]; order[j]=order[k]; order[k]=t;
       }
-    }
-#endif
-   node->axis=axis;
-   if (!splitlists(node->head,
-                   node->tail,
-                   heads,
-                   tails,
-                   newCounts,
-                   axis,
-                   node->pixelCount)) {
-#ifndef NO_OUTPUT
-      printf ("list split failed.\n");
-#endif
-      return 0;
-   }
-#ifdef TEST_SPLIT
-   if (!test_sorted(heads[0])) {
-      printf ("bug in split");
-      exit(1);
-   }
-   if (!test_sorted(heads[1])) {
-      printf ("bug in split");
-      exit(1);
    }
-#endif
-   left=malloc(sizeof(BoxNode));
-   right=malloc(sizeof(BoxNode));
-   if (!left||!right) {
+
+   node->l=new_box(classes,order,node->start,j,left);
+   node->r=new_box(classes,order,j,node->end,node->pixelCount-left);
+   if (!node->l||!node->r) {
       return 0;
    }
-   for(i=0;i<3;i++) {
-      left->head[i]=heads[0][i];
-      left->tail[i]=tails[0][i];
-      right->head[i]=heads[1][i];
-      right->tail[i]=tails[1][i];
-      node->head[i]=NULL;
-      node->tail[i]=NULL;
-   }
-#ifdef TEST_SPLIT
-   if (left->head[0]) {
-      rh=left->head[0]->p.c.r;
-      rl=left->tail[0]->p.c.r;
-      gh=left->head[1]->p.c.g;
-      gl=left->tail[1]->p.c.g;
-      bh=left->head[2]->p.c.b;
-      bl=left->tail[2]->p.c.b;
-      printf ("   left node  [%3d %3d %3d] [%3d %3d %3d]\n",rl,gl,bl,rh,gh,bh);
-   }
-   if (right->head[0]) {
-      rh=right->head[0]->p.c.r;
-      rl=right->tail[0]->p.c.r;
-      gh=right->head[1]->p.c.g;
-      gl=right->tail[1]->p.c.g;
-      bh=right->head[2]->p.c.b;
-      bl=right->tail[2]->p.c.b;
-      printf ("   right node [%3d %3d %3d] [%3d %3d %3d]\n",rl,gl,bl,rh,gh,bh);
-   }
-#endif
-   left->l=left->r=NULL;
-   right->l=right->r=NULL;
-   left->axis=right->axis=-1;
-   left->volume=right->volume=-1;
-   left->pixelCount=newCounts[0];
-   right->pixelCount=newCounts[1];
-   node->l=left;
-   node->r=right;
    return 1;
 }
 
+static void
+free_box_tree(BoxNode *n)
+{
+   if (n->l) free_box_tree(n->l);
+   if (n->r) free_box_tree(n->r);
+   free(n);
+}
+
 static BoxNode *
-median_cut(PixelList *hl[3],
+median_cut(PixelClass *classes,
+           unsigned long *order,
+           unsigned long nClasses,
            unsigned long imPixelCount,
            int nPixels)
 {
-   PixelList *tl[3];
-   int i;
    BoxNode *root;
    Heap h;
    BoxNode *thisNode;
 
    h=ImagingQuantHeapNew(box_heap_cmp);
-   root=malloc(sizeof(BoxNode));
+   if (!h) return NULL;
+   root=new_box(classes,order,0,nClasses,imPixelCount);
    if (!root) { ImagingQuantHeapFree(h); return NULL; }
-   for(i=0;i<3;i++) {
-      for (tl[i]=hl[i];tl[i]&&tl[i]->next[i];tl[i]=tl[i]->next[i]);
-      root->head[i]=hl[i];
-      root->tail[i]=tl[i];
-   }
-   root->l=root->r=NULL;
-   root->axis=-1;
-   root->volume=-1;
-   root->pixelCount=imPixelCount;
 
    ImagingQuantHeapAdd(h,(void *)root);
    while (--nPixels) {
@@ -646,12 +503,14 @@ median_cut(PixelList *hl[3],
          if (!ImagingQuantHeapRemove(h,(void **)&thisNode)) {
             goto done;
          }
-      } while (compute_box_volume(thisNode)==1);
-      if (!split(thisNode)) {
+      } while (thisNode->volume==1);
+      if (!split(thisNode,classes,order)) {
 #ifndef NO_OUTPUT
          printf ("Oops, split failed...\n");
 #endif
-         exit (1);
+         ImagingQuantHeapFree(h);
+         free_box_tree(root);
+         return NULL;
       }
       ImagingQuantHeapAdd(h,(void *)(thisNode->l));
       ImagingQuantHeapAdd(h,(void *)(thisNode->r));
@@ -662,69 +521,58 @@ done:
 }
 
 static void
-free_box_tree(BoxNode *n)
-{
-   PixelList *p,*pp;
-   if (n->l) free_box_tree(n->l);
-   if (n->r) free_box_tree(n->r);
-   for (p=n->head[0];p;p=pp) {
-      pp=p->next[0];
-      free(p);
-   }
-   free(n);
-}
-
-#ifdef TEST_SPLIT_INTEGRITY
-static int
-checkContained(BoxNode *n,Pixel *pp)
+annotate_classes(BoxNode *n,
+                 PixelClass *classes,
+                 unsigned long *order,
+                 unsigned long *box)
 {
+   unsigned long i;
    if (n->l&&n->r) {
-      return checkContained(n->l,pp)+checkContained(n->r,pp);
+      annotate_classes(n->l,classes,order,box);
+      annotate_classes(n->r,classes,order,box);
+      return;
    }
-   if (n->l||n->r) {
-#ifndef NO_OUTPUT
-      printf ("box tree is dead\n");
-#endif
-      return 0;
+   for (i=n->start;i<n->end;i++) {
+      classes[order[i]].box=*box;
    }
-   if (
-       pp->c.r<=n->head[0]->p.c.r &&
-       pp->c.r>=n->tail[0]->p.c.r &&
-       pp->c.g<=n->head[1]->p.c.g &&
-       pp->c.g>=n->tail[1]->p.c.g &&
-       pp->c.b<=n->head[2]->p.c.b &&
-       pp->c.b>=n->tail[2]->p.c.b) {
-      return 1;
-   }
-   return 0;
+   if (n->start<n->end) (*box)++;
 }
-#endif
 
 static int
-annotate_hash_table(BoxNode *n,HashTable h,unsigned long *box)
+compute_palette_from_median_cut(
+    PixelHistogram *h,
+    Pixel **palette,
+    unsigned long nPaletteEntries)
 {
-   PixelList *p;
-   PixelHashData *d=(PixelHashData *)hashtable_get_user_data(h);
-   Pixel q;
-   if (n->l&&n->r) {
-      return annotate_hash_table(n->l,h,box) && annotate_hash_table(n->r,h,box);
+   unsigned long i;
+   PixelClass *c;
+   Pixel *p;
+   unsigned long *avg;
+
+   *palette=NULL;
+   avg=calloc(nPaletteEntries*4,sizeof(unsigned long));
+   if (!avg) {
+      return 0;
    }
-   if (n->l||n->r) {
-#ifndef NO_OUTPUT
-      printf ("box tree is dead\n");
-#endif
+   for (i=0;i<(unsigned long)h->count;i++) {
+      c=&h->classes[i];
+      avg[c->box*4+0]+=c->sum[0];
+      avg[c->box*4+1]+=c->sum[1];
+      avg[c->box*4+2]+=c->sum[2];
+      avg[c->box*4+3]+=c->count;
+   }
+   p=malloc(sizeof(Pixel)*nPaletteEntries);
+   if (!p) {
+      free(avg);
       return 0;
    }
-   for (p=n->head[0];p;p=p->next[0]) {
-      PIXEL_UNSCALE(&(p->p),&q,d->scale);
-      if (!hashtable_insert(h,(void *)q.v,(void *)*box)) {
-#ifndef NO_OUTPUT
-         printf ("hashtable insert failed\n");
-#endif
-         return 0;
-      }
+   for (i=0;i<nPaletteEntries;i++) {
+      p[i].c.r=(int)(.5+(double)avg[i*4+0]/(double)avg[i*4+3]);
+      p[i].c.g=(int)(.5+(double)avg[i*4+1]/(double)avg[i*4+3]);
+      p[i].c.b=(int)(.5+(double)avg[i*4+2]/(double)avg[i*4+3]);
    }
-   if (n->head[0]) (*box)++;
+   *palette=p;
+   free(avg);
    return 1;
 }
 
@@ -793,247 +641,222 @@ build_distance_tables(unsigned long *avgDist,
    return 1;
 }
 
-static int
-map_image_pixels(Pixel *pixelData,
-                 unsigned long nPixels,
-                 Pixel *paletteData,
-                 unsigned long nPaletteEntries,
-                 unsigned long *avgDist,
-                 unsigned long **avgDistSortKey,
-                 unsigned long *pixelArray)
-{
-   unsigned long *aD,**aDSK;
-   unsigned long idx;
-   unsigned long i,j;
-   unsigned long bestdist,bestmatch,dist;
-   unsigned long initialdist;
-   HashTable h2;
+/* nearest colour tables for a fixed palette (see ImagingQuantizePalette) */
 
-   h2=hashtable_new(unshifted_pixel_hash,unshifted_pixel_cmp);
-   for (i=0;i<nPixels;i++) {
-      if (!hashtable_lookup(h2,(void *)pixelData[i].v,(void **)&bestmatch)) {
-         bestmatch=0;
-         initialdist=_DISTSQR(paletteData+bestmatch,pixelData+i);
-         bestdist=initialdist;
-         initialdist<<=2;
-         aDSK=avgDistSortKey+bestmatch*nPaletteEntries;
-         aD=avgDist+bestmatch*nPaletteEntries;
-         for (j=0;j<nPaletteEntries;j++) {
-            idx=aDSK[j]-aD;
-            if (*(aDSK[j])<=initialdist)  {
-               dist=_DISTSQR(paletteData+idx,pixelData+i);
-               if (dist<bestdist) {
-                  bestdist=dist;
-                  bestmatch=idx;
-               }
-            } else {
-               break;
-            }
-         }
-         hashtable_insert(h2,(void *)pixelData[i].v,(void *)bestmatch);
-      }
-      pixelArray[i]=bestmatch;
-   }
-   hashtable_free(h2);
-   return 1;
-}
+struct ImagingPaletteNearest {
+   unsigned long nEntries;
+   Pixel entries[256];    /* distinct palette colours */
+   UINT8 index[256];      /* palette index for each colour */
+   UINT8 entry[256];      /* colour for each palette index */
+   unsigned long *avgDist;
+   unsigned long **avgDistSortKey;
+};
 
-static int
-map_image_pixels_from_quantized_pixels(
-    Pixel *pixelData,
-    unsigned long nPixels,
-    Pixel *paletteData,
-    unsigned long nPaletteEntries,
-    unsigned long *avgDist,
-    unsigned long **avgDistSortKey,
-    unsigned long *pixelArray,
-    unsigned long *avg[3],
-    unsigned long *count)
+static unsigned long
+nearest_entry(Pixel *pixel,
+              unsigned long start,
+              Pixel *paletteData,
+              unsigned long nPaletteEntries,
+              unsigned long *avgDist,
+              unsigned long **avgDistSortKey)
 {
    unsigned long *aD,**aDSK;
    unsigned long idx;
-   unsigned long i,j;
+   unsigned long j;
    unsigned long bestdist,bestmatch,dist;
    unsigned long initialdist;
-   HashTable h2;
-   int changes=0;
 
-   h2=hashtable_new(unshifted_pixel_hash,unshifted_pixel_cmp);
-   for (i=0;i<nPixels;i++) {
-      if (!hashtable_lookup(h2,(void *)pixelData[i].v,(void **)&bestmatch)) {
-         bestmatch=pixelArray[i];
-         initialdist=_DISTSQR(paletteData+bestmatch,pixelData+i);
-         bestdist=initialdist;
-         initialdist<<=2;
-         aDSK=avgDistSortKey+bestmatch*nPaletteEntries;
-         aD=avgDist+bestmatch*nPaletteEntries;
-         for (j=0;j<nPaletteEntries;j++) {
-            idx=aDSK[j]-aD;
-            if (*(aDSK[j])<=initialdist)  {
-               dist=_DISTSQR(paletteData+idx,pixelData+i);
-               if (dist<bestdist) {
-                  bestdist=dist;
-                  bestmatch=idx;
-               }
-            } else {
-               break;
-            }
+   initialdist=_DISTSQR(paletteData+start,pixel);
+   bestdist=initialdist;
+   bestmatch=start;
+   initialdist<<=2;
+   aDSK=avgDistSortKey+start*nPaletteEntries;
+   aD=avgDist+start*nPaletteEntries;
+   for (j=0;j<nPaletteEntries;j++) {
+      idx=aDSK[j]-aD;
+      if (*(aDSK[j])<=initialdist)  {
+         dist=_DISTSQR(paletteData+idx,pixel);
+         if (dist<bestdist) {
+            bestdist=dist;
+            bestmatch=idx;
          }
-         hashtable_insert(h2,(void *)pixelData[i].v,(void *)bestmatch);
-      }
-      if (pixelArray[i]!=bestmatch) {
-         changes++;
-         avg[0][bestmatch]+=pixelData[i].c.r;
-         avg[1][bestmatch]+=pixelData[i].c.g;
-         avg[2][bestmatch]+=pixelData[i].c.b;
-         avg[0][pixelArray[i]]-=pixelData[i].c.r;
-         avg[1][pixelArray[i]]-=pixelData[i].c.g;
-         avg[2][pixelArray[i]]-=pixelData[i].c.b;
-         count[bestmatch]++;
-         count[pixelArray[i]]--;
-         pixelArray[i]=bestmatch;
+      } else {
+         break;
       }
    }
-   hashtable_free(h2);
-   return changes;
+   return bestmatch;
 }
 
-static int
-map_image_pixels_from_median_box(
-    Pixel *pixelData,
-    unsigned long nPixels,
-    Pixel *paletteData,
-    unsigned long nPaletteEntries,
-    HashTable *medianBoxHash,
-    unsigned long *avgDist,
-    unsigned long **avgDistSortKey,
-    unsigned long *pixelArray)
-{
-   unsigned long *aD,**aDSK;
-   unsigned long idx;
-   unsigned long i,j;
-   unsigned long bestdist,bestmatch,dist;
-   unsigned long initialdist;
-   HashTable h2;
-   int pixelVal;
+/* The result for a given colour only depends on the colour itself, so
+   the image can be mapped in parallel.  Each worker remembers recent
+   results in a small direct mapped cache. */
 
-   h2=hashtable_new(unshifted_pixel_hash,unshifted_pixel_cmp);
-   for (i=0;i<nPixels;i++) {
-      if (hashtable_lookup(h2,(void *)pixelData[i].v,(void **)&pixelVal)) {
-         pixelArray[i]=pixelVal;
+#define MAP_CACHE_BITS 16
+#define MAP_CACHE_MIN_BITS 8
+
+struct map_context {
+   Pixel *pixelData;
+   Pixel *paletteData;
+   unsigned long nPaletteEntries;
+   PixelHistogram *medianBoxes;
+   ImagingPalette guess;
+   unsigned long *avgDist;
+   unsigned long **avgDistSortKey;
+   unsigned long *pixelArray;
+   int failed;
+};
+
+static void
+map_pixels(void *context,int start,int end)
+{
+   struct map_context *ctx=(struct map_context *)context;
+   Pixel *p;
+   PixelClass *c;
+   UINT32 *cache;
+   UINT8 *cached;
+   UINT32 key;
+   unsigned long bestmatch;
+   int i,slot;
+   int scale=ctx->medianBoxes?ctx->medianBoxes->scale:0;
+   int bits=MAP_CACHE_MIN_BITS;
+
+   /* no point in a cache larger than the number of pixels */
+   while (bits<MAP_CACHE_BITS && (1<<bits)<end-start) {
+      bits++;
+   }
+
+   /* colours are 24-bit, so all ones marks an unused entry */
+   cache=malloc((sizeof(UINT32)+1)<<bits);
+   if (!cache) {
+      ctx->failed=1;
+      return;
+   }
+   memset(cache,255,sizeof(UINT32)<<bits);
+   cached=(UINT8 *)(cache+(1<<bits));
+   for (i=start;i<end;i++) {
+      p=&ctx->pixelData[i];
+      key=CLASS_KEY(p->c.r,p->c.g,p->c.b,0);
+      slot=CLASS_SLOT(key,bits);
+      if (cache[slot]==key) {
+         ctx->pixelArray[i]=cached[slot];
          continue;
       }
-      if (!hashtable_lookup(medianBoxHash,(void *)pixelData[i].v,(void **)&pixelVal)) {
+      bestmatch=0;
+      if (ctx->medianBoxes) {
+         c=histogram_lookup(ctx->medianBoxes,
+                            CLASS_KEY(p->c.r,p->c.g,p->c.b,scale));
+         if (!c) {
 #ifndef NO_OUTPUT
-         printf ("pixel lookup failed\n");
+            printf ("pixel lookup failed\n");
 #endif
-         return 0;
-      }
-      initialdist=_DISTSQR(paletteData+pixelVal,pixelData+i);
-      bestdist=initialdist;
-      bestmatch=pixelVal;
-      initialdist<<=2;
-      aDSK=avgDistSortKey+pixelVal*nPaletteEntries;
-      aD=avgDist+pixelVal*nPaletteEntries;
-      for (j=0;j<nPaletteEntries;j++) {
-         idx=aDSK[j]-aD;
-         if (*(aDSK[j])<=initialdist)  {
-            dist=_DISTSQR(paletteData+idx,pixelData+i);
-            if (dist<bestdist) {
-               bestdist=dist;
-               bestmatch=idx;
-            }
-         } else {
+            ctx->failed=1;
             break;
          }
+         bestmatch=c->box;
+      } else if (ctx->guess) {
+         bestmatch=ctx->guess->nearest->entry[
+            ImagingPaletteCache(ctx->guess,p->c.r,p->c.g,p->c.b)];
       }
-      pixelArray[i]=bestmatch;
-      hashtable_insert(h2,(void *)pixelData[i].v,(void *)bestmatch);
-   }
-   hashtable_free(h2);
-   return 1;
+      bestmatch=nearest_entry(p,
+                              bestmatch,
+                              ctx->paletteData,
+                              ctx->nPaletteEntries,
+                              ctx->avgDist,
+                              ctx->avgDistSortKey);
+      ctx->pixelArray[i]=bestmatch;
+      cache[slot]=key;
+      cached[slot]=(UINT8)bestmatch;
+   }
+   free(cache);
 }
 
 static int
-compute_palette_from_median_cut(
+map_image_pixels(Pixel *pixelData,
+                 unsigned long nPixels,
+                 Pixel *paletteData,
+                 unsigned long nPaletteEntries,
+                 PixelHistogram *medianBoxes,
+                 ImagingPalette guess,
+                 unsigned long *avgDist,
+                 unsigned long **avgDistSortKey,
+                 unsigned long *pixelArray)
+{
+   /* if medianBoxes is given, the search for each pixel starts at the
+      median cut box it belongs to.  if guess is given, it starts at
+      the entry given by the palette's colour cache.  otherwise, it
+      starts at the first entry */
+   struct map_context ctx;
+   ctx.pixelData=pixelData;
+   ctx.paletteData=paletteData;
+   ctx.nPaletteEntries=nPaletteEntries;
+   ctx.medianBoxes=medianBoxes;
+   ctx.guess=guess;
+   ctx.avgDist=avgDist;
+   ctx.avgDistSortKey=avgDistSortKey;
+   ctx.pixelArray=pixelArray;
+   ctx.failed=0;
+   ImagingParallelFor((int)nPixels,65536,map_pixels,&ctx);
+   return !ctx.failed;
+}
+
+static int
+map_image_pixels_from_quantized_pixels(
     Pixel *pixelData,
     unsigned long nPixels,
-    HashTable medianBoxHash,
-    Pixel **palette,
-    unsigned long nPaletteEntries)
-{
-   unsigned long i;
-   unsigned long paletteEntry;
-   Pixel *p;
-   unsigned long *avg[3];
-   unsigned long *count;
-   
-   *palette=NULL;
-   if (!(count=malloc(sizeof(unsigned long)*nPaletteEntries))) {
-      return 0;
-   }
-   memset(count,0,sizeof(unsigned long)*nPaletteEntries);
-   for(i=0;i<3;i++) {
-      avg[i]=NULL;
-   }
-   for(i=0;i<3;i++) {
-      if (!(avg[i]=malloc(sizeof(unsigned long)*nPaletteEntries))) {
-         for(i=0;i<3;i++) {
-            if (avg[i]) free (avg[i]);
-         }
-         free(count);
-         return 0;
-      }
-   }
-   for(i=0;i<3;i++) {
-      memset(avg[i],0,sizeof(unsigned long)*nPaletteEntries);
-   }
+    Pixel *paletteData,
+    unsigned long nPaletteEntries,
+    unsigned long *avgDist,
+    unsigned long **avgDistSortKey,
+    unsigned long *pixelArray,
+    unsigned long *avg[3],
+    unsigned long *count)
+{
+   unsigned long *aD,**aDSK;
+   unsigned long idx;
+   unsigned long i,j;
+   unsigned long bestdist,bestmatch,dist;
+   unsigned long initialdist;
+   HashTable h2;
+   int changes=0;
+
+   h2=hashtable_new(unshifted_pixel_hash,unshifted_pixel_cmp);
    for (i=0;i<nPixels;i++) {
-#ifdef TEST_SPLIT_INTEGRITY
-      if (!(i%100)) { printf ("%05d\r",i); fflush(stdout); }
-      if (checkContained(root,pixelData+i)>1) {
-         printf ("pixel in two boxes\n");
-         for(i=0;i<3;i++) free (avg[i]);
-         free(count);
-         return 0;
-      }
-#endif
-      if (!hashtable_lookup(medianBoxHash,(void *)pixelData[i].v,(void **)&paletteEntry)) {
-#ifndef NO_OUTPUT
-         printf ("pixel lookup failed\n");
-#endif
-         for(i=0;i<3;i++) free (avg[i]);
-         free(count);
-         return 0;
+      if (!hashtable_lookup(h2,(void *)pixelData[i].v,(void **)&bestmatch)) {
+         bestmatch=pixelArray[i];
+         initialdist=_DISTSQR(paletteData+bestmatch,pixelData+i);
+         bestdist=initialdist;
+         initialdist<<=2;
+         aDSK=avgDistSortKey+bestmatch*nPaletteEntries;
+         aD=avgDist+bestmatch*nPaletteEntries;
+         for (j=0;j<nPaletteEntries;j++) {
+            idx=aDSK[j]-aD;
+            if (*(aDSK[j])<=initialdist)  {
+               dist=_DISTSQR(paletteData+idx,pixelData+i);
+               if (dist<bestdist) {
+                  bestdist=dist;
+                  bestmatch=idx;
+               }
+            } else {
+               break;
+            }
+         }
+         hashtable_insert(h2,(void *)pixelData[i].v,(void *)bestmatch);
       }
-      if (paletteEntry>=nPaletteEntries) {
-#ifndef NO_OUTPUT
-         printf ("panic - paletteEntry>=nPaletteEntries (%d>=%d)\n",(int)paletteEntry,(int)nPaletteEntries);
-#endif
-         for(i=0;i<3;i++) free (avg[i]);
-         free(count);
-         return 0;
+      if (pixelArray[i]!=bestmatch) {
+         changes++;
+         avg[0][bestmatch]+=pixelData[i].c.r;
+         avg[1][bestmatch]+=pixelData[i].c.g;
+         avg[2][bestmatch]+=pixelData[i].c.b;
+         avg[0][pixelArray[i]]-=pixelData[i].c.r;
+         avg[1][pixelArray[i]]-=pixelData[i].c.g;
+         avg[2][pixelArray[i]]-=pixelData[i].c.b;
+         count[bestmatch]++;
+         count[pixelArray[i]]--;
+         pixelArray[i]=bestmatch;
       }
-      avg[0][paletteEntry]+=pixelData[i].c.r;
-      avg[1][paletteEntry]+=pixelData[i].c.g;
-      avg[2][paletteEntry]+=pixelData[i].c.b;
-      count[paletteEntry]++;
-   }
-   p=malloc(sizeof(Pixel)*nPaletteEntries);
-   if (!p) {
-      for(i=0;i<3;i++) free (avg[i]);
-      free(count);
-      return 0;
-   }
-   for (i=0;i<nPaletteEntries;i++) {
-      p[i].c.r=(int)(.5+(double)avg[0][i]/(double)count[i]);
-      p[i].c.g=(int)(.5+(double)avg[1][i]/(double)count[i]);
-      p[i].c.b=(int)(.5+(double)avg[2][i]/(double)count[i]);
    }
-   *palette=p;
-   for(i=0;i<3;i++) free (avg[i]);
-   free(count);
-   return 1;
+   hashtable_free(h2);
+   return changes;
 }
 
 static int
@@ -1046,6 +869,8 @@ recompute_palette_from_averages(
     unsigned long i;
 
     for (i=0;i<nPaletteEntries;i++) {
+        /* leave entries that lost all their pixels alone */
+        if (!count[i]) continue;
         palette[i].c.r=(int)(.5+(double)avg[0][i]/(double)count[i]);
         palette[i].c.g=(int)(.5+(double)avg[1][i]/(double)count[i]);
         palette[i].c.b=(int)(.5+(double)avg[2][i]/(double)count[i]);
@@ -1081,12 +906,7 @@ compute_palette_from_quantized_pixels(
       avg[2][qp[i]]+=pixelData[i].c.b;
       count[qp[i]]++;
    }
-   for (i=0;i<nPaletteEntries;i++) {
-      palette[i].c.r=(int)(.5+(double)avg[0][i]/(double)count[i]);
-      palette[i].c.g=(int)(.5+(double)avg[1][i]/(double)count[i]);
-      palette[i].c.b=(int)(.5+(double)avg[2][i]/(double)count[i]);
-   }
-   return 1;
+   return recompute_palette_from_averages(palette,nPaletteEntries,avg,count);
 }
 
 static int
@@ -1095,8 +915,13 @@ k_means(Pixel *pixelData,
         Pixel *paletteData,
         unsigned long nPaletteEntries,
         unsigned long *qp,
-        int threshold)
+        int threshold,
+        int maxIterations,
+        double maxTime)
 {
+   /* stop when no more than threshold pixels change, after
+      maxIterations passes, or when maxTime seconds of processor time
+      have been used (zero means no limit) */
    unsigned long *avg[3];
    unsigned long *count;
    unsigned long i;
@@ -1104,6 +929,8 @@ k_means(Pixel *pixelData,
    unsigned long **avgDistSortKey;
    int changes;
    int built=0;
+   int iterations=0;
+   clock_t start=clock();
    
    if (!(count=malloc(sizeof(unsigned long)*nPaletteEntries))) {
       return 0;
@@ -1150,6 +977,9 @@ k_means(Pixel *pixelData,
       printf (".(%d)",changes);fflush(stdout);
 #endif
       if (changes<=threshold) break;
+      iterations++;
+      if (maxIterations>0 && iterations>=maxIterations) break;
+      if (maxTime>0 && (double)(clock()-start)/CLOCKS_PER_SEC>=maxTime) break;
    }
 #ifndef NO_OUTPUT
    printf("]\n");
@@ -1170,6 +1000,62 @@ error_1:
    return 0;
 }
 
+static int
+refine_palette(Pixel *pixelData,
+               unsigned long nPixels,
+               Pixel *paletteData,
+               unsigned long nPaletteEntries,
+               unsigned long *qp,
+               PixelHistogram *medianBoxes,
+               KMeansOptions *kmeans)
+{
+   /* run k-means on the full image, or on an evenly spaced sample of
+      it.  in the latter case, the full image is mapped to the refined
+      palette afterwards */
+   Pixel *sp;
+   unsigned long *sqp;
+   unsigned long i,j,n;
+   unsigned long *avgDist;
+   unsigned long **avgDistSortKey;
+   int ok;
+
+   if (!kmeans->threshold) {
+      return 1;
+   }
+   n=kmeans->sample;
+   if (!n||n>=nPixels) {
+      return k_means(pixelData,nPixels,paletteData,nPaletteEntries,qp,
+                     kmeans->threshold-1,kmeans->iterations,kmeans->time);
+   }
+
+   sp=malloc(sizeof(Pixel)*n);
+   sqp=malloc(sizeof(unsigned long)*n);
+   avgDist=malloc(sizeof(unsigned long)*nPaletteEntries*nPaletteEntries);
+   avgDistSortKey=malloc(sizeof(unsigned long *)*nPaletteEntries*nPaletteEntries);
+   if (!sp||!sqp||!avgDist||!avgDistSortKey) {
+      ok=0;
+      goto done;
+   }
+   for (i=0;i<n;i++) {
+      j=(unsigned long)((double)i*nPixels/n);
+      sp[i]=pixelData[j];
+      sqp[i]=qp[j];
+   }
+   ok=k_means(sp,n,paletteData,nPaletteEntries,sqp,
+              kmeans->threshold-1,kmeans->iterations,kmeans->time);
+   if (ok) {
+      build_distance_tables(avgDist,avgDistSortKey,paletteData,nPaletteEntries);
+      ok=map_image_pixels(pixelData,nPixels,paletteData,nPaletteEntries,
+                          medianBoxes,NULL,avgDist,avgDistSortKey,qp);
+   }
+done:
+   if (sp) free(sp);
+   if (sqp) free(sqp);
+   if (avgDist) free(avgDist);
+   if (avgDistSortKey) free(avgDistSortKey);
+   return ok;
+}
+
 int
 quantize(Pixel *pixelData,
          unsigned long nPixels,
@@ -1177,95 +1063,71 @@ quantize(Pixel *pixelData,
          Pixel **palette,
          unsigned long *paletteLength,
          unsigned long **quantizedPixels,
-         int kmeans)
+         KMeansOptions *kmeans)
 {
-   PixelList *hl[3];
-   HashTable h;
+   PixelHistogram h;
    BoxNode *root;
    unsigned long i;
+   unsigned long *order;
    unsigned long *qp;
    unsigned long nPaletteEntries;
-   
+
    unsigned long *avgDist;
    unsigned long **avgDistSortKey;
    Pixel *p;
-   
+
 #ifndef NO_OUTPUT
    unsigned long timer,timer2;
 #endif
 
 #ifndef NO_OUTPUT
    timer2=clock();
-   printf ("create hash table..."); fflush(stdout); timer=clock();
-#endif
-   h=create_pixel_hash(pixelData,nPixels);
-#ifndef NO_OUTPUT
-   printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
+   printf ("create histogram..."); fflush(stdout); timer=clock();
 #endif
-   if (!h) {
+   if (!create_pixel_histogram(pixelData,nPixels,&h)) {
       goto error_0;
    }
-
-#ifndef NO_OUTPUT
-   printf ("create lists from hash table..."); fflush(stdout); timer=clock();
-#endif
-   hl[0]=hl[1]=hl[2]=NULL;
-   hashtable_foreach(h,hash_to_list,hl);
 #ifndef NO_OUTPUT
    printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
 #endif
 
-   if (!hl[0]) {
+   if (!h.count) {
       goto error_1;
    }
-
-#ifndef NO_OUTPUT
-   printf ("mergesort lists..."); fflush(stdout); timer=clock();
-#endif
-   for(i=0;i<3;i++) {
-      hl[i]=mergesort_pixels(hl[i],i);
-   }
-#ifdef TEST_MERGESORT
-   if (!test_sorted(hl)) {
-      printf ("bug in mergesort\n");
+   order=malloc(sizeof(unsigned long)*h.count);
+   if (!order) {
       goto error_1;
    }
-#endif
-#ifndef NO_OUTPUT
-   printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
-#endif
+   for (i=0;i<(unsigned long)h.count;i++) {
+      order[i]=i;
+   }
 
 #ifndef NO_OUTPUT
    printf ("median cut..."); fflush(stdout); timer=clock();
 #endif
-   root=median_cut(hl,nPixels,nQuantPixels);
+   root=median_cut(h.classes,order,h.count,nPixels,nQuantPixels);
 #ifndef NO_OUTPUT
    printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
 #endif
    if (!root) {
-      goto error_1;
+      goto error_2;
    }
    nPaletteEntries=0;
-#ifndef NO_OUTPUT
-   printf ("median cut tree to hash table..."); fflush(stdout); timer=clock();
-#endif
-   annotate_hash_table(root,h,&nPaletteEntries);
-#ifndef NO_OUTPUT
-   printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
-#endif
+   annotate_classes(root,h.classes,order,&nPaletteEntries);
+   free_box_tree(root);
+   free(order);
+   order=NULL;
+
 #ifndef NO_OUTPUT
    printf ("compute palette...\n"); fflush(stdout); timer=clock();
 #endif
-   if (!compute_palette_from_median_cut(pixelData,nPixels,h,&p,nPaletteEntries)) {
-      goto error_3;
+   if (!compute_palette_from_median_cut(&h,&p,nPaletteEntries)) {
+      goto error_1;
    }
 #ifndef NO_OUTPUT
    printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
 #endif
 
-   free_box_tree(root);
-   root=NULL;
-
    qp=malloc(sizeof(unsigned long)*nPixels);
    if (!qp) { goto error_4; }
 
@@ -1279,60 +1141,22 @@ quantize(Pixel *pixelData,
       goto error_7;
    }
 
-   if (!map_image_pixels_from_median_box(pixelData,nPixels,p,nPaletteEntries,h,avgDist,avgDistSortKey,qp)) {
+#ifndef NO_OUTPUT
+   printf ("map pixels..."); fflush(stdout); timer=clock();
+#endif
+   if (!map_image_pixels(pixelData,nPixels,p,nPaletteEntries,&h,NULL,avgDist,avgDistSortKey,qp)) {
       goto error_7;
    }
-
-#ifdef TEST_NEAREST_NEIGHBOUR
-#include <math.h>
-   {
-      unsigned long bestmatch,bestdist,dist;
-      HashTable h2;
-      printf ("nearest neighbour search (full search)..."); fflush(stdout); timer=clock();
-      h2=hashtable_new(unshifted_pixel_hash,unshifted_pixel_cmp);
-      for (i=0;i<nPixels;i++) {
-         if (hashtable_lookup(h2,(void *)pixelData[i].v,(void **)&paletteEntry)) {
-            bestmatch=paletteEntry;
-         } else {
-            bestmatch=0;
-            bestdist=
-               _SQR(pixelData[i].c.r-p[0].c.r)+
-               _SQR(pixelData[i].c.g-p[0].c.g)+
-               _SQR(pixelData[i].c.b-p[0].c.b);
-            for (j=1;j<nPaletteEntries;j++) {
-               dist=
-                  _SQR(pixelData[i].c.r-p[j].c.r)+
-                  _SQR(pixelData[i].c.g-p[j].c.g)+
-                  _SQR(pixelData[i].c.b-p[j].c.b);
-               if (dist==bestdist && j==qp[i]) {
-                  bestmatch=j;
-               }
-               if (dist<bestdist) {
-                  bestdist=dist;
-                  bestmatch=j;
-               }
-            }
-            hashtable_insert(h2,(void *)pixelData[i].v,(void *)bestmatch);
-         }
-         if (qp[i]!=bestmatch ) {
-            printf ("discrepancy in matching algorithms pixel %d [%d %d] %f %f\n",
-                    i,qp[i],bestmatch,
-                    sqrt((double)(_SQR(pixelData[i].c.r-p[qp[i]].c.r)+
-                                  _SQR(pixelData[i].c.g-p[qp[i]].c.g)+
-                                  _SQR(pixelData[i].c.b-p[qp[i]].c.b))),
-                    sqrt((double)(_SQR(pixelData[i].c.r-p[bestmatch].c.r)+
-                                  _SQR(pixelData[i].c.g-p[bestmatch].c.g)+
-                                  _SQR(pixelData[i].c.b-p[bestmatch].c.b)))
-                   );
-         }
-      }
-      hashtable_free(h2);
-   }
+#ifndef NO_OUTPUT
+   printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
 #endif
+
 #ifndef NO_OUTPUT
    printf ("k means...\n"); fflush(stdout); timer=clock();
 #endif
-   if (kmeans) k_means(pixelData,nPixels,p,nPaletteEntries,qp,kmeans-1);
+   if (!refine_palette(pixelData,nPixels,p,nPaletteEntries,qp,&h,kmeans)) {
+      goto error_7;
+   }
 #ifndef NO_OUTPUT
    printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
 #endif
@@ -1341,30 +1165,26 @@ quantize(Pixel *pixelData,
    *palette=p;
    *paletteLength=nPaletteEntries;
 
+   free(avgDist);
+   free(avgDistSortKey);
+   histogram_free(&h);
 #ifndef NO_OUTPUT
-   printf ("cleanup..."); fflush(stdout); timer=clock();
-#endif
-   if (avgDist) free(avgDist);
-   if (avgDistSortKey) free(avgDistSortKey);
-   destroy_pixel_hash(h);
-#ifndef NO_OUTPUT
-   printf ("done (%f)\n",(clock()-timer)/(double)CLOCKS_PER_SEC);
    printf ("-----\ntotal time %f\n",(clock()-timer2)/(double)CLOCKS_PER_SEC);
 #endif
    return 1;
 
 error_7:
-   if (avgDistSortKey) free(avgDistSortKey);
+   free(avgDistSortKey);
 error_6:
-   if (avgDist) free(avgDist);
+   free(avgDist);
 error_5:
-   if (qp) free(qp);
+   free(qp);
 error_4:
-   if (p) free(p);
-error_3:
-   if (root) free_box_tree(root);
+   free(p);
+error_2:
+   if (order) free(order);
 error_1:
-   destroy_pixel_hash(h);
+   histogram_free(&h);
 error_0:
    *quantizedPixels=NULL;
    *paletteLength=0;
@@ -1404,7 +1224,7 @@ quantize2(Pixel *pixelData,
           Pixel **palette,
           unsigned long *paletteLength,
           unsigned long **quantizedPixels,
-          int kmeans)
+          KMeansOptions *kmeans)
 {
    HashTable h;
    unsigned long i;
@@ -1451,10 +1271,12 @@ quantize2(Pixel *pixelData,
       goto error_4;
    }
 
-   if (!map_image_pixels(pixelData,nPixels,p,nQuantPixels,avgDist,avgDistSortKey,qp)) {
+   if (!map_image_pixels(pixelData,nPixels,p,nQuantPixels,NULL,NULL,avgDist,avgDistSortKey,qp)) {
+      goto error_4;
+   }
+   if (!refine_palette(pixelData,nPixels,p,nQuantPixels,qp,NULL,kmeans)) {
       goto error_4;
    }
-   if (kmeans) k_means(pixelData,nPixels,p,nQuantPixels,qp,kmeans-1);
 
    *paletteLength=nQuantPixels;
    *palette=p;
@@ -1474,39 +1296,18 @@ error_1:
    return 0;
 }
 
-Imaging
-ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
+static Pixel*
+collect_pixels(Imaging im)
 {
-    int i, j;
-    int x, y, v;
+    /* copy L, P, RGB or RGBA image data to a pixel array */
+
+    int i, x, y, v;
     UINT8* pp;
     Pixel* p;
-    Pixel* palette;
-    unsigned long paletteLength;
-    int result;
-    unsigned long* newData;
-    Imaging imOut;
-    int withAlpha = 0;
-    ImagingSectionCookie cookie;
-
-    if (!im)
-	return ImagingError_ModeError();
-    if (colors < 1 || colors > 256)
-        /* FIXME: for colors > 256, consider returning an RGB image
-           instead (see @PIL205) */
-        return (Imaging) ImagingError_ValueError("bad number of colors");
-
-    if (strcmp(im->mode, "L") != 0 && strcmp(im->mode, "P") != 0 &&
-        strcmp(im->mode, "RGB") != 0 && strcmp(im->mode, "RGBA") !=0)
-        return ImagingError_ModeError();
-
-    /* only octree supports RGBA */
-    if (!strcmp(im->mode, "RGBA") && mode != 2)
-       return ImagingError_ModeError();
 
     p = malloc(sizeof(Pixel) * im->xsize * im->ysize);
     if (!p)
-        return ImagingError_MemoryError();
+        return NULL;
 
     /* collect statistics */
 
@@ -1543,11 +1344,56 @@ ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
             for (x = 0; x < im->xsize; x++, i++)
                 p[i].v = im->image32[y][x];
 
-    } else {
-        free(p);
-        return (Imaging) ImagingError_ValueError("internal error");
     }
 
+    return p;
+}
+
+Imaging
+ImagingQuantize(Imaging im, int colors, int mode, int kmeans,
+                int kmeansSample, int kmeansIterations, double kmeansTime,
+                int octreeBits)
+{
+    int i, j;
+    int x, y;
+    UINT8* pp;
+    Pixel* p;
+    Pixel* palette;
+    unsigned long paletteLength;
+    int result;
+    unsigned long* newData;
+    Imaging imOut;
+    int withAlpha = 0;
+    KMeansOptions options;
+    ImagingSectionCookie cookie;
+
+    if (!im)
+	return ImagingError_ModeError();
+    if (colors < 1 || colors > 256)
+        /* FIXME: for colors > 256, consider returning an RGB image
+           instead (see @PIL205) */
+        return (Imaging) ImagingError_ValueError("bad number of colors");
+
+    if (strcmp(im->mode, "L") != 0 && strcmp(im->mode, "P") != 0 &&
+        strcmp(im->mode, "RGB") != 0 && strcmp(im->mode, "RGBA") !=0)
+        return ImagingError_ModeError();
+
+    if (octreeBits != 0 && (octreeBits < 4 || octreeBits > 6))
+        return (Imaging) ImagingError_ValueError("bad number of octree bits");
+
+    /* only octree supports RGBA */
+    if (!strcmp(im->mode, "RGBA") && mode != 2)
+       return ImagingError_ModeError();
+
+    p = collect_pixels(im);
+    if (!p)
+        return ImagingError_MemoryError();
+
+    options.threshold = kmeans;
+    options.sample = kmeansSample > 0 ? kmeansSample : 0;
+    options.iterations = kmeansIterations;
+    options.time = kmeansTime;
+
     ImagingSectionEnter(&cookie);
 
     switch (mode) {
@@ -1560,7 +1406,7 @@ ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
             &palette,
             &paletteLength,
             &newData,
-            kmeans
+            &options
             );
         break;
     case 1:
@@ -1572,7 +1418,7 @@ ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
             &palette,
             &paletteLength,
             &newData,
-            kmeans
+            &options
             );
         break;
     case 2:
@@ -1586,7 +1432,8 @@ ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
             &palette,
             &paletteLength,
             &newData,
-            withAlpha
+            withAlpha,
+            octreeBits
             );
         break;
     default:
@@ -1641,3 +1488,127 @@ ImagingQuantize(Imaging im, int colors, int mode, int kmeans)
 
     }
 }
+
+
+/* -------------------------------------------------------------------- */
+/* Map images to a given palette					*/
+/* -------------------------------------------------------------------- */
+
+/* The distance tables for a palette are kept in the palette object
+   (as palette->nearest, see above), so mapping many images to the
+   same palette only builds them once. */
+
+static struct ImagingPaletteNearest*
+nearest_tables(ImagingPalette palette)
+{
+    struct ImagingPaletteNearest* n;
+    unsigned long i, j, k;
+    UINT8* pp;
+
+    if (palette->nearest)
+        return palette->nearest;
+
+    /* allocate everything in one block, so the palette can free it
+       without knowing the layout */
+    n = malloc(sizeof(struct ImagingPaletteNearest) +
+               256 * 256 * (sizeof(unsigned long) + sizeof(unsigned long*)));
+    if (!n)
+        return NULL;
+    n->avgDistSortKey = (unsigned long**) (n + 1);
+    n->avgDist = (unsigned long*) (n->avgDistSortKey + 256 * 256);
+
+    /* duplicate entries (such as unused black entries at the end of
+       a quantized palette) map to the first one */
+    pp = palette->palette;
+    for (i = k = 0; i < 256; i++) {
+        for (j = 0; j < k; j++)
+            if (n->entries[j].c.r == pp[i*4+0] &&
+                n->entries[j].c.g == pp[i*4+1] &&
+                n->entries[j].c.b == pp[i*4+2])
+                break;
+        if (j == k) {
+            n->entries[k].v = 0;
+            n->entries[k].c.r = pp[i*4+0];
+            n->entries[k].c.g = pp[i*4+1];
+            n->entries[k].c.b = pp[i*4+2];
+            n->index[k] = (UINT8) i;
+            k++;
+        }
+        n->entry[i] = (UINT8) j;
+    }
+    n->nEntries = k;
+
+    build_distance_tables(n->avgDist, n->avgDistSortKey, n->entries, k);
+
+    palette->nearest = n;
+    return n;
+}
+
+Imaging
+ImagingQuantizePalette(Imaging im, ImagingPalette palette)
+{
+    /* map each pixel to the nearest colour in the palette */
+
+    ImagingSectionCookie cookie;
+    struct ImagingPaletteNearest* n;
+    Imaging imOut;
+    Pixel* p;
+    unsigned long* qp;
+    int i, x, y, ok;
+
+    if (!im || !palette)
+	return ImagingError_ModeError();
+
+    if (strcmp(im->mode, "L") != 0 && strcmp(im->mode, "P") != 0 &&
+        strcmp(im->mode, "RGB") != 0 && strcmp(im->mode, "RGBA") !=0)
+        return ImagingError_ModeError();
+
+    /* build the tables while holding the interpreter lock, since the
+       palette may be shared.  the colour cache is used as a starting
+       point for the nearest colour search */
+    n = nearest_tables(palette);
+    if (!n)
+        return ImagingError_MemoryError();
+    if (ImagingPaletteCacheBuild(palette) < 0)
+        return NULL;
+
+    imOut = ImagingNew("P", im->xsize, im->ysize);
+    if (!imOut)
+        return NULL;
+    ImagingPaletteDelete(imOut->palette);
+    imOut->palette = ImagingPaletteDuplicate(palette);
+    if (!imOut->palette) {
+        ImagingDelete(imOut);
+        return NULL;
+    }
+
+    p = collect_pixels(im);
+    qp = malloc(sizeof(unsigned long) * im->xsize * im->ysize);
+    if (!p || !qp) {
+        if (p) free(p);
+        if (qp) free(qp);
+        ImagingDelete(imOut);
+        return ImagingError_MemoryError();
+    }
+
+    ImagingSectionEnter(&cookie);
+
+    ok = map_image_pixels(p, im->xsize * im->ysize, n->entries, n->nEntries,
+                          NULL, palette, n->avgDist, n->avgDistSortKey, qp);
+    if (ok)
+        for (i = y = 0; y < im->ysize; y++)
+            for (x = 0; x < im->xsize; x++)
+                imOut->image8[y][x] = n->index[qp[i++]];
+
+    ImagingSectionLeave(&cookie);
+
+    free(p);
+    free(qp);
+
+    if (!ok) {
+        ImagingDelete(imOut);
+        return ImagingError_MemoryError();
+    }
+
+    return imOut;
+}
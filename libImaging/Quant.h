@@ -22,13 +22,20 @@ typedef union {
    unsigned long v;
 } Pixel;
 
+typedef struct {
+   int threshold;          /* 0 = off, else stop when fewer pixels change */
+   unsigned long sample;   /* number of pixels to use (0 = all) */
+   int iterations;         /* max number of passes (0 = no limit) */
+   double time;            /* max processor time, in seconds (0 = no limit) */
+} KMeansOptions;
+
 int quantize(Pixel *,
              unsigned long,
              unsigned long,
              Pixel **,
              unsigned long *,
              unsigned long **,
-             int);
+             KMeansOptions *);
 
 int quantize2(Pixel *,
              unsigned long,
@@ -36,5 +43,5 @@ int quantize2(Pixel *,
              Pixel **,
              unsigned long *,
              unsigned long **,
-             int);
+             KMeansOptions *);
 #endif
@@ -23,12 +23,19 @@
 // This file implements a variation of the octree color quantization algorithm.
 */
 
+#include "Imaging.h"
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "Quant.h"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
 typedef struct _ColorBucket{
    /* contains palette index when used for look up cube */
    unsigned long count;
@@ -109,20 +116,166 @@ color_bucket_offset(const ColorCube cube, const Pixel *p) {
    return color_bucket_offset_pos(cube, r, g, b, a);
 }
 
+/* compute the bucket offsets for a run of pixels */
+static void
+color_bucket_offsets(const ColorCube cube, const Pixel *p, long n,
+                     UINT32 *offsets)
+{
+   long i = 0;
+#ifdef USE_SSE2
+   /* four pixels at a time; the shift counts are the same for all
+      pixels, so each channel takes a mask and two shifts */
+   __m128i mask = _mm_set1_epi32(255);
+   __m128i rs = _mm_cvtsi32_si128(8-cube->rBits);
+   __m128i gs = _mm_cvtsi32_si128(8-cube->gBits);
+   __m128i bs = _mm_cvtsi32_si128(8-cube->bBits);
+   __m128i as = _mm_cvtsi32_si128(8-cube->aBits);
+   __m128i ro = _mm_cvtsi32_si128(cube->rOffset);
+   __m128i go = _mm_cvtsi32_si128(cube->gOffset);
+   __m128i bo = _mm_cvtsi32_si128(cube->bOffset);
+   for (; i+4 <= n; i += 4) {
+      __m128i v, r, g, b, a;
+      if (sizeof(Pixel) == 4) {
+         v = _mm_loadu_si128((const __m128i*) &p[i]);
+      } else {
+         /* the colour is in the low half of each pixel */
+         __m128i lo = _mm_loadu_si128((const __m128i*) &p[i]);
+         __m128i hi = _mm_loadu_si128((const __m128i*) &p[i+2]);
+         lo = _mm_shuffle_epi32(lo, _MM_SHUFFLE(3, 1, 2, 0));
+         hi = _mm_shuffle_epi32(hi, _MM_SHUFFLE(3, 1, 2, 0));
+         v = _mm_unpacklo_epi64(lo, hi);
+      }
+      r = _mm_srl_epi32(_mm_and_si128(v, mask), rs);
+      g = _mm_srl_epi32(_mm_and_si128(_mm_srli_epi32(v, 8), mask), gs);
+      b = _mm_srl_epi32(_mm_and_si128(_mm_srli_epi32(v, 16), mask), bs);
+      a = _mm_srl_epi32(_mm_srli_epi32(v, 24), as);
+      v = _mm_or_si128(_mm_or_si128(_mm_sll_epi32(r, ro),
+                                    _mm_sll_epi32(g, go)),
+                       _mm_or_si128(_mm_sll_epi32(b, bo), a));
+      _mm_storeu_si128((__m128i*) &offsets[i], v);
+   }
+#endif
+   for (; i < n; i++) {
+      offsets[i] = (UINT32) color_bucket_offset(cube, &p[i]);
+   }
+}
+
 static ColorBucket
 color_bucket_from_cube(const ColorCube cube, const Pixel *p) {
    unsigned int offset = color_bucket_offset(cube, p);
    return &cube->buckets[offset];
 }
 
+/* The histogram is built in parallel.  Each chunk of the image gets
+   its own cube of 32-bit buckets, which are added up at the end.
+   Chunks are kept small enough for the sums not to overflow. */
+
+typedef struct {
+   UINT32 count, r, g, b, a;
+} PartialBucket;
+
+#define MAX_CHUNK_PIXELS (1<<24)
+#define MIN_CHUNK_PIXELS 65536
+#define OFFSET_RUN 256
+
+struct histogram_context {
+   const Pixel *pixelData;
+   unsigned long nPixels;
+   ColorCube cube;
+   int chunks;
+   PartialBucket **partial;
+   int failed;
+};
+
 static void
-add_color_to_color_cube(const ColorCube cube, const Pixel *p) {
-   ColorBucket bucket = color_bucket_from_cube(cube, p);
-   bucket->count += 1;
-   bucket->r += p->c.r;
-   bucket->g += p->c.g;
-   bucket->b += p->c.b;
-   bucket->a += p->c.a;
+histogram_chunks(void *context, int start, int end) {
+   struct histogram_context *ctx = (struct histogram_context *) context;
+   UINT32 offsets[OFFSET_RUN];
+   PartialBucket *buckets, *bucket;
+   const Pixel *p;
+   unsigned long i, first, stop;
+   long j, n;
+   int chunk;
+
+   for (chunk=start; chunk<end; chunk++) {
+      buckets = calloc(ctx->cube->size, sizeof(PartialBucket));
+      ctx->partial[chunk] = buckets;
+      if (!buckets) {
+         ctx->failed = 1;
+         return;
+      }
+      first = (unsigned long)((double)ctx->nPixels*chunk/ctx->chunks);
+      stop = (unsigned long)((double)ctx->nPixels*(chunk+1)/ctx->chunks);
+      for (i=first; i<stop; i+=n) {
+         n = (stop-i < OFFSET_RUN) ? (long)(stop-i) : OFFSET_RUN;
+         p = &ctx->pixelData[i];
+         color_bucket_offsets(ctx->cube, p, n, offsets);
+         for (j=0; j<n; j++) {
+            bucket = &buckets[offsets[j]];
+            bucket->count += 1;
+            bucket->r += p[j].c.r;
+            bucket->g += p[j].c.g;
+            bucket->b += p[j].c.b;
+            bucket->a += p[j].c.a;
+         }
+      }
+   }
+}
+
+static void
+histogram_merge(void *context, int start, int end) {
+   struct histogram_context *ctx = (struct histogram_context *) context;
+   ColorBucket bucket;
+   PartialBucket *partial;
+   int i, chunk;
+
+   for (i=start; i<end; i++) {
+      bucket = &ctx->cube->buckets[i];
+      for (chunk=0; chunk<ctx->chunks; chunk++) {
+         partial = &ctx->partial[chunk][i];
+         bucket->count += partial->count;
+         bucket->r += partial->r;
+         bucket->g += partial->g;
+         bucket->b += partial->b;
+         bucket->a += partial->a;
+      }
+   }
+}
+
+static int
+add_pixels_to_color_cube(const ColorCube cube, const Pixel *pixelData,
+                         unsigned long nPixels) {
+   struct histogram_context ctx;
+   unsigned long minChunk;
+   int i;
+
+   /* don't use more chunks than there are threads, unless the sums
+      could overflow.  small images only get a single chunk */
+   minChunk = cube->size > MIN_CHUNK_PIXELS ? cube->size : MIN_CHUNK_PIXELS;
+   ctx.chunks = ImagingParallelGetThreads();
+   if ((unsigned long) ctx.chunks > nPixels/minChunk)
+      ctx.chunks = (int) (nPixels/minChunk);
+   if ((unsigned long) ctx.chunks < (nPixels+MAX_CHUNK_PIXELS-1)/MAX_CHUNK_PIXELS)
+      ctx.chunks = (int) ((nPixels+MAX_CHUNK_PIXELS-1)/MAX_CHUNK_PIXELS);
+   if (ctx.chunks < 1)
+      ctx.chunks = 1;
+
+   ctx.partial = calloc(ctx.chunks, sizeof(PartialBucket *));
+   if (!ctx.partial) return 0;
+   ctx.pixelData = pixelData;
+   ctx.nPixels = nPixels;
+   ctx.cube = cube;
+   ctx.failed = 0;
+
+   ImagingParallelFor(ctx.chunks, 1, histogram_chunks, &ctx);
+   if (!ctx.failed)
+      ImagingParallelFor(cube->size, 4096, histogram_merge, &ctx);
+
+   for (i=0; i<ctx.chunks; i++) {
+      free(ctx.partial[i]);
+   }
+   free(ctx.partial);
+   return !ctx.failed;
 }
 
 static long
@@ -154,12 +307,24 @@ compare_bucket_count(const ColorBucket a, const ColorBucket b) {
 static ColorBucket
 create_sorted_color_palette(const ColorCube cube) {
    ColorBucket buckets;
+   long i, n;
    buckets = malloc(sizeof(struct _ColorBucket)*cube->size);
    if (!buckets) return NULL;
-   memcpy(buckets, cube->buckets, sizeof(struct _ColorBucket)*cube->size);
 
-   qsort(buckets, cube->size, sizeof(struct _ColorBucket),
+   /* only the used buckets need sorting; the empty ones go last, in
+      their original order (large cubes are mostly empty) */
+   for (i=n=0; i<cube->size; i++) {
+      if (cube->buckets[i].count > 0) {
+         buckets[n++] = cube->buckets[i];
+      }
+   }
+   qsort(buckets, n, sizeof(struct _ColorBucket),
          (int (*)(void const *, void const *))&compare_bucket_count);
+   for (i=0; i<cube->size; i++) {
+      if (cube->buckets[i].count == 0) {
+         buckets[n++] = cube->buckets[i];
+      }
+   }
 
    return buckets;
 }
@@ -300,20 +465,49 @@ create_palette_array(const ColorBucket palette, unsigned int paletteLength) {
    return paletteArray;
 }
 
+struct map_context {
+   const Pixel *pixelData;
+   ColorCube lookupCube;
+   unsigned long *pixelArray;
+};
+
+static void
+map_pixels(void *context, int start, int end)
+{
+   struct map_context *ctx = (struct map_context *) context;
+   UINT32 offsets[OFFSET_RUN];
+   long i, j, n;
+   for (i=start; i<end; i+=n) {
+      n = (end-i < OFFSET_RUN) ? end-i : OFFSET_RUN;
+      color_bucket_offsets(ctx->lookupCube, &ctx->pixelData[i], n, offsets);
+      for (j=0; j<n; j++) {
+         ctx->pixelArray[i+j] = ctx->lookupCube->buckets[offsets[j]].count;
+      }
+   }
+}
+
 static void
 map_image_pixels(const Pixel *pixelData,
                  unsigned long nPixels,
                  const ColorCube lookupCube,
                  unsigned long *pixelArray)
 {
-   long i;
-   for (i=0; i<nPixels; i++) {
-      pixelArray[i] = lookup_color(lookupCube, &pixelData[i]);
-   }
+   struct map_context ctx;
+   ctx.pixelData = pixelData;
+   ctx.lookupCube = lookupCube;
+   ctx.pixelArray = pixelArray;
+   ImagingParallelFor((int) nPixels, 65536, map_pixels, &ctx);
 }
 
-const int CUBE_LEVELS[8]       = {4, 4, 4, 0, 2, 2, 2, 0};
-const int CUBE_LEVELS_ALPHA[8] = {3, 4, 3, 3, 2, 2, 2, 2};
+/* fine cube bits (r, g, b, a) and coarse cube bits, for the default
+   cube and for 5 and 6 bits per colour channel.  with alpha, fewer
+   bits are used for the alpha channel */
+const int CUBE_LEVELS[8]         = {4, 4, 4, 0, 2, 2, 2, 0};
+const int CUBE_LEVELS_ALPHA[8]   = {3, 4, 3, 3, 2, 2, 2, 2};
+const int CUBE_LEVELS_5[8]       = {5, 5, 5, 0, 2, 2, 2, 0};
+const int CUBE_LEVELS_5_ALPHA[8] = {5, 5, 5, 3, 2, 2, 2, 2};
+const int CUBE_LEVELS_6[8]       = {6, 6, 6, 0, 2, 2, 2, 0};
+const int CUBE_LEVELS_6_ALPHA[8] = {6, 6, 6, 2, 2, 2, 2, 2};
 
 int quantize_octree(Pixel *pixelData,
           unsigned long nPixels,
@@ -321,7 +515,8 @@ int quantize_octree(Pixel *pixelData,
           Pixel **palette,
           unsigned long *paletteLength,
           unsigned long **quantizedPixels,
-          int withAlpha)
+          int withAlpha,
+          int bits)
 {
    ColorCube fineCube = NULL;
    ColorCube coarseCube = NULL;
@@ -331,15 +526,19 @@ int quantize_octree(Pixel *pixelData,
    ColorBucket paletteBucketsFine = NULL;
    ColorBucket paletteBuckets = NULL;
    unsigned long *qp = NULL;
-   long i;
    long nCoarseColors, nFineColors, nAlreadySubtracted;
    const int *cubeBits;
 
-   if (withAlpha) {
-       cubeBits = CUBE_LEVELS_ALPHA;
-   }
-   else {
-       cubeBits = CUBE_LEVELS;
+   switch (bits) {
+   case 5:
+       cubeBits = withAlpha ? CUBE_LEVELS_5_ALPHA : CUBE_LEVELS_5;
+       break;
+   case 6:
+       cubeBits = withAlpha ? CUBE_LEVELS_6_ALPHA : CUBE_LEVELS_6;
+       break;
+   default:
+       cubeBits = withAlpha ? CUBE_LEVELS_ALPHA : CUBE_LEVELS;
+       break;
    }
 
    /*
@@ -361,9 +560,7 @@ int quantize_octree(Pixel *pixelData,
    fineCube = new_color_cube(cubeBits[0], cubeBits[1],
                              cubeBits[2], cubeBits[3]);
    if (!fineCube) goto error;
-   for (i=0; i<nPixels; i++) {
-      add_color_to_color_cube(fineCube, &pixelData[i]);
-   }
+   if (!add_pixels_to_color_cube(fineCube, pixelData, nPixels)) goto error;
 
    /* create coarse cube */
    coarseCube = copy_color_cube(fineCube, cubeBits[4], cubeBits[5],
@@ -7,6 +7,7 @@ int quantize_octree(Pixel *,
           Pixel **,
           unsigned long *,
           unsigned long **,
+          int,
           int);
 
 #endif
\ No newline at end of file
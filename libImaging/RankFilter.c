@@ -47,6 +47,196 @@ MakeRankFunction(UINT8)
 MakeRankFunction(INT32)
 MakeRankFunction(FLOAT32)
 
+/* Rank filter for 8-bit images, using sliding histograms (see
+   ModeFilter.c).  Column histograms are moved down one line at a
+   time, and the window histogram is moved right one pixel at a time
+   by adding and subtracting column histograms, so the cost per pixel
+   doesn't depend on the window size.  The coarse bins are used to
+   find the right part of the fine histogram. */
+
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define USE_SSE2
+#include <emmintrin.h>
+#endif
+
+#define HISTSIZE (256 + 16) /* fine bins, coarse bins */
+
+static void
+histogram_update(UINT16* h, const UINT16* add, const UINT16* sub)
+{
+    int i = 0;
+#ifdef USE_SSE2
+    for (; i < HISTSIZE; i += 8)
+        _mm_storeu_si128((__m128i*) &h[i], _mm_sub_epi16(
+            _mm_add_epi16(_mm_loadu_si128((__m128i*) &h[i]),
+                          _mm_loadu_si128((__m128i*) &add[i])),
+            _mm_loadu_si128((__m128i*) &sub[i])));
+#else
+    for (; i < HISTSIZE; i++)
+        h[i] += add[i] - sub[i];
+#endif
+}
+
+static void
+column_update(UINT16* columns, UINT8* in, int xsize, int pixelsize,
+              const int* offsets, int bands, int sign)
+{
+    /* add (or remove) a line to the column histograms.  there's one
+       histogram per band and column, stored next to each other */
+    int x, b;
+    UINT8 v;
+    for (x = 0; x < xsize; x++, in += pixelsize)
+        for (b = 0; b < bands; b++, columns += HISTSIZE) {
+            v = in[offsets[b]];
+            columns[v] += sign;
+            columns[256 + (v >> 4)] += sign;
+        }
+}
+
+static UINT8
+histogram_rank(UINT16* h, int rank)
+{
+    int c, i, n;
+    for (c = n = 0; c < 15; c++) {
+        if (n + h[256 + c] > rank)
+            break;
+        n += h[256 + c];
+    }
+    for (i = c * 16; i < 255; i++) {
+        n += h[i];
+        if (n > rank)
+            break;
+    }
+    return (UINT8) i;
+}
+
+struct rank_context {
+    Imaging imOut;
+    Imaging imIn;
+    int size, rank;
+    int bands;
+    int offsets[4]; /* where the bands are stored in each pixel */
+    int failed;
+};
+
+static void
+rank8_finish(Imaging imOut, UINT8* out, int bands)
+{
+    /* fill in unused bytes, like the unpackers do */
+    int x;
+    if (bands == 2)
+        for (x = 0; x < imOut->xsize; x++, out += 4)
+            out[1] = out[2] = out[0];
+    else if (bands == 3)
+        for (x = 0; x < imOut->xsize; x++, out += 4)
+            out[3] = 255;
+}
+
+static void
+rank8_rows(void* context, int y0, int y1)
+{
+    struct rank_context* ctx = context;
+    Imaging im = ctx->imIn;
+    Imaging imOut = ctx->imOut;
+    int size = ctx->size;
+    int bands = ctx->bands;
+    int pixelsize = im->pixelsize;
+    int stride = bands * HISTSIZE; /* per column */
+    UINT16* columns;
+    UINT16* zero;
+    UINT16 histogram[4][HISTSIZE];
+    int x, y, b, i;
+    UINT8* out;
+
+    if (imOut->xsize < 1)
+        return;
+
+    /* the last histogram is always empty */
+    columns = calloc((im->xsize * bands + 1) * HISTSIZE, sizeof(UINT16));
+    if (!columns) {
+        ctx->failed = 1;
+        return;
+    }
+    zero = &columns[im->xsize * stride];
+
+    for (y = y0; y < y0 + size - 1; y++)
+        column_update(columns, (UINT8*) im->image[y], im->xsize, pixelsize,
+                      ctx->offsets, bands, 1);
+
+    for (y = y0; y < y1; y++) {
+
+        column_update(columns, (UINT8*) im->image[y + size - 1], im->xsize,
+                      pixelsize, ctx->offsets, bands, 1);
+        if (y > y0)
+            column_update(columns, (UINT8*) im->image[y - 1], im->xsize,
+                          pixelsize, ctx->offsets, bands, -1);
+
+        memset(histogram, 0, sizeof(histogram));
+        for (i = 0; i < size; i++)
+            for (b = 0; b < bands; b++)
+                histogram_update(histogram[b],
+                                 &columns[i * stride + b * HISTSIZE], zero);
+
+        out = (UINT8*) imOut->image[y];
+        for (b = 0; b < bands; b++)
+            out[ctx->offsets[b]] = histogram_rank(histogram[b], ctx->rank);
+        for (x = 1; x < imOut->xsize; x++)
+            for (b = 0; b < bands; b++) {
+                histogram_update(histogram[b],
+                                 &columns[(x + size - 1) * stride + b*HISTSIZE],
+                                 &columns[(x - 1) * stride + b*HISTSIZE]);
+                out[x * pixelsize + ctx->offsets[b]] =
+                    histogram_rank(histogram[b], ctx->rank);
+            }
+
+        rank8_finish(imOut, out, bands);
+    }
+
+    free(columns);
+}
+
+static void
+rank8_select(void* context, int y0, int y1)
+{
+    /* multiband version of RANK_BODY, below */
+    struct rank_context* ctx = context;
+    Imaging im = ctx->imIn;
+    Imaging imOut = ctx->imOut;
+    int size = ctx->size;
+    int size2 = size * size;
+    int bands = ctx->bands;
+    int pixelsize = im->pixelsize;
+    UINT8* buf;
+    UINT8* in;
+    UINT8* out;
+    int x, y, b, i, j;
+
+    buf = malloc(bands * size2);
+    if (!buf) {
+        ctx->failed = 1;
+        return;
+    }
+
+    for (y = y0; y < y1; y++) {
+        out = (UINT8*) imOut->image[y];
+        for (x = 0; x < imOut->xsize; x++) {
+            for (i = 0; i < size; i++) {
+                in = (UINT8*) im->image[y+i] + x * pixelsize;
+                for (j = 0; j < size; j++, in += pixelsize)
+                    for (b = 0; b < bands; b++)
+                        buf[b * size2 + i * size + j] = in[ctx->offsets[b]];
+            }
+            for (b = 0; b < bands; b++)
+                out[x * pixelsize + ctx->offsets[b]] =
+                    RankUINT8(buf + b * size2, size2, ctx->rank);
+        }
+        rank8_finish(imOut, out, bands);
+    }
+
+    free(buf);
+}
+
 Imaging
 ImagingRankFilter(Imaging im, int size, int rank)
 {
@@ -54,7 +244,9 @@ ImagingRankFilter(Imaging im, int size, int rank)
     int x, y;
     int i, margin, size2;
 
-    if (!im || im->bands != 1 || im->type == IMAGING_TYPE_SPECIAL)
+    if (!im || im->type == IMAGING_TYPE_SPECIAL)
+	return (Imaging) ImagingError_ModeError();
+    if (im->bands != 1 && im->type != IMAGING_TYPE_UINT8)
 	return (Imaging) ImagingError_ModeError();
 
     if (!(size & 1))
@@ -81,9 +273,32 @@ ImagingRankFilter(Imaging im, int size, int rank)
                        size * sizeof(type));\
             IMAGING_PIXEL_##type(imOut, x, y) = Rank##type(buf, size2, rank);\
         }\
+    free(buf);\
 } while (0)
 
-    if (im->image8)
+    if (im->type == IMAGING_TYPE_UINT8 && (im->bands > 1 || size >= 5)) {
+        /* use sliding histograms (with 16-bit counters), except for
+           small windows, where the selection algorithm is faster.
+           all bands are done in one pass */
+        ImagingSectionCookie cookie;
+        struct rank_context ctx;
+        ctx.imOut = imOut;
+        ctx.imIn = im;
+        ctx.size = size;
+        ctx.rank = rank;
+        ctx.bands = im->bands;
+        for (i = 0; i < im->bands; i++)
+            ctx.offsets[i] = (im->bands == 2 && i == 1) ? 3 : i;
+        ctx.failed = 0;
+        ImagingSectionEnter(&cookie);
+        if (size >= 5 && size2 <= 65535)
+            ImagingParallelFor(imOut->ysize, 32, rank8_rows, &ctx);
+        else
+            ImagingParallelFor(imOut->ysize, 32, rank8_select, &ctx);
+        ImagingSectionLeave(&cookie);
+        if (ctx.failed)
+            goto nomemory;
+    } else if (im->image8)
         RANK_BODY(UINT8);
     else if (im->type == IMAGING_TYPE_INT32)
         RANK_BODY(INT32);
@@ -84,6 +84,9 @@ ImagingRawDecode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 
 	state->state = SKIP;
 
+	if (state->ystop && state->y >= state->ystop)
+	    return ptr - buf; /* caller wants the lines */
+
     }
 
 }
@@ -346,6 +346,191 @@ ImagingNewBlock(const char *mode, int xsize, int ysize)
     return ImagingNewEpilogue(im);
 }
 
+/* Pool Storage Type */
+/* ----------------- */
+/* Allocate image as a single block, recycled through a process-wide
+   pool of released blocks.  Blocks are rounded up to a size class
+   (four classes per power of two), and each class keeps a free list.
+   The pool is protected by the interpreter lock; like the other
+   allocators, this must not be called from inside a thread section. */
+
+#define	POOL_MINSIZE	4096
+#define	POOL_CLASSES	(1 + (30 - 12) * 4) /* up to 1 gigabyte */
+
+typedef struct ImagingPoolBlockInstance {
+    struct ImagingPoolBlockInstance* next;
+    int sizeclass;
+    int size;
+} *ImagingPoolBlock;
+
+/* keep the raster data aligned */
+#define	POOL_HEADER	((sizeof(struct ImagingPoolBlockInstance) + 15) & ~15)
+
+static struct {
+    int enabled;
+    int maxblocks;
+    long maxbytes;
+    ImagingPoolBlock free[POOL_CLASSES];
+    struct ImagingMemoryPoolStats stats;
+} pool = {
+    0, 64, 64*1024*1024L
+};
+
+static int
+pool_sizeclass(int bytes, int* size)
+{
+    int k, step, sub;
+
+    if (bytes <= POOL_MINSIZE) {
+        *size = POOL_MINSIZE;
+        return 0;
+    }
+
+    /* find k such that 2**k < bytes <= 2**(k+1) */
+    for (k = 12; k < 29 && (bytes - 1) >> (k + 1); k++)
+        ;
+    if ((bytes - 1) >> (k + 1))
+        return -1; /* too large for the pool */
+
+    step = 1 << (k - 2);
+    sub = (bytes - (1 << k) + step - 1) / step;
+
+    *size = (1 << k) + sub * step;
+    return 1 + (k - 12) * 4 + (sub - 1);
+}
+
+static void
+pool_release(ImagingPoolBlock block)
+{
+    if (pool.enabled && block->sizeclass >= 0 &&
+        pool.stats.blocks < pool.maxblocks &&
+        pool.stats.bytes + block->size <= pool.maxbytes) {
+        /* keep it for later */
+        block->next = pool.free[block->sizeclass];
+        pool.free[block->sizeclass] = block;
+        pool.stats.blocks++;
+        pool.stats.bytes += block->size;
+        pool.stats.returned++;
+    } else {
+        free(block);
+        pool.stats.released++;
+    }
+}
+
+static void
+ImagingDestroyPooled(Imaging im)
+{
+    if (im->block)
+        pool_release((ImagingPoolBlock) (im->block - POOL_HEADER));
+}
+
+Imaging
+ImagingNewPooled(const char *mode, int xsize, int ysize)
+{
+    Imaging im;
+    ImagingPoolBlock block;
+    int y, i;
+    int bytes, size, sizeclass;
+
+    im = ImagingNewPrologue(mode, xsize, ysize);
+    if (!im)
+	return NULL;
+
+    bytes = im->ysize * im->linesize;
+    if (bytes <= 0)
+        bytes = 1;
+
+    sizeclass = pool_sizeclass(bytes, &size);
+    if (sizeclass < 0)
+        size = bytes; /* not poolable; use an ordinary block */
+
+    block = NULL;
+    if (sizeclass >= 0 && pool.free[sizeclass]) {
+        block = pool.free[sizeclass];
+        pool.free[sizeclass] = block->next;
+        pool.stats.blocks--;
+        pool.stats.bytes -= block->size;
+        pool.stats.hits++;
+    } else {
+        block = (ImagingPoolBlock) malloc(POOL_HEADER + size);
+        if (block) {
+            block->sizeclass = sizeclass;
+            block->size = size;
+            pool.stats.misses++;
+        }
+    }
+
+    if (block) {
+
+        im->block = (char *) block + POOL_HEADER;
+
+	for (y = i = 0; y < im->ysize; y++) {
+	    im->image[y] = im->block + i;
+	    i += im->linesize;
+	}
+
+	im->destroy = ImagingDestroyPooled;
+
+    }
+
+    return ImagingNewEpilogue(im);
+}
+
+void
+ImagingMemoryPoolSetup(int enabled, int maxblocks, long maxbytes)
+{
+    pool.enabled = enabled;
+    if (maxblocks >= 0)
+        pool.maxblocks = maxblocks;
+    if (maxbytes >= 0)
+        pool.maxbytes = maxbytes;
+
+    if (!enabled)
+        ImagingMemoryPoolClear();
+    else {
+        /* trim the pool to the new limits */
+        int i;
+        ImagingPoolBlock block;
+        for (i = POOL_CLASSES - 1; i >= 0; i--)
+            while (pool.free[i] && (pool.stats.blocks > pool.maxblocks ||
+                                    pool.stats.bytes > pool.maxbytes)) {
+                block = pool.free[i];
+                pool.free[i] = block->next;
+                pool.stats.blocks--;
+                pool.stats.bytes -= block->size;
+                pool.stats.released++;
+                free(block);
+            }
+    }
+}
+
+void
+ImagingMemoryPoolClear(void)
+{
+    int i;
+    ImagingPoolBlock block;
+
+    for (i = 0; i < POOL_CLASSES; i++)
+        while (pool.free[i]) {
+            block = pool.free[i];
+            pool.free[i] = block->next;
+            pool.stats.released++;
+            free(block);
+        }
+
+    pool.stats.blocks = 0;
+    pool.stats.bytes = 0;
+}
+
+void
+ImagingMemoryPoolGetStats(ImagingMemoryPoolStats* stats)
+{
+    *stats = pool.stats;
+    stats->enabled = pool.enabled;
+    stats->maxblocks = pool.maxblocks;
+    stats->maxbytes = pool.maxbytes;
+}
+
 /* --------------------------------------------------------------------
  * Create a new, internally allocated, image.
  */
@@ -369,6 +554,13 @@ ImagingNew(const char* mode, int xsize, int ysize)
     } else
         bytes = strlen(mode); /* close enough */
 
+    if (pool.enabled && (long) xsize * ysize * bytes <= pool.maxbytes) {
+        im = ImagingNewPooled(mode, xsize, ysize);
+        if (im)
+            return im;
+        ImagingError_Clear();
+    }
+
     if ((long) xsize * ysize * bytes <= THRESHOLD) {
         im = ImagingNewBlock(mode, xsize, ysize);
         if (im)
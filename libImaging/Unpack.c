@@ -32,6 +32,14 @@
 
 #include "Imaging.h"
 
+/* the SSSE3 and AVX2 versions of the most common unpackers are picked
+   at run time, when the CPU supports them */
+
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define USE_SIMD
+#include <immintrin.h>
+#endif
 
 #define	R 0
 #define	G 1
@@ -849,6 +857,269 @@ band3I(UINT8* out, const UINT8* in, int pixels)
     }
 }
 
+/* -------------------------------------------------------------------- */
+/* SIMD unpackers.  Each kernel handles as many whole vectors as it can,
+   and leaves the rest of the line to the plain C version. */
+
+#ifdef USE_SIMD
+
+#define SSSE3 __attribute__((target("ssse3")))
+#define AVX2 __attribute__((target("avx2")))
+
+/* shuffle masks.  indexes with the top bit set clear the byte; ZERO
+   stays negative when the masks add their offsets */
+
+#define ZERO -128
+
+#define RGB_MASK(a, b, c)\
+    a, b, c, ZERO, a+3, b+3, c+3, ZERO, a+6, b+6, c+6, ZERO,\
+    a+9, b+9, c+9, ZERO
+#define QUAD_MASK(a, b, c, d)\
+    a, b, c, d, a+4, b+4, c+4, d+4, a+8, b+8, c+8, d+8,\
+    a+12, b+12, c+12, d+12
+
+SSSE3 static int
+unpack24_ssse3(UINT8* out, const UINT8* in, int pixels, __m128i mask)
+{
+    /* 16 packed triplets to quadruples, with opaque alpha */
+    __m128i alpha = _mm_set1_epi32(0xff000000);
+    __m128i a, b, c;
+    int i;
+    for (i = 0; i + 16 <= pixels; i += 16) {
+        a = _mm_loadu_si128((__m128i*) in);
+        b = _mm_loadu_si128((__m128i*) (in + 16));
+        c = _mm_loadu_si128((__m128i*) (in + 32));
+        _mm_storeu_si128((__m128i*) out, _mm_or_si128(
+            _mm_shuffle_epi8(a, mask), alpha));
+        _mm_storeu_si128((__m128i*) (out + 16), _mm_or_si128(
+            _mm_shuffle_epi8(_mm_alignr_epi8(b, a, 12), mask), alpha));
+        _mm_storeu_si128((__m128i*) (out + 32), _mm_or_si128(
+            _mm_shuffle_epi8(_mm_alignr_epi8(c, b, 8), mask), alpha));
+        _mm_storeu_si128((__m128i*) (out + 48), _mm_or_si128(
+            _mm_shuffle_epi8(_mm_srli_si128(c, 4), mask), alpha));
+        out += 64; in += 48;
+    }
+    return i;
+}
+
+AVX2 static int
+unpack24_avx2(UINT8* out, const UINT8* in, int pixels, __m128i mask)
+{
+    /* spread 24 bytes over the two lanes, then shuffle each lane like
+       the SSSE3 version.  the load reads 32 bytes, so stop early */
+    __m256i lanes = _mm256_setr_epi32(0, 1, 2, 0, 3, 4, 5, 0);
+    __m256i alpha = _mm256_set1_epi32(0xff000000);
+    __m256i mask2 = _mm256_broadcastsi128_si256(mask);
+    __m256i v;
+    int i;
+    for (i = 0; i + 11 <= pixels; i += 8) {
+        v = _mm256_loadu_si256((__m256i*) in);
+        v = _mm256_permutevar8x32_epi32(v, lanes);
+        _mm256_storeu_si256((__m256i*) out, _mm256_or_si256(
+            _mm256_shuffle_epi8(v, mask2), alpha));
+        out += 32; in += 24;
+    }
+    return i;
+}
+
+SSSE3 static int
+unpack32_ssse3(UINT8* out, const UINT8* in, int pixels, __m128i mask,
+               UINT32 fill)
+{
+    /* quadruples to quadruples, setting the bits in fill */
+    __m128i or = _mm_set1_epi32(fill);
+    int i;
+    for (i = 0; i + 4 <= pixels; i += 4) {
+        _mm_storeu_si128((__m128i*) out, _mm_or_si128(_mm_shuffle_epi8(
+            _mm_loadu_si128((__m128i*) in), mask), or));
+        out += 16; in += 16;
+    }
+    return i;
+}
+
+AVX2 static int
+unpack32_avx2(UINT8* out, const UINT8* in, int pixels, __m128i mask,
+              UINT32 fill)
+{
+    __m256i or = _mm256_set1_epi32(fill);
+    __m256i mask2 = _mm256_broadcastsi128_si256(mask);
+    int i;
+    for (i = 0; i + 8 <= pixels; i += 8) {
+        _mm256_storeu_si256((__m256i*) out, _mm256_or_si256(
+            _mm256_shuffle_epi8(_mm256_loadu_si256((__m256i*) in), mask2),
+            or));
+        out += 32; in += 32;
+    }
+    return i;
+}
+
+SSSE3 static int
+expand1_ssse3(UINT8* out, const UINT8* in, int pixels, __m128i bits,
+              __m128i set)
+{
+    /* 16 pixels from two bytes.  each byte is copied to eight lanes,
+       and each lane tests one bit.  lanes equal to "set" become 255 */
+    __m128i spread = _mm_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+                                   1, 1, 1, 1, 1, 1, 1, 1);
+    __m128i v;
+    int i;
+    for (i = 0; i + 16 <= pixels; i += 16) {
+        v = _mm_cvtsi32_si128(in[0] | (in[1] << 8));
+        v = _mm_and_si128(_mm_shuffle_epi8(v, spread), bits);
+        _mm_storeu_si128((__m128i*) out, _mm_cmpeq_epi8(v, set));
+        out += 16; in += 2;
+    }
+    return i;
+}
+
+AVX2 static int
+expand1_avx2(UINT8* out, const UINT8* in, int pixels, __m128i bits,
+             __m128i set)
+{
+    __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0,
+                                      1, 1, 1, 1, 1, 1, 1, 1,
+                                      2, 2, 2, 2, 2, 2, 2, 2,
+                                      3, 3, 3, 3, 3, 3, 3, 3);
+    __m256i bits2 = _mm256_broadcastsi128_si256(bits);
+    __m256i set2 = _mm256_broadcastsi128_si256(set);
+    __m256i v;
+    int i;
+    for (i = 0; i + 32 <= pixels; i += 32) {
+        v = _mm256_set1_epi32((int) ((UINT32) in[0] | ((UINT32) in[1] << 8) |
+                                     ((UINT32) in[2] << 16) |
+                                     ((UINT32) in[3] << 24)));
+        v = _mm256_and_si256(_mm256_shuffle_epi8(v, spread), bits2);
+        _mm256_storeu_si256((__m256i*) out, _mm256_cmpeq_epi8(v, set2));
+        out += 32; in += 4;
+    }
+    return i;
+}
+
+SSSE3 static int
+unpack16_ssse3(UINT8* out, const UINT8* in, int pixels, __m128i swap,
+               int sign)
+{
+    /* 16-bit integers to INT32.  the shuffle puts each value in the
+       upper half of a 32-bit lane, and the shift moves it down */
+    __m128i v;
+    int i;
+    for (i = 0; i + 8 <= pixels; i += 8) {
+        v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) in), swap);
+        if (sign) {
+            _mm_storeu_si128((__m128i*) out, _mm_srai_epi32(
+                _mm_unpacklo_epi16(_mm_setzero_si128(), v), 16));
+            _mm_storeu_si128((__m128i*) (out + 16), _mm_srai_epi32(
+                _mm_unpackhi_epi16(_mm_setzero_si128(), v), 16));
+        } else {
+            _mm_storeu_si128((__m128i*) out, _mm_srli_epi32(
+                _mm_unpacklo_epi16(_mm_setzero_si128(), v), 16));
+            _mm_storeu_si128((__m128i*) (out + 16), _mm_srli_epi32(
+                _mm_unpackhi_epi16(_mm_setzero_si128(), v), 16));
+        }
+        out += 32; in += 16;
+    }
+    return i;
+}
+
+AVX2 static int
+unpack16_avx2(UINT8* out, const UINT8* in, int pixels, __m128i swap,
+              int sign)
+{
+    __m128i v;
+    int i;
+    for (i = 0; i + 8 <= pixels; i += 8) {
+        v = _mm_shuffle_epi8(_mm_loadu_si128((__m128i*) in), swap);
+        _mm256_storeu_si256((__m256i*) out, sign ?
+                            _mm256_cvtepi16_epi32(v) :
+                            _mm256_cvtepu16_epi32(v));
+        out += 32; in += 16;
+    }
+    return i;
+}
+
+#define UNPACK24(NAME, GENERIC, MASK)\
+SSSE3 static void NAME##_ssse3(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = unpack24_ssse3(out, in, pixels, _mm_setr_epi8(MASK));\
+    GENERIC(out + 4*n, in + 3*n, pixels - n);\
+}\
+AVX2 static void NAME##_avx2(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = unpack24_avx2(out, in, pixels, _mm_setr_epi8(MASK));\
+    NAME##_ssse3(out + 4*n, in + 3*n, pixels - n);\
+}
+
+#define UNPACK32(NAME, GENERIC, MASK, FILL)\
+SSSE3 static void NAME##_ssse3(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = unpack32_ssse3(out, in, pixels, _mm_setr_epi8(MASK), FILL);\
+    GENERIC(out + 4*n, in + 4*n, pixels - n);\
+}\
+AVX2 static void NAME##_avx2(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = unpack32_avx2(out, in, pixels, _mm_setr_epi8(MASK), FILL);\
+    NAME##_ssse3(out + 4*n, in + 4*n, pixels - n);\
+}
+
+#define UNPACK1(NAME, GENERIC, BITS, SET)\
+SSSE3 static void NAME##_ssse3(UINT8* out, const UINT8* in, int pixels)\
+{\
+    __m128i bits = _mm_setr_epi8(BITS, BITS);\
+    int n = expand1_ssse3(out, in, pixels, bits, SET);\
+    GENERIC(out + n, in + n/8, pixels - n);\
+}\
+AVX2 static void NAME##_avx2(UINT8* out, const UINT8* in, int pixels)\
+{\
+    __m128i bits = _mm_setr_epi8(BITS, BITS);\
+    int n = expand1_avx2(out, in, pixels, bits, SET);\
+    NAME##_ssse3(out + n, in + n/8, pixels - n);\
+}
+
+#define UNPACK16(NAME, GENERIC, SWAP, SIGN)\
+SSSE3 static void NAME##_ssse3(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = unpack16_ssse3(out, in, pixels, SWAP, SIGN);\
+    GENERIC(out + 4*n, in + 2*n, pixels - n);\
+}\
+AVX2 static void NAME##_avx2(UINT8* out, const UINT8* in, int pixels)\
+{\
+    int n = unpack16_avx2(out, in, pixels, SWAP, SIGN);\
+    NAME##_ssse3(out + 4*n, in + 2*n, pixels - n);\
+}
+
+#define MSB_FIRST -128, 64, 32, 16, 8, 4, 2, 1
+#define LSB_FIRST 1, 2, 4, 8, 16, 32, 64, -128
+
+#define NATIVE_16\
+    _mm_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15)
+#define SWAPPED_16\
+    _mm_setr_epi8(1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14)
+
+UNPACK24(unpackRGB, ImagingUnpackRGB, RGB_MASK(0, 1, 2))
+UNPACK24(unpackBGR, ImagingUnpackBGR, RGB_MASK(2, 1, 0))
+
+UNPACK32(unpackBGRX, ImagingUnpackBGRX,
+         QUAD_MASK(2, 1, 0, ZERO), 0xff000000)
+UNPACK32(unpackXRGB, ImagingUnpackXRGB,
+         QUAD_MASK(1, 2, 3, ZERO), 0xff000000)
+UNPACK32(unpackXBGR, ImagingUnpackXBGR,
+         QUAD_MASK(3, 2, 1, ZERO), 0xff000000)
+UNPACK32(unpackBGRA, unpackBGRA, QUAD_MASK(2, 1, 0, 3), 0)
+UNPACK32(unpackARGB, unpackARGB, QUAD_MASK(1, 2, 3, 0), 0)
+UNPACK32(unpackABGR, unpackABGR, QUAD_MASK(3, 2, 1, 0), 0)
+
+UNPACK1(unpack1, unpack1, MSB_FIRST, bits)
+UNPACK1(unpack1I, unpack1I, MSB_FIRST, _mm_setzero_si128())
+UNPACK1(unpack1R, unpack1R, LSB_FIRST, bits)
+UNPACK1(unpack1IR, unpack1IR, LSB_FIRST, _mm_setzero_si128())
+
+UNPACK16(unpackI16, unpackI16, NATIVE_16, 0)
+UNPACK16(unpackI16S, unpackI16S, NATIVE_16, 1)
+UNPACK16(unpackI16B, unpackI16B, SWAPPED_16, 0)
+UNPACK16(unpackI16BS, unpackI16BS, SWAPPED_16, 1)
+
+#endif
+
 static struct {
     const char* mode;
     const char* rawmode;
@@ -1023,11 +1294,74 @@ static struct {
 };
 
 
+#ifdef USE_SIMD
+
+#define FAST(NAME, GENERIC) {GENERIC, NAME##_ssse3, NAME##_avx2}
+
+static struct {
+    ImagingShuffler generic;
+    ImagingShuffler ssse3;
+    ImagingShuffler avx2;
+} fast_unpackers[] = {
+    FAST(unpackRGB, ImagingUnpackRGB),
+    FAST(unpackBGR, ImagingUnpackBGR),
+    FAST(unpackBGRX, ImagingUnpackBGRX),
+    FAST(unpackXRGB, ImagingUnpackXRGB),
+    FAST(unpackXBGR, ImagingUnpackXBGR),
+    FAST(unpackBGRA, unpackBGRA),
+    FAST(unpackARGB, unpackARGB),
+    FAST(unpackABGR, unpackABGR),
+    FAST(unpack1, unpack1),
+    FAST(unpack1I, unpack1I),
+    FAST(unpack1R, unpack1R),
+    FAST(unpack1IR, unpack1IR),
+    FAST(unpackI16, unpackI16),
+    FAST(unpackI16S, unpackI16S),
+    FAST(unpackI16B, unpackI16B),
+    FAST(unpackI16BS, unpackI16BS),
+    {NULL}
+};
+
+#endif
+
+static void
+select_unpackers(void)
+{
+    /* replace the generic unpackers with the best versions for this
+       CPU (only done once) */
+
+    static int ready = 0;
+
+#ifdef USE_SIMD
+    int i, j, ssse3, avx2;
+
+    if (ready)
+        return;
+
+    ssse3 = ImagingCPUFeatures() & IMAGING_CPU_SSSE3;
+    avx2 = ImagingCPUFeatures() & IMAGING_CPU_AVX2;
+
+    for (i = 0; unpackers[i].rawmode; i++)
+        for (j = 0; fast_unpackers[j].generic; j++)
+            if (unpackers[i].unpack == fast_unpackers[j].generic) {
+                if (avx2)
+                    unpackers[i].unpack = fast_unpackers[j].avx2;
+                else if (ssse3)
+                    unpackers[i].unpack = fast_unpackers[j].ssse3;
+                break;
+            }
+#endif
+
+    ready = 1;
+}
+
 ImagingShuffler
 ImagingFindUnpacker(const char* mode, const char* rawmode, int* bits_out)
 {
     int i;
 
+    select_unpackers();
+
     /* find a suitable pixel unpacker */
     for (i = 0; unpackers[i].rawmode; i++)
 	if (strcmp(unpackers[i].mode, mode) == 0 &&
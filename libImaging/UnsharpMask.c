@@ -54,43 +54,23 @@ static inline UINT8 clip(double in)
     return (UINT8) in;
 }
 
-static Imaging
-gblur(Imaging im, Imaging imOut, float floatRadius, int channels, int padding)
+static float*
+gaussian_mask(float floatRadius, int* size)
 {
-    ImagingSectionCookie cookie;
+    /* create the normalized gaussian curve used by gblur.  the
+       number of weights is stored in size */
 
     float *maskData = NULL;
-    int y = 0;
     int x = 0;
     float z = 0;
     float sum = 0.0;
     float dev = 0.0;
 
-    float *buffer = NULL;
-
-    int *line = NULL;
-    UINT8 *line8 = NULL;
-
-    int pix = 0;
-    float newPixel[4];
-    int channel = 0;
-    int offset = 0;
-    INT32 newPixelFinals;
-
     int radius = 0;
     float remainder = 0.0;
 
     int i;
 
-    /* Do the gaussian blur */
-
-    /* For a symmetrical gaussian blur, instead of doing a radius*radius
-       matrix lookup, you get the EXACT same results by doing a radius*1
-       transform, followed by a 1*radius transform.  This reduces the
-       number of lookups exponentially (10 lookups per pixel for a
-       radius of 5 instead of 25 lookups).  So, we blur the lines first,
-       then we blur the resulting columns. */
-
     /* first, round radius off to the next higher integer and hold the
        remainder this is used so we can support float radius values
        properly. */
@@ -103,10 +83,13 @@ gblur(Imaging im, Imaging imOut, float floatRadius, int channels, int padding)
        so that it is a true "radius", not a diameter (the results match
        other paint programs closer that way too). */
     radius = (int) ((floatRadius * 2.0) + 2.0);
+    if (radius < 1)
+	radius = 1; /* negative radius */
 
     /* create the maskData for the gaussian curve */
     maskData = malloc(radius * sizeof(float));
-    /* FIXME: error checking */
+    if (!maskData)
+	return (float*) ImagingError_MemoryError();
     for (x = 0; x < radius; x++) {
 	z = ((float) (x + 2) / ((float) radius));
 	dev = 0.5 + (((float) (radius * radius)) * 0.001);
@@ -135,14 +118,56 @@ gblur(Imaging im, Imaging imOut, float floatRadius, int channels, int padding)
 	/* printf("%f\n", maskData[i]); */
     }
 
+    *size = radius;
+
+    return maskData;
+}
+
+static Imaging
+gblur(Imaging im, Imaging imOut, float floatRadius, int channels, int padding)
+{
+    ImagingSectionCookie cookie;
+
+    float *maskData = NULL;
+    int y = 0;
+    int x = 0;
+
+    float *buffer = NULL;
+
+    int *line = NULL;
+    UINT8 *line8 = NULL;
+
+    int pix = 0;
+    float newPixel[4];
+    int channel = 0;
+    int offset = 0;
+    INT32 newPixelFinals;
+
+    int radius = 0;
+
+    /* Do the gaussian blur */
+
+    /* For a symmetrical gaussian blur, instead of doing a radius*radius
+       matrix lookup, you get the EXACT same results by doing a radius*1
+       transform, followed by a 1*radius transform.  This reduces the
+       number of lookups exponentially (10 lookups per pixel for a
+       radius of 5 instead of 25 lookups).  So, we blur the lines first,
+       then we blur the resulting columns. */
+
+    maskData = gaussian_mask(floatRadius, &radius);
+    if (!maskData)
+	return NULL;
+
     /* create a temporary memory buffer for the data for the first pass
        memset the buffer to 0 so we can use it directly with += */
 
     /* don't bother about alpha/padding */
     buffer = calloc((size_t) (im->xsize * im->ysize * channels),
 		    sizeof(float));
-    if (buffer == NULL)
+    if (buffer == NULL) {
+	free(maskData);
 	return ImagingError_MemoryError();
+    }
 
     /* be nice to other threads while you go off to lala land */
     ImagingSectionEnter(&cookie);
@@ -245,6 +270,7 @@ gblur(Imaging im, Imaging imOut, float floatRadius, int channels, int padding)
 
     /* free the buffer */
     free(buffer);
+    free(maskData);
 
     /* get the GIL back so Python knows who you are */
     ImagingSectionLeave(&cookie);
@@ -252,7 +278,234 @@ gblur(Imaging im, Imaging imOut, float floatRadius, int channels, int padding)
     return imOut;
 }
 
-Imaging ImagingGaussianBlur(Imaging im, Imaging imOut, float radius)
+/* Extended box blur.  A few successive box blurs give a very good
+   approximation of a gaussian blur, and each box blur can be done
+   with a running sum, so the cost per pixel doesn't depend on the
+   radius.  To get the variance right for any radius, the box gets
+   fractional weights at both ends (see Gwosdek et al, "Theoretical
+   foundations of gaussian convolution by extended box filtering").
+
+   The boxes are sized to match the variance of the gblur curve for
+   the same radius. */
+
+#define BOXSTRIP 16 /* columns per strip in the vertical pass */
+
+struct boxblur_context {
+    float *buffer;
+    int xsize, ysize, channels;
+    int r; /* box radius */
+    float a; /* weight for the extra pixel at each end */
+    int passes;
+    int failed;
+};
+
+static void
+box_line(float *out, const float *in, int size, int lanes,
+	 int r, float a, double *sum)
+{
+    /* blur a line of size samples, where each sample has a number
+       of independent lanes.  edge pixels are repeated */
+
+    double scale = 1.0 / (2 * r + 1 + 2 * a);
+    int x, l, i, lo, hi, old;
+
+    for (l = 0; l < lanes; l++)
+	sum[l] = 0.0;
+    for (i = -r; i <= r; i++) {
+	x = (i < 0) ? 0 : (i >= size) ? size - 1 : i;
+	for (l = 0; l < lanes; l++)
+	    sum[l] += in[x * lanes + l];
+    }
+
+    for (x = 0; x < size; x++) {
+	lo = (x - r - 1 < 0) ? 0 : x - r - 1;
+	hi = (x + r + 1 >= size) ? size - 1 : x + r + 1;
+	old = (x - r < 0) ? 0 : x - r;
+	for (l = 0; l < lanes; l++) {
+	    out[x * lanes + l] = (float)
+		((sum[l] + a * (in[lo * lanes + l] + in[hi * lanes + l])) *
+		 scale);
+	    sum[l] += in[hi * lanes + l] - in[old * lanes + l];
+	}
+    }
+}
+
+static void
+boxblur_rows(void *context, int y0, int y1)
+{
+    struct boxblur_context *ctx = context;
+    int lanes = ctx->channels;
+    float *line, *tmp;
+    double *sum;
+    int y, pass;
+
+    line = malloc(2 * ctx->xsize * lanes * sizeof(float));
+    sum = malloc(lanes * sizeof(double));
+    if (!line || !sum) {
+	free(line);
+	free(sum);
+	ctx->failed = 1;
+	return;
+    }
+    tmp = line + ctx->xsize * lanes;
+
+    for (y = y0; y < y1; y++) {
+	float *row = ctx->buffer + y * ctx->xsize * lanes;
+	float *in = row, *out = line;
+	for (pass = 0; pass < ctx->passes; pass++) {
+	    box_line(out, in, ctx->xsize, lanes, ctx->r, ctx->a, sum);
+	    in = out;
+	    out = (in == line) ? tmp : line;
+	}
+	memcpy(row, in, ctx->xsize * lanes * sizeof(float));
+    }
+
+    free(sum);
+    free(line);
+}
+
+static void
+boxblur_columns(void *context, int s0, int s1)
+{
+    /* process strips s0 to s1.  each strip is copied to a separate
+       buffer, where the columns are stored next to each other */
+    struct boxblur_context *ctx = context;
+    int rowsize = ctx->xsize * ctx->channels;
+    float *strip, *tmp, *in, *out;
+    double *sum;
+    int s, x0, lanes, y, pass;
+
+    strip = malloc(2 * ctx->ysize * BOXSTRIP * ctx->channels * sizeof(float));
+    sum = malloc(BOXSTRIP * ctx->channels * sizeof(double));
+    if (!strip || !sum) {
+	free(strip);
+	free(sum);
+	ctx->failed = 1;
+	return;
+    }
+    tmp = strip + ctx->ysize * BOXSTRIP * ctx->channels;
+
+    for (s = s0; s < s1; s++) {
+	x0 = s * BOXSTRIP;
+	lanes = ctx->xsize - x0;
+	if (lanes > BOXSTRIP)
+	    lanes = BOXSTRIP;
+	lanes *= ctx->channels;
+	for (y = 0; y < ctx->ysize; y++)
+	    memcpy(strip + y * lanes,
+		   ctx->buffer + y * rowsize + x0 * ctx->channels,
+		   lanes * sizeof(float));
+	in = strip;
+	out = tmp;
+	for (pass = 0; pass < ctx->passes; pass++) {
+	    box_line(out, in, ctx->ysize, lanes, ctx->r, ctx->a, sum);
+	    in = out;
+	    out = (in == strip) ? tmp : strip;
+	}
+	for (y = 0; y < ctx->ysize; y++)
+	    memcpy(ctx->buffer + y * rowsize + x0 * ctx->channels,
+		   in + y * lanes, lanes * sizeof(float));
+    }
+
+    free(sum);
+    free(strip);
+}
+
+static Imaging
+boxblur(Imaging im, Imaging imOut, float floatRadius, int channels,
+	int passes)
+{
+    ImagingSectionCookie cookie;
+    struct boxblur_context ctx;
+    float *maskData;
+    double mean, variance, v;
+    int radius, offset, pix, x, y, c;
+
+    /* get the variance of the gblur curve */
+    maskData = gaussian_mask(floatRadius, &radius);
+    if (!maskData)
+	return NULL;
+    mean = variance = 0.0;
+    for (pix = 0; pix < radius; pix++) {
+	offset = (int) (-((float) radius / 2.0) + (float) pix + 0.5);
+	mean += maskData[pix] * offset;
+	variance += maskData[pix] * offset * offset;
+    }
+    variance -= mean * mean;
+    free(maskData);
+
+    /* size the boxes.  each pass contributes an equal share of the
+       variance.  a box with radius r has variance r(r+1)/3 */
+    v = variance / passes;
+    ctx.r = (int) floor((sqrt(12.0 * v + 1.0) - 1.0) / 2.0);
+    if (ctx.r < 0)
+	ctx.r = 0;
+    ctx.a = (float) ((2 * ctx.r + 1) * (v - ctx.r * (ctx.r + 1) / 3.0) /
+		     (2.0 * ((ctx.r + 1) * (ctx.r + 1) - v)));
+    if (ctx.a < 0)
+	ctx.a = 0;
+
+    ctx.xsize = im->xsize;
+    ctx.ysize = im->ysize;
+    ctx.channels = channels;
+    ctx.passes = passes;
+    ctx.failed = 0;
+
+    ctx.buffer = malloc((size_t) im->xsize * im->ysize * channels *
+			sizeof(float));
+    if (!ctx.buffer)
+	return ImagingError_MemoryError();
+
+    ImagingSectionEnter(&cookie);
+
+    for (y = 0; y < im->ysize; y++) {
+	float *row = ctx.buffer + y * im->xsize * channels;
+	UINT8 *in = (UINT8 *) im->image[y];
+	for (x = 0; x < im->xsize; x++)
+	    for (c = 0; c < channels; c++)
+		row[x * channels + c] = in[x * im->pixelsize + c];
+    }
+
+    ImagingParallelFor(im->ysize, 16, boxblur_rows, &ctx);
+    if (!ctx.failed)
+	ImagingParallelFor((im->xsize + BOXSTRIP - 1) / BOXSTRIP, 4,
+			   boxblur_columns, &ctx);
+
+    for (y = 0; y < im->ysize; y++) {
+	float *row = ctx.buffer + y * im->xsize * channels;
+	UINT8 *out = (UINT8 *) imOut->image[y];
+	UINT8 *in = (UINT8 *) im->image[y];
+	for (x = 0; x < im->xsize; x++) {
+	    for (c = 0; c < channels; c++)
+		out[x * im->pixelsize + c] = clip(row[x * channels + c]);
+	    /* copy alpha/padding */
+	    for (; c < im->pixelsize; c++)
+		out[x * im->pixelsize + c] = in[x * im->pixelsize + c];
+	}
+    }
+
+    ImagingSectionLeave(&cookie);
+
+    free(ctx.buffer);
+
+    if (ctx.failed)
+	return ImagingError_MemoryError();
+
+    return imOut;
+}
+
+static Imaging
+blur(Imaging im, Imaging imOut, float radius, int channels, int padding,
+     int passes)
+{
+    /* passes = 0 means the exact gaussian curve */
+    if (passes > 0)
+	return boxblur(im, imOut, radius, channels, passes);
+    return gblur(im, imOut, radius, channels, padding);
+}
+
+Imaging ImagingGaussianBlur(Imaging im, Imaging imOut, float radius,
+			    int passes)
 {
     int channels = 0;
     int padding = 0;
@@ -275,12 +528,12 @@ Imaging ImagingGaussianBlur(Imaging im, Imaging imOut, float radius)
     } else
 	return ImagingError_ModeError();
 
-    return gblur(im, imOut, radius, channels, padding);
+    return blur(im, imOut, radius, channels, padding, passes);
 }
 
 Imaging
 ImagingUnsharpMask(Imaging im, Imaging imOut, float radius, int percent,
-		   int threshold)
+		   int threshold, int passes)
 {
     ImagingSectionCookie cookie;
 
@@ -321,7 +574,7 @@ ImagingUnsharpMask(Imaging im, Imaging imOut, float radius, int percent,
 
     /* first, do a gaussian blur on the image, putting results in imOut
        temporarily */
-    result = gblur(im, imOut, radius, channels, padding);
+    result = blur(im, imOut, radius, channels, padding, passes);
     if (!result)
 	return NULL;
 
@@ -33,10 +33,16 @@ typedef struct {
     /* compression strategy Z_XXX */
     int compress_type;
 
+    /* PNG filter type (0-4), or -1 to pick the best one for each line */
+    int filter;
+
     /* Predefined dictionary (experimental) */
     char* dictionary;
     int dictionary_size;
 
+    /* Compress bands of the image in parallel (PNG only) */
+    int parallel;
+
     /* PRIVATE CONTEXT (set by decoder/encoder) */
 
     z_stream z_stream;		/* (de)compression stream */
@@ -53,10 +59,16 @@ typedef struct {
 
     UINT8* output;		/* output data */
 
+    UINT8* pbuffer;		/* output from parallel encoder (allocated) */
+    int pbuffer_size;
+    int pbuffer_offset;
+
     int prefix;			/* size of filter prefix (0 for TIFF data) */
     
     int interlaced;		/* is the image interlaced? (PNG) */
     
     int pass;			/* current pass of the interlaced image (PNG) */
 
+    int stopped;		/* decoder stopped at ystop (may have output) */
+
 } ZIPSTATE;
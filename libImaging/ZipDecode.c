@@ -18,6 +18,12 @@
 
 #include "Imaging.h"
 
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define USE_SIMD
+#include <immintrin.h>
+#endif
+
 #ifdef	HAVE_LIBZ
 
 #include "Zip.h"
@@ -36,6 +42,103 @@ static int get_row_len(ImagingCodecState state, int pass)
     return ((row_len * state->bits) + 7) / 8;
 }
 
+/* -------------------------------------------------------------------- */
+/* SSSE3 reconstruction.  Each pixel depends on the one to its left, so
+   for 3- and 4-byte pixels, the filters are undone one pixel at a time,
+   with all bytes of the pixel in one register (the same approach as
+   libpng).  ROW and PREVIOUS point to the first byte after the filter
+   selector, and BYTES must be a multiple of BPP. */
+
+#ifdef USE_SIMD
+
+__attribute__((target("ssse3"))) static __m128i
+load_pixel(const UINT8* p, int bpp)
+{
+    UINT32 v = 0;
+    memcpy(&v, p, bpp);
+    return _mm_cvtsi32_si128((int) v);
+}
+
+__attribute__((target("ssse3"))) static void
+store_pixel(UINT8* p, __m128i v, int bpp)
+{
+    UINT32 u = (UINT32) _mm_cvtsi128_si32(v);
+    memcpy(p, &u, bpp);
+}
+
+__attribute__((target("ssse3"))) static void
+unprior_ssse3(UINT8* row, int bpp, int bytes)
+{
+    __m128i a = _mm_setzero_si128();
+    int i;
+    for (i = 0; i < bytes; i += bpp) {
+	a = _mm_add_epi8(load_pixel(row + i, bpp), a);
+	store_pixel(row + i, a, bpp);
+    }
+}
+
+__attribute__((target("ssse3"))) static void
+unup_ssse3(UINT8* row, const UINT8* previous, int bytes)
+{
+    int i;
+    for (i = 0; i + 16 <= bytes; i += 16)
+	_mm_storeu_si128((__m128i*) (row + i), _mm_add_epi8(
+	    _mm_loadu_si128((const __m128i*) (row + i)),
+	    _mm_loadu_si128((const __m128i*) (previous + i))));
+    for (; i < bytes; i++)
+	row[i] += previous[i];
+}
+
+__attribute__((target("ssse3"))) static void
+unaverage_ssse3(UINT8* row, const UINT8* previous, int bpp, int bytes)
+{
+    /* pavgb rounds up; subtract the lost bit to get (a + b) / 2 */
+    __m128i one = _mm_set1_epi8(1);
+    __m128i a = _mm_setzero_si128();
+    int i;
+    for (i = 0; i < bytes; i += bpp) {
+	__m128i b = load_pixel(previous + i, bpp);
+	__m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b),
+				   _mm_and_si128(_mm_xor_si128(a, b), one));
+	a = _mm_add_epi8(load_pixel(row + i, bpp), avg);
+	store_pixel(row + i, a, bpp);
+    }
+}
+
+__attribute__((target("ssse3"))) static void
+unpaeth_ssse3(UINT8* row, const UINT8* previous, int bpp, int bytes)
+{
+    /* the first pixel has no left neighbours; with a and c set to
+       zero, the predictor picks b as it should */
+    __m128i zero = _mm_setzero_si128();
+    __m128i a = zero, c = zero;
+    int i;
+    for (i = 0; i < bytes; i += bpp) {
+	__m128i b = _mm_unpacklo_epi8(load_pixel(previous + i, bpp), zero);
+	__m128i pa = _mm_sub_epi16(b, c);
+	__m128i pb = _mm_sub_epi16(a, c);
+	__m128i pc = _mm_abs_epi16(_mm_add_epi16(pa, pb));
+	__m128i smallest, mask, nearest;
+	pa = _mm_abs_epi16(pa);
+	pb = _mm_abs_epi16(pb);
+	smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+	/* ties are resolved in favour of a, then b */
+	mask = _mm_cmpeq_epi16(smallest, pb);
+	nearest = _mm_or_si128(_mm_and_si128(mask, b),
+			       _mm_andnot_si128(mask, c));
+	mask = _mm_cmpeq_epi16(smallest, pa);
+	nearest = _mm_or_si128(_mm_and_si128(mask, a),
+			       _mm_andnot_si128(mask, nearest));
+	a = _mm_add_epi8(load_pixel(row + i, bpp),
+			 _mm_packus_epi16(nearest, nearest));
+	store_pixel(row + i, a, bpp);
+	a = _mm_unpacklo_epi8(a, zero);
+	c = b;
+    }
+}
+
+#endif
+
 /* -------------------------------------------------------------------- */
 /* Decoder								*/
 /* -------------------------------------------------------------------- */
@@ -102,8 +205,12 @@ ImagingZipDecode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
     context->z_stream.next_in = buf;
     context->z_stream.avail_in = bytes;
 
-    /* Decompress what we've got this far */
-    while (context->z_stream.avail_in > 0) {
+    /* Decompress what we've got this far.  if we stopped at ystop
+       last time, the inflater may have more output even if there's
+       no more input */
+    while (context->z_stream.avail_in > 0 || context->stopped) {
+
+	context->stopped = 0;
 
 	context->z_stream.next_out = state->buffer + context->last_output;
 	context->z_stream.avail_out =
@@ -111,7 +218,7 @@ ImagingZipDecode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 
 	err = inflate(&context->z_stream, Z_NO_FLUSH);
 
-	if (err < 0) {
+	if (err < 0 && err != Z_BUF_ERROR) { /* BUF_ERROR: no progress */
 	    /* Something went wrong inside the compression library */
 	    if (err == Z_DATA_ERROR)
 		state->errcode = IMAGING_CODEC_BROKEN;
@@ -140,17 +247,38 @@ ImagingZipDecode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 	    case 1:
 		/* prior */
 		bpp = (state->bits + 7) / 8;
+#ifdef USE_SIMD
+		if ((bpp == 3 || bpp == 4) &&
+		    (ImagingCPUFeatures() & IMAGING_CPU_SSSE3)) {
+		    unprior_ssse3(state->buffer+1, bpp, row_len);
+		    break;
+		}
+#endif
 		for (i = bpp+1; i <= row_len; i++)
 		    state->buffer[i] += state->buffer[i-bpp];
 		break;
 	    case 2:
 		/* up */
+#ifdef USE_SIMD
+		if (ImagingCPUFeatures() & IMAGING_CPU_SSSE3) {
+		    unup_ssse3(state->buffer+1, context->previous+1, row_len);
+		    break;
+		}
+#endif
 		for (i = 1; i <= row_len; i++)
 		    state->buffer[i] += context->previous[i];
 		break;
 	    case 3:
 		/* average */
 		bpp = (state->bits + 7) / 8;
+#ifdef USE_SIMD
+		if ((bpp == 3 || bpp == 4) &&
+		    (ImagingCPUFeatures() & IMAGING_CPU_SSSE3)) {
+		    unaverage_ssse3(state->buffer+1, context->previous+1,
+				    bpp, row_len);
+		    break;
+		}
+#endif
 		for (i = 1; i <= bpp; i++)
 		    state->buffer[i] += context->previous[i]/2;
 		for (; i <= row_len; i++)
@@ -160,6 +288,14 @@ ImagingZipDecode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 	    case 4:
 		/* paeth filtering */
 		bpp = (state->bits + 7) / 8;
+#ifdef USE_SIMD
+		if ((bpp == 3 || bpp == 4) &&
+		    (ImagingCPUFeatures() & IMAGING_CPU_SSSE3)) {
+		    unpaeth_ssse3(state->buffer+1, context->previous+1,
+				  bpp, row_len);
+		    break;
+		}
+#endif
 		for (i = 1; i <= bpp; i++)
 		    state->buffer[i] += context->previous[i];
 		for (; i <= row_len; i++) {
@@ -190,8 +326,9 @@ ImagingZipDecode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 	    }
 	    break;
 	case ZIP_TIFF_PREDICTOR:
+	    /* no filter prefix in TIFF mode */
 	    bpp = (state->bits + 7) / 8;
-	    for (i = bpp+1; i <= row_len; i++)
+	    for (i = bpp; i < row_len; i++)
 		state->buffer[i] += state->buffer[i-bpp];
 	    break;
 	}
@@ -262,6 +399,12 @@ ImagingZipDecode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 	state->buffer = context->previous;
 	context->previous = ptr;
 
+	if (state->ystop && state->y >= state->ystop) {
+	    /* caller wants the lines */
+	    context->stopped = 1;
+	    return bytes - context->z_stream.avail_in;
+	}
+
     }
 
     return bytes; /* consumed all of it */
@@ -17,10 +17,607 @@
 
 #include "Imaging.h"
 
+#if defined(__GNUC__) && (__GNUC__ >= 5 || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define USE_AVX2
+#include <immintrin.h>
+#endif
+
 #ifdef	HAVE_LIBZ
 
 #include "Zip.h"
 
+/* -------------------------------------------------------------------- */
+/* AVX2 filters.  Each kernel filters the bytes from I and up, as long
+   as there's a full vector left, adds the sum of the absolute values
+   of the filtered bytes (as signed bytes) to SUM, and returns the
+   index of the first byte it didn't handle.  The encoder filters the
+   original data, so this works for any pixel size. */
+
+#ifdef USE_AVX2
+
+__attribute__((target("avx2"))) static int
+hsum_avx2(__m256i acc)
+{
+    __m128i v = _mm_add_epi64(_mm256_castsi256_si128(acc),
+			      _mm256_extracti128_si256(acc, 1));
+    v = _mm_add_epi64(v, _mm_unpackhi_epi64(v, v));
+    return _mm_cvtsi128_si32(v);
+}
+
+/* sum of absolute differences from zero */
+#define	SAD(v) _mm256_sad_epu8(_mm256_abs_epi8(v), zero)
+
+__attribute__((target("avx2"))) static int
+none_avx2(const UINT8* line, int i, int bytes, int* sum)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (; i + 32 <= bytes + 1; i += 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i*) (line + i));
+	acc = _mm256_add_epi64(acc, SAD(v));
+    }
+    *sum += hsum_avx2(acc);
+    return i;
+}
+
+__attribute__((target("avx2"))) static int
+up_avx2(UINT8* out, const UINT8* line, const UINT8* previous,
+	int i, int bytes, int* sum)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (; i + 32 <= bytes + 1; i += 32) {
+	__m256i v = _mm256_sub_epi8(
+	    _mm256_loadu_si256((const __m256i*) (line + i)),
+	    _mm256_loadu_si256((const __m256i*) (previous + i)));
+	_mm256_storeu_si256((__m256i*) (out + i), v);
+	acc = _mm256_add_epi64(acc, SAD(v));
+    }
+    *sum += hsum_avx2(acc);
+    return i;
+}
+
+__attribute__((target("avx2"))) static int
+prior_avx2(UINT8* out, const UINT8* line, int bpp,
+	   int i, int bytes, int* sum)
+{
+    __m256i zero = _mm256_setzero_si256();
+    __m256i acc = zero;
+    for (; i + 32 <= bytes + 1; i += 32) {
+	__m256i v = _mm256_sub_epi8(
+	    _mm256_loadu_si256((const __m256i*) (line + i)),
+	    _mm256_loadu_si256((const __m256i*) (line + i - bpp)));
+	_mm256_storeu_si256((__m256i*) (out + i), v);
+	acc = _mm256_add_epi64(acc, SAD(v));
+    }
+    *sum += hsum_avx2(acc);
+    return i;
+}
+
+__attribute__((target("avx2"))) static int
+average_avx2(UINT8* out, const UINT8* line, const UINT8* previous, int bpp,
+	     int i, int bytes, int* sum)
+{
+    /* pavgb rounds up; subtract the lost bit to get (a + b) / 2 */
+    __m256i zero = _mm256_setzero_si256();
+    __m256i one = _mm256_set1_epi8(1);
+    __m256i acc = zero;
+    for (; i + 32 <= bytes + 1; i += 32) {
+	__m256i a = _mm256_loadu_si256((const __m256i*) (line + i - bpp));
+	__m256i b = _mm256_loadu_si256((const __m256i*) (previous + i));
+	__m256i avg = _mm256_sub_epi8(
+	    _mm256_avg_epu8(a, b),
+	    _mm256_and_si256(_mm256_xor_si256(a, b), one));
+	__m256i v = _mm256_sub_epi8(
+	    _mm256_loadu_si256((const __m256i*) (line + i)), avg);
+	_mm256_storeu_si256((__m256i*) (out + i), v);
+	acc = _mm256_add_epi64(acc, SAD(v));
+    }
+    *sum += hsum_avx2(acc);
+    return i;
+}
+
+__attribute__((target("avx2"))) static int
+paeth_avx2(UINT8* out, const UINT8* line, const UINT8* previous, int bpp,
+	   int i, int bytes, int* sum)
+{
+    /* the predictor is computed on 16-bit values, 16 bytes at a time */
+    __m128i acc = _mm_setzero_si128();
+    for (; i + 16 <= bytes + 1; i += 16) {
+	__m256i a = _mm256_cvtepu8_epi16(
+	    _mm_loadu_si128((const __m128i*) (line + i - bpp)));
+	__m256i b = _mm256_cvtepu8_epi16(
+	    _mm_loadu_si128((const __m128i*) (previous + i)));
+	__m256i c = _mm256_cvtepu8_epi16(
+	    _mm_loadu_si128((const __m128i*) (previous + i - bpp)));
+	__m256i pa = _mm256_sub_epi16(b, c);
+	__m256i pb = _mm256_sub_epi16(a, c);
+	__m256i pc = _mm256_abs_epi16(_mm256_add_epi16(pa, pb));
+	__m256i smallest, nearest;
+	__m128i p;
+	pa = _mm256_abs_epi16(pa);
+	pb = _mm256_abs_epi16(pb);
+	smallest = _mm256_min_epi16(pc, _mm256_min_epi16(pa, pb));
+	/* ties are resolved in favour of a, then b */
+	nearest = _mm256_blendv_epi8(
+	    _mm256_blendv_epi8(c, b, _mm256_cmpeq_epi16(smallest, pb)),
+	    a, _mm256_cmpeq_epi16(smallest, pa));
+	p = _mm_packus_epi16(_mm256_castsi256_si128(nearest),
+			     _mm256_extracti128_si256(nearest, 1));
+	p = _mm_sub_epi8(_mm_loadu_si128((const __m128i*) (line + i)), p);
+	_mm_storeu_si128((__m128i*) (out + i), p);
+	acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_abs_epi8(p),
+					      _mm_setzero_si128()));
+    }
+    acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+    *sum += _mm_cvtsi128_si32(acc);
+    return i;
+}
+
+#undef	SAD
+
+#endif
+
+/* Each filter writes the filtered line to OUT, and returns the total
+   distance from zero for the filtered data.  LINE and PREVIOUS hold
+   the current and the previous line, after a one-byte filter selector
+   (taken from LIBPNG) */
+
+static int
+filter_none(UINT8* line, int bytes)
+{
+    int i = 1, sum = 0;
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+	i = none_avx2(line, i, bytes, &sum);
+#endif
+    for (; i <= bytes; i++) {
+	UINT8 v = line[i];
+	sum += (v < 128) ? v : 256 - v;
+    }
+    return sum;
+}
+
+static int
+filter_prior(UINT8* out, UINT8* line, int bytes, int bpp)
+{
+    int i, s;
+    for (i = 1, s = 0; i <= bpp; i++) {
+	UINT8 v = line[i];
+	out[i] = v;
+	s += (v < 128) ? v : 256 - v;
+    }
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+	i = prior_avx2(out, line, bpp, i, bytes, &s);
+#endif
+    for (; i <= bytes; i++) {
+	UINT8 v = line[i] - line[i-bpp];
+	out[i] = v;
+	s += (v < 128) ? v : 256 - v;
+    }
+    return s;
+}
+
+static int
+filter_up(UINT8* out, UINT8* line, UINT8* previous, int bytes)
+{
+    int i = 1, s = 0;
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+	i = up_avx2(out, line, previous, i, bytes, &s);
+#endif
+    for (; i <= bytes; i++) {
+	UINT8 v = line[i] - previous[i];
+	out[i] = v;
+	s += (v < 128) ? v : 256 - v;
+    }
+    return s;
+}
+
+static int
+filter_average(UINT8* out, UINT8* line, UINT8* previous, int bytes, int bpp)
+{
+    int i, s;
+    for (i = 1, s = 0; i <= bpp; i++) {
+	UINT8 v = line[i] - previous[i]/2;
+	out[i] = v;
+	s += (v < 128) ? v : 256 - v;
+    }
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+	i = average_avx2(out, line, previous, bpp, i, bytes, &s);
+#endif
+    for (; i <= bytes; i++) {
+	UINT8 v = line[i] - (line[i-bpp] + previous[i])/2;
+	out[i] = v;
+	s += (v < 128) ? v : 256 - v;
+    }
+    return s;
+}
+
+static int
+filter_paeth(UINT8* out, UINT8* line, UINT8* previous, int bytes, int bpp)
+{
+    int i, s;
+    for (i = 1, s = 0; i <= bpp; i++) {
+	UINT8 v = line[i] - previous[i];
+	out[i] = v;
+	s += (v < 128) ? v : 256 - v;
+    }
+#ifdef USE_AVX2
+    if (ImagingCPUFeatures() & IMAGING_CPU_AVX2)
+	i = paeth_avx2(out, line, previous, bpp, i, bytes, &s);
+#endif
+    for (; i <= bytes; i++) {
+	UINT8 v;
+	int a, b, c;
+	int pa, pb, pc;
+
+	/* fetch pixels */
+	a = line[i-bpp];
+	b = previous[i];
+	c = previous[i-bpp];
+
+	/* distances to surrounding pixels */
+	pa = abs(b - c);
+	pb = abs(a - c);
+	pc = abs(a + b - 2*c);
+
+	/* pick predictor with the shortest distance */
+	v = line[i] -
+	    ((pa <= pb && pa <= pc) ? a :
+	     (pb <= pc) ? b : c);
+	out[i] = v;
+	s += (v < 128) ? v : 256 - v;
+    }
+    return s;
+}
+
+/* Filter one line of PNG data, and return the buffer that holds the
+   result.  If the filter type is not given, this uses the filter that
+   gives the least total distance from zero for the filtered data */
+
+static UINT8*
+filter_line(ZIPSTATE* context, UINT8* line, UINT8* previous,
+	    int bytes, int bpp,
+	    UINT8* prior, UINT8* up, UINT8* average, UINT8* paeth)
+{
+    UINT8* output = line;
+    int s, sum;
+
+    /* Fixed filter; only compute that one */
+    switch (context->filter) {
+    case 0:
+	return line;
+    case 1:
+	filter_prior(prior, line, bytes, bpp);
+	return prior;
+    case 2:
+	filter_up(up, line, previous, bytes);
+	return up;
+    case 3:
+	filter_average(average, line, previous, bytes, bpp);
+	return average;
+    case 4:
+	filter_paeth(paeth, line, previous, bytes, bpp);
+	return paeth;
+    }
+
+    /* 0. No filter */
+    sum = filter_none(line, bytes);
+
+    /* 2. Up.  We'll test this first to save time when
+       an image line is identical to the one above. */
+    if (sum > 0) {
+	s = filter_up(up, line, previous, bytes);
+	if (s < sum) {
+	    output = up;
+	    sum = s; /* 0 if line was duplicated */
+	}
+    }
+
+    /* 1. Prior */
+    if (sum > 0) {
+	s = filter_prior(prior, line, bytes, bpp);
+	if (s < sum) {
+	    output = prior;
+	    sum = s; /* 0 if line is solid */
+	}
+    }
+
+    /* 3. Average (not very common in real-life images,
+       so its only used with the optimize option) */
+    if (context->optimize && sum > 0) {
+	s = filter_average(average, line, previous, bytes, bpp);
+	if (s < sum) {
+	    output = average;
+	    sum = s;
+	}
+    }
+
+    /* 4. Paeth */
+    if (sum > 0) {
+	s = filter_paeth(paeth, line, previous, bytes, bpp);
+	if (s < sum) {
+	    output = paeth;
+	    sum = s;
+	}
+    }
+
+    return output;
+}
+
+
+/* -------------------------------------------------------------------- */
+/* Parallel encoder							*/
+/* -------------------------------------------------------------------- */
+
+/* The image is split into bands of at least BAND_SIZE bytes of filtered
+   data.  The bands are first filtered and then deflated in parallel,
+   each to a raw deflate stream that uses the end of the previous band
+   as a preset dictionary.  All bands but the last end with a sync
+   flush, so the streams can simply be concatenated (the same approach
+   as pigz).  The band size doesn't depend on the number of threads, so
+   the output doesn't either. */
+
+#define	BAND_SIZE 131072
+#define	WINDOW_SIZE 32768
+
+typedef struct {
+    Imaging im;
+    ImagingCodecState state;
+    ZIPSTATE* context;
+    int rows;			/* rows per band */
+    int bands;
+    int linesize;		/* bytes per filtered line */
+    UINT8* data;		/* filtered image data */
+    UINT8** output;		/* deflated bands */
+    int* output_size;
+    uLong* adler;		/* checksum for each band */
+    int level;
+    int strategy;
+    int failed;
+} ZIPBANDS;
+
+static void
+shuffle_line(ZIPBANDS* ctx, UINT8* out, int y)
+{
+    ImagingCodecState state = ctx->state;
+    state->shuffle(out + 1,
+		   (UINT8*) ctx->im->image[y + state->yoff] +
+		   state->xoff * ctx->im->pixelsize,
+		   state->xsize);
+}
+
+static void
+filter_bands(void* context, int start, int end)
+{
+    ZIPBANDS* ctx = (ZIPBANDS*) context;
+    ImagingCodecState state = ctx->state;
+    int bytes = state->bytes;
+    int bpp = (state->bits + 7) / 8;
+    UINT8 *buffer, *line, *previous, *output, *ptr;
+    int y, y0, y1;
+
+    /* line, previous line, and the four filters */
+    buffer = (UINT8*) calloc(6, bytes+1);
+    if (!buffer) {
+	ctx->failed = 1;
+	return;
+    }
+    line = buffer;
+    previous = buffer + (bytes+1);
+    buffer[2*(bytes+1)] = 1;
+    buffer[3*(bytes+1)] = 2;
+    buffer[4*(bytes+1)] = 3;
+    buffer[5*(bytes+1)] = 4;
+
+    y0 = start * ctx->rows;
+    y1 = end * ctx->rows;
+    if (y1 > state->ysize)
+	y1 = state->ysize;
+
+    /* the first line is filtered against the line above it */
+    if (y0 > 0 && ctx->context->mode == ZIP_PNG)
+	shuffle_line(ctx, previous, y0-1);
+
+    for (y = y0; y < y1; y++) {
+	shuffle_line(ctx, line, y);
+	output = line;
+	if (ctx->context->mode == ZIP_PNG)
+	    output = filter_line(ctx->context, line, previous, bytes, bpp,
+				 buffer + 2*(bytes+1), buffer + 3*(bytes+1),
+				 buffer + 4*(bytes+1), buffer + 5*(bytes+1));
+	memcpy(ctx->data + (size_t) y * ctx->linesize, output, bytes+1);
+	ptr = line; line = previous; previous = ptr;
+    }
+
+    free(buffer);
+}
+
+static void
+deflate_bands(void* context, int start, int end)
+{
+    ZIPBANDS* ctx = (ZIPBANDS*) context;
+    z_stream z;
+    int band, last, err;
+    size_t offset, size, window;
+
+    for (band = start; band < end; band++) {
+
+	last = (band == ctx->bands - 1);
+	offset = (size_t) band * ctx->rows * ctx->linesize;
+	if (last)
+	    size = (size_t) ctx->state->ysize * ctx->linesize - offset;
+	else
+	    size = (size_t) ctx->rows * ctx->linesize;
+
+	z.zalloc = (alloc_func)0;
+	z.zfree = (free_func)0;
+	z.opaque = (voidpf)0;
+	if (deflateInit2(&z, ctx->level, Z_DEFLATED, -15, 9,
+			 ctx->strategy) != Z_OK) {
+	    ctx->failed = 1;
+	    return;
+	}
+
+	/* continue where the previous band left off */
+	if (band > 0) {
+	    window = (offset < WINDOW_SIZE) ? offset : WINDOW_SIZE;
+	    if (deflateSetDictionary(&z, ctx->data + offset - window,
+				     (uInt) window) != Z_OK) {
+		deflateEnd(&z);
+		ctx->failed = 1;
+		return;
+	    }
+	}
+
+	/* room for the data, plus an empty block from the sync flush */
+	ctx->output_size[band] = (int) deflateBound(&z, (uLong) size) + 16;
+	ctx->output[band] = (UINT8*) malloc(ctx->output_size[band]);
+	if (!ctx->output[band]) {
+	    deflateEnd(&z);
+	    ctx->failed = 1;
+	    return;
+	}
+
+	z.next_in = ctx->data + offset;
+	z.avail_in = (uInt) size;
+	z.next_out = ctx->output[band];
+	z.avail_out = ctx->output_size[band];
+
+	err = deflate(&z, (last) ? Z_FINISH : Z_SYNC_FLUSH);
+	if ((last) ? err != Z_STREAM_END :
+	    (err != Z_OK || z.avail_in > 0 || z.avail_out == 0))
+	    ctx->failed = 1;
+
+	ctx->output_size[band] -= z.avail_out;
+	ctx->adler[band] = adler32(adler32(0L, Z_NULL, 0),
+				   ctx->data + offset, (uInt) size);
+
+	deflateEnd(&z);
+	if (ctx->failed)
+	    return;
+    }
+}
+
+static int
+encode_bands(Imaging im, ImagingCodecState state, ZIPSTATE* context,
+	     int level, int strategy)
+{
+    ZIPBANDS ctx;
+    ImagingSectionCookie cookie;
+    uLong adler;
+    size_t size;
+    int band, header, flags;
+    UINT8* ptr;
+
+    ctx.im = im;
+    ctx.state = state;
+    ctx.context = context;
+    ctx.linesize = state->bytes+1;
+    ctx.rows = (BAND_SIZE + ctx.linesize - 1) / ctx.linesize;
+    ctx.bands = (state->ysize + ctx.rows - 1) / ctx.rows;
+    ctx.level = level;
+    ctx.strategy = strategy;
+    ctx.failed = 0;
+
+    ctx.data = (UINT8*) malloc((size_t) state->ysize * ctx.linesize);
+    ctx.output = (UINT8**) calloc(ctx.bands, sizeof(UINT8*));
+    ctx.output_size = (int*) calloc(ctx.bands, sizeof(int));
+    ctx.adler = (uLong*) calloc(ctx.bands, sizeof(uLong));
+    if (!ctx.data || !ctx.output || !ctx.output_size || !ctx.adler)
+	ctx.failed = 1;
+
+    if (!ctx.failed) {
+	ImagingSectionEnter(&cookie);
+	ImagingParallelFor(ctx.bands, 1, filter_bands, &ctx);
+	if (!ctx.failed)
+	    ImagingParallelFor(ctx.bands, 1, deflate_bands, &ctx);
+	ImagingSectionLeave(&cookie);
+    }
+
+    /* Join the bands into a zlib stream */
+    context->pbuffer = NULL;
+    if (!ctx.failed) {
+	size = 2 + 4;
+	for (band = 0; band < ctx.bands; band++)
+	    size += ctx.output_size[band];
+	context->pbuffer = (UINT8*) malloc(size);
+	context->pbuffer_size = (int) size;
+	context->pbuffer_offset = 0;
+    }
+
+    if (context->pbuffer) {
+
+	/* same header as deflate would write for this level */
+	if (level == Z_DEFAULT_COMPRESSION)
+	    level = 6;
+	if (strategy >= Z_HUFFMAN_ONLY || level < 2)
+	    flags = 0;
+	else if (level < 6)
+	    flags = 1;
+	else if (level == 6)
+	    flags = 2;
+	else
+	    flags = 3;
+	header = (0x78 << 8) | (flags << 6);
+	header += 31 - (header % 31);
+
+	ptr = context->pbuffer;
+	*ptr++ = (UINT8) (header >> 8);
+	*ptr++ = (UINT8) header;
+
+	adler = adler32(0L, Z_NULL, 0);
+	for (band = 0; band < ctx.bands; band++) {
+	    memcpy(ptr, ctx.output[band], ctx.output_size[band]);
+	    ptr += ctx.output_size[band];
+	    adler = adler32_combine(adler, ctx.adler[band],
+				    (band == ctx.bands - 1) ?
+				    (z_off_t) (state->ysize - band * ctx.rows) *
+				    ctx.linesize :
+				    (z_off_t) ctx.rows * ctx.linesize);
+	}
+
+	*ptr++ = (UINT8) (adler >> 24);
+	*ptr++ = (UINT8) (adler >> 16);
+	*ptr++ = (UINT8) (adler >> 8);
+	*ptr++ = (UINT8) adler;
+    }
+
+    if (ctx.output)
+	for (band = 0; band < ctx.bands; band++)
+	    free(ctx.output[band]);
+    free(ctx.output);
+    free(ctx.output_size);
+    free(ctx.adler);
+    free(ctx.data);
+
+    if (!context->pbuffer) {
+	state->errcode = IMAGING_CODEC_MEMORY;
+	return -1;
+    }
+
+    return 0;
+}
+
+
+static void
+free_buffers(ZIPSTATE* context)
+{
+    /* release filter and output buffers (safe to call more than once) */
+    free(context->paeth);
+    free(context->average);
+    free(context->up);
+    free(context->prior);
+    free(context->previous);
+    free(context->pbuffer);
+    context->paeth = context->average = context->up = NULL;
+    context->prior = context->previous = context->pbuffer = NULL;
+}
+
 int
 ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 {
@@ -28,7 +625,6 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
     int err;
     int compress_level, compress_type;
     UINT8* ptr;
-    int i, bpp, s, sum;
     ImagingSectionCookie cookie;
 
     if (!state->state) {
@@ -37,6 +633,31 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 
 	/* Valid modes are ZIP_PNG, ZIP_PNG_PALETTE, and ZIP_TIFF */
 
+	compress_level = (context->optimize) ? Z_BEST_COMPRESSION
+					     : context->compress_level;
+
+	if (context->compress_type == -1) {
+	    compress_type = (context->mode == ZIP_PNG) ? Z_FILTERED
+						       : Z_DEFAULT_STRATEGY;
+	} else {
+	    compress_type = context->compress_type;
+	}
+
+	if (context->parallel && !context->dictionary_size) {
+	    /* Compress the whole image in one go, and return it piece by
+	       piece (state 3) */
+	    if (encode_bands(im, state, context,
+			     compress_level, compress_type) < 0)
+		return -1;
+	    state->state = 3;
+	}
+
+    }
+
+    if (!state->state) {
+
+	/* Sequential encoder */
+
 	/* Expand standard buffer to make room for the filter selector,
 	   and allocate filter buffers */
 	free(state->buffer);
@@ -48,11 +669,7 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 	context->paeth = (UINT8*) malloc(state->bytes+1);
 	if (!state->buffer || !context->previous || !context->prior ||
 	    !context->up || !context->average || !context->paeth) {
-	    free(context->paeth);
-	    free(context->average);
-	    free(context->up);
-	    free(context->prior);
-	    free(context->previous);
+	    free_buffers(context);
 	    state->errcode = IMAGING_CODEC_MEMORY;
 	    return -1;
 	}
@@ -74,16 +691,6 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 	context->z_stream.next_in = 0;
 	context->z_stream.avail_in = 0;
 
-	compress_level = (context->optimize) ? Z_BEST_COMPRESSION
-					     : context->compress_level;
-
-	if (context->compress_type == -1) {
-	    compress_type = (context->mode == ZIP_PNG) ? Z_FILTERED
-						       : Z_DEFAULT_STRATEGY;
-	} else {
-	    compress_type = context->compress_type;
-	}
-
 	err = deflateInit2(&context->z_stream,
 			   /* compression level */
 			   compress_level,
@@ -112,6 +719,19 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 
     }
 
+    if (state->state == 3) {
+	int n = context->pbuffer_size - context->pbuffer_offset;
+	if (n > bytes)
+	    n = bytes;
+	memcpy(buf, context->pbuffer + context->pbuffer_offset, n);
+	context->pbuffer_offset += n;
+	if (context->pbuffer_offset >= context->pbuffer_size) {
+	    free_buffers(context);
+	    state->errcode = IMAGING_CODEC_END;
+	}
+	return n;
+    }
+
     /* Setup the destination buffer */
     context->z_stream.next_out = buf;
     context->z_stream.avail_out = bytes;
@@ -127,11 +747,7 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 		state->errcode = IMAGING_CODEC_MEMORY;
 	    else
 		state->errcode = IMAGING_CODEC_CONFIG;
-	    free(context->paeth);
-	    free(context->average);
-	    free(context->up);
-	    free(context->prior);
-	    free(context->previous);
+	    free_buffers(context);
 	    deflateEnd(&context->z_stream);
 	    return -1;
 	}
@@ -164,108 +780,14 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 
 		context->output = state->buffer;
 
-		if (context->mode == ZIP_PNG) {
-
-		    /* Filter the image data.  For each line, select
-		       the filter that gives the least total distance
-		       from zero for the filtered data (taken from
-		       LIBPNG) */
-
-		    bpp = (state->bits + 7) / 8;
-
-		    /* 0. No filter */
-		    for (i = 1, sum = 0; i <= state->bytes; i++) {
-			UINT8 v = state->buffer[i];
-			sum += (v < 128) ? v : 256 - v;
-		    }
-
-		    /* 2. Up.  We'll test this first to save time when
-		       an image line is identical to the one above. */
-		    if (sum > 0) {
-			for (i = 1, s = 0; i <= state->bytes; i++) {
-			    UINT8 v = state->buffer[i] - context->previous[i];
-			    context->up[i] = v;
-			    s += (v < 128) ? v : 256 - v;
-			}
-			if (s < sum) {
-			    context->output = context->up;
-			    sum = s; /* 0 if line was duplicated */
-			}
-		    }
-
-		    /* 1. Prior */
-		    if (sum > 0) {
-			for (i = 1, s = 0; i <= bpp; i++) {
-			    UINT8 v = state->buffer[i];
-			    context->prior[i] = v;
-			    s += (v < 128) ? v : 256 - v;
-			}
-			for (; i <= state->bytes; i++) {
-			    UINT8 v = state->buffer[i] - state->buffer[i-bpp];
-			    context->prior[i] = v;
-			    s += (v < 128) ? v : 256 - v;
-			}
-			if (s < sum) {
-			    context->output = context->prior;
-			    sum = s; /* 0 if line is solid */
-			}
-		    }
-
-		    /* 3. Average (not very common in real-life images,
-		       so its only used with the optimize option) */
-		    if (context->optimize && sum > 0) {
-			for (i = 1, s = 0; i <= bpp; i++) {
-			    UINT8 v = state->buffer[i] - context->previous[i]/2;
-			    context->average[i] = v;
-			    s += (v < 128) ? v : 256 - v;
-			}
-			for (; i <= state->bytes; i++) {
-			    UINT8 v = state->buffer[i] -
-				      (state->buffer[i-bpp] + context->previous[i])/2;
-			    context->average[i] = v;
-			    s += (v < 128) ? v : 256 - v;
-			}
-			if (s < sum) {
-			    context->output = context->average;
-			    sum = s;
-			}
-		    }
-
-		    /* 4. Paeth */
-		    if (sum > 0) {
-			for (i = 1, s = 0; i <= bpp; i++) {
-			    UINT8 v = state->buffer[i] - context->previous[i];
-			    context->paeth[i] = v;
-			    s += (v < 128) ? v : 256 - v;
-			}
-			for (; i <= state->bytes; i++) {
-			    UINT8 v;
-			    int a, b, c;
-			    int pa, pb, pc;
-
-			    /* fetch pixels */
-			    a = state->buffer[i-bpp];
-			    b = context->previous[i];
-			    c = context->previous[i-bpp];
-
-			    /* distances to surrounding pixels */
-			    pa = abs(b - c);
-			    pb = abs(a - c);
-			    pc = abs(a + b - 2*c);
-
-			    /* pick predictor with the shortest distance */
-			    v = state->buffer[i] -
-				((pa <= pb && pa <= pc) ? a :
-                                 (pb <= pc) ? b : c);
-			    context->paeth[i] = v;
-			    s += (v < 128) ? v : 256 - v;
-			}
-			if (s < sum) {
-			    context->output = context->paeth;
-			    sum = s;
-			}
-		    }
-		}
+		if (context->mode == ZIP_PNG)
+		    context->output = filter_line(context, state->buffer,
+						  context->previous,
+						  state->bytes,
+						  (state->bits + 7) / 8,
+						  context->prior, context->up,
+						  context->average,
+						  context->paeth);
 
 		/* Compress this line */
 		context->z_stream.next_in = context->output;
@@ -281,11 +803,7 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 			state->errcode = IMAGING_CODEC_MEMORY;
 		    else
 			state->errcode = IMAGING_CODEC_CONFIG;
-		    free(context->paeth);
-		    free(context->average);
-		    free(context->up);
-		    free(context->prior);
-		    free(context->previous);
+		    free_buffers(context);
 		    deflateEnd(&context->z_stream);
 		    ImagingSectionLeave(&cookie);
 		    return -1;
@@ -311,11 +829,7 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
 
 		if (err == Z_STREAM_END) {
 
-		    free(context->paeth);
-		    free(context->average);
-		    free(context->up);
-		    free(context->prior);
-		    free(context->previous);
+		    free_buffers(context);
 
 		    deflateEnd(&context->z_stream);
 
@@ -341,6 +855,19 @@ ImagingZipEncode(Imaging im, ImagingCodecState state, UINT8* buf, int bytes)
     return -1;
 }
 
+void
+ImagingZipEncodeCleanup(ImagingCodecState state)
+{
+    /* called when the encoder is destroyed.  if it stopped early,
+       the buffers and the compressor are still allocated */
+    ZIPSTATE* context = (ZIPSTATE*) state->context;
+
+    if (context) {
+	free_buffers(context);
+	deflateEnd(&context->z_stream);
+    }
+}
+
 const char*
 ImagingZipVersion(void)
 {
@@ -86,8 +86,8 @@ LIBIMAGING = [
     "Geometry", "GetBBox", "GifDecode", "GifEncode", "HexDecode",
     "Histo", "JpegDecode", "JpegEncode", "LzwDecode", "Matrix",
     "ModeFilter", "MspDecode", "Negative", "Offset", "Pack",
-    "PackDecode", "Palette", "Paste", "Quant", "QuantOctree", "QuantHash",
-    "QuantHeap", "PcdDecode", "PcxDecode", "PcxEncode", "Point",
+    "PackDecode", "Palette", "Parallel", "Paste", "Quant", "QuantOctree",
+    "QuantHash", "QuantHeap", "PcdDecode", "PcxDecode", "PcxEncode", "Point",
     "RankFilter", "RawDecode", "RawEncode", "Storage", "SunRleDecode",
     "TgaRleDecode", "Unpack", "UnpackYCC", "UnsharpMask", "WebPDecode",
     "WebPEncode", "XbmDecode", "XbmEncode", "ZipDecode", "ZipEncode"
@@ -338,6 +338,8 @@ class pil_build_ext(build_ext):
             defs.append(("HAVE_LIBZ", None))
         if sys.platform == "win32":
             libs.extend(["kernel32", "user32", "gdi32"])
+        else:
+            libs.append("pthread")
         if sys.byteorder == "big":
             defs.append(("WORDS_BIGENDIAN", None))
 